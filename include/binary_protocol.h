@@ -0,0 +1,85 @@
+// Compact binary protocol for position streams (stream type 'binary') and telemetry (stream type 'telemetry').
+//
+// Each packet is a BinaryPositionPacket or BinaryTelemetryPacket followed by CRC16, encoded with COBS (Consistent
+// Overhead Byte Stuffing) and terminated by a zero byte. COBS guarantees there are no zeros inside the frame, so the
+// receiver can always resynchronize on the next zero byte. The first byte of a packet is its type. All multi-byte
+// fields are little-endian.
+//
+// This file has no dependencies on the rest of the project so that it can be used by host-side decoders.
+#pragma once
+#include <stdint.h>
+
+constexpr uint8_t binary_position_packet_type = 0x50;  // 'P', version 0.
+
+struct __attribute__((packed)) BinaryPositionPacket {
+    uint8_t type;            // binary_position_packet_type
+    uint8_t object_idx;
+    uint16_t fix_level;      // FixLevel value.
+    uint16_t seq;            // Incremented for every packet of the stream; use to detect lost packets.
+    uint32_t time_usec;      // Time of the position, microseconds, wraps around.
+    int32_t pos_mm[3];       // Position, millimeters.
+    uint32_t q_packed;       // Rotation quaternion, see pack_quaternion().
+    uint16_t pos_stddev_um;  // Position uncertainty, sqrt(trace(covariance)), micrometers; 0xFFFF if larger.
+};
+
+// Size of the packet with CRC before COBS encoding and the max size of a complete frame on the wire.
+constexpr uint32_t binary_position_packet_size = sizeof(BinaryPositionPacket) + 2;
+constexpr uint32_t binary_position_frame_max_size = binary_position_packet_size + binary_position_packet_size / 254 + 2;
+
+constexpr uint8_t binary_telemetry_packet_type = 0x54;  // 'T', version 0.
+constexpr uint32_t telemetry_max_sensors = 8;
+constexpr uint32_t telemetry_max_objects = 8;
+constexpr uint32_t telemetry_max_base_stations = 2;
+constexpr uint32_t telemetry_max_outputs = 4;
+
+// State and counters gathered from all pipeline nodes, see WorkerNode::collect_telemetry(). Counters are free-running
+// since the pipeline was created and wrap around; rates are calculated from consecutive packets. Fields of sensors,
+// objects etc. that don't exist are zero.
+struct __attribute__((packed)) BinaryTelemetryPacket {
+    uint8_t type;                // binary_telemetry_packet_type
+    uint8_t reserved;
+    uint16_t seq;                // Incremented for every packet of the stream.
+    uint32_t time_usec;          // Time of the packet, microseconds, wraps around.
+    uint16_t cycle_fix_level;    // PulseProcessor's FixLevel.
+    uint16_t phase_fix_level;    // CyclePhaseClassifier's FixLevel.
+    uint32_t cycle_idx;          // Index of the current cycle.
+    uint16_t phase_error_x10us;  // Average error of pulse timings vs the cycle phase, 0.1us units.
+    uint32_t sensor_pulses[telemetry_max_sensors];          // Pulses received from each sensor.
+    uint16_t sensor_pulses_dropped[telemetry_max_sensors];  // Pulses lost due to full input buffer.
+    uint16_t object_fix_levels[telemetry_max_objects];      // FixLevel of each geometry object.
+    uint16_t data_frames_started[telemetry_max_base_stations];  // OOTX frames with preamble found.
+    uint16_t data_frames_decoded[telemetry_max_base_stations];  // OOTX frames received fully.
+    uint16_t output_queue_bytes[telemetry_max_outputs];     // Bytes waiting to be sent.
+    uint32_t output_bytes_dropped[telemetry_max_outputs];   // Bytes of data streams dropped as outputs couldn't keep up.
+    uint32_t arena_bytes;        // Memory used by nodes of all pipelines, peak.
+};
+
+constexpr uint32_t binary_telemetry_packet_size = sizeof(BinaryTelemetryPacket) + 2;
+constexpr uint32_t binary_telemetry_frame_max_size = binary_telemetry_packet_size + binary_telemetry_packet_size / 254 + 2;
+
+// CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF).
+uint16_t crc16_ccitt(const uint8_t *data, uint32_t len, uint16_t crc = 0xFFFF);
+
+// COBS encode 'len' bytes from 'src' into 'dst'. 'dst' needs to have at least len + len/254 + 1 bytes.
+// Returns number of bytes written. The terminating zero is not written.
+uint32_t cobs_encode(const uint8_t *src, uint32_t len, uint8_t *dst);
+
+// COBS decode a frame without its terminating zero. 'dst' needs to have at least 'len' bytes.
+// Returns number of decoded bytes or -1 if the frame is malformed.
+int32_t cobs_decode(const uint8_t *src, uint32_t len, uint8_t *dst);
+
+// "Smallest three" quaternion compression into 32 bits: 2 bits for the index of the largest component and
+// 10 bits for each of the 3 others, which are in [-1/sqrt(2), 1/sqrt(2)] range. Precision is ~0.0014.
+uint32_t pack_quaternion(const float q[4]);
+void unpack_quaternion(uint32_t packed, float q[4]);
+
+// Serialize the packet with CRC and COBS framing into 'frame' (binary_position_frame_max_size bytes).
+// Returns frame length including the terminating zero.
+uint32_t encode_position_frame(const BinaryPositionPacket &packet, uint8_t *frame);
+
+// Parse a frame without its terminating zero. Returns false if it's malformed or CRC doesn't match.
+bool decode_position_frame(const uint8_t *frame, uint32_t len, BinaryPositionPacket *packet);
+
+// Same for telemetry packets; 'frame' needs binary_telemetry_frame_max_size bytes.
+uint32_t encode_telemetry_frame(const BinaryTelemetryPacket &packet, uint8_t *frame);
+bool decode_telemetry_frame(const uint8_t *frame, uint32_t len, BinaryTelemetryPacket *packet);
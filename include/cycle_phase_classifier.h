@@ -2,6 +2,8 @@
 #include "messages.h"
 #include "primitives/string_utils.h"
 
+struct BinaryTelemetryPacket;
+
 // Given pairs of pulse lens from 2 base stations, this class determines the phase for current cycle
 // Phases are: 
 //   0) Base 1 (B), horizontal sweep
@@ -34,6 +36,7 @@ public:
     // Print debug information.
     virtual bool debug_cmd(HashedWord *input_words);
     virtual void debug_print(PrintStream &stream);
+    void collect_telemetry(BinaryTelemetryPacket &packet);
 
 private:
     float expected_pulse_len(bool skip, bool data, bool axis);
@@ -36,9 +36,15 @@ class DataFrameDecoder
 public:
     DataFrameDecoder(uint32_t base_station_idx);
     virtual void consume(const DataFrameBit &bit);
+    virtual Timestamp next_work_time(Timestamp cur_time) { return cur_time + max_sleep_time; }
 
     virtual bool debug_cmd(HashedWord *input_words);
     virtual void debug_print(PrintStream &stream);
+    virtual void collect_telemetry(BinaryTelemetryPacket &packet);
+
+    // Statistics since creation: frames whose preamble was found and frames received fully.
+    uint32_t frames_started() const { return frames_started_; }
+    uint32_t frames_decoded() const { return frames_decoded_; }
 
 private:
     void reset();
@@ -52,4 +58,6 @@ private:
     int32_t data_idx_;
     int32_t data_frame_len_;
     DataFrame data_frame_;
+    uint32_t frames_started_;
+    uint32_t frames_decoded_;
 };
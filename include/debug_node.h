@@ -4,6 +4,18 @@
 #include "primitives/string_utils.h"
 #include "print_helpers.h"
 
+class PersistentSettings;
+
+// Settings of the running pipeline that can be changed without restarting it, see create_vive_sensor_pipeline().
+class LiveSettings {
+public:
+    virtual const PersistentSettings &settings() const = 0;
+
+    // Applies a definition command, like in configuration mode (e.g. 'stream1 angles > usb_serial'). Prints the
+    // result. Changes take effect in the next do_work() of the pipeline.
+    virtual void change(HashedWord *input_words, PrintStream &stream) = 0;
+};
+
 // This node calls debug_cmd and debug_print for all pipeline nodes periodically,
 // provides some other debug facilities and blinks LED.
 class DebugNode 
@@ -12,21 +24,28 @@ class DebugNode
     , public Producer<DataChunk>
     , public Producer<OutputCommand> {
 public:
-    DebugNode(Pipeline *pipeline);
+    DebugNode(Pipeline *pipeline, LiveSettings *live_settings);
+
+    // Keeps debug, exclusive and continuous print modes of the node this one replaces when the streams are changed.
+    void continue_from(const DebugNode &prev);
 
     virtual void consume_line(char *line, Timestamp time);
     virtual void do_work(Timestamp cur_time);
+    virtual Timestamp next_work_time(Timestamp cur_time);
     virtual bool debug_cmd(HashedWord *input_words);
     virtual void debug_print(PrintStream &stream);
 
 private:
-    void set_output_attached(bool attached);
+    void set_output_exclusive(bool exclusive);
 
     Pipeline *pipeline_;
+    LiveSettings *live_settings_;
     Timestamp continuous_print_period_;
+    Timestamp last_led_update_;
     uint32_t continuous_debug_print_;
     uint32_t stream_idx_;
-    bool output_attached_;
+    bool debug_mode_;
+    bool output_exclusive_;
     bool print_debug_memory_;
 };
 
@@ -0,0 +1,82 @@
+// Flight recorder: always-on ring of recent pulses, sensor angles and positions, to see what happened right before
+// tracking was lost.
+//
+// Messages are stored as compact variable-length records (1 tag byte, time delta since the previous record as a
+// varint, then type-specific fields), so a few seconds fit in a few kilobytes. The oldest records are dropped to make
+// room for new ones. Only the angles of the current phase are kept from SensorAnglesFrame-s; the others were in the
+// previous frames.
+//
+// Contents are dumped on debug command ('recorder dump > serial1') or automatically when an object loses its fix
+// ('recorder auto > serial1'). The dump is a pulse trace (see pulse_trace.h), so it can be replayed by Linux pulse
+// sources and the trace analyzer as is. Angles and positions are written as comments.
+#pragma once
+#include "primitives/workers.h"
+#include "primitives/producer_consumer.h"
+#include "messages.h"
+#include "outputs.h"
+
+constexpr uint32_t flight_recorder_size = 8192;  // Bytes; ~2-3s with one sensor and two objects.
+
+class FlightRecorder
+    : public WorkerNode
+    , public Consumer<Pulse>
+    , public Consumer<SensorAnglesFrame>
+    , public Consumer<ObjectPosition> {
+public:
+    // Pins of the inputs, indexed by input_idx. They are written to the dump instead of input indexes, like in traces.
+    explicit FlightRecorder(const Vector<uint32_t, max_num_inputs> &input_pins);
+
+    virtual void consume(const Pulse &p);
+    virtual void consume(const SensorAnglesFrame &f);
+    virtual void consume(const ObjectPosition &f);
+
+    virtual void do_work(Timestamp cur_time);
+    virtual Timestamp next_work_time(Timestamp cur_time);
+    virtual bool debug_cmd(HashedWord *input_words);
+
+    // Dumps go to the output with given index; they need to be connected to the output nodes.
+    Producer<DataChunk> &output(uint32_t output_idx) { return outputs_[output_idx]; }
+
+    // Number of bytes taken by the records; used by tests.
+    uint32_t size() const { return write_idx_ - read_idx_; }
+
+private:
+    // Reads records from the ring.
+    class Reader {
+    public:
+        Reader(const FlightRecorder &recorder, uint32_t idx) : recorder_(recorder), idx_(idx) {}
+        uint8_t byte() { return recorder_.buf_[idx_++ % flight_recorder_size]; }
+        uint32_t varint();
+        int32_t svarint();
+        uint32_t idx() const { return idx_; }
+        void skip_record(uint8_t tag);
+
+    private:
+        const FlightRecorder &recorder_;
+        uint32_t idx_;
+    };
+
+    uint8_t *start_record(uint8_t *rec, uint8_t tag, Timestamp time);
+    void add_record(const uint8_t *rec, uint32_t len, Timestamp time);
+    void drop_oldest();
+    void start_dump(uint32_t output_idx, Timestamp cur_time, int32_t lost_object_idx);
+    void dump_record(PrintStream &stream, Reader &reader);
+    void print_time(PrintStream &stream);
+
+    Vector<uint32_t, max_num_inputs> input_pins_;
+
+    uint8_t buf_[flight_recorder_size];
+    uint32_t read_idx_, write_idx_;  // Free-running.
+    Timestamp base_time_;  // Time delta of the record at read_idx_ is relative to it.
+    Timestamp last_time_;  // Time of the last record.
+    FixLevel fix_levels_[max_num_inputs];  // Latest fix level of each object, to detect fix loss.
+
+    // Dump in progress. Recording is paused until it's done, so records are read directly from the ring.
+    Producer<DataChunk> outputs_[num_outputs];
+    bool dumping_;
+    uint32_t dump_output_idx_;
+    uint32_t dump_idx_;
+    Timestamp dump_time_;  // Time of the last dumped record.
+    Timestamp next_dump_work_time_;
+    int32_t auto_dump_output_idx_;  // -1 if disabled.
+};
@@ -3,15 +3,22 @@
 #include "primitives/producer_consumer.h"
 #include "messages.h"
 #include "geometry.h"
+#include "outputs.h"
+#include "binary_protocol.h"
 
 enum class FormatterType {
     kAngles,
     kDataFrame,
     kPosition,
+    kTelemetry,
 };
 enum class FormatterSubtype {
     kPosText,
     kPosMavlink,
+    kPosBinary,
+    kPosMavlinkVision,
+    kPosMavlinkOdometry,
+    kPosUblox,
 };
 
 // Stored definition of a FormatterNode
@@ -23,6 +30,12 @@ struct FormatterDef {
 
     CoordSysType coord_sys_type;
     CoordSysDef coord_sys_params;
+    vec3d offset;  // Added to the position after coordinate system conversion.
+    GeoOrigin geo_origin;  // Geodetic position of NED origin; used by GPS emulation.
+    DropPolicy drop_policy;  // What to do when the output can't keep up.
+    uint16_t rate_hz;        // Max rate of the stream, 0 if not limited. Frames in between are skipped.
+                             // Telemetry streams are sent at this rate (1 Hz if not set).
+    bool rate_average;       // Send an average of positions since the previous frame instead of the latest one.
 
     void print_def(uint32_t idx, PrintStream &stream);
     bool parse_def(uint32_t idx, HashedWord *input_words, PrintStream &err_stream);
@@ -34,14 +47,29 @@ class FormatterNode
     : public WorkerNode
     , public Producer<DataChunk> {
 public:
+    // Formatters only work when they consume input.
+    virtual Timestamp next_work_time(Timestamp cur_time) { return cur_time + max_sleep_time; }
     virtual bool debug_cmd(HashedWord *input_words);
     virtual void debug_print(PrintStream &stream);
 
+    // Formatters that need data received by their output (e.g. protocol handshakes) return a consumer for it.
+    virtual Consumer<DataChunk> *output_data_consumer() { return nullptr; }
+
 protected:
     FormatterNode(uint32_t idx, const FormatterDef &def);
 
+    // Returns false if the frame with given time needs to be skipped to keep the stream rate. Call it before any
+    // formatting work so that skipped frames cost nothing.
+    bool rate_limit_passed(Timestamp time);
+
     uint32_t node_idx_;
     FormatterDef def_;
+
+private:
+    TimeDelta min_period_;
+    Timestamp last_sent_time_;
+    bool sent_any_;
+    uint32_t frames_skipped_;
 };
 
 // Format sensor angles to a text form.
@@ -53,42 +81,150 @@ public:
     virtual void consume(const SensorAnglesFrame& f);
 };
 
-// Base class for geometry formatters.
+// Send BinaryTelemetryPacket-s with counters collected from all nodes of the source pipeline, see binary_protocol.h.
+// Unlike other formatters, works on a timer instead of consuming values.
+class TelemetryFormatter : public FormatterNode {
+public:
+    TelemetryFormatter(uint32_t idx, const FormatterDef &def, WorkerNode *source);
+    virtual void do_work(Timestamp cur_time);
+    virtual Timestamp next_work_time(Timestamp cur_time);
+
+private:
+    WorkerNode *source_;
+    TimeDelta period_;
+    Timestamp last_sent_time_;
+    bool sent_any_;
+    uint16_t seq_;
+
+    // Packet and its frame are too large for the stack.
+    BinaryTelemetryPacket packet_;
+    uint8_t frame_[binary_telemetry_frame_max_size];
+};
+
+// Base class for geometry formatters. Applies the coordinate transform and passes the result to format().
 class GeometryFormatter 
     : public FormatterNode
     , public Consumer<ObjectPosition> {
 public:
-    static std::unique_ptr<GeometryFormatter> create(uint32_t idx, const FormatterDef &def);
+    static ArenaPtr<GeometryFormatter> create(Arena &arena, uint32_t idx, const FormatterDef &def,
+                                              const CoordinateTransform &transform);
+    // Same, with the transform composed from the stream definition.
+    static ArenaPtr<GeometryFormatter> create(Arena &arena, uint32_t idx, const FormatterDef &def);
+    virtual void consume(const ObjectPosition& f);
 
 protected:
-    GeometryFormatter(uint32_t idx, const FormatterDef &def) : FormatterNode(idx, def) {}
+    GeometryFormatter(uint32_t idx, const FormatterDef &def, const CoordinateTransform &transform);
+    virtual void format(const ObjectPosition& f) = 0;
+
+    // Applies rate limit, averaging and the transform. Returns the position to format, or nullptr if it's skipped.
+    const ObjectPosition *prepare(const ObjectPosition& f);
+
+    CoordinateTransform transform_;
+    bool transform_needed_;
+
+private:
+    void accumulate(const ObjectPosition& f);
+    void get_average(const ObjectPosition& latest, ObjectPosition *res);
+
+    // Sums for 'rate_average' mode; positions are averaged before the transform.
+    ObjectPosition avg_sum_;
+    TimeDelta avg_time_sum_;  // Relative to the first accumulated position time.
+    uint32_t avg_count_;
+    ObjectPosition averaged_, transformed_;  // Results of prepare().
 };
 
 // Format object geometry in a text form.
 class GeometryTextFormatter : public GeometryFormatter {
 public:
-    GeometryTextFormatter(uint32_t idx, const FormatterDef &def) : GeometryFormatter(idx, def) {}
-    virtual void consume(const ObjectPosition& f);
+    GeometryTextFormatter(uint32_t idx, const FormatterDef &def, const CoordinateTransform &transform)
+        : GeometryFormatter(idx, def, transform) {}
+    virtual void format(const ObjectPosition& f);
 };
 
 
-// Format object geometry in Mavlink format.
-class GeometryMavlinkFormatter : public GeometryFormatter {
+// Format object geometry in a compact binary form, see binary_protocol.h.
+class GeometryBinaryFormatter : public GeometryFormatter {
 public:
-    GeometryMavlinkFormatter(uint32_t idx, const FormatterDef &def);
-    virtual void consume(const ObjectPosition& f);
+    GeometryBinaryFormatter(uint32_t idx, const FormatterDef &def, const CoordinateTransform &transform)
+        : GeometryFormatter(idx, def, transform), chunk_{}, seq_(0) {}
+    virtual void format(const ObjectPosition& f);
+
+    // Work of consume(), except that the frame is returned instead of produced; nullptr if the position is skipped.
+    // Used by StaticPipeline.
+    const DataChunk *process(const ObjectPosition& f);
+
+private:
+    void encode(const ObjectPosition& f);  // Writes the frame to chunk_.
+
+    DataChunk chunk_;
+    uint16_t seq_;
+};
+
+// Format object geometry in Mavlink format. Depending on subtype, sends ATT_POS_MOCAP, VISION_POSITION_ESTIMATE
+// or ODOMETRY messages. Also answers TIMESYNC requests coming from the output so that the autopilot can convert our
+// timestamps to its time.
+constexpr uint32_t max_mavlink_payload_len = 255;
+constexpr uint32_t max_mavlink_frame_len = 10 + max_mavlink_payload_len + 2 + 13;  // Header, payload, checksum, signature.
+
+class GeometryMavlinkFormatter 
+    : public GeometryFormatter
+    , public Consumer<DataChunk> {
+public:
+    GeometryMavlinkFormatter(uint32_t idx, const FormatterDef &def, const CoordinateTransform &transform);
+    virtual void format(const ObjectPosition& f);
+
+    using GeometryFormatter::consume;
+    virtual void consume(const DataChunk &chunk);
+    virtual Consumer<DataChunk> *output_data_consumer() { return this; }
 
     virtual bool debug_cmd(HashedWord *input_words);
     virtual void debug_print(PrintStream &stream);
 
 private:
     bool position_valid(const ObjectPosition& g);
-    void send_message(uint32_t msgid, const char *packet, Timestamp cur_time, uint8_t min_length, uint8_t length, uint8_t crc_extra);
+    void update_velocity(const ObjectPosition& g);
+    void send_att_pos_mocap(const ObjectPosition& g);
+    void send_vision_position_estimate(const ObjectPosition& g);
+    void send_odometry(const ObjectPosition& g);
+    void process_rx_frame(Timestamp time);
+    void send_message(uint32_t msgid, const char *packet, Timestamp cur_time, uint8_t min_length, uint8_t length, 
+                      uint8_t crc_extra, uint32_t stream_idx);
 
     uint32_t current_tx_seq_;
     Timestamp last_message_timestamp_;  // LongTimestamp
     float last_pos_[3];
+    float last_pos_variance_[3];
+    vec3d velocity_;
+    float velocity_variance_[3];
+    bool velocity_valid_;
     bool debug_print_state_;
     uint32_t debug_late_messages_;
+    uint32_t debug_timesync_requests_;
+
+    uint8_t rx_buf_[max_mavlink_frame_len];
+    uint32_t rx_len_;
+    alignas(8) uint8_t tx_packet_[max_mavlink_payload_len];  // Large packets are built here to save stack.
 };
 
+// Emulate a u-blox GPS receiver: convert NED position to geodetic coordinates around a configured origin and send
+// UBX NAV-SOL, NAV-POSLLH and NAV-VELNED messages, limited to ublox_max_rate_hz. Used with flight controllers that
+// don't accept external positions in any other way.
+constexpr uint32_t ublox_max_rate_hz = 10;
+
+class GeometryUbloxFormatter : public GeometryFormatter {
+public:
+    GeometryUbloxFormatter(uint32_t idx, const FormatterDef &def, const CoordinateTransform &transform);
+    virtual void format(const ObjectPosition& f);
+
+private:
+    void update_velocity(const ObjectPosition& g);
+    void send_packet(uint8_t msg_class, uint8_t msg_id, const void *payload, uint16_t payload_len, Timestamp time);
+
+    GeoConverter geo_;
+    Timestamp last_sent_time_;
+    Timestamp last_pos_time_;
+    vec3d last_pos_;
+    vec3d velocity_;
+    float velocity_variance_;
+    bool velocity_valid_;
+};
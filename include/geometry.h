@@ -45,23 +45,28 @@ protected:
     GeometryBuilderDef def_;
 };
 
-// Simple class for single-point sensors.
+// Simple class for single-point sensors. Position of the sensor relative to the object (SensorLocalGeometry::pos) is
+// compensated, so all consumers get the object position.
 class PointGeometryBuilder : public GeometryBuilder {
 public:
     PointGeometryBuilder(uint32_t idx, const GeometryBuilderDef &geo_def,
                          const Vector<BaseStationGeometryDef, num_base_stations> &base_stations);
     virtual void consume(const SensorAnglesFrame& f);
-    virtual void do_work(Timestamp cur_time);
+    virtual Timestamp next_work_time(Timestamp cur_time) { return cur_time + max_sleep_time; }
+
+    // Work of consume(), except that the position is returned instead of produced. Used by StaticPipeline.
+    const ObjectPosition *process(const SensorAnglesFrame& f);
 
     virtual bool debug_cmd(HashedWord *input_words);
     virtual void debug_print(PrintStream &stream);
+    virtual void collect_telemetry(BinaryTelemetryPacket &packet);
 
 private:
     ObjectPosition pos_;
 };
 
 
-// Stored type and definition for CoordinateSystemConverter.
+// Stored type and definition of the output coordinate system.
 enum class CoordSysType {
     kDefault,  // No conversion.
     kNED,      // North-East-Down.
@@ -73,24 +78,51 @@ union CoordSysDef {
     } ned;
 };
 
-// Helper node to convert coordinates to a different coordinate system.
-class CoordinateSystemConverter
-    : public WorkerNode
-    , public Consumer<ObjectPosition>
-    , public Producer<ObjectPosition> {
-public:
-    CoordinateSystemConverter(float m[9]);
+// Rigid transform of object position and orientation: pos' = mat * pos + offset; q' = q_rot * q.
+// Chains of coordinate conversions are composed once when the pipeline is created and then applied in a single pass.
+struct CoordinateTransform {
+    float mat[9];    // Rotation matrix, row-major. Axis swaps must keep it a proper rotation (det = 1).
+    vec3d offset;    // Translation, applied after rotation.
+    float q_rot[4];  // Same rotation as 'mat', as a quaternion (w, x, y, z).
 
-    static std::unique_ptr<CoordinateSystemConverter> create(CoordSysType type, const CoordSysDef& def);
+    static CoordinateTransform identity();
+    static CoordinateTransform translation(const vec3d &offset);
+    static CoordinateTransform rotation(const float (&mat)[9]);
 
-    // Convert from standard Vive coordinate system to NED.
-    // Needs angle between North and X axis, in degrees.
-    static std::unique_ptr<CoordinateSystemConverter> NED(const CoordSysDef &def);
+    // Convert from standard Vive coordinate system to the given one.
+    static CoordinateTransform coord_sys(CoordSysType type, const CoordSysDef &def);
 
-    virtual void consume(const ObjectPosition& geo);
-    virtual bool debug_cmd(HashedWord *input_words);
-    virtual void debug_print(PrintStream &stream);
+    // Full transform of a position stream: convert coordinate system, then apply the offset.
+    static CoordinateTransform for_stream(CoordSysType type, const CoordSysDef &def, const vec3d &offset);
+
+    // Returns transform equivalent to applying this one first and then 'next'.
+    CoordinateTransform then(const CoordinateTransform &next) const;
+    bool is_identity() const;
+
+    void apply(const ObjectPosition &in, ObjectPosition *out) const;
+};
+
+// Geodetic (WGS84) position of the local NED coordinate system origin.
+struct GeoOrigin {
+    int32_t lat_e7;  // Latitude, degrees * 1e7.
+    int32_t lon_e7;  // Longitude, degrees * 1e7.
+    int32_t alt_mm;  // Height above ellipsoid, millimeters.
+};
+
+// Converts local NED coordinates (meters) around the origin to geodetic and ECEF ones. All trigonometry is done once
+// in the constructor, so that conversions are just a few multiplications. Local tangent plane approximation is used,
+// which keeps errors below a millimeter within ~100m of the origin.
+class GeoConverter {
+public:
+    explicit GeoConverter(const GeoOrigin &origin);
+
+    void ned_to_llh(const vec3d &ned, int32_t *lat_e7, int32_t *lon_e7, int32_t *alt_mm) const;
+    void ned_to_ecef_cm(const vec3d &ned, int32_t *ecef_cm) const;  // ecef_cm is 3 elements.
+    void rotate_ned_to_ecef(const vec3d &ned, float *ecef) const;   // For vectors, like velocity.
 
 private:
-    float mat_[9];
-};
\ No newline at end of file
+    GeoOrigin origin_;
+    float lat_e7_per_m_, lon_e7_per_m_;  // Scale of North/East offsets at the origin.
+    int32_t origin_ecef_cm_[3];
+    float ned_to_ecef_[9];  // Rotation matrix, row-major; columns are N, E, D unit vectors in ECEF.
+};
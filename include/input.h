@@ -31,13 +31,15 @@ class InputNode
     : public WorkerNode
     , public Producer<Pulse> {
 public:
-    // Create input node of needed type from given configuration.
-    static std::unique_ptr<InputNode> create(uint32_t input_idx, const InputDef &def);
+    // Create input node of needed type from given configuration, in the arena of the pipeline that will own it.
+    static ArenaPtr<InputNode> create(Arena &arena, uint32_t input_idx, const InputDef &def);
     typedef StaticRegistrar<decltype(create)*> CreatorRegistrar;
 
     virtual void do_work(Timestamp cur_time);
+    virtual Timestamp next_work_time(Timestamp cur_time);
     virtual bool debug_cmd(HashedWord *input_words);
     virtual void debug_print(PrintStream &stream);
+    virtual void collect_telemetry(BinaryTelemetryPacket &packet);
 
 protected:
     InputNode(uint32_t input_idx);
@@ -50,4 +52,7 @@ private:
     // We keep the pulse buffer to move Pulse-s from irq context to main thread context.
     static constexpr int pulses_buffer_len = 32;
     CircularBuffer<Pulse, pulses_buffer_len> pulses_buf_;
+
+    uint32_t num_pulses_;
+    uint32_t num_dropped_pulses_;  // Changed in irq context.
 };
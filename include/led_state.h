@@ -14,3 +14,6 @@ enum class LedState {
 void set_led_state(LedState state);
 void update_led_pattern(Timestamp cur_time);
 
+// Led patterns have steps of 30 ms or longer, so update_led_pattern() can be called this often.
+constexpr TimeDelta led_update_period(10, msec);
+
@@ -2,6 +2,7 @@
 #pragma once
 #include "primitives/timestamp.h"
 #include "primitives/vector.h"
+#include "primitives/producer_consumer.h"
 #include <stdint.h>
 
 // Tunable constants
@@ -32,6 +33,7 @@ enum class FixLevel {
 struct SensorAngles {
     float angles[num_cycle_phases]; // Angles of base stations to sensor, -1/3 Pi to 1/3 Pi
     uint32_t updated_cycles[num_cycle_phases]; // Cycle id when this angle was last updated.
+    float angle_variances[num_cycle_phases]; // Estimated variance of angle jitter, rad^2.
 };
 
 // SensorAnglesFrame is produced by PulseProcessor every 4 cycles and consumed by GeometryBuilders. It contains
@@ -67,6 +69,7 @@ struct ObjectPosition {
     float pos[3];     // 3d object position
     float pos_delta;  // Distance between base station rays. Can be used as a measure of position uncertainty.
     float q[4];       // Rotation quaternion (unit if no rotation information available)
+    float pos_covariance[6];  // Position covariance, upper triangle of 3x3 matrix: xx, xy, xz, yy, yz, zz. In m^2.
 };
 
 // DataChunk is used to send raw data to outputs.
@@ -77,6 +80,12 @@ struct DataChunk {
     bool last_chunk;  // True if this is the last chunk in a "packet". Useful for polling mode.
 };
 
+// Fan-out of messages that can go to every geometry builder and/or formatter, plus the flight recorder. Checked against
+// the max number of definitions in vive_sensors_pipeline.cpp.
+template<> struct MaxConsumers<SensorAnglesFrame> { static constexpr uint32_t value = 2 * max_num_inputs + 1; };
+template<> struct MaxConsumers<ObjectPosition> { static constexpr uint32_t value = max_num_inputs + 1; };
+template<> struct MaxConsumers<DataChunk> { static constexpr uint32_t value = max_num_inputs + 1; };
+
 
 enum class OutputCommandType {
     kMakeExclusive,  // Make given stream_idx exclusive and don't accept data chunks from other streams.
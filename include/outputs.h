@@ -9,9 +9,95 @@
 // Currently supported: usb serial + 3x hardware serials.
 constexpr int num_outputs = 4;
 
+// Sizes of the transmit queues of each output, in bytes and in messages ("packets" of chunks ending with last_chunk).
+// Data streams and debug/config output are queued separately, see OutputNode.
+constexpr uint32_t tx_queue_size = 1024;
+constexpr uint32_t max_tx_queue_messages = 32;
+constexpr uint32_t debug_tx_queue_size = 512;
+constexpr uint32_t max_debug_tx_queue_messages = 16;
+
+// What to do with a message of a stream when it doesn't fit into the transmit queue.
+enum class DropPolicy {
+    kDropOldest,  // Drop oldest queued messages of the same stream. If there are none, drop the new one.
+    kDropNewest,  // Drop the new message.
+    kNeverDrop,   // Wait until the hardware accepts enough bytes. Used for debug output and config replies.
+};
+
+// Queue of bytes to send, split into messages. Messages can be removed from the middle of the queue as long
+// as we haven't started sending them.
+// NOTE: Indexes are free-running and will overflow uint32_t, that's fine.
+class TxQueueBase {
+public:
+    struct Message {
+        uint32_t start_idx, end_idx;  // Range of the message bytes in the buffer.
+        uint32_t stream_idx;
+        Timestamp time;  // Time of the first chunk; used to measure latency.
+        bool complete;  // False while we wait for the rest of the chunks of this message.
+    };
+
+    // Exhaustion counters, reset by the owner.
+    struct Stats {
+        uint32_t peak_size;  // Max number of queued bytes.
+        uint32_t num_full;   // Number of chunks that didn't fit right away.
+    };
+
+    uint32_t num_messages() const { return msg_write_idx_ - msg_read_idx_; }
+    Message &message(uint32_t i) { return messages_[(msg_read_idx_ + i) % max_messages_]; }
+    uint32_t size() const { return write_idx_ - read_idx_; }
+    bool continues_message() { return num_messages() > 0 && !message(num_messages() - 1).complete; }
+    // Front message is partially sent and we need to finish it before sending anything else.
+    bool front_started() { return num_messages() > 0 && (int32_t)(read_idx_ - message(0).start_idx) > 0; }
+
+    bool can_fit(uint32_t len) {
+        return buf_size_ - size() >= len && (continues_message() || num_messages() < max_messages_);
+    }
+    void push(const DataChunk &chunk);
+    bool erase(uint32_t i);  // Removes i-th message if we haven't started sending it. Returns true if removed.
+    void copy_from(const TxQueueBase &other);  // Takes over the contents of a queue of the same size.
+
+    // Contiguous run of unsent bytes of the front message.
+    uint32_t front_bytes(const uint8_t **data);
+    void advance(uint32_t len) { read_idx_ += len; }
+    // Removes front message if it's sent completely.
+    bool pop_sent(Message *msg);
+
+    Stats &stats() { return stats_; }
+
+protected:
+    TxQueueBase(uint8_t *buf, uint32_t buf_size, Message *messages, uint32_t max_messages)
+        : buf_(buf), buf_size_(buf_size), messages_(messages), max_messages_(max_messages)
+        , read_idx_(0), write_idx_(0), msg_read_idx_(0), msg_write_idx_(0), stats_{} {}
+
+private:
+    uint8_t *buf_;
+    uint32_t buf_size_;
+    Message *messages_;
+    uint32_t max_messages_;
+    uint32_t read_idx_, write_idx_;
+    uint32_t msg_read_idx_, msg_write_idx_;
+    Stats stats_;
+};
+
+template<uint32_t BufSize, uint32_t MaxMessages>
+class TxQueue : public TxQueueBase {
+public:
+    TxQueue() : TxQueueBase(buf_, BufSize, messages_, MaxMessages) {}
+    TxQueue(const TxQueue &) = delete;
+
+private:
+    uint8_t buf_[BufSize];
+    Message messages_[MaxMessages];
+};
+
+// Polling mode: data streams are not sent continuously. Instead, the latest complete message of each data stream
+// is kept and sent when the host sends a poll request byte (ASCII ENQ).
+constexpr uint8_t poll_request_byte = 0x05;
+constexpr uint32_t max_poll_message_size = 4 * max_bytes_in_data_chunk;  // Fits largest mavlink messages we send.
+
 struct OutputDef {
     bool active;
     uint32_t bitrate;
+    bool polling;
 
     void print_def(uint32_t idx, PrintStream &stream);
     bool parse_def(uint32_t idx, HashedWord *input_words, PrintStream &err_stream);
@@ -23,24 +109,86 @@ class OutputNode
     , public Consumer<OutputCommand>
     , public Producer<DataChunk> {
 public:
-    static std::unique_ptr<OutputNode> create(uint32_t idx, const OutputDef& def);
+    static ArenaPtr<OutputNode> create(Arena &arena, uint32_t idx, const OutputDef& def);
     typedef StaticRegistrar<decltype(create)*> CreatorRegistrar;
 
+    // Set drop policy for given stream. Streams with a policy are data streams and take priority over other
+    // streams (debug output, config replies), which are never dropped.
+    void set_drop_policy(uint32_t stream_idx, DropPolicy policy);
+
+    // Polling mode keeps the latest message of each data stream; create() allocates room for them from the pipeline
+    // arena when the definition enables polling. Nodes created otherwise need to call this to enable polling.
+    void allocate_poll_slots(Arena &arena);
+
+    // Takes over queued data and mode of the node it replaces when the streams are changed, so that nothing is lost
+    // or cut in the middle. Both nodes are for the same output.
+    void continue_from(const OutputNode &prev);
+
     // Common methods that do i/o with the stream_ object.
+    // Data chunks are queued and sent in do_work() as the hardware accepts bytes, so slow outputs don't stall
+    // the pipeline. Data streams are sent first; other streams use the remaining bandwidth. Messages are never
+    // interleaved.
     virtual void consume(const DataChunk &chunk);
     virtual void consume(const OutputCommand& cmd);
     virtual void do_work(Timestamp cur_time);
+    virtual Timestamp next_work_time(Timestamp cur_time);
+    virtual bool debug_cmd(HashedWord *input_words);
+    virtual void debug_print(PrintStream &stream);
+    virtual void collect_telemetry(BinaryTelemetryPacket &packet);
 
 protected:
     OutputNode(uint32_t idx, const OutputDef& def);
 
     virtual size_t write(const uint8_t *buffer, size_t size) = 0;
-    virtual int read() = 0;
+    // Read up to 'size' bytes that are already available, without blocking. Returns number of bytes read.
+    virtual size_t read(uint8_t *buffer, size_t size) = 0;
+    // Number of bytes that can be written without blocking.
+    virtual size_t write_available() = 0;
+    // True if read() would return some bytes. Used to skip do_work() while there's nothing to do.
+    virtual bool read_available() { return true; }
 
     uint32_t node_idx_;
     OutputDef def_;
     DataChunk chunk_;
     bool exclusive_mode_;
     uint32_t exclusive_stream_idx_;
-};
 
+private:
+    // Latest-value slot of a data stream in polling mode.
+    struct PollSlot {
+        Vector<uint8_t, max_poll_message_size> latest, pending;
+        Timestamp time;
+        bool overflow;  // Pending message is too large to be kept.
+    };
+
+    // Per-stream statistics. Last element is used for all non-data streams.
+    struct StreamStats {
+        uint32_t bytes_sent, bytes_dropped;
+        TimeDelta peak_latency;
+    };
+
+    DropPolicy drop_policy(uint32_t stream_idx);
+    StreamStats &stream_stats(uint32_t stream_idx);
+    TxQueueBase &tx_queue(uint32_t stream_idx);
+    TxQueueBase *next_tx_queue();
+
+    void send_chunk(const DataChunk &chunk);
+    void store_poll_chunk(const DataChunk &chunk);
+    void send_poll_reply();
+    bool make_room(const DataChunk &chunk, TxQueueBase &queue, Timestamp cur_time);
+    bool send_queued(Timestamp cur_time, bool blocking);
+    void drop(uint32_t stream_idx, uint32_t len);
+
+    DropPolicy drop_policies_[max_num_inputs];
+    bool is_data_stream_[max_num_inputs];
+    TxQueue<tx_queue_size, max_tx_queue_messages> data_tx_queue_;
+    TxQueue<debug_tx_queue_size, max_debug_tx_queue_messages> debug_tx_queue_;
+    bool receiving_message_;  // True if the last accepted chunk was not the last one in its message.
+    bool dropping_message_;  // True if we're dropping remaining chunks of a message.
+    PollSlot *poll_slots_;  // max_num_inputs slots indexed by stream_idx; null if not polling.
+
+    // Statistics, reset on each debug print.
+    bool print_tx_stats_;
+    StreamStats stats_[max_num_inputs + 1];
+    uint32_t data_bytes_dropped_;  // Not reset.
+};
@@ -0,0 +1,92 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <utility>
+
+// Size of the heap blocks an Arena carves allocations from. Allocations larger than half of it get their own block.
+constexpr size_t default_arena_block_size = 2048;
+
+// Deleter for objects allocated in an Arena: only calls the destructor, memory is released with the arena itself.
+struct ArenaDeleter {
+    template<typename T>
+    void operator()(T *ptr) const { ptr->~T(); }
+};
+
+// Owning pointer to an object allocated in an Arena. Must not outlive the arena.
+template<typename T>
+using ArenaPtr = std::unique_ptr<T, ArenaDeleter>;
+
+// Monotonic allocator: memory is carved sequentially from large heap blocks and is only released, all at once, when
+// the arena is destroyed. Each Pipeline owns one for its nodes, so rebuilding a pipeline (configuration mode,
+// validation, production) leaves no holes in the heap. This matters on Teensy, where _sbrk() never shrinks the heap.
+// NOTE: An Arena is not thread-safe; each one is used by the thread creating its pipeline. Totals of all arenas are
+// atomic, as pipelines can be created in several threads (e.g. by the trace analyzer).
+class Arena {
+public:
+    explicit Arena(size_t block_size = default_arena_block_size);
+    ~Arena();
+    Arena(const Arena &) = delete;
+    Arena &operator=(const Arena &) = delete;
+
+    // Throws std::bad_alloc when the heap is exhausted, like operator new().
+    void *allocate(size_t size, size_t align);
+
+    template<typename T, typename... Args>
+    ArenaPtr<T> make(Args&&... args) {
+        void *mem = allocate(sizeof(T), alignof(T));
+        return ArenaPtr<T>(new (mem) T(std::forward<Args>(args)...));
+    }
+
+    // Whether given pointer was allocated from this arena.
+    bool contains(const void *ptr) const;
+
+    // Bytes given out so far, including alignment padding. As the arena never frees, this is also its peak usage.
+    size_t bytes_used() const { return bytes_used_; }
+    // Heap taken by this arena's blocks.
+    size_t bytes_reserved() const { return bytes_reserved_; }
+    uint32_t num_blocks() const { return num_blocks_; }
+
+    // Max heap taken by all arenas at the same time since the start. Use it to size RAM.
+    static size_t peak_total_reserved() { return peak_total_reserved_.load(std::memory_order_relaxed); }
+
+private:
+    struct Block {
+        Block *next;
+        size_t size;  // Size of data following this header.
+    };
+    Block *add_block(size_t size);
+
+    size_t block_size_;
+    Block *blocks_;  // Linked list; first block is the one being carved.
+    uintptr_t cur_, end_;  // Free space of the first block.
+    size_t bytes_used_;
+    size_t bytes_reserved_;
+    uint32_t num_blocks_;
+
+    static std::atomic<size_t> total_reserved_;
+    static std::atomic<size_t> peak_total_reserved_;
+};
+
+// Adapter to keep standard containers in an Arena. Deallocation is a no-op, so only use it for containers that
+// don't grow much.
+template<typename T>
+struct ArenaAllocator {
+    typedef T value_type;
+
+    ArenaAllocator(Arena *arena) : arena(arena) {}
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+    T *allocate(size_t n) { return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T))); }
+    void deallocate(T *ptr, size_t n) {}
+
+    Arena *arena;
+};
+
+template<typename T, typename U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.arena == b.arena; }
+template<typename T, typename U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.arena != b.arena; }
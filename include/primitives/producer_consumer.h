@@ -1,7 +1,7 @@
 #pragma once
+#include "string_utils.h"
 #include <cassert>
 #include <memory>
-#include <list>
 
 // Very simple, low-overhead Producer/Consumer pattern.
 // To use, inherit from Consumer/Producer as needed, implement consume() then call pipe() and produce()
@@ -13,6 +13,14 @@ public:
 };
 
 
+// Max number of consumers that can be piped to one producer of type T. Consumers are kept in an inline array,
+// so most producers keep the default; specialize this for message types that fan out to many consumers.
+template<typename T>
+struct MaxConsumers {
+    static constexpr uint32_t value = 4;
+};
+
+
 template<typename T>
 class ProduceLogger {
 public:
@@ -29,22 +37,36 @@ public:
 template<typename T, int out_idx = 0>
 class Producer {
 public:
-    // This method connects producer to consumer.
+    static constexpr uint32_t max_consumers = MaxConsumers<T>::value;
+
+    // This method connects producer to consumer. Consumers connected later get the values first.
     void pipe(Consumer<T> *consumer) {
-        consumers_.push_front(consumer);
+        if (num_consumers_ >= max_consumers)
+            throw_printf("Too many consumers of one producer (max %d)", max_consumers);
+        consumers_[num_consumers_++] = consumer;
+    }
+
+    // Disconnects consumer, e.g. before it's replaced. Order of the other consumers is kept.
+    void unpipe(Consumer<T> *consumer) {
+        for (uint32_t i = 0; i < num_consumers_; i++)
+            if (consumers_[i] == consumer) {
+                for (num_consumers_--; i < num_consumers_; i++)
+                    consumers_[i] = consumers_[i + 1];
+                return;
+            }
     }
 
     // This method should be called to send the value to all connected consumers.
     void produce(const T& val) {
-        for (auto &cons : consumers_)
-            cons->consume(val);
+        for (uint32_t i = num_consumers_; i > 0; i--)
+            consumers_[i - 1]->consume(val);
         if (logger_)
             logger_->log_produce(val);
     }
 
     // This method is an optimization so that the values which don't have consumers wouldn't have to be calculated.
     bool has_consumers() {
-        return !consumers_.empty();
+        return num_consumers_ > 0;
     }
 
     // Mostly used for debugging purposes, this method allows external parties to set up a logger for this producer.
@@ -58,7 +80,8 @@ public:
 
     virtual ~Producer() {};
 private:
-    std::list<Consumer<T> *> consumers_;
+    Consumer<T> *consumers_[max_consumers];
+    uint32_t num_consumers_ = 0;
     std::unique_ptr<ProduceLogger<T>> logger_;
 };
 
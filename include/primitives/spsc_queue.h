@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <stdint.h>
+
+// Lock-free queue of elements of type T with capacity C, for exactly one producer thread and one consumer thread.
+// Unlike CircularBuffer, it's safe on multi-core hosts: indexes are atomics with acquire/release ordering.
+// NOTE: Both read and write indexes will freely overflow uint32_t and that's fine.
+template<typename T, uint32_t C>
+class SpscQueue {
+    static_assert(!(C & (C-1)), "Only power-of-two sizes of queue are supported.");
+    static_assert(C > 0, "Please provide positive capacity");
+public:
+    SpscQueue() : write_idx_(0), read_idx_(0) {}
+    SpscQueue(const SpscQueue &) = delete;
+
+    // Producer side. Returns false if the queue is full.
+    bool push(const T &elem) {
+        uint32_t write_idx = write_idx_.load(std::memory_order_relaxed);
+        if (write_idx - read_idx_.load(std::memory_order_acquire) >= C)
+            return false;
+        elems_[write_idx & (C-1)] = elem;
+        write_idx_.store(write_idx + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Producer side. Position of the next pushed element, to be passed to truncate().
+    uint32_t write_pos() const { return write_idx_.load(std::memory_order_relaxed); }
+
+    // Producer side. Removes elements pushed at or after given position. The caller must ensure the consumer doesn't
+    // pop them (e.g. by only popping up to a count it publishes separately, like ThreadBridge does).
+    void truncate(uint32_t pos) { write_idx_.store(pos, std::memory_order_release); }
+
+    // Consumer side. Returns false if the queue is empty.
+    bool pop(T *elem) {
+        uint32_t read_idx = read_idx_.load(std::memory_order_relaxed);
+        if (read_idx == write_idx_.load(std::memory_order_acquire))
+            return false;
+        *elem = elems_[read_idx & (C-1)];
+        read_idx_.store(read_idx + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Approximate when called from a third thread.
+    uint32_t size() const {
+        return write_idx_.load(std::memory_order_acquire) - read_idx_.load(std::memory_order_acquire);
+    }
+    bool empty() const { return size() == 0; }
+    static constexpr uint32_t max_size() { return C; }
+
+private:
+    // Indexes are on separate cache lines so that the threads don't invalidate each other's cache on every access.
+    alignas(64) std::atomic<uint32_t> write_idx_;
+    alignas(64) std::atomic<uint32_t> read_idx_;
+    alignas(64) T elems_[C];
+};
@@ -0,0 +1,155 @@
+#pragma once
+#include "workers.h"
+#include "producer_consumer.h"
+#include <tuple>
+#include <utility>
+
+// Pipeline with a chain of nodes fixed at compile time, for the common topology that needs no configuration:
+// PulseProcessor -> PointGeometryBuilder -> GeometryBinaryFormatter -> OutputNode, fed with pulses from inputs.
+// Nodes are members of the pipeline, so there's no node list and no allocation, and values go from each node to the
+// next one with direct calls instead of Producer<T>::produce() and virtual consume(). Nodes on the chain provide
+// non-virtual versions of their work that return the value to pass on (nullptr if there's none):
+//   const Out *process(const In &val)     - used instead of consume(In).
+//   const Out *process_time(Timestamp t)  - used instead of do_work().
+// Other nodes, like the last one, get values through a qualified (non-virtual) call of consume() and work as usual.
+// Values passed on are also produced to whatever is piped to the node at runtime (e.g. debug loggers), which costs
+// nothing when there's nothing piped.
+//
+// Usage:
+//   StaticPipeline<PulseProcessor, PointGeometryBuilder, GeometryBinaryFormatter, UsbSerialOutputNode> pipeline(
+//       std::forward_as_tuple(num_inputs), std::forward_as_tuple(0, geo_def, base_stations),
+//       std::forward_as_tuple(0, formatter_def, transform), std::forward_as_tuple(0, output_def));
+//   pipeline.consume(pulse);
+//   pipeline.do_work(cur_time);
+
+namespace static_pipeline_impl {
+
+// Recursive list of nodes, each constructed from its own tuple of constructor arguments and passing values to the
+// next one.
+template<typename... Nodes>
+struct NodeList {
+    NodeList() {}
+    template<typename T>
+    void consume(const T &val) {}
+    void do_work(Timestamp cur_time) {}
+    Timestamp next_work_time(Timestamp cur_time, Timestamp next_time) { return next_time; }
+    void start() {}
+    bool debug_cmd(HashedWord *input_words) { return false; }
+    void debug_print(PrintStream &stream) {}
+    void collect_telemetry(BinaryTelemetryPacket &packet) {}
+};
+
+template<typename Node, typename... Rest>
+struct NodeList<Node, Rest...> {
+    Node node;
+    NodeList<Rest...> rest;
+
+    template<typename... Args, typename... RestArgs>
+    NodeList(std::tuple<Args...> args, RestArgs&&... rest_args)
+        : NodeList(std::index_sequence_for<Args...>(), args, std::forward<RestArgs>(rest_args)...) {}
+
+    template<size_t... Is, typename... Args, typename... RestArgs>
+    NodeList(std::index_sequence<Is...>, std::tuple<Args...> &args, RestArgs&&... rest_args)
+        : node(std::get<Is>(std::move(args))...)
+        , rest(std::forward<RestArgs>(rest_args)...) {}
+
+    template<typename T>
+    void consume(const T &val) { consume(val, 0); }
+
+    // Same scheduling as in Pipeline, see Pipeline::do_work().
+    void do_work(Timestamp cur_time) {
+        TimeDelta time_left = node.Node::next_work_time(cur_time) - cur_time;
+        if (time_left <= TimeDelta() || time_left > max_sleep_time)
+            do_work(cur_time, 0);
+        rest.do_work(cur_time);
+    }
+    Timestamp next_work_time(Timestamp cur_time, Timestamp next_time) {
+        Timestamp node_time = node.Node::next_work_time(cur_time);
+        return rest.next_work_time(cur_time, node_time < next_time ? node_time : next_time);
+    }
+    void start() {
+        node.Node::start();
+        rest.start();
+    }
+    bool debug_cmd(HashedWord *input_words) {
+        return node.Node::debug_cmd(input_words) || rest.debug_cmd(input_words);
+    }
+    void debug_print(PrintStream &stream) {
+        node.Node::debug_print(stream);
+        rest.debug_print(stream);
+    }
+    void collect_telemetry(BinaryTelemetryPacket &packet) {
+        node.Node::collect_telemetry(packet);
+        rest.collect_telemetry(packet);
+    }
+
+private:
+    // Overloads taking int are preferred; the ones taking long are used when the node has no process*() method.
+    // N is always Node; it makes the checks depend on the template arguments.
+    template<typename T, typename N = Node>
+    auto consume(const T &val, int) -> decltype(std::declval<N &>().process(val), void()) {
+        if (auto out = node.Node::process(val))
+            pass_on(*out);
+    }
+    template<typename T>
+    void consume(const T &val, long) { node.Node::consume(val); }
+
+    template<typename N = Node>
+    auto do_work(Timestamp cur_time, int) -> decltype(std::declval<N &>().process_time(cur_time), void()) {
+        if (auto out = node.Node::process_time(cur_time))
+            pass_on(*out);
+    }
+    template<typename N = Node>
+    void do_work(Timestamp cur_time, long) { node.Node::do_work(cur_time); }
+
+    template<typename Out>
+    void pass_on(const Out &out) {
+        rest.consume(out);
+        static_cast<Producer<Out> &>(node).produce(out);
+    }
+};
+
+template<size_t I>
+struct NodeGetter {
+    template<typename List>
+    static auto &get(List &list) { return NodeGetter<I - 1>::get(list.rest); }
+};
+
+template<>
+struct NodeGetter<0> {
+    template<typename List>
+    static auto &get(List &list) { return list.node; }
+};
+
+}  // namespace static_pipeline_impl
+
+template<typename... Nodes>
+class StaticPipeline : public WorkerNode {
+public:
+    // One tuple of constructor arguments per node, see std::forward_as_tuple().
+    template<typename... ArgTuples>
+    StaticPipeline(ArgTuples&&... node_args) : nodes_(std::forward<ArgTuples>(node_args)...) {
+        static_assert(sizeof...(ArgTuples) == sizeof...(Nodes), "Constructor arguments are needed for each node");
+    }
+
+    template<size_t I>
+    typename std::tuple_element<I, std::tuple<Nodes...>>::type &node() {
+        return static_pipeline_impl::NodeGetter<I>::get(nodes_);
+    }
+
+    // Feed a value to the first node, e.g. a pulse from an input.
+    template<typename T>
+    void consume(const T &val) { nodes_.consume(val); }
+
+    virtual void do_work(Timestamp cur_time) { nodes_.do_work(cur_time); }
+    virtual Timestamp next_work_time(Timestamp cur_time) {
+        return nodes_.next_work_time(cur_time, cur_time + max_sleep_time);
+    }
+    virtual void start() { nodes_.start(); }
+    virtual bool debug_cmd(HashedWord *input_words) { return nodes_.debug_cmd(input_words); }
+    virtual void debug_print(PrintStream &stream) { nodes_.debug_print(stream); }
+    virtual void collect_telemetry(BinaryTelemetryPacket &packet) { nodes_.collect_telemetry(packet); }
+
+private:
+    static_pipeline_impl::NodeList<Nodes...> nodes_;
+};
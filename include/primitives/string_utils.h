@@ -8,12 +8,30 @@ constexpr int max_input_str_len = 256;
 constexpr int max_words = 64;
 
 // Very simple virtual printer class.
+// Use print_* methods in hot paths: they don't use vsnprintf and its static buffer.
 class PrintStream {
 public:
     virtual size_t write(const char *buffer, size_t size) = 0;
 	int printf(const char *format, ...);
+
+    void print(const char *str);
+    void print(char c) { write(&c, 1); }
+    void print_uint(uint32_t val, uint32_t min_digits = 1);
+    void print_int(int32_t val);
+    void print_hex(uint32_t val, uint32_t min_digits = 1, bool uppercase = false);
+    void print_fixed(float val, uint32_t decimals);
 };
 
+// Fast printf-free number formatting. Each function writes to 'buf' and returns pointer to the char after the last
+// written one; no zero terminator is added. 'buf' needs to have at least max_formatted_number_len bytes.
+constexpr int max_formatted_number_len = 20;
+char *format_uint(char *buf, uint32_t val, uint32_t min_digits = 1);  // Like "%0*u"
+char *format_int(char *buf, int32_t val);                              // Like "%d"
+char *format_hex(char *buf, uint32_t val, uint32_t min_digits = 1, bool uppercase = false);  // Like "%0*x" or "%0*X"
+// Like "%.*f", but limited to 6 decimals and values with abs(val) < 2^32. Larger values are printed as "ovf"/"-ovf".
+// Rounding is done in float, so the last digit can differ from printf when the value is very close to a tie.
+char *format_fixed(char *buf, float val, uint32_t decimals);
+
 // Parses provided string to null-terminated array of trimmed strings.
 // NOTE: Provided string is changed - null characters are added after words.
 char **parse_words(char *str);
@@ -25,6 +43,7 @@ char* next_word(char **str);
 // Parses given string into a uint32 and returns true if the parsing is successful.
 bool parse_uint32(const char *str, uint32_t *res);
 bool parse_float(const char *str, float *res);
+bool parse_double(const char *str, double *res);
 
 
 // Simple structure to hold both original word and its hash to help with comparisons.
@@ -37,6 +56,7 @@ struct HashedWord {
     operator unsigned long() const { return hash; } // By default, can be casted to uint32_t as a hash.
     inline bool as_uint32(uint32_t *res) { return parse_uint32(word, res); }
     inline bool as_float(float *res) { return parse_float(word, res); }
+    inline bool as_double(double *res) { return parse_double(word, res); }
 };
 
 // Return a static, zero-terminated array of hashes for words in given string.
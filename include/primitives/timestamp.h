@@ -3,6 +3,7 @@
 // Also, a utility function throttle_ms to run something periodically.
 #pragma once
 #include <stdint.h>
+#include <atomic>
 
 enum TimeUnit {
     usec = 3,            // This can be increased to get better time resolution.
@@ -66,14 +67,18 @@ public:
 
     // Get adjusted value of this timestamp in provided time unit. 
     // We try to "extend" the value outside of regular period of timestamp using current time in millis.
-    // TODO: Add 64bit version of get_value.
     uint32_t get_value(TimeUnit tu) const;
 
+    // 64 bit version of get_value() that doesn't wrap around. Overflows of millis are counted by a shared
+    // MillisWrapCounter, which is kept current by cur_time_millis_64() calls in Pipeline::run_once().
+    uint64_t get_value_64(TimeUnit tu) const;
+
     // Get raw value in 'ticks'.
     uint32_t get_raw_value() { return time_; }
 
     // Static getters.
     static Timestamp cur_time(); // Implementation will try to get the best resolution possible.
+    static uint64_t cur_time_millis_64(); // Current millis that don't wrap around. Thread-safe.
 
     // Create TimeDelta from a pair of Timestamps. Note that the wrapping is handled here correctly as we're converting to a signed int.
     constexpr TimeDelta operator-(const Timestamp& other) const { return time_ - other.time_; }
@@ -98,6 +103,19 @@ private:
     uint32_t time_;  // Think about this as some global time mod 2^32.
 };
 
+// Extends 32 bit millis to 64 bits by counting their wraps. Can be called from several threads; callers with a slightly
+// stale millis value get the wrap count of their value. Needs to see the clock at least once every ~24 days (a quarter
+// of the period) to notice all wraps.
+class MillisWrapCounter {
+public:
+    MillisWrapCounter(): state_(0) {}
+    uint64_t extend(uint32_t millis);
+
+private:
+    static constexpr uint32_t seen_flag = 4;
+    std::atomic<uint32_t> state_;  // Number of wraps << 3 | seen_flag | quarter of the period of the latest millis.
+};
+
 // Returns true only once per period_time. cur_time is the current timestamp. block_prev_run is a pointer to Timestamp that
 // keeps data between calls, should not be used otherwise; slips will contain the number of skipped periods, if provided.
 // Usage:
@@ -11,6 +11,8 @@ class Vector {
     static_assert(std::is_trivially_destructible<T>(), "Vector only works on simple types");
     static_assert(std::is_trivially_copyable<T>(), "Vector only works on simple types");
 public:
+    static constexpr unsigned capacity = C;
+
     Vector() : size_{} {}
     inline unsigned long size() const { return size_; }
     inline unsigned long max_size() const { return C; }
@@ -1,8 +1,19 @@
 #pragma once
 #include "timestamp.h"
 #include "string_utils.h"
-#include <list>
-#include <memory>
+#include "arena.h"
+#include <assert.h>
+#include <vector>
+
+struct BinaryTelemetryPacket;
+
+// Max time the pipeline sleeps waiting for work. Nodes that have nothing to do return cur_time + max_sleep_time
+// from next_work_time().
+constexpr TimeDelta max_sleep_time(100, msec);
+
+// Sleep until given time or until an input event (interrupt, readable file descriptor) happens, whichever is first.
+// Can return early. This function needs to be defined by the platform.
+void wait_for_event(Timestamp deadline);
 
 // Simple worker node pattern. 
 // To create a worker node, inherit from this interface and override functions needed.
@@ -11,6 +22,10 @@ public:
     // This function is called continuously in a loop. Analogous to the loop() function in Arduino.
     virtual void do_work(Timestamp cur_time) {};
 
+    // Time when do_work() needs to be called next; it's skipped until then. Nodes waiting for input should check
+    // whether it's already available and return cur_time in that case. Default is to be called continuously.
+    virtual Timestamp next_work_time(Timestamp cur_time) { return cur_time; }
+
     // This function will be called once before starting to run the real pipeline.
     // Analogous to setup() function in Arduino, place any hard-to-undo hardware setup here.
     // It won't be called if the pipeline is created just for config validation. For common setup, use constructor.
@@ -23,47 +38,82 @@ public:
     // Print current debugging information about this module. This function is called ~ every second.
     virtual void debug_print(PrintStream &stream) {};
 
+    // Add current state and counters of this module to the telemetry packet (see binary_protocol.h). Called at the
+    // rate of telemetry streams, so it should only copy values.
+    virtual void collect_telemetry(BinaryTelemetryPacket &packet) {};
+
     // Virtual destructor to help with correct deletions.
     virtual ~WorkerNode() = default;
 };
 
 // Pipeline defines an ordered list of WorkerNodes that work together.
-// Pipeline 'owns' all the nodes and all of them will be deleted when the pipeline is deleted.
+// Pipeline 'owns' all the nodes and all of them will be deleted when the pipeline is deleted. Nodes are allocated from
+// the pipeline's arena, so all their memory is returned to the heap in one piece.
 class Pipeline : public WorkerNode {
 public:
     Pipeline() 
-        : stop_requested_(false) 
-    {}
+        : nodes_(ArenaAllocator<WorkerNode *>(&arena_))
+        , stop_requested_(false) {
+        nodes_.reserve(16);
+    }
+    virtual ~Pipeline() {
+        for (auto node : nodes_)
+            node->~WorkerNode();
+    }
 
-    // Adding WorkerNodes to this pipeline. Note, after this Pipeline starts to own them and will
-    // destruct them when needed. Suggested usage:
-    // SpecializedNode *node = pipeline->add_front(std::make_unique<SpecializedNode>());
+    // Creating WorkerNodes in this pipeline. Suggested usage:
+    // SpecializedNode *node = pipeline->emplace_back<SpecializedNode>(constructor args);
+    template<typename T, typename... Args>
+    T *emplace_front(Args&&... args) {
+        return add_front(arena_.make<T>(std::forward<Args>(args)...));
+    }
+
+    template<typename T, typename... Args>
+    T *emplace_back(Args&&... args) {
+        return add_back(arena_.make<T>(std::forward<Args>(args)...));
+    }
+
+    // Adding nodes created by factories, like InputNode::create(pipeline->arena(), ...). They must be allocated from
+    // this pipeline's arena.
     template<typename T> 
-    T *add_front(std::unique_ptr<T> node) { 
-        T *res = node.get();
-        nodes_.emplace_front(std::move(node));
-        return res;
+    T *add_front(ArenaPtr<T> node) { 
+        assert(arena_.contains(node.get()));
+        nodes_.insert(nodes_.begin(), node.get());
+        return node.release();
     }
 
     template<typename T> 
-    T *add_back(std::unique_ptr<T> node) {
-        T *res = node.get();
-        nodes_.emplace_back(std::move(node));
-        return res;
+    T *add_back(ArenaPtr<T> node) {
+        assert(arena_.contains(node.get()));
+        nodes_.push_back(node.get());
+        return node.release();
     }
 
+    Arena &arena() { return arena_; }
+
     // Helper function to run this pipeline.
     void run() {
         // Setup all hardware changes needed to run this pipeline.
         start();
 
-        // Process incoming work until finished.
+        // Process incoming work until finished, sleeping while no node needs to work.
         while (!stop_requested_)
-            do_work(Timestamp::cur_time());
+            run_once();
         
         // TODO someday: create method end(), symmetrical to start().
     }
 
+    // One iteration of run(): work while nodes are due, then sleep until the next deadline or an event. Platforms
+    // that drive the pipeline from their own loop call this instead of do_work().
+    void run_once() {
+        Timestamp::cur_time_millis_64();  // Keep the count of millis wraps current for get_value_64().
+        do_work(Timestamp::cur_time());
+        Timestamp cur_time = Timestamp::cur_time();
+        Timestamp next_time = next_work_time(cur_time);
+        if (next_time > cur_time)
+            wait_for_event(next_time);
+    }
+
     void stop() {
         stop_requested_ = true;
     }
@@ -74,8 +124,21 @@ public:
 
     // Define WorkerNode functions to work on all nodes in order.
     virtual void do_work(Timestamp cur_time) {
-        for (auto& node : nodes_) 
-            node->do_work(cur_time);
+        for (auto& node : nodes_) {
+            // Times further than we'd ever sleep are stale (e.g. wrapped around), so such nodes are called too.
+            TimeDelta time_left = node->next_work_time(cur_time) - cur_time;
+            if (time_left <= TimeDelta() || time_left > max_sleep_time)
+                node->do_work(cur_time);
+        }
+    }
+    virtual Timestamp next_work_time(Timestamp cur_time) {
+        Timestamp next_time = cur_time + max_sleep_time;
+        for (auto& node : nodes_) {
+            Timestamp node_time = node->next_work_time(cur_time);
+            if (node_time < next_time)
+                next_time = node_time;
+        }
+        return next_time;
     }
     virtual void start() {
         for (auto& node : nodes_)
@@ -91,10 +154,17 @@ public:
         for (auto& node : nodes_) 
             node->debug_print(stream); 
     }
+    virtual void collect_telemetry(BinaryTelemetryPacket &packet) {
+        for (auto& node : nodes_)
+            node->collect_telemetry(packet);
+    }
 
 protected:
+    Arena arena_;
+
     // Owning list of nodes. All nodes here will have the same lifecycle as the pipeline itself.
-    std::list<std::unique_ptr<WorkerNode>> nodes_;
+    // Kept contiguous as it's iterated on each do_work(); nodes are only added while the pipeline is created.
+    std::vector<WorkerNode *, ArenaAllocator<WorkerNode *>> nodes_;
 
     // Flag that this pipeline should be stopped.
     bool stop_requested_;
@@ -16,15 +16,22 @@ public:
     PulseProcessor(uint32_t num_inputs);
     virtual void consume(const Pulse& p);
     virtual void do_work(Timestamp cur_time);
+    virtual Timestamp next_work_time(Timestamp cur_time);
+
+    // Work of do_work(), except that the angles frame is returned instead of produced; nullptr if there's none.
+    // StaticPipeline uses it to pass frames on with direct calls.
+    const SensorAnglesFrame *process_time(Timestamp cur_time);
 
     virtual bool debug_cmd(HashedWord *input_words);
     virtual void debug_print(PrintStream &stream);
+    virtual void collect_telemetry(BinaryTelemetryPacket &packet);
 
 private:
     void process_long_pulse(const Pulse &p);
     void process_short_pulse(const Pulse &p);
-    void process_cycle_fix(Timestamp cur_time);
+    bool process_cycle_fix(Timestamp cur_time);  // Returns true if angles_frame_ is ready to be sent.
     void reset_cycle_pulses();
+    void update_angle(uint32_t input_idx, int cycle_phase, float angle);
 
     uint32_t num_inputs_;
 
@@ -46,6 +53,13 @@ private:
     // Output data: angles.
     SensorAnglesFrame angles_frame_;
 
+    // Last two angles for each sensor and phase, used to estimate angle jitter.
+    struct AngleHistory {
+        float prev[2];    // prev[0] is the last angle, prev[1] is the one before it.
+        uint32_t len;     // Number of consecutive angles seen, up to 2.
+    };
+    AngleHistory angle_history_[max_num_inputs][num_cycle_phases];
+
     TimeDelta time_from_last_long_pulse_;
     bool debug_print_state_;
 };
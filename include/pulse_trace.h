@@ -0,0 +1,16 @@
+// Pulse traces: text recordings of sensor pulses, read by Linux pulse sources (see platform-linux/input_stream.h) and
+// the trace analyzer, and written by the flight recorder.
+// Each line is '<pin> <start_us> <len_us>': pin number of the sensor, pulse start time in microseconds (uint32, can
+// have a fractional part, wraps around) and pulse length in microseconds (can be fractional). Lines starting with '#'
+// are comments.
+#pragma once
+#include <stdint.h>
+
+struct TracePulse {
+    uint32_t pin;
+    uint32_t start_us;
+    float start_frac;  // Fractional part of start_us.
+    float len_us;
+};
+enum class TraceLineType { kPulse, kComment, kInvalid };
+TraceLineType parse_trace_line(const char *line, TracePulse *pulse);
@@ -4,8 +4,19 @@
 #include "geometry.h"
 #include "formatters.h"
 #include "outputs.h"
+#include "settings_storage.h"
 #include <type_traits>
 
+class PersistentSettings;
+
+// Additional check of a changed definition, see PersistentSettings::set_definition().
+class DefinitionValidator {
+public:
+    // Returns false and prints the error if changed settings can't be used.
+    virtual bool validate(const PersistentSettings &settings, PrintStream &error_stream) = 0;
+    virtual ~DefinitionValidator() = default;
+};
+
 // This class provides configurability to our project. It reads/writes configuration data to EEPROM and provides
 // configuration command interface.
 class PersistentSettings {
@@ -20,35 +31,42 @@ public:
     // Settings lifecycle methods
     PersistentSettings();
     bool needs_configuration() { return !is_configured_; }
-    void restart_in_configuration_mode();
+    void restart_in_configuration_mode() const;
 
     std::unique_ptr<Pipeline> create_configuration_pipeline(uint32_t stream_idx);
     bool process_command(char *input_cmd, PrintStream &stream);
 
+    // Applies one definition command, e.g. 'stream1 angles > usb_serial', if the result passes validate_defs() and
+    // the validator, if given. Otherwise the previous definition is restored. Prints the result. Returns true if the
+    // definition was updated.
+    bool set_definition(HashedWord *input_words, PrintStream &stream, DefinitionValidator *validator = nullptr);
+
+    // Only changed definitions are written. Returns false if there's not enough space.
+    bool write_to_eeprom() const;
+
 private:
+    bool validate_defs(PrintStream &error_stream) const;
     bool validate_setup(PrintStream &error_stream);
 
     template<typename T, unsigned arr_len>
-    void set_value(Vector<T, arr_len> &arr, uint32_t idx, HashedWord *input_words, PrintStream &stream);
+    bool set_value(Vector<T, arr_len> &arr, uint32_t idx, HashedWord *input_words, PrintStream &stream,
+                   DefinitionValidator *validator);
 
     void reset();
     bool read_from_eeprom();
-    void write_to_eeprom();
+    bool read_legacy_settings();
 
-    // NOTE: This is the same layout as used for EEPROM.
-    // NOTE: Increase current_settings_version with each change.
+    // NOTE: Each vector is stored as separate records in EEPROM, see settings.cpp. When changing definition structs,
+    // only append fields and increase settings_record_version.
     bool is_configured_;
     Vector<InputDef, max_num_inputs> inputs_;
     Vector<BaseStationGeometryDef, num_base_stations> base_stations_;
     Vector<GeometryBuilderDef, max_num_inputs> geo_builders_;
     Vector<FormatterDef, max_num_inputs> formatters_;
     Vector<OutputDef, num_outputs> outputs_;
-};
 
-// Singleton to access current settings.
-extern PersistentSettings settings;
+    mutable SettingsStorage storage_;
+};
 
 // Functions to be implemented by platform
 void restart_system();
-void eeprom_read(uint32_t eeprom_addr, void *dest, uint32_t len);
-void eeprom_write(uint32_t eeprom_addr, const void *src, uint32_t len);
@@ -0,0 +1,92 @@
+// Log-structured storage of settings records in EEPROM.
+//
+// Each record holds one definition (e.g. 'sensor2') tagged with its type, index, layout version and CRC. Records are
+// appended to a log kept in 120-byte pages that are used in a circle, so writes are spread over the whole storage
+// area instead of rewriting the same cells. Records continue across page boundaries, so no space is lost at page
+// ends. Writing a record whose contents are already stored is a no-op, so only changed definitions are written. The
+// latest copy of each record wins.
+// Before a page is reused, the live records starting in it are copied to the end of the log. Enough free space is
+// kept for that, so any set of records up to settings_capacity bytes can be rewritten indefinitely.
+#pragma once
+#include <stdint.h>
+
+constexpr uint32_t settings_page_size = 120;
+constexpr uint32_t settings_num_pages = 17;  // 2040 bytes: fits EEPROM of both Teensy 3.x (2048) and Particle (2047).
+constexpr uint32_t settings_max_record_types = 8;
+constexpr uint32_t settings_max_record_idx = 8;
+constexpr uint32_t settings_max_payload = 80;
+constexpr uint32_t settings_record_header_size = 6;
+constexpr uint32_t settings_page_header_size = 8;
+constexpr uint32_t settings_page_data_size = settings_page_size - settings_page_header_size;
+
+// Total size of live records, including their headers, that is guaranteed to fit. Reusing a page needs free space for
+// its live records: up to a page plus a record that continues into the next one. A record being written needs one
+// more record, and so does an unfinished copy left by power loss.
+constexpr uint32_t settings_max_record_size = settings_record_header_size + settings_max_payload;
+constexpr uint32_t settings_capacity =
+    (settings_num_pages - 1) * settings_page_data_size - 3 * settings_max_record_size + 1;
+
+class SettingsStorage {
+public:
+    SettingsStorage();
+
+    // Scans page and record headers and checks records. Returns false if nothing is stored.
+    bool load();
+
+    // Reads the latest intact copy of given record, up to max_len bytes of payload.
+    // Returns the stored payload length, or -1 if there is no such record.
+    int32_t read(uint8_t type, uint8_t idx, uint8_t *version, void *dest, uint32_t max_len);
+
+    // Stores a record, unless its latest copy has the same contents. Returns false if storage is full.
+    bool write(uint8_t type, uint8_t idx, uint8_t version, const void *data, uint32_t len);
+
+    // Drops records of given type with index >= first_idx, so that they are not copied when their page is reused.
+    void forget(uint8_t type, uint8_t first_idx);
+
+private:
+    struct __attribute__((packed)) RecordHeader {
+        uint8_t type;     // 0xFF marks the end of records in a page.
+        uint8_t idx;
+        uint8_t version;  // Layout version of the payload.
+        uint8_t len;      // Payload length.
+        uint16_t crc;     // CRC16 of the log position, header fields above and payload.
+    };
+    struct __attribute__((packed)) PageHeader {
+        uint32_t seq;    // Incremented each time a page is started; 0 = invalid.
+        uint16_t first;  // Offset of the first record starting in this page, after the end of the one continued.
+        uint16_t check;  // CRC16 of the fields above.
+    };
+    static_assert(sizeof(RecordHeader) == settings_record_header_size, "Record header size mismatch");
+    static_assert(sizeof(PageHeader) == settings_page_header_size, "Page header size mismatch");
+
+    // Records are addressed by their position in the log: page seq * settings_page_data_size + offset in page data.
+    static uint32_t eeprom_addr(uint32_t pos);
+    void read_log(uint32_t pos, void *dest, uint32_t len);
+    void write_log(uint32_t pos, const void *src, uint32_t len);
+    static uint16_t page_check(const PageHeader &header);
+    bool read_page_header(uint32_t seq, PageHeader *header);
+    uint32_t first_record(uint32_t seq);  // Position of the first record starting in given page.
+    void start_page(uint32_t seq, uint32_t first);
+
+    template<typename Fn>
+    uint32_t scan(uint32_t from, uint32_t to, Fn fn);
+    template<typename Fn>
+    void read_payload_chunks(uint32_t pos, uint32_t len, Fn fn);
+    static uint16_t header_crc(uint32_t pos, const RecordHeader &header);
+    bool check_record(uint32_t pos, RecordHeader *header);  // Reads the header; returns true if CRC matches.
+    void begin_record(uint32_t size);
+    void put_record(uint8_t type, uint8_t idx, uint8_t version, const uint8_t *payload, uint32_t len);
+    void copy_record(uint32_t src_pos, RecordHeader header);
+    void finish_record(const RecordHeader &header);
+    bool reuse_tail_page();
+    uint32_t free_space() const;
+
+    uint32_t latest_[settings_max_record_types][settings_max_record_idx];  // Position of latest copy, 0 = none.
+    uint32_t tail_;       // Position of the oldest record that may be live.
+    uint32_t head_;       // Position where the next record is written.
+    uint32_t last_page_;  // Seq of the last started page; 0 if nothing is stored yet.
+};
+
+// Functions to be implemented by platform. Erased EEPROM reads as 0xFF.
+void eeprom_read(uint32_t eeprom_addr, void *dest, uint32_t len);
+void eeprom_write(uint32_t eeprom_addr, const void *src, uint32_t len);
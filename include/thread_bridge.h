@@ -0,0 +1,192 @@
+// Helpers to run parts of a pipeline in separate threads on platforms that support it (see PipelineThreads).
+#pragma once
+#include "primitives/workers.h"
+#include "primitives/producer_consumer.h"
+#include "primitives/spsc_queue.h"
+#include "messages.h"
+#include <atomic>
+
+// Thread running a pipeline. Implemented by the platform.
+class PipelineThread {
+public:
+    // Wake the thread up from wait_for_event(). Called from other threads when they send messages to it.
+    virtual void wake() = 0;
+    virtual ~PipelineThread() = default;
+};
+
+// Messages that consist of several values are never split between threads: ThreadBridge forwards them whole.
+template<typename T>
+inline bool ends_message(const T &val) { return true; }
+inline bool ends_message(const DataChunk &chunk) { return chunk.last_chunk; }
+
+constexpr uint32_t thread_bridge_capacity = 64;
+
+// Passes values from a producer in one thread to consumers in another one, keeping their order. It's a node of the
+// consumer's pipeline: consume() is called in the producer thread, values are produced in do_work().
+// The producer never waits for the consumer: when the queue is full, the message being pushed is dropped and counted,
+// like outputs drop data they can't send. Waiting would stall the producer's pipeline (e.g. PulseProcessor) behind a
+// slow worker, and deadlock threads bridged in both directions. Messages longer than the queue are always dropped.
+template<typename T>
+class ThreadBridge
+    : public WorkerNode
+    , public Consumer<T>
+    , public Producer<T> {
+public:
+    ThreadBridge(PipelineThread *consumer_thread)
+        : consumer_thread_(consumer_thread), pushed_messages_(0), dropped_messages_(0)
+        , message_start_(0), dropping_message_(false), forwarded_messages_(0), peak_size_(0) {}
+
+    virtual void consume(const T &val) {
+        if (!dropping_message_ && !queue_.push(val)) {
+            // Values of the incomplete message are not popped yet (see do_work()), so they can be taken back.
+            queue_.truncate(message_start_);
+            dropping_message_ = true;
+            dropped_messages_.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (ends_message(val)) {
+            if (!dropping_message_) {
+                message_start_ = queue_.write_pos();
+                pushed_messages_.fetch_add(1, std::memory_order_release);
+                consumer_thread_->wake();
+            }
+            dropping_message_ = false;
+        }
+    }
+
+    virtual void do_work(Timestamp cur_time) {
+        uint32_t size = queue_.size();
+        if (size > peak_size_)
+            peak_size_ = size;
+
+        // Only values of complete messages are popped.
+        uint32_t pushed_messages = pushed_messages_.load(std::memory_order_acquire);
+        while (forwarded_messages_ != pushed_messages && queue_.pop(&val_)) {
+            if (ends_message(val_))
+                forwarded_messages_++;
+            Producer<T>::produce(val_);
+        }
+    }
+
+    virtual Timestamp next_work_time(Timestamp cur_time) {
+        bool has_messages = forwarded_messages_ != pushed_messages_.load(std::memory_order_acquire);
+        return has_messages ? cur_time : cur_time + max_sleep_time;
+    }
+
+    virtual void debug_print(PrintStream &stream) {
+        stream.printf("Thread bridge: peak queue %u/%u, dropped messages %u\n", peak_size_, queue_.max_size(),
+                      dropped_messages());
+        peak_size_ = 0;
+    }
+
+    // Number of messages dropped because the queue was full. Can be read from any thread.
+    uint32_t dropped_messages() const { return dropped_messages_.load(std::memory_order_relaxed); }
+
+private:
+    PipelineThread *consumer_thread_;
+    SpscQueue<T, thread_bridge_capacity> queue_;
+    std::atomic<uint32_t> pushed_messages_;  // Complete messages pushed to the queue.
+    std::atomic<uint32_t> dropped_messages_;
+
+    // Producer thread state.
+    uint32_t message_start_;  // Queue position of the first value of the message being pushed.
+    bool dropping_message_;   // Rest of the current message is dropped.
+
+    // Consumer thread state.
+    uint32_t forwarded_messages_;
+    T val_;  // Value being forwarded. DataChunk-s are too large for the stack.
+
+    // Statistics. Not synchronized, only used for debug output.
+    uint32_t peak_size_;
+};
+
+
+// Max time a PipelineCallBridge waits for the other thread to make the call.
+constexpr TimeDelta max_pipeline_call_time(100, msec);
+
+// Node of a pipeline in another thread that makes the calls requested by a PipelineCallBridge. It's added to the front
+// of that pipeline, so the calls are made between the work of its nodes, never concurrently with it.
+class PipelineCallTarget : public WorkerNode {
+public:
+    PipelineCallTarget(Pipeline *pipeline) : pipeline_(pipeline), state_(kIdle) {}
+
+    virtual void do_work(Timestamp cur_time) {
+        uint32_t state = kRequested;
+        if (!state_.compare_exchange_strong(state, kRunning, std::memory_order_acquire))
+            return;
+        switch (call_) {
+            case kDebugCmd:         result_ = pipeline_->debug_cmd(input_words_); break;
+            case kDebugPrint:       pipeline_->debug_print(*stream_); break;
+            case kCollectTelemetry: pipeline_->collect_telemetry(*packet_); break;
+        }
+        state_.store(kDone, std::memory_order_release);
+    }
+
+    virtual Timestamp next_work_time(Timestamp cur_time) {
+        return state_.load(std::memory_order_relaxed) == kRequested ? cur_time : cur_time + max_sleep_time;
+    }
+
+private:
+    friend class PipelineCallBridge;
+    enum State : uint32_t { kIdle, kRequested, kRunning, kDone };
+    enum Call { kDebugCmd, kDebugPrint, kCollectTelemetry };
+
+    Pipeline *pipeline_;
+    std::atomic<uint32_t> state_;
+
+    // Arguments and result of the call. Owned by the caller unless the call is requested or running.
+    Call call_;
+    HashedWord *input_words_;
+    PrintStream *stream_;
+    BinaryTelemetryPacket *packet_;
+    bool result_;
+};
+
+// Forwards debug commands, debug print and telemetry collection to the pipeline of another thread, so that its nodes
+// are included in the calls of this pipeline. The caller waits while the other thread makes the call. If it doesn't
+// get to it in max_pipeline_call_time (e.g. it's busy with a long debug command), the call is skipped.
+class PipelineCallBridge : public WorkerNode {
+public:
+    PipelineCallBridge(PipelineCallTarget *target, PipelineThread *target_thread)
+        : target_(target), target_thread_(target_thread), skipped_calls_(0) {}
+
+    virtual bool debug_cmd(HashedWord *input_words) {
+        target_->input_words_ = input_words;
+        return call(PipelineCallTarget::kDebugCmd) && target_->result_;
+    }
+
+    virtual void debug_print(PrintStream &stream) {
+        target_->stream_ = &stream;
+        if (!call(PipelineCallTarget::kDebugPrint))
+            stream.printf("Worker pipeline is busy; its nodes are skipped (%u calls so far).\n", skipped_calls_);
+    }
+
+    virtual void collect_telemetry(BinaryTelemetryPacket &packet) {
+        target_->packet_ = &packet;
+        call(PipelineCallTarget::kCollectTelemetry);
+    }
+
+private:
+    // Returns false if the call was skipped.
+    bool call(PipelineCallTarget::Call call) {
+        target_->call_ = call;
+        target_->state_.store(PipelineCallTarget::kRequested, std::memory_order_release);
+        target_thread_->wake();
+        Timestamp deadline = Timestamp::cur_time() + max_pipeline_call_time;
+        while (target_->state_.load(std::memory_order_acquire) != PipelineCallTarget::kDone) {
+            uint32_t state = PipelineCallTarget::kRequested;
+            if (Timestamp::cur_time() > deadline &&
+                target_->state_.compare_exchange_strong(state, PipelineCallTarget::kIdle, std::memory_order_relaxed)) {
+                skipped_calls_++;
+                return false;
+            }
+            // The call is either not taken yet or running; running calls don't wait for this thread, so they finish.
+            wait_for_event(Timestamp::cur_time() + TimeDelta(1, msec));
+        }
+        target_->state_.store(PipelineCallTarget::kIdle, std::memory_order_relaxed);
+        return true;
+    }
+
+    PipelineCallTarget *target_;
+    PipelineThread *target_thread_;
+    uint32_t skipped_calls_;
+};
@@ -1,7 +1,23 @@
 #pragma once
 #include "primitives/workers.h"
 #include "settings.h"
+#include "thread_bridge.h"
 #include <memory>
 
-// Create Pipeline specialized for Vive Sensors, using provided configuration settings.
-std::unique_ptr<Pipeline> create_vive_sensor_pipeline(const PersistentSettings &settings);
+// Worker threads provided by platforms that can run parts of the pipeline in parallel. Each geometry object,
+// together with its formatters, is assigned to a worker pipeline; everything else runs in the main pipeline
+// (returned by create_vive_sensor_pipeline). Messages between pipelines go through ThreadBridge-s; debug commands,
+// debug print and telemetry of worker nodes go through PipelineCallBridge-s. Streams can't be changed live.
+class PipelineThreads {
+public:
+    virtual PipelineThread *main_thread() = 0;
+    virtual uint32_t num_workers() = 0;
+    virtual PipelineThread *worker(uint32_t idx) = 0;
+    virtual Pipeline *worker_pipeline(uint32_t idx) = 0;
+    virtual ~PipelineThreads() = default;
+};
+
+// Create Pipeline specialized for Vive Sensors, using provided configuration settings. The pipeline keeps a reference
+// to them: definitions changed live (see LiveSettings) are applied to these settings.
+std::unique_ptr<Pipeline> create_vive_sensor_pipeline(PersistentSettings &settings,
+                                                      PipelineThreads *threads = nullptr);
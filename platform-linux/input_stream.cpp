@@ -0,0 +1,224 @@
+#include "input_stream.h"
+#include "platform.h"
+#include "message_logging.h"
+#include "pulse_trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// Max number of pulses to dispatch in one poll() to avoid overflowing input pulse buffers.
+constexpr uint32_t max_pulses_per_poll = 16;
+
+// Pulse times are re-synchronized to our clock if they jump by more than this.
+constexpr TimeDelta max_pulse_time_jump(1000, msec);
+// Live sources are re-synchronized if their clock drifts from ours by more than this.
+constexpr TimeDelta max_clock_drift(200, msec);
+
+// ======  PulseSource  =======================================================
+
+PulseSource *PulseSource::get() {
+    static std::unique_ptr<PulseSource> source;
+    if (!source) {
+        if (!pulse_source_spec)
+            throw_printf("Pulse source is not given. Use --input <source> argument.");
+        source.reset(new PulseSource(pulse_source_spec));
+    }
+    return source.get();
+}
+
+PulseSource::PulseSource(const char *spec)
+    : fd_(-1)
+    , fifo_writer_fd_(-1)
+    , replay_(false)
+    , eof_(false)
+    , pending_(false)
+    , pending_time_()
+    , buf_len_(0)
+    , last_poll_time_()
+    , synced_(false)
+    , last_src_us_(0)
+    , last_src_frac_(0)
+    , last_local_time_()
+    , lines_invalid_(0)
+    , resyncs_(0) {
+    if (!strncmp(spec, "unix:", 5)) {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, spec + 5, sizeof(addr.sun_path) - 1);
+        fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd_ < 0 || connect(fd_, (sockaddr *)&addr, sizeof(addr)) < 0)
+            throw_printf("Can't connect to %s: %s", spec, strerror(errno));
+    } else {
+        // Non-blocking open doesn't wait for a FIFO writer.
+        fd_ = !strcmp(spec, "-") ? STDIN_FILENO : open(spec, O_RDONLY | O_NONBLOCK);
+        if (fd_ < 0)
+            throw_printf("Can't open %s: %s", spec, strerror(errno));
+        struct stat st;
+        if (fstat(fd_, &st) == 0) {
+            replay_ = S_ISREG(st.st_mode);
+            if (S_ISFIFO(st.st_mode) && fd_ != STDIN_FILENO)
+                fifo_writer_fd_ = open(spec, O_WRONLY | O_NONBLOCK);
+        }
+    }
+    if (!replay_)
+        add_wakeup_fd(fd_);
+}
+
+void PulseSource::attach(uint32_t pin, InputStreamNode *node) {
+    inputs_.push_back({pin, node});
+}
+
+void PulseSource::detach(InputStreamNode *node) {
+    for (auto it = inputs_.begin(); it != inputs_.end(); )
+        it = it->node == node ? inputs_.erase(it) : it + 1;
+}
+
+void PulseSource::read_available() {
+    if (eof_ || buf_len_ == sizeof(buf_))
+        return;
+    pollfd pfd = {fd_, POLLIN, 0};
+    if (::poll(&pfd, 1, 0) <= 0)
+        return;
+    ssize_t len = read(fd_, buf_ + buf_len_, sizeof(buf_) - buf_len_);
+    if (len > 0) {
+        buf_len_ += len;
+    } else if (len == 0) {
+        eof_ = true;  // End of file or closed socket.
+        remove_wakeup_fd(fd_);
+    }
+}
+
+Timestamp PulseSource::next_poll_time(Timestamp cur_time) {
+    if (pending_)
+        return pending_time_;
+    if ((replay_ && !eof_) || memchr(buf_, '\n', buf_len_))
+        return cur_time;
+    return cur_time + max_sleep_time;
+}
+
+void PulseSource::poll(Timestamp cur_time) {
+    if (cur_time == last_poll_time_)
+        return;  // Already done in this loop iteration by another input.
+    last_poll_time_ = cur_time;
+    pending_ = false;
+
+    read_available();
+    uint32_t pos = 0, pulses = 0;
+    while (pulses < max_pulses_per_poll) {
+        char *line = buf_ + pos;
+        char *line_end = (char *)memchr(line, '\n', buf_len_ - pos);
+        if (!line_end) {
+            if (buf_len_ == sizeof(buf_) && pos == 0) {
+                lines_invalid_++;  // Line is too long; skip it.
+                buf_len_ = 0;
+            }
+            break;
+        }
+        *line_end = 0;
+        if (!parse_line(line, cur_time)) {
+            *line_end = '\n';  // Pulse is in the future; try again later.
+            break;
+        }
+        pos = line_end + 1 - buf_;
+        pulses++;
+    }
+    memmove(buf_, buf_ + pos, buf_len_ - pos);
+    buf_len_ -= pos;
+}
+
+bool PulseSource::parse_line(const char *line, Timestamp cur_time) {
+    TracePulse pulse;
+    switch (parse_trace_line(line, &pulse)) {
+        case TraceLineType::kComment: return true;
+        case TraceLineType::kInvalid: lines_invalid_++; return true;
+        case TraceLineType::kPulse: break;
+    }
+    uint32_t src_us = pulse.start_us;
+    float src_frac = pulse.start_frac;
+
+    // Convert source time to ours.
+    Timestamp local_time = cur_time;
+    bool resync = !synced_;
+    if (synced_) {
+        int32_t delta_us = (int32_t)(src_us - last_src_us_);
+        if (-max_pulse_time_jump.get_value(usec) < delta_us && delta_us < max_pulse_time_jump.get_value(usec)) {
+            local_time = last_local_time_ + TimeDelta(delta_us, usec)
+                       + TimeDelta((int)lroundf((src_frac - last_src_frac_) * usec), (TimeUnit)1);
+            if (!replay_ && !(local_time - cur_time).within_range_of(TimeDelta(), max_clock_drift))
+                resync = true;
+        } else {
+            resync = true;
+        }
+    }
+    if (resync) {
+        local_time = cur_time;
+        if (synced_)
+            resyncs_++;
+    }
+    if (replay_ && local_time > cur_time) {
+        pending_ = true;
+        pending_time_ = local_time;
+        return false;
+    }
+
+    synced_ = true;
+    last_src_us_ = src_us;
+    last_src_frac_ = src_frac;
+    last_local_time_ = local_time;
+
+    TimeDelta len((int)lroundf(pulse.len_us * usec), (TimeUnit)1);
+    for (auto &input : inputs_)
+        if (input.pin == pulse.pin)
+            input.node->add_pulse(local_time, len);
+    return true;
+}
+
+void PulseSource::debug_print(PrintStream &stream, InputStreamNode *node) {
+    if (inputs_.empty() || inputs_[0].node != node)
+        return;  // Print once for all inputs.
+    if (lines_invalid_ || resyncs_)
+        stream.printf("Pulse source: %u invalid lines, %u time re-syncs%s\n", lines_invalid_, resyncs_,
+                      eof_ ? ", finished" : "");
+    lines_invalid_ = resyncs_ = 0;
+}
+
+// ======  InputStreamNode  ===================================================
+
+InputStreamNode::InputStreamNode(uint32_t input_idx, const InputDef &def)
+    : InputNode(input_idx)
+    , source_(PulseSource::get()) {
+    source_->attach(def.pin, this);
+}
+
+InputStreamNode::~InputStreamNode() {
+    source_->detach(this);
+}
+
+void InputStreamNode::do_work(Timestamp cur_time) {
+    source_->poll(cur_time);
+    InputNode::do_work(cur_time);
+}
+
+Timestamp InputStreamNode::next_work_time(Timestamp cur_time) {
+    Timestamp source_time = source_->next_poll_time(cur_time);
+    Timestamp input_time = InputNode::next_work_time(cur_time);
+    return source_time < input_time ? source_time : input_time;
+}
+
+void InputStreamNode::debug_print(PrintStream &stream) {
+    InputNode::debug_print(stream);
+    source_->debug_print(stream, this);
+}
+
+// All input types read from the same pulse source on Linux.
+InputNode::CreatorRegistrar InputStreamNode::creator_([](Arena &arena, uint32_t input_idx, const InputDef &def) -> ArenaPtr<InputNode> {
+    return arena.make<InputStreamNode>(input_idx, def);
+});
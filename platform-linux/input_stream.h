@@ -0,0 +1,69 @@
+#pragma once
+#include "input.h"
+#include <vector>
+
+class InputStreamNode;
+
+// Source of pulses for all inputs: a file, a FIFO or a UNIX socket, given by pulse_source_spec:
+//   <path>        - regular file (replayed in real time) or FIFO,
+//   unix:<path>   - UNIX stream socket to connect to,
+//   -             - stdin.
+// Pulses are read as a pulse trace, see pulse_trace.h.
+// Pulse times are rebased to our clock; large jumps re-synchronize them to the current time.
+class PulseSource {
+public:
+    // Returns the shared source, opening it on first use. Throws if the source can't be opened.
+    static PulseSource *get();
+
+    void attach(uint32_t pin, InputStreamNode *node);
+    void detach(InputStreamNode *node);
+
+    // Read available pulses and send them to attached inputs. Cheap to call from each input.
+    void poll(Timestamp cur_time);
+    // Time when poll() has something to do. Live sources wake the pipeline up when data arrives.
+    Timestamp next_poll_time(Timestamp cur_time);
+    void debug_print(PrintStream &stream, InputStreamNode *node);
+
+private:
+    explicit PulseSource(const char *spec);
+    bool parse_line(const char *line, Timestamp cur_time);  // Returns false if the pulse is in the future.
+    void read_available();
+
+    struct Attachment { uint32_t pin; InputStreamNode *node; };
+    std::vector<Attachment> inputs_;
+
+    int fd_;
+    int fifo_writer_fd_;  // Kept open so that the FIFO doesn't report end of file between writers.
+    bool replay_;  // Regular file: pulses are released as their time comes.
+    bool eof_;
+    bool pending_;  // Replay: next pulse is in the future, at pending_time_.
+    Timestamp pending_time_;
+    char buf_[4096];
+    uint32_t buf_len_;
+    Timestamp last_poll_time_;
+
+    // Mapping of the source clock to ours.
+    bool synced_;
+    uint32_t last_src_us_;
+    float last_src_frac_;
+    Timestamp last_local_time_;
+
+    uint32_t lines_invalid_, resyncs_;
+};
+
+// Input node receiving pulses of one sensor from PulseSource. Sensor pin selects the pulses.
+class InputStreamNode : public InputNode {
+public:
+    InputStreamNode(uint32_t input_idx, const InputDef &def);
+    ~InputStreamNode();
+
+    virtual void do_work(Timestamp cur_time);
+    virtual Timestamp next_work_time(Timestamp cur_time);
+    virtual void debug_print(PrintStream &stream);
+
+    void add_pulse(Timestamp start, TimeDelta len) { enqueue_pulse(start, len); }
+
+private:
+    PulseSource *source_;
+    static CreatorRegistrar creator_;
+};
@@ -0,0 +1,83 @@
+#include "vive_sensors_pipeline.h"
+#include "settings.h"
+#include "platform.h"
+#include "pipeline_threads.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void print_usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s --input <pulse source> [--output<N> <output>]... [--threads <N>]\n"
+        "  Pulse source: <file or fifo>, unix:<socket path> or '-' for stdin.\n"
+        "    Each line is '<pin> <start_us> <len_us>'. Regular files are replayed in real time.\n"
+        "  Outputs: stdio (default for output0), stdout, file:<path>, tty:<device>, tcp:<port>, udp:<host>:<port>.\n"
+        "  Threads: number of worker threads for geometry objects and their streams (default 0: single thread).\n"
+        "  Settings are kept in %s; set VIVE_SETTINGS_FILE to change.\n",
+        name, default_settings_file);
+}
+
+static uint32_t num_worker_threads = 0;
+
+// Settings of this device, read from the settings file on start.
+static PersistentSettings settings;
+
+static bool parse_args(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        int output_idx;
+        if (i + 1 < argc && !strcmp(argv[i], "--input")) {
+            pulse_source_spec = argv[++i];
+        } else if (i + 1 < argc && !strcmp(argv[i], "--threads")) {
+            num_worker_threads = strtoul(argv[++i], nullptr, 10);
+        } else if (i + 1 < argc && sscanf(argv[i], "--output%d", &output_idx) == 1
+                   && 0 <= output_idx && output_idx < num_outputs) {
+            output_specs[output_idx] = argv[++i];
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (!parse_args(argc, argv)) {
+        print_usage(argv[0]);
+        return 2;
+    }
+    restart_argv = argv;
+    signal(SIGPIPE, SIG_IGN);  // Write errors are handled by outputs.
+
+    try {
+        // This will be either configuration pipeline, or production pipeline.
+        std::unique_ptr<Pipeline> pipeline;
+        std::unique_ptr<LinuxPipelineThreads> threads;  // Declared last to be stopped before pipelines are deleted.
+        while (true) {
+            if (!pipeline || pipeline->is_stop_requested()) {
+                threads.reset();
+                pipeline.reset();
+                if (settings.needs_configuration()) {
+                    // Initialize persistent settings interactively from user input, if needed.
+                    pipeline = settings.create_configuration_pipeline(0);
+                    pipeline->start();
+                } else {
+                    // Otherwise, create production pipeline, optionally with worker threads.
+                    if (num_worker_threads > 0)
+                        threads = std::make_unique<LinuxPipelineThreads>(num_worker_threads);
+                    pipeline = create_vive_sensor_pipeline(settings, threads.get());
+                    pipeline->start();
+                    if (threads)
+                        threads->start();
+                }
+            }
+
+            // Work and sleep until the next node needs to work or input arrives.
+            pipeline->run_once();
+        }
+    }
+    catch (const ValidationException &exc) {
+        fprintf(stderr, "Error: %s\n", exc.what());
+        return 1;
+    }
+}
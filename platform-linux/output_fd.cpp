@@ -0,0 +1,250 @@
+#include "output_fd.h"
+#include "platform.h"
+#include "message_logging.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+// Max time write() waits for the output to accept more data.
+constexpr int max_write_wait_ms = 100;
+
+static speed_t tty_speed(uint32_t bitrate) {
+    switch (bitrate) {
+        case 300: return B300;
+        case 600: return B600;
+        case 1200: return B1200;
+        case 2400: return B2400;
+        case 4800: return B4800;
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        default: throw_printf("Bitrate %d is not supported by serial ports", bitrate);
+    }
+}
+
+static int open_tty(const char *device, uint32_t bitrate) {
+    speed_t speed = tty_speed(bitrate ? bitrate : 115200);
+    int fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0)
+        throw_printf("Can't open %s: %s", device, strerror(errno));
+    termios tio;
+    if (tcgetattr(fd, &tio) < 0) {
+        int err = errno;
+        close(fd);
+        throw_printf("%s is not a serial port: %s", device, strerror(err));
+    }
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, speed);
+    tcsetattr(fd, TCSANOW, &tio);
+    return fd;
+}
+
+static int open_udp(const char *host_port) {
+    char host[256];
+    const char *colon = strrchr(host_port, ':');
+    if (!colon || colon - host_port >= (int)sizeof(host))
+        throw_printf("Invalid UDP address: %s. Expected udp:<host>:<port>", host_port);
+    memcpy(host, host_port, colon - host_port);
+    host[colon - host_port] = 0;
+
+    addrinfo hints = {}, *addr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (int err = getaddrinfo(host, colon + 1, &hints, &addr))
+        throw_printf("Can't resolve %s: %s", host_port, gai_strerror(err));
+    int fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addr);
+    if (fd < 0)
+        throw_printf("Can't create UDP socket to %s: %s", host_port, strerror(errno));
+    return fd;
+}
+
+static int open_tcp_listener(const char *port_str) {
+    char *end;
+    uint32_t port = strtoul(port_str, &end, 10);
+    if (*end || !port || port > 65535)
+        throw_printf("Invalid TCP port: %s", port_str);
+
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    int on = 1, off = 0;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    sockaddr_in6 addr = {};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if (fd < 0 || bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0)
+        throw_printf("Can't listen on TCP port %d: %s", port, strerror(errno));
+    return fd;
+}
+
+
+// ======  OutputNodeFd  ======================================================
+
+OutputNodeFd::OutputNodeFd(uint32_t idx, const OutputDef& def, const char *spec)
+    : OutputNode(idx, def)
+    , spec_(spec)
+    , read_fd_(-1)
+    , write_fd_(-1)
+    , listen_fd_(-1)
+    , datagrams_(false)
+    , write_timed_out_(false) {
+}
+
+OutputNodeFd::~OutputNodeFd() {
+    remove_wakeup_fd(read_fd_);
+    remove_wakeup_fd(listen_fd_);
+    if (read_fd_ > STDERR_FILENO)
+        close(read_fd_);
+    if (write_fd_ > STDERR_FILENO && write_fd_ != read_fd_)
+        close(write_fd_);
+    if (listen_fd_ >= 0)
+        close(listen_fd_);
+}
+
+// Files and sockets are opened here and not in constructor, as pipelines are also created for config validation.
+void OutputNodeFd::start() {
+    OutputNode::start();
+    if (!strcmp(spec_, "stdio")) {
+        read_fd_ = STDIN_FILENO;
+        write_fd_ = STDOUT_FILENO;
+    } else if (!strcmp(spec_, "stdout")) {
+        write_fd_ = STDOUT_FILENO;
+    } else if (!strncmp(spec_, "file:", 5)) {
+        write_fd_ = open(spec_ + 5, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (write_fd_ < 0)
+            throw_printf("Can't open %s: %s", spec_ + 5, strerror(errno));
+    } else if (!strncmp(spec_, "tty:", 4)) {
+        read_fd_ = write_fd_ = open_tty(spec_ + 4, def_.bitrate);
+    } else if (!strncmp(spec_, "tcp:", 4)) {
+        listen_fd_ = open_tcp_listener(spec_ + 4);
+    } else if (!strncmp(spec_, "udp:", 4)) {
+        read_fd_ = write_fd_ = open_udp(spec_ + 4);
+        datagrams_ = true;
+    } else {
+        throw_printf("Unknown output%d kind: %s", node_idx_, spec_);
+    }
+    if (read_fd_ >= 0)
+        add_wakeup_fd(read_fd_);
+    if (listen_fd_ >= 0)
+        add_wakeup_fd(listen_fd_);
+}
+
+void OutputNodeFd::accept_client() {
+    int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK);
+    if (fd < 0)
+        return;
+    if (read_fd_ >= 0) {
+        close(fd);  // Only one client at a time.
+    } else {
+        read_fd_ = write_fd_ = fd;
+        add_wakeup_fd(fd);
+    }
+}
+
+void OutputNodeFd::close_client() {
+    if (listen_fd_ >= 0 && read_fd_ >= 0) {
+        remove_wakeup_fd(read_fd_);
+        close(read_fd_);
+        read_fd_ = write_fd_ = -1;
+    }
+}
+
+void OutputNodeFd::do_work(Timestamp cur_time) {
+    if (listen_fd_ >= 0)
+        accept_client();
+    OutputNode::do_work(cur_time);
+}
+
+// Writes all bytes, waiting for the descriptor if needed, like a serial port does when its buffer is full.
+// A reader that doesn't take any data for max_write_wait_ms would block the whole pipeline, so then the rest of the
+// data is dropped (TCP clients are disconnected instead).
+size_t OutputNodeFd::write(const uint8_t *buffer, size_t size) {
+    if (write_fd_ < 0)
+        return size;  // Nobody is listening; discard.
+    size_t pos = 0;
+    while (pos < size) {
+        ssize_t len = ::write(write_fd_, buffer + pos, size - pos);
+        if (len > 0) {
+            pos += len;
+        } else if (len < 0 && errno == EINTR) {
+            continue;
+        } else if (len < 0 && errno == EAGAIN) {
+            pollfd pfd = {write_fd_, POLLOUT, 0};
+            if (::poll(&pfd, 1, max_write_wait_ms) > 0)
+                continue;
+            if (listen_fd_ >= 0) {
+                close_client();  // Client doesn't read; wait for the next one.
+            } else {
+                if (!write_timed_out_)
+                    fprintf(stderr, "Output%d (%s) is not read; dropping data.\n", node_idx_, spec_);
+                write_timed_out_ = true;
+            }
+            break;
+        } else if (datagrams_ && len < 0 && errno == ECONNREFUSED) {
+            break;  // Nobody receives at the other end; it's ok for UDP.
+        } else if (listen_fd_ >= 0) {
+            close_client();  // Client is gone; wait for the next one.
+            break;
+        } else {
+            fprintf(stderr, "Error writing to output%d (%s): %s. Output disabled.\n", node_idx_, spec_, strerror(errno));
+            write_fd_ = -1;
+            break;
+        }
+    }
+    return size;
+}
+
+size_t OutputNodeFd::read(uint8_t *buffer, size_t size) {
+    if (read_fd_ < 0)
+        return 0;
+    pollfd pfd = {read_fd_, POLLIN, 0};
+    if (::poll(&pfd, 1, 0) <= 0)
+        return 0;
+    ssize_t len = ::read(read_fd_, buffer, size);
+    if (!datagrams_ && (len == 0 || (len < 0 && errno != EAGAIN && errno != EINTR))) {
+        if (listen_fd_ >= 0) {
+            close_client();  // Client disconnected; wait for the next one.
+        } else {
+            remove_wakeup_fd(read_fd_);
+            read_fd_ = -1;  // End of input; keep writing.
+        }
+    }
+    return len > 0 ? len : 0;
+}
+
+// New TCP clients are also accepted in do_work().
+bool OutputNodeFd::read_available() {
+    pollfd pfds[2] = {{read_fd_, POLLIN, 0}, {listen_fd_, POLLIN, 0}};  // Negative fds are ignored.
+    return ::poll(pfds, 2, 0) > 0;
+}
+
+size_t OutputNodeFd::write_available() {
+    if (write_fd_ < 0 || datagrams_)
+        return (size_t)-1;  // Datagrams are sent right away; without a client data is discarded.
+    pollfd pfd = {write_fd_, POLLOUT, 0};
+    return ::poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLOUT) ? PIPE_BUF : 0;
+}
+
+// All outputs are file descriptor based on Linux; kind of each one is given on the command line.
+OutputNode::CreatorRegistrar OutputNodeFd::creator_([](Arena &arena, uint32_t idx, const OutputDef& def) -> ArenaPtr<OutputNode> {
+    if (idx < num_outputs && output_specs[idx])
+        return arena.make<OutputNodeFd>(idx, def, output_specs[idx]);
+    return nullptr;
+});
@@ -0,0 +1,35 @@
+#pragma once
+#include "outputs.h"
+
+// Output backed by file descriptors. Kind of output is selected by output_specs[idx]:
+//   stdio              - read from stdin, write to stdout (default for output 0),
+//   stdout             - write to stdout,
+//   file:<path>        - append to a file,
+//   tty:<device>       - serial port, configured with the output bitrate,
+//   tcp:<port>         - listen on a TCP port; one client at a time, data is dropped while nobody is connected,
+//   udp:<host>:<port>  - send each message as UDP datagram(s) to given address.
+class OutputNodeFd : public OutputNode {
+public:
+    OutputNodeFd(uint32_t idx, const OutputDef& def, const char *spec);
+    ~OutputNodeFd();
+
+    virtual void start();
+    virtual void do_work(Timestamp cur_time);
+
+protected:
+    virtual size_t write(const uint8_t *buffer, size_t size);
+    virtual size_t read(uint8_t *buffer, size_t size);
+    virtual bool read_available();
+    virtual size_t write_available();
+
+private:
+    void accept_client();
+    void close_client();
+
+    const char *spec_;
+    int read_fd_, write_fd_;
+    int listen_fd_;  // TCP only; read_fd_ and write_fd_ are the accepted client socket.
+    bool datagrams_;
+    bool write_timed_out_;  // Data was dropped because the output didn't accept it in time; reported once.
+    static CreatorRegistrar creator_;
+};
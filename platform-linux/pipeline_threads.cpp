@@ -0,0 +1,69 @@
+#include "pipeline_threads.h"
+#include "platform.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+// ======  LinuxPipelineThreads::Thread  ======================================
+
+LinuxPipelineThreads::Thread::Thread()
+    : event_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+    if (event_fd < 0)
+        throw_printf("Can't create eventfd: %s", strerror(errno));
+}
+
+LinuxPipelineThreads::Thread::~Thread() {
+    close(event_fd);
+}
+
+void LinuxPipelineThreads::Thread::wake() {
+    uint64_t event = 1;
+    if (write(event_fd, &event, sizeof(event)) < 0 && errno != EAGAIN)
+        fprintf(stderr, "Can't wake up thread: %s\n", strerror(errno));
+}
+
+// Same loop as the main one: work while nodes are due, then sleep until the next deadline or a wake up.
+void LinuxPipelineThreads::Thread::run(const std::atomic<bool> &stop_requested) {
+    set_thread_event_fd(event_fd);
+    try {
+        while (!stop_requested.load(std::memory_order_relaxed))
+            pipeline.run_once();
+    }
+    catch (const ValidationException &exc) {
+        fprintf(stderr, "Error in worker thread: %s\n", exc.what());
+        exit(1);
+    }
+}
+
+
+// ======  LinuxPipelineThreads  ==============================================
+
+LinuxPipelineThreads::LinuxPipelineThreads(uint32_t num_workers)
+    : stop_requested_(false) {
+    set_thread_event_fd(main_thread_.event_fd);
+    for (uint32_t i = 0; i < num_workers; i++)
+        workers_.push_back(std::make_unique<Thread>());
+}
+
+LinuxPipelineThreads::~LinuxPipelineThreads() {
+    stop_requested_ = true;
+    for (auto &worker : workers_) {
+        if (worker->thread.joinable()) {
+            worker->wake();
+            worker->thread.join();
+        }
+    }
+    set_thread_event_fd(-1);
+}
+
+void LinuxPipelineThreads::start() {
+    for (auto &worker : workers_) {
+        worker->pipeline.start();
+        Thread *thread = worker.get();
+        worker->thread = std::thread([this, thread]() { thread->run(stop_requested_); });
+    }
+}
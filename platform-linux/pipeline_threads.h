@@ -0,0 +1,38 @@
+#pragma once
+#include "vive_sensors_pipeline.h"
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Runs worker pipelines in their own threads; see PipelineThreads. Threads are woken up with eventfd-s.
+class LinuxPipelineThreads : public PipelineThreads {
+public:
+    // Must be created in the thread running the main pipeline.
+    explicit LinuxPipelineThreads(uint32_t num_workers);
+    ~LinuxPipelineThreads();  // Stops worker threads.
+
+    // Start worker pipelines and their threads. Call after the main pipeline is created.
+    void start();
+
+    virtual PipelineThread *main_thread() { return &main_thread_; }
+    virtual uint32_t num_workers() { return workers_.size(); }
+    virtual PipelineThread *worker(uint32_t idx) { return workers_[idx].get(); }
+    virtual Pipeline *worker_pipeline(uint32_t idx) { return &workers_[idx]->pipeline; }
+
+private:
+    class Thread : public PipelineThread {
+    public:
+        Thread();
+        ~Thread();
+        virtual void wake();
+        void run(const std::atomic<bool> &stop_requested);
+
+        int event_fd;
+        Pipeline pipeline;
+        std::thread thread;
+    };
+
+    Thread main_thread_;
+    std::vector<std::unique_ptr<Thread>> workers_;
+    std::atomic<bool> stop_requested_;
+};
@@ -0,0 +1,126 @@
+#include "platform.h"
+#include "debug_node.h"
+#include "settings.h"
+#include "led_state.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <vector>
+
+const char *pulse_source_spec = nullptr;
+const char *output_specs[num_outputs] = {"stdio"};
+char **restart_argv = nullptr;
+
+
+// ====  Timestamps  ==========================================================
+
+static uint64_t monotonic_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+Timestamp Timestamp::cur_time() {
+    return (uint32_t)(monotonic_ns() * usec / 1000);  // Wraps around, like on MCUs.
+}
+
+uint32_t Timestamp::cur_time_millis() {
+    return (uint32_t)(monotonic_ns() / 1000000);
+}
+
+
+// ====  Sleep  ===============================================================
+
+static thread_local std::vector<pollfd> wakeup_fds;
+static thread_local int thread_event_fd = -1;
+
+void add_wakeup_fd(int fd) {
+    wakeup_fds.push_back({fd, POLLIN, 0});
+}
+
+void remove_wakeup_fd(int fd) {
+    for (auto it = wakeup_fds.begin(); it != wakeup_fds.end(); )
+        it = it->fd == fd ? wakeup_fds.erase(it) : it + 1;
+}
+
+void set_thread_event_fd(int fd) {
+    if (thread_event_fd >= 0)
+        remove_wakeup_fd(thread_event_fd);
+    thread_event_fd = fd;
+    if (fd >= 0)
+        add_wakeup_fd(fd);
+}
+
+void wait_for_event(Timestamp deadline) {
+    int ticks = (deadline - Timestamp::cur_time()).get_value((TimeUnit)1);
+    if (ticks <= 0)
+        return;
+    uint64_t ns = (uint64_t)ticks * 1000 / usec;
+    timespec timeout = {(time_t)(ns / 1000000000), (long)(ns % 1000000000)};
+    ppoll(wakeup_fds.data(), wakeup_fds.size(), &timeout, nullptr);
+
+    // Reset the event fd; we'll check what's changed in the next pipeline iteration.
+    uint64_t events;
+    if (thread_event_fd >= 0)
+        while (read(thread_event_fd, &events, sizeof(events)) > 0) {}
+}
+
+
+// ====  Led  =================================================================
+// There's no led; state is visible in debug output.
+
+void set_led_state(LedState state) {
+}
+
+void update_led_pattern(Timestamp cur_time) {
+}
+
+
+// ====  Debug node helpers  ==================================================
+
+void print_platform_memory_info(PrintStream &stream) {
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    stream.printf("RAM: max resident %ld kB\n", usage.ru_maxrss);
+}
+
+
+// ====  Configuration helpers  ===============================================
+
+void restart_system() {
+    // Restart with the same arguments to re-read the settings.
+    if (restart_argv)
+        execv("/proc/self/exe", restart_argv);
+    exit(1);
+}
+
+static const char *settings_file() {
+    const char *filename = getenv("VIVE_SETTINGS_FILE");
+    return filename && *filename ? filename : default_settings_file;
+}
+
+// Missing file or bytes read as 0xFF, like erased EEPROM.
+void eeprom_read(uint32_t eeprom_addr, void *dest, uint32_t len) {
+    memset(dest, 0xFF, len);
+    int fd = open(settings_file(), O_RDONLY);
+    if (fd < 0)
+        return;
+    if (pread(fd, dest, len, eeprom_addr) < 0)
+        memset(dest, 0xFF, len);
+    close(fd);
+}
+
+void eeprom_write(uint32_t eeprom_addr, const void *src, uint32_t len) {
+    int fd = open(settings_file(), O_WRONLY | O_CREAT, 0644);
+    if (fd < 0 || pwrite(fd, src, len, eeprom_addr) != (ssize_t)len)
+        fprintf(stderr, "Can't write settings to %s: %s\n", settings_file(), strerror(errno));
+    if (fd >= 0)
+        close(fd);
+}
@@ -0,0 +1,20 @@
+// Linux platform: runs the full pipeline as a regular process, e.g. on a companion computer with USB-attached
+// front-ends. Hardware interfaces are replaced with file descriptors, see input_stream.h and output_fd.h.
+#pragma once
+#include "outputs.h"
+
+// Command line configuration, set in main() before pipelines are created.
+extern const char *pulse_source_spec;             // See PulseSource.
+extern const char *output_specs[num_outputs];     // See OutputNodeFd::create.
+extern char **restart_argv;                       // Used to restart the process in restart_system().
+
+// File descriptors that wake up the pipeline from wait_for_event() when they become readable. The list is kept
+// per thread; nodes register their descriptors in the thread that runs them.
+void add_wakeup_fd(int fd);
+void remove_wakeup_fd(int fd);
+
+// Event fd of the current thread, signalled by other threads to wake it up (see LinuxPipelineThreads).
+void set_thread_event_fd(int fd);
+
+// Settings are kept in this file instead of EEPROM. Can be changed with VIVE_SETTINGS_FILE environment variable.
+constexpr const char *default_settings_file = "vive-settings.bin";
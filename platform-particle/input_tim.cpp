@@ -89,9 +89,9 @@ InputTimNode::InputTimNode(uint32_t input_idx, const InputDef &input_def)
     channel_pair_used_by_pin[timer_idx_][channel_idx_/2] = pin_+1;  // Store pin+1 to keep 0 as an 'available' flag.
 }
 
-InputNode::CreatorRegistrar InputTimNode::creator_([](uint32_t input_idx, const InputDef &input_def) -> std::unique_ptr<InputNode> {
+InputNode::CreatorRegistrar InputTimNode::creator_([](Arena &arena, uint32_t input_idx, const InputDef &input_def) -> ArenaPtr<InputNode> {
     if (input_def.input_type == InputType::kTimer)
-        return std::make_unique<InputTimNode>(input_idx, input_def);
+        return arena.make<InputTimNode>(input_idx, input_def);
     return nullptr;
 });
 
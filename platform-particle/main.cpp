@@ -5,6 +5,9 @@
 SYSTEM_MODE(MANUAL);
 //SerialLogHandler logHandler;  // Uncomment to pipe system logging to Serial.
 
+// Settings of this device, read from EEPROM on start.
+static PersistentSettings settings;
+
 // This will be either configuration pipeline, or production pipeline.
 std::unique_ptr<Pipeline> pipeline;
 
@@ -26,7 +29,7 @@ void loop() {
             pipeline->start();
         }
         
-        pipeline->do_work(Timestamp::cur_time());
+        pipeline->run_once();  // Doesn't sleep on this platform, see wait_for_event().
     }
     catch (const ValidationException &exc) {
         Serial.printf("Caught exception: %s", exc.what());
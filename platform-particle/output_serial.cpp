@@ -13,8 +13,16 @@ size_t OutputNodeStream::write(const uint8_t *buffer, size_t size) {
     return stream_.write(buffer, size);
 }
 
-int OutputNodeStream::read() {
-    return stream_.read();
+size_t OutputNodeStream::read(uint8_t *buffer, size_t size) {
+    int available = stream_.available();
+    if (available <= 0)
+        return 0;
+    // readBytes() doesn't wait for timeout when we ask for bytes that are already available.
+    return stream_.readBytes((char *)buffer, (size_t)available < size ? available : size);
+}
+
+bool OutputNodeStream::read_available() {
+    return stream_.available() > 0;
 }
 
 // ======  UsbSerialOutputNode  ===============================================
@@ -24,9 +32,13 @@ UsbSerialOutputNode::UsbSerialOutputNode(uint32_t idx, const OutputDef& def)
     assert(idx == 0);
 }
 
-OutputNode::CreatorRegistrar UsbSerialOutputNode::creator_([](uint32_t idx, const OutputDef& def) -> std::unique_ptr<OutputNode> {
+size_t UsbSerialOutputNode::write_available() {
+    return Serial.availableForWrite();
+}
+
+OutputNode::CreatorRegistrar UsbSerialOutputNode::creator_([](Arena &arena, uint32_t idx, const OutputDef& def) -> ArenaPtr<OutputNode> {
     if (idx == 0)
-        return std::make_unique<UsbSerialOutputNode>(idx, def);
+        return arena.make<UsbSerialOutputNode>(idx, def);
     return nullptr;
 });
 
@@ -45,8 +57,12 @@ void HardwareSerialOutputNode::start() {
     reinterpret_cast<HardwareSerial *>(&stream_)->begin(def_.bitrate);
 }
 
-OutputNode::CreatorRegistrar HardwareSerialOutputNode::creator_([](uint32_t idx, const OutputDef& def) -> std::unique_ptr<OutputNode> {
+size_t HardwareSerialOutputNode::write_available() {
+    return reinterpret_cast<HardwareSerial *>(&stream_)->availableForWrite();
+}
+
+OutputNode::CreatorRegistrar HardwareSerialOutputNode::creator_([](Arena &arena, uint32_t idx, const OutputDef& def) -> ArenaPtr<OutputNode> {
     if (idx < num_outputs && hardware_serials[idx])
-        return std::make_unique<HardwareSerialOutputNode>(idx, def);
+        return arena.make<HardwareSerialOutputNode>(idx, def);
     return nullptr;
 });
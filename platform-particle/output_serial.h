@@ -9,7 +9,8 @@ public:
 
 protected:
     virtual size_t write(const uint8_t *buffer, size_t size);
-    virtual int read();
+    virtual size_t read(uint8_t *buffer, size_t size);
+    virtual bool read_available();
 
     Stream &stream_;
 };
@@ -17,6 +18,7 @@ protected:
 class UsbSerialOutputNode : public OutputNodeStream {
 public:
     UsbSerialOutputNode(uint32_t idx, const OutputDef& def);
+    virtual size_t write_available();
     static CreatorRegistrar creator_;
 };
 
@@ -24,5 +26,6 @@ class HardwareSerialOutputNode : public OutputNodeStream {
 public:
     HardwareSerialOutputNode(uint32_t idx, const OutputDef& def);
     virtual void start();
+    virtual size_t write_available();
     static CreatorRegistrar creator_;
 };
@@ -23,14 +23,24 @@ size_t OutputNodeWifi::write(const uint8_t *buffer, size_t size) {
     return ret;
 }
 
-int OutputNodeWifi::read() {
+size_t OutputNodeWifi::read(uint8_t *buffer, size_t size) {
     if (!udp_stream_.available())
         udp_stream_.parsePacket();
-    return udp_stream_.read();
+    int len = udp_stream_.read(buffer, size);
+    return len > 0 ? len : 0;
 }
 
-OutputNode::CreatorRegistrar OutputNodeWifi::creator_([](uint32_t idx, const OutputDef& def) -> std::unique_ptr<OutputNode> {
+bool OutputNodeWifi::read_available() {
+    return udp_stream_.available() > 0 || udp_stream_.parsePacket() > 0;
+}
+
+// UDP packets are sent right away, so we never need to queue them.
+size_t OutputNodeWifi::write_available() {
+    return (size_t)-1;
+}
+
+OutputNode::CreatorRegistrar OutputNodeWifi::creator_([](Arena &arena, uint32_t idx, const OutputDef& def) -> ArenaPtr<OutputNode> {
     if (idx == 2)
-        return std::make_unique<OutputNodeWifi>(idx, def);
+        return arena.make<OutputNodeWifi>(idx, def);
     return nullptr;
 });
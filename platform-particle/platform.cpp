@@ -62,6 +62,13 @@ void print_platform_memory_info(PrintStream &stream) {
 }
 
 
+// ====  Sleep  ===============================================================
+
+// Pipeline is driven from loop(), which has to return to the system firmware, so we don't sleep here.
+void wait_for_event(Timestamp deadline) {
+}
+
+
 // ====  Configuration helpers  ===============================================
 
 void restart_system() {
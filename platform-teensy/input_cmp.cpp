@@ -168,9 +168,9 @@ InputCmpNode::InputCmpNode(uint32_t input_idx, const InputDef &input_def)
     input_cmps[cmp_idx_] = this;
 }
 
-InputNode::CreatorRegistrar InputCmpNode::creator_([](uint32_t input_idx, const InputDef &input_def) -> std::unique_ptr<InputNode> {
+InputNode::CreatorRegistrar InputCmpNode::creator_([](Arena &arena, uint32_t input_idx, const InputDef &input_def) -> ArenaPtr<InputNode> {
     if (input_def.input_type == InputType::kCMP)
-        return std::make_unique<InputCmpNode>(input_idx, input_def);
+        return arena.make<InputCmpNode>(input_idx, input_def);
     return nullptr;
 });
 
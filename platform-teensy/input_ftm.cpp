@@ -100,9 +100,9 @@ InputFTMNode::InputFTMNode(uint32_t input_idx, const InputDef &input_def)
     ftms_used[ftm_idx_][ftm_ch_idx_] = this;
 }
 
-InputNode::CreatorRegistrar InputFTMNode::creator_([](uint32_t input_idx, const InputDef &input_def) -> std::unique_ptr<InputNode> {
+InputNode::CreatorRegistrar InputFTMNode::creator_([](Arena &arena, uint32_t input_idx, const InputDef &input_def) -> ArenaPtr<InputNode> {
     if (input_def.input_type == InputType::kTimer)
-        return std::make_unique<InputFTMNode>(input_idx, input_def);
+        return arena.make<InputFTMNode>(input_idx, input_def);
     return nullptr;
 });
 
@@ -1,6 +1,9 @@
 #include "vive_sensors_pipeline.h"
 #include "settings.h"
 
+// Settings of this device, read from EEPROM on start.
+static PersistentSettings settings;
+
 extern "C" int main() {
     // Initialize persistent settings interactively from user input, if needed.
     if (settings.needs_configuration()) {
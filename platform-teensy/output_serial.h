@@ -9,7 +9,9 @@ public:
 
 protected:
     virtual size_t write(const uint8_t *buffer, size_t size);
-    virtual int read();
+    virtual size_t read(uint8_t *buffer, size_t size);
+    virtual bool read_available();
+    virtual size_t write_available();
 
     Stream &stream_;
 };
@@ -177,10 +177,16 @@ int get_stack_high_water_mark() {
 // Yet another way is to place stack in the beginning of RAM. That way we'll fail hard.
 // 
 
-// ====  6. Yield  ============================================================
+// ====  6. Yield & sleep  ====================================================
 // This needs to be replaced with empty body to avoid linking to all the Serial-s and save memory.
 void yield() {}
 
+// Sleep until the next interrupt. Pulse inputs, USB/serial and 1 kHz SysTick interrupts all wake us up, so the
+// deadline is met within 1 ms.
+void wait_for_event(Timestamp deadline) {
+    asm volatile("wfi");
+}
+
 
 // ====  7. Printing debug information ========================================
 
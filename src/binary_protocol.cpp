@@ -0,0 +1,133 @@
+#include "binary_protocol.h"
+#include <math.h>
+#include <string.h>
+
+uint16_t crc16_ccitt(const uint8_t *data, uint32_t len, uint16_t crc) {
+    for (uint32_t i = 0; i < len; i++) {
+        crc ^= (uint16_t)data[i] << 8;
+        for (int j = 0; j < 8; j++)
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+    }
+    return crc;
+}
+
+uint32_t cobs_encode(const uint8_t *src, uint32_t len, uint8_t *dst) {
+    uint32_t code_pos = 0, dst_pos = 1;
+    uint8_t code = 1;
+    for (uint32_t i = 0; i < len; i++) {
+        if (src[i] != 0) {
+            dst[dst_pos++] = src[i];
+            code++;
+        }
+        if (src[i] == 0 || code == 0xFF) {
+            dst[code_pos] = code;
+            code_pos = dst_pos++;
+            code = 1;
+        }
+    }
+    dst[code_pos] = code;
+    return dst_pos;
+}
+
+int32_t cobs_decode(const uint8_t *src, uint32_t len, uint8_t *dst) {
+    uint32_t src_pos = 0, dst_pos = 0;
+    while (src_pos < len) {
+        uint8_t code = src[src_pos++];
+        if (code == 0 || src_pos + code - 1 > len)
+            return -1;
+        for (uint32_t i = 1; i < code; i++) {
+            if (src[src_pos] == 0)
+                return -1;
+            dst[dst_pos++] = src[src_pos++];
+        }
+        if (code != 0xFF && src_pos < len)
+            dst[dst_pos++] = 0;
+    }
+    return dst_pos;
+}
+
+// ======  Quaternion compression  ============================================
+static constexpr float quat_component_range = 0.70710678f;  // 1/sqrt(2)
+static constexpr uint32_t quat_component_max = (1 << 10) - 1;
+
+uint32_t pack_quaternion(const float q[4]) {
+    uint32_t largest = 0;
+    for (uint32_t i = 1; i < 4; i++)
+        if (fabsf(q[i]) > fabsf(q[largest]))
+            largest = i;
+
+    // q and -q are the same rotation, so we make the largest component positive and don't send it.
+    float sign = q[largest] < 0 ? -1.f : 1.f;
+    uint32_t res = largest;
+    for (uint32_t i = 0; i < 4; i++)
+        if (i != largest) {
+            float v = (q[i] * sign + quat_component_range) / (2 * quat_component_range);
+            v = v < 0.f ? 0.f : v > 1.f ? 1.f : v;
+            res = (res << 10) | (uint32_t)(v * quat_component_max + 0.5f);
+        }
+    return res;
+}
+
+void unpack_quaternion(uint32_t packed, float q[4]) {
+    uint32_t largest = packed >> 30;
+    float sum_sq = 0.f;
+    for (int i = 3; i >= 0; i--)
+        if ((uint32_t)i != largest) {
+            float v = (packed & quat_component_max) / (float)quat_component_max;
+            q[i] = v * (2 * quat_component_range) - quat_component_range;
+            sum_sq += q[i] * q[i];
+            packed >>= 10;
+        }
+    q[largest] = sum_sq < 1.f ? sqrtf(1.f - sum_sq) : 0.f;
+}
+
+// ======  Framing  ===========================================================
+// Packet with CRC -> COBS frame with terminating zero. 'buf' has 2 spare bytes for CRC after the packet.
+static uint32_t encode_frame(uint8_t *buf, uint32_t packet_len, uint8_t *frame) {
+    uint16_t crc = crc16_ccitt(buf, packet_len);
+    buf[packet_len] = crc & 0xFF;
+    buf[packet_len + 1] = crc >> 8;
+
+    uint32_t len = cobs_encode(buf, packet_len + 2, frame);
+    frame[len++] = 0;
+    return len;
+}
+
+// COBS frame -> packet of given length, if CRC matches. 'buf' needs to fit the whole frame.
+static bool decode_frame(const uint8_t *frame, uint32_t len, uint8_t *buf, uint32_t buf_len, uint32_t packet_len) {
+    if (len > buf_len)
+        return false;
+    int32_t decoded_len = cobs_decode(frame, len, buf);
+    if (decoded_len != (int32_t)packet_len + 2)
+        return false;
+    uint16_t crc = crc16_ccitt(buf, packet_len);
+    return buf[packet_len] == (crc & 0xFF) && buf[packet_len + 1] == (crc >> 8);
+}
+
+uint32_t encode_position_frame(const BinaryPositionPacket &packet, uint8_t *frame) {
+    uint8_t buf[binary_position_packet_size];
+    memcpy(buf, &packet, sizeof(packet));
+    return encode_frame(buf, sizeof(packet), frame);
+}
+
+bool decode_position_frame(const uint8_t *frame, uint32_t len, BinaryPositionPacket *packet) {
+    uint8_t buf[binary_position_frame_max_size];
+    if (!decode_frame(frame, len, buf, sizeof(buf), sizeof(BinaryPositionPacket)))
+        return false;
+    memcpy(packet, buf, sizeof(BinaryPositionPacket));
+    return packet->type == binary_position_packet_type;
+}
+
+uint32_t encode_telemetry_frame(const BinaryTelemetryPacket &packet, uint8_t *frame) {
+    uint8_t buf[binary_telemetry_packet_size];
+    memcpy(buf, &packet, sizeof(packet));
+    return encode_frame(buf, sizeof(packet), frame);
+}
+
+bool decode_telemetry_frame(const uint8_t *frame, uint32_t len, BinaryTelemetryPacket *packet) {
+    uint8_t buf[binary_telemetry_frame_max_size];
+    if (!decode_frame(frame, len, buf, sizeof(buf), sizeof(BinaryTelemetryPacket)))
+        return false;
+    memcpy(packet, buf, sizeof(BinaryTelemetryPacket));
+    return packet->type == binary_telemetry_packet_type;
+}
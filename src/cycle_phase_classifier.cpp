@@ -1,4 +1,5 @@
 #include "cycle_phase_classifier.h"
+#include "binary_protocol.h"
 
 enum PhaseFixLevels {  // Unscoped enum because we use it more like set of constants.
     kPhaseFixNone = 0,
@@ -119,6 +120,12 @@ bool CyclePhaseClassifier::debug_cmd(HashedWord *input_words) {
         }
     return false;
 }
+void CyclePhaseClassifier::collect_telemetry(BinaryTelemetryPacket &packet) {
+    packet.phase_fix_level = (uint16_t)fix_level_;
+    float error_x10us = average_error_ * 10.f;
+    packet.phase_error_x10us = error_x10us < 65535.f ? (uint16_t)error_x10us : 0xFFFF;
+}
+
 void CyclePhaseClassifier::debug_print(PrintStream &stream) {
     if (debug_print_state_) {
         stream.printf("CyclePhaseClassifier: fix %d, phase %d, pulse_base_len %f, history 0x%x, avg error %.1f us\n", 
@@ -1,5 +1,6 @@
 #include "data_frame_decoder.h"
 #include "message_logging.h"
+#include "binary_protocol.h"
 
 DataFrameDecoder::DataFrameDecoder(uint32_t base_station_idx)
     : base_station_idx_(base_station_idx)
@@ -10,7 +11,9 @@ DataFrameDecoder::DataFrameDecoder(uint32_t base_station_idx)
     , cur_bit_idx_(0)
     , data_idx_(0)
     , data_frame_len_(0)
-    , data_frame_{} {
+    , data_frame_{}
+    , frames_started_(0)
+    , frames_decoded_(0) {
 }
 
 void DataFrameDecoder::consume(const DataFrameBit& frame_bit) {
@@ -46,6 +49,7 @@ void DataFrameDecoder::consume(const DataFrameBit& frame_bit) {
             if (preamble_len_ == 17) {
                 skip_one_set_bit_ = true;
                 data_idx_ = -2; // 2 bytes for data len.
+                frames_started_++;
             }
         }
         return;
@@ -75,6 +79,7 @@ void DataFrameDecoder::consume(const DataFrameBit& frame_bit) {
         data_frame_.time = frame_bit.time;
         data_frame_.base_station_idx = base_station_idx_;
         produce(data_frame_);
+        frames_decoded_++;
         reset();
     }
 }
@@ -97,6 +102,13 @@ bool DataFrameDecoder::debug_cmd(HashedWord *input_words) {
     return false;
 }
 
+void DataFrameDecoder::collect_telemetry(BinaryTelemetryPacket &packet) {
+    if (base_station_idx_ < telemetry_max_base_stations) {
+        packet.data_frames_started[base_station_idx_] = (uint16_t)frames_started_;
+        packet.data_frames_decoded[base_station_idx_] = (uint16_t)frames_decoded_;
+    }
+}
+
 void DataFrameDecoder::debug_print(PrintStream &stream) {
     producer_debug_print(this, stream);
 }
@@ -6,24 +6,55 @@
 #include "print_helpers.h"
 
 
-DebugNode::DebugNode(Pipeline *pipeline)
+DebugNode::DebugNode(Pipeline *pipeline, LiveSettings *live_settings)
     : pipeline_(pipeline)
+    , live_settings_(live_settings)
     , continuous_debug_print_(0)
     , stream_idx_(0x1000)
-    , output_attached_(true)
+    , debug_mode_(false)
+    , output_exclusive_(false)
     , print_debug_memory_(false) {
-    assert(pipeline);
+    assert(pipeline && live_settings);
+}
+
+void DebugNode::continue_from(const DebugNode &prev) {
+    continuous_print_period_ = prev.continuous_print_period_;
+    continuous_debug_print_ = prev.continuous_debug_print_;
+    debug_mode_ = prev.debug_mode_;
+    output_exclusive_ = prev.output_exclusive_;  // Output nodes keep their exclusive mode, see OutputNode.
+    print_debug_memory_ = prev.print_debug_memory_;
 }
 
 void DebugNode::consume_line(char *input_cmd, Timestamp time) {
     // Process debug input commands
-    bool print_debug = !output_attached_ && !continuous_debug_print_;
-    set_output_attached(false);
+    // NOTE: Data streams keep going to the same output; the output node sends them first and fills the remaining
+    // bandwidth with debug output. Use 'x' command to stop them.
+    bool print_debug = debug_mode_ && !continuous_debug_print_;
+    debug_mode_ = true;
     continuous_debug_print_ = 0;
 
     HashedWord* hashed_words = hash_words(input_cmd);
+    switch (*hashed_words) {
+    case "set"_hash: {
+        // Settings commands print their own result.
+        DataChunkPrintStream printer(this, time, stream_idx_);
+        live_settings_->change(hashed_words + 1, printer);
+        printer.printf("debug> ");
+        return;
+    }
+    case "save"_hash: {
+        DataChunkPrintStream printer(this, time, stream_idx_);
+        if (live_settings_->settings().write_to_eeprom())
+            printer.printf("Settings written to EEPROM.\n");
+        else
+            printer.printf("Write to EEPROM failed: not enough space for all definitions.\n");
+        printer.printf("debug> ");
+        return;
+    }
+    }
+
     bool res = !*hashed_words || pipeline_->debug_cmd(hashed_words);
-    if (!output_attached_ && !continuous_debug_print_) {
+    if (debug_mode_ && !continuous_debug_print_) {
         DataChunkPrintStream printer(this, time, stream_idx_);
         if (!res)
             printer.printf("Unknown command.\n");                
@@ -43,20 +74,31 @@ void DebugNode::do_work(Timestamp cur_time) {
 
     // Update led pattern.
     update_led_pattern(cur_time);
+    last_led_update_ = cur_time;
+}
+
+Timestamp DebugNode::next_work_time(Timestamp cur_time) {
+    Timestamp next_time = last_led_update_ + led_update_period;
+    if (continuous_debug_print_ > 0) {
+        Timestamp print_time = continuous_print_period_ + TimeDelta(continuous_debug_print_, ms);
+        if (print_time < next_time)
+            next_time = print_time;
+    }
+    return next_time;
 }
 
-// Sometimes the same output is used both for debug and to print values. We want to detach the values stream
-// while we're in debug mode.
-void DebugNode::set_output_attached(bool attached) {
-    if (output_attached_ == attached)
+// Sometimes the same output is used both for debug and to print values. Values streams can be detached to make
+// the debug output easier to read.
+void DebugNode::set_output_exclusive(bool exclusive) {
+    if (output_exclusive_ == exclusive)
         return;
 
     // Send command to the output node we're working with.
-    Producer<OutputCommand>::produce(attached 
-        ? OutputCommand{.type = OutputCommandType::kMakeNonExclusive} 
-        : OutputCommand{.type = OutputCommandType::kMakeExclusive, .stream_idx = stream_idx_});
+    Producer<OutputCommand>::produce(exclusive 
+        ? OutputCommand{.type = OutputCommandType::kMakeExclusive, .stream_idx = stream_idx_}
+        : OutputCommand{.type = OutputCommandType::kMakeNonExclusive});
     
-    output_attached_ = attached;
+    output_exclusive_ = exclusive;
 }
 
 bool DebugNode::debug_cmd(HashedWord *input_words) {
@@ -70,8 +112,9 @@ bool DebugNode::debug_cmd(HashedWord *input_words) {
         }
         break;
     
-    case "!"_hash: settings.restart_in_configuration_mode(); return true;
-    case "o"_hash: set_output_attached(true); return true;
+    case "!"_hash: live_settings_->settings().restart_in_configuration_mode(); return true;
+    case "o"_hash: debug_mode_ = false; set_output_exclusive(false); return true;
+    case "x"_hash: set_output_exclusive(true); return true;
     case "c"_hash:
         uint32_t val;
         if (!*input_words) {
@@ -87,5 +130,8 @@ bool DebugNode::debug_cmd(HashedWord *input_words) {
 void DebugNode::debug_print(PrintStream &stream) {
     if (print_debug_memory_) {
         print_platform_memory_info(stream);
+        const Arena &arena = pipeline_->arena();
+        stream.printf("Pipeline arena: %d bytes used, %d bytes in %d blocks; peak of all arenas %d bytes\n",
+                      arena.bytes_used(), arena.bytes_reserved(), arena.num_blocks(), Arena::peak_total_reserved());
     }
 }
@@ -0,0 +1,309 @@
+#include "flight_recorder.h"
+#include "binary_protocol.h"
+#include "print_helpers.h"
+#include <math.h>
+
+// Dumps are not a data stream, so the output never drops them.
+constexpr uint32_t flight_recorder_stream_idx = 0x1001;
+// Records dumped per do_work(), to leave time for the rest of the pipeline.
+constexpr uint32_t dump_records_per_work = 4;
+constexpr TimeDelta dump_period(1, msec);
+
+// Record tags: type in the high bits, input or object index in the low ones.
+enum RecordType : uint8_t {
+    kPulseRecord = 0x00,     // varint pulse_len
+    kAnglesRecord = 0x40,    // varint cycle_idx, phase_id | fix_level/100 << 2, num_sensors, sensors_mask,
+                             // svarint angle (1e-5 rad) for each sensor updated in this phase
+    kPositionRecord = 0x80,  // fix_level/100 | 0x80 if rotated; if fix: 3x svarint pos (0.1mm); if rotated: q_packed
+};
+constexpr uint8_t record_type_mask = 0xC0;
+constexpr uint32_t max_record_size = 1 + 5 + 5 + 3 + max_num_inputs * 5;
+
+static uint8_t *put_varint(uint8_t *p, uint32_t val) {
+    while (val >= 0x80) {
+        *p++ = (val & 0x7F) | 0x80;
+        val >>= 7;
+    }
+    *p++ = val;
+    return p;
+}
+
+static uint8_t *put_svarint(uint8_t *p, int32_t val) {
+    return put_varint(p, ((uint32_t)val << 1) ^ (uint32_t)(val >> 31));  // Zigzag encoding.
+}
+
+uint32_t FlightRecorder::Reader::varint() {
+    uint32_t val = 0;
+    for (uint32_t shift = 0; shift < 35; shift += 7) {
+        uint8_t b = byte();
+        val |= (uint32_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            break;
+    }
+    return val;
+}
+
+int32_t FlightRecorder::Reader::svarint() {
+    uint32_t val = varint();
+    return (int32_t)(val >> 1) ^ -(int32_t)(val & 1);
+}
+
+// Skips the fields after tag and time delta.
+void FlightRecorder::Reader::skip_record(uint8_t tag) {
+    switch (tag & record_type_mask) {
+        case kPulseRecord: varint(); break;
+        case kAnglesRecord: {
+            varint(); byte(); byte();
+            for (uint8_t mask = byte(); mask; mask &= mask - 1)
+                svarint();
+            break;
+        }
+        case kPositionRecord: {
+            uint8_t fix = byte();
+            if ((fix & 0x7F) * 100 >= (int)FixLevel::kStaleFix)
+                for (int i = 0; i < 3; i++)
+                    svarint();
+            if (fix & 0x80)
+                idx_ += 4;
+            break;
+        }
+    }
+}
+
+FlightRecorder::FlightRecorder(const Vector<uint32_t, max_num_inputs> &input_pins)
+    : input_pins_(input_pins)
+    , read_idx_(0)
+    , write_idx_(0)
+    , base_time_()
+    , last_time_()
+    , fix_levels_{}
+    , dumping_(false)
+    , dump_output_idx_(0)
+    , dump_idx_(0)
+    , dump_time_()
+    , next_dump_work_time_()
+    , auto_dump_output_idx_(-1) {
+}
+
+// ======  Recording  =========================================================
+uint8_t *FlightRecorder::start_record(uint8_t *rec, uint8_t tag, Timestamp time) {
+    if (!size())
+        base_time_ = last_time_ = time;
+    *rec++ = tag;
+    return put_svarint(rec, (time - last_time_).get_value((TimeUnit)1));
+}
+
+void FlightRecorder::add_record(const uint8_t *rec, uint32_t len, Timestamp time) {
+    while (flight_recorder_size - size() < len)
+        drop_oldest();
+    for (uint32_t i = 0; i < len; i++)
+        buf_[write_idx_++ % flight_recorder_size] = rec[i];
+    last_time_ = time;
+}
+
+void FlightRecorder::drop_oldest() {
+    Reader reader(*this, read_idx_);
+    uint8_t tag = reader.byte();
+    base_time_ += TimeDelta(reader.svarint(), (TimeUnit)1);
+    reader.skip_record(tag);
+    read_idx_ = reader.idx();
+}
+
+void FlightRecorder::consume(const Pulse &p) {
+    if (dumping_)
+        return;
+    uint8_t rec[max_record_size];
+    uint8_t *end = start_record(rec, kPulseRecord | p.input_idx, p.start_time);
+    end = put_varint(end, p.pulse_len.get_value((TimeUnit)1));
+    add_record(rec, end - rec, p.start_time);
+}
+
+void FlightRecorder::consume(const SensorAnglesFrame &f) {
+    if (dumping_)
+        return;
+    uint8_t rec[max_record_size];
+    uint8_t *end = start_record(rec, kAnglesRecord, f.time);
+    end = put_varint(end, f.cycle_idx);
+    *end++ = f.phase_id | (int)f.fix_level / 100 << 2;
+    *end++ = f.sensors.size();
+    uint8_t *mask = end++;
+    *mask = 0;
+    for (uint32_t i = 0; i < f.sensors.size(); i++)
+        if (f.sensors[i].updated_cycles[f.phase_id] == f.cycle_idx) {
+            *mask |= 1 << i;
+            end = put_svarint(end, lroundf(f.sensors[i].angles[f.phase_id] * 1e5f));
+        }
+    add_record(rec, end - rec, f.time);
+}
+
+void FlightRecorder::consume(const ObjectPosition &f) {
+    if (dumping_ || f.object_idx >= max_num_inputs)
+        return;
+    uint8_t rec[max_record_size];
+    uint8_t *end = start_record(rec, kPositionRecord | f.object_idx, f.time);
+    bool rotated = f.q[0] != 1.0f;
+    *end++ = (int)f.fix_level / 100 | (rotated ? 0x80 : 0);
+    if (f.fix_level >= FixLevel::kStaleFix)
+        for (int i = 0; i < 3; i++)
+            end = put_svarint(end, lroundf(f.pos[i] * 1e4f));
+    if (rotated) {
+        uint32_t q_packed = pack_quaternion(f.q);
+        for (int i = 0; i < 4; i++)
+            *end++ = q_packed >> (8 * i);
+    }
+    add_record(rec, end - rec, f.time);
+
+    FixLevel prev_fix_level = fix_levels_[f.object_idx];
+    fix_levels_[f.object_idx] = f.fix_level;
+    if (auto_dump_output_idx_ >= 0 && prev_fix_level >= FixLevel::kStaleFix && f.fix_level < FixLevel::kStaleFix)
+        start_dump(auto_dump_output_idx_, f.time, f.object_idx);
+}
+
+// ======  Dumping  ===========================================================
+void FlightRecorder::start_dump(uint32_t output_idx, Timestamp cur_time, int32_t lost_object_idx) {
+    if (dumping_ || !size())
+        return;
+    DataChunkPrintStream printer(&outputs_[output_idx], cur_time, flight_recorder_stream_idx);
+    printer.printf("# Flight recorder dump, %d bytes, %d ms", size(), (last_time_ - base_time_).get_value(msec));
+    if (lost_object_idx >= 0)
+        printer.printf(": object%d lost fix", lost_object_idx);
+    printer.printf("\n");
+    dumping_ = true;
+    dump_output_idx_ = output_idx;
+    dump_idx_ = read_idx_;
+    dump_time_ = base_time_;
+    next_dump_work_time_ = cur_time;
+}
+
+void FlightRecorder::do_work(Timestamp cur_time) {
+    if (!dumping_)
+        return;
+    next_dump_work_time_ = cur_time + dump_period;
+    DataChunkPrintStream printer(&outputs_[dump_output_idx_], cur_time, flight_recorder_stream_idx);
+    for (uint32_t i = 0; i < dump_records_per_work && dump_idx_ != write_idx_; i++) {
+        Reader reader(*this, dump_idx_);
+        dump_record(printer, reader);
+        dump_idx_ = reader.idx();
+    }
+    if (dump_idx_ == write_idx_) {
+        printer.printf("# End of flight recorder dump\n");
+        // Start over, so that the next dump doesn't repeat these records.
+        read_idx_ = write_idx_;
+        dumping_ = false;
+    }
+}
+
+Timestamp FlightRecorder::next_work_time(Timestamp cur_time) {
+    return dumping_ ? next_dump_work_time_ : cur_time + max_sleep_time;
+}
+
+// Time in the trace format: microseconds with optional fractional part.
+void FlightRecorder::print_time(PrintStream &stream) {
+    stream.print_uint(dump_time_.get_value(usec));
+    if (uint32_t frac = dump_time_.get_raw_value() % usec) {
+        stream.print('.');
+        stream.print_uint((frac * 100 + usec / 2) / usec, 2);
+    }
+}
+
+void FlightRecorder::dump_record(PrintStream &stream, Reader &reader) {
+    uint8_t tag = reader.byte();
+    uint32_t idx = tag & ~record_type_mask;
+    dump_time_ += TimeDelta(reader.svarint(), (TimeUnit)1);
+    switch (tag & record_type_mask) {
+        case kPulseRecord: {
+            stream.print_uint(idx < input_pins_.size() ? input_pins_[idx] : idx);
+            stream.print(' ');
+            print_time(stream);
+            stream.print(' ');
+            stream.print_fixed(reader.varint() / (float)usec, 2);
+            break;
+        }
+        case kAnglesRecord: {
+            uint32_t cycle_idx = reader.varint();
+            uint8_t phase_fix = reader.byte();
+            uint32_t num_sensors = reader.byte();
+            uint8_t mask = reader.byte();
+            stream.print("# ANG ");
+            print_time(stream);
+            stream.printf(" cycle %u phase %d fix %d", cycle_idx, phase_fix & 3, (phase_fix >> 2) * 100);
+            for (uint32_t i = 0; i < num_sensors; i++) {
+                stream.print(' ');
+                if (mask & (1 << i))
+                    stream.print_fixed(reader.svarint() * 1e-5f, 5);
+                else
+                    stream.print('-');
+            }
+            break;
+        }
+        case kPositionRecord: {
+            uint8_t fix = reader.byte();
+            stream.print("# OBJ");
+            stream.print_uint(idx);
+            stream.print(' ');
+            print_time(stream);
+            stream.printf(" fix %d", (fix & 0x7F) * 100);
+            if ((fix & 0x7F) * 100 >= (int)FixLevel::kStaleFix) {
+                stream.print(" pos");
+                for (int i = 0; i < 3; i++) {
+                    stream.print(' ');
+                    stream.print_fixed(reader.svarint() * 1e-4f, 4);
+                }
+            }
+            if (fix & 0x80) {
+                uint32_t q_packed = 0;
+                for (int i = 0; i < 4; i++)
+                    q_packed |= (uint32_t)reader.byte() << (8 * i);
+                float q[4];
+                unpack_quaternion(q_packed, q);
+                stream.print(" q");
+                for (int i = 0; i < 4; i++) {
+                    stream.print(' ');
+                    stream.print_fixed(q[i], 4);
+                }
+            }
+            break;
+        }
+    }
+    stream.print('\n');
+}
+
+// ======  Debug commands  ====================================================
+// Output for dumps: '> usb_serial' or '> serial<n>'; usb_serial if not given.
+static bool parse_output(HashedWord *input_words, uint32_t *output_idx) {
+    *output_idx = 0;
+    if (!*input_words)
+        return true;
+    if (*input_words++ != ">"_hash)
+        return false;
+    if (*input_words == "usb_serial"_hash)
+        return true;
+    if (*input_words == "serial#"_hash && input_words->idx < num_outputs) {
+        *output_idx = input_words->idx;
+        return true;
+    }
+    return false;
+}
+
+bool FlightRecorder::debug_cmd(HashedWord *input_words) {
+    if (*input_words++ != "recorder"_hash)
+        return false;
+    uint32_t output_idx;
+    switch (*input_words++) {
+        case "dump"_hash:
+            if (!parse_output(input_words, &output_idx))
+                return false;
+            start_dump(output_idx, Timestamp::cur_time(), -1);
+            return true;
+        case "auto"_hash:
+            if (*input_words == "off"_hash) {
+                auto_dump_output_idx_ = -1;
+                return true;
+            }
+            if (!parse_output(input_words, &output_idx))
+                return false;
+            auto_dump_output_idx_ = output_idx;
+            return true;
+    }
+    return false;
+}
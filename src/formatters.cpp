@@ -1,13 +1,40 @@
 #include "formatters.h"
+#include <math.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <string.h>
+#include <algorithm>
+#include "binary_protocol.h"
 #include "print_helpers.h"
 #include "message_logging.h"
 
 // ======  FormatterNode  =====================================================
 FormatterNode::FormatterNode(uint32_t idx, const FormatterDef &def)
     : node_idx_(idx)
-    , def_(def) {
+    , def_(def)
+    , min_period_(def.rate_hz ? TimeDelta(1000000 / def.rate_hz, usec) : TimeDelta())
+    , last_sent_time_()
+    , sent_any_(false)
+    , frames_skipped_(0) {
+}
+
+bool FormatterNode::rate_limit_passed(Timestamp time) {
+    if (min_period_ == TimeDelta())
+        return true;
+
+    TimeDelta since_last = time - last_sent_time_;
+    if (sent_any_ && TimeDelta() <= since_last && since_last < min_period_) {
+        frames_skipped_++;
+        return false;
+    }
+
+    // Keep a steady cadence when input is regular, but don't try to catch up after gaps.
+    if (sent_any_ && TimeDelta() <= since_last && since_last < min_period_ * 2)
+        last_sent_time_ += min_period_;
+    else
+        last_sent_time_ = time;
+    sent_any_ = true;
+    return true;
 }
 
 bool FormatterNode::debug_cmd(HashedWord *input_words) {
@@ -19,59 +46,270 @@ bool FormatterNode::debug_cmd(HashedWord *input_words) {
 }
 void FormatterNode::debug_print(PrintStream &stream) {
     producer_debug_print(this, stream);
+    if (frames_skipped_) {
+        stream.printf("Stream %d: %u frames skipped by rate limit\n", node_idx_, frames_skipped_);
+        frames_skipped_ = 0;
+    }
 }
 
 // ======  SensorAnglesTextFormatter  =========================================
 void SensorAnglesTextFormatter::consume(const SensorAnglesFrame& f) {
+    if (!rate_limit_passed(f.time))
+        return;
+
     uint32_t time = f.time.get_value(msec);
 
     // Print each sensor on its own line.
     for (uint32_t i = 0; i < f.sensors.size(); i++) {
         DataChunkPrintStream printer(this, f.time, node_idx_);
         const SensorAngles &angles = f.sensors[i];
-        printer.printf("ANG%d\t%u\t%d", i, time, f.fix_level);
+        printer.print("ANG");
+        printer.print_uint(i);
+        printer.print('\t');
+        printer.print_uint(time);
+        printer.print('\t');
+        printer.print_int((int32_t)f.fix_level);
         for (uint32_t j = 0; j < num_cycle_phases; j++) {
-            printer.printf("\t");
+            printer.print('\t');
             if (f.fix_level == FixLevel::kCycleSynced && angles.updated_cycles[j] == f.cycle_idx - f.phase_id + j)
-                printer.printf("%.4f", angles.angles[j]);
+                printer.print_fixed(angles.angles[j], 4);
         }
-        printer.printf("\n");
+        printer.print('\n');
+    }
+}
+
+// ======  TelemetryFormatter  ================================================
+TelemetryFormatter::TelemetryFormatter(uint32_t idx, const FormatterDef &def, WorkerNode *source)
+    : FormatterNode(idx, def)
+    , source_(source)
+    , period_(1000000 / (def.rate_hz ? def.rate_hz : 1), usec)
+    , last_sent_time_()
+    , sent_any_(false)
+    , seq_(0) {
+}
+
+// Periods can be longer than max_sleep_time, which Pipeline treats as stale, so the time is clamped.
+Timestamp TelemetryFormatter::next_work_time(Timestamp cur_time) {
+    if (!sent_any_)
+        return cur_time;
+    TimeDelta time_left = last_sent_time_ + period_ - cur_time;
+    return time_left > max_sleep_time ? cur_time + max_sleep_time : last_sent_time_ + period_;
+}
+
+void TelemetryFormatter::do_work(Timestamp cur_time) {
+    // Pipelines call do_work() whenever any node has work, so check the rate here.
+    TimeDelta since_last = cur_time - last_sent_time_;
+    if (sent_any_ && TimeDelta() <= since_last && since_last < period_)
+        return;
+
+    // Keep the cadence, but don't send bursts after the pipeline was stalled.
+    last_sent_time_ = sent_any_ && TimeDelta() <= since_last && since_last < period_ * 2
+        ? last_sent_time_ + period_ : cur_time;
+    sent_any_ = true;
+
+    packet_ = BinaryTelemetryPacket();
+    packet_.type = binary_telemetry_packet_type;
+    packet_.seq = seq_++;
+    packet_.time_usec = cur_time.get_value(usec);
+    packet_.arena_bytes = Arena::peak_total_reserved();
+    source_->collect_telemetry(packet_);
+
+    // Frame is larger than a DataChunk, so it's sent as several chunks of one message.
+    uint32_t len = encode_telemetry_frame(packet_, frame_);
+    DataChunk chunk;
+    chunk.time = cur_time;
+    chunk.stream_idx = node_idx_;
+    for (uint32_t pos = 0; pos < len; pos += max_bytes_in_data_chunk) {
+        uint32_t chunk_len = std::min(len - pos, (uint32_t)max_bytes_in_data_chunk);
+        chunk.data.set_size(chunk_len);
+        memcpy(&chunk.data[0], frame_ + pos, chunk_len);
+        chunk.last_chunk = pos + chunk_len == len;
+        produce(chunk);
     }
 }
 
 // ======  GeometryFormatter  =================================================
-std::unique_ptr<GeometryFormatter> GeometryFormatter::create(uint32_t idx, const FormatterDef &def) {
+ArenaPtr<GeometryFormatter> GeometryFormatter::create(Arena &arena, uint32_t idx, const FormatterDef &def,
+                                                      const CoordinateTransform &transform) {
     switch (def.formatter_subtype) {
-        case FormatterSubtype::kPosText:    return std::make_unique<GeometryTextFormatter>(idx, def);
-        case FormatterSubtype::kPosMavlink: return std::make_unique<GeometryMavlinkFormatter>(idx, def);
+        case FormatterSubtype::kPosText:    return arena.make<GeometryTextFormatter>(idx, def, transform);
+        case FormatterSubtype::kPosMavlink:
+        case FormatterSubtype::kPosMavlinkVision:
+        case FormatterSubtype::kPosMavlinkOdometry:
+            return arena.make<GeometryMavlinkFormatter>(idx, def, transform);
+        case FormatterSubtype::kPosUblox:   return arena.make<GeometryUbloxFormatter>(idx, def, transform);
+        case FormatterSubtype::kPosBinary:  return arena.make<GeometryBinaryFormatter>(idx, def, transform);
         default: throw_printf("Unknown geometry formatter subtype: %d", def.formatter_subtype);
     }
 }
 
+ArenaPtr<GeometryFormatter> GeometryFormatter::create(Arena &arena, uint32_t idx, const FormatterDef &def) {
+    return create(arena, idx, def, CoordinateTransform::for_stream(def.coord_sys_type, def.coord_sys_params, def.offset));
+}
+
+GeometryFormatter::GeometryFormatter(uint32_t idx, const FormatterDef &def, const CoordinateTransform &transform)
+    : FormatterNode(idx, def)
+    , transform_(transform)
+    , transform_needed_(!transform.is_identity())
+    , avg_sum_()
+    , avg_time_sum_()
+    , avg_count_(0)
+    , averaged_()
+    , transformed_() {
+}
+
+void GeometryFormatter::consume(const ObjectPosition& f) {
+    if (const ObjectPosition *pos = prepare(f))
+        format(*pos);
+}
+
+const ObjectPosition *GeometryFormatter::prepare(const ObjectPosition& f) {
+    if (def_.rate_average)
+        accumulate(f);
+    if (!rate_limit_passed(f.time))
+        return nullptr;
+
+    const ObjectPosition *pos = &f;
+    if (avg_count_ > 1) {
+        get_average(f, &averaged_);
+        pos = &averaged_;
+    }
+    avg_count_ = 0;
+
+    if (!transform_needed_)
+        return pos;
+
+    transform_.apply(*pos, &transformed_);
+    return &transformed_;
+}
+
+// Only positions with a fix are averaged; losing the fix restarts averaging.
+void GeometryFormatter::accumulate(const ObjectPosition& f) {
+    if (f.fix_level < FixLevel::kStaleFix) {
+        avg_count_ = 0;
+        return;
+    }
+    if (avg_count_ == 0) {
+        avg_sum_ = f;
+        avg_time_sum_ = TimeDelta();
+    } else {
+        avg_time_sum_ += f.time - avg_sum_.time;
+        for (int i = 0; i < vec3d_size; i++)
+            avg_sum_.pos[i] += f.pos[i];
+        avg_sum_.pos_delta += f.pos_delta;
+        for (int i = 0; i < 6; i++)
+            avg_sum_.pos_covariance[i] += f.pos_covariance[i];
+    }
+    avg_count_++;
+}
+
+// Averaged position keeps fix level and rotation of the latest one. Covariance is averaged too, which is
+// conservative: noise of consecutive positions is correlated.
+void GeometryFormatter::get_average(const ObjectPosition& latest, ObjectPosition *res) {
+    *res = latest;
+    float k = 1.0f / avg_count_;
+    res->time = avg_sum_.time + avg_time_sum_ / (int)avg_count_;
+    for (int i = 0; i < vec3d_size; i++)
+        res->pos[i] = avg_sum_.pos[i] * k;
+    res->pos_delta = avg_sum_.pos_delta * k;
+    for (int i = 0; i < 6; i++)
+        res->pos_covariance[i] = avg_sum_.pos_covariance[i] * k;
+}
+
 // ======  GeometryTextFormatter  =============================================
-void GeometryTextFormatter::consume(const ObjectPosition& f) {
+void GeometryTextFormatter::format(const ObjectPosition& f) {
     DataChunkPrintStream printer(this, f.time, node_idx_);
-    printer.printf("OBJ%d\t%u\t%d", f.object_idx, f.time.get_value(msec), f.fix_level);
+    printer.print("OBJ");
+    printer.print_uint(f.object_idx);
+    printer.print('\t');
+    printer.print_uint(f.time.get_value(msec));
+    printer.print('\t');
+    printer.print_int((int32_t)f.fix_level);
     if (f.fix_level >= FixLevel::kStaleFix) {
-        printer.printf("\t%.4f\t%.4f\t%.4f\t%.4f", f.pos[0], f.pos[1], f.pos[2], f.pos_delta);
+        for (int i = 0; i < vec3d_size; i++) {
+            printer.print('\t');
+            printer.print_fixed(f.pos[i], 4);
+        }
+        printer.print('\t');
+        printer.print_fixed(f.pos_delta, 4);
         if (f.q[0] != 1.0f) {  // Output quaternion if available.
-            printer.printf("\t%.4f\t%.4f\t%.4f\t%.4f", f.q[0], f.q[1], f.q[2], f.q[3]);
+            for (int i = 0; i < 4; i++) {
+                printer.print('\t');
+                printer.print_fixed(f.q[i], 4);
+            }
         }
     }
-    printer.printf("\n");
+    printer.print('\n');
+}
+
+// ======  GeometryBinaryFormatter  ===========================================
+void GeometryBinaryFormatter::format(const ObjectPosition& f) {
+    encode(f);
+    produce(chunk_);
+}
+
+const DataChunk *GeometryBinaryFormatter::process(const ObjectPosition& f) {
+    const ObjectPosition *pos = prepare(f);
+    if (!pos)
+        return nullptr;
+    encode(*pos);
+    return &chunk_;
+}
+
+void GeometryBinaryFormatter::encode(const ObjectPosition& f) {
+    BinaryPositionPacket packet = {};
+    packet.type = binary_position_packet_type;
+    packet.object_idx = f.object_idx;
+    packet.fix_level = (uint16_t)f.fix_level;
+    packet.seq = seq_++;
+    packet.time_usec = f.time.get_value(usec);
+    if (f.fix_level >= FixLevel::kStaleFix) {
+        for (int i = 0; i < 3; i++)
+            packet.pos_mm[i] = (int32_t)lroundf(f.pos[i] * 1000.f);
+        float stddev_um = sqrtf(f.pos_covariance[0] + f.pos_covariance[3] + f.pos_covariance[5]) * 1e6f;
+        packet.pos_stddev_um = stddev_um < 65535.f ? (uint16_t)stddev_um : 0xFFFF;
+    } else {
+        packet.pos_stddev_um = 0xFFFF;
+    }
+    packet.q_packed = pack_quaternion(f.q);
+
+    // Write the frame directly to the chunk to avoid extra copies.
+    static_assert(binary_position_frame_max_size <= max_bytes_in_data_chunk, "Binary frame must fit into a DataChunk");
+    chunk_.time = f.time;
+    chunk_.stream_idx = node_idx_;
+    chunk_.last_chunk = true;
+    chunk_.data.set_size(encode_position_frame(packet, &chunk_.data[0]));
 }
 
 // ======  FormatterDef I/O  =====================================================
 // Format: stream<idx> <type> <settings> > <output>
 // stream0 mavlink object0 ned 110 > serial1
+// stream0 mavlink object0 ned 110 offset 0 0 -0.1 > serial1
 // stream1 angles > usb_serial
 // stream2 position object0 > usb_serial
+// stream3 binary object0 > serial1
+// stream4 position object0 drop newest > serial2
+// stream5 mavlink_odometry object0 ned 110 > serial1
+// stream6 ublox object0 ned 110 origin 37.4275 -122.1697 30 > serial1
+// stream7 position object0 rate 10 avg drop newest > serial2
+// stream8 telemetry rate 5 > serial1
 
 HashedWord formatter_types[] = {
     {"angles",    "angles"_hash,    (int)FormatterType::kAngles    << 16 },
     {"dataframe", "dataframe"_hash, (int)FormatterType::kDataFrame << 16 },
     {"position",  "position"_hash,  (int)FormatterType::kPosition  << 16 | (int)FormatterSubtype::kPosText},
     {"mavlink",   "mavlink"_hash,   (int)FormatterType::kPosition  << 16 | (int)FormatterSubtype::kPosMavlink},
+    {"binary",    "binary"_hash,    (int)FormatterType::kPosition  << 16 | (int)FormatterSubtype::kPosBinary},
+    {"mavlink_vision",   "mavlink_vision"_hash,   (int)FormatterType::kPosition << 16 | (int)FormatterSubtype::kPosMavlinkVision},
+    {"mavlink_odometry", "mavlink_odometry"_hash, (int)FormatterType::kPosition << 16 | (int)FormatterSubtype::kPosMavlinkOdometry},
+    {"ublox",     "ublox"_hash,     (int)FormatterType::kPosition  << 16 | (int)FormatterSubtype::kPosUblox},
+    {"telemetry", "telemetry"_hash, (int)FormatterType::kTelemetry << 16 },
+};
+
+HashedWord drop_policies[] = {
+    {"oldest", "oldest"_hash, (int)DropPolicy::kDropOldest},
+    {"newest", "newest"_hash, (int)DropPolicy::kDropNewest},
+    {"never",  "never"_hash,  (int)DropPolicy::kNeverDrop},
 };
 
 
@@ -89,6 +327,7 @@ void FormatterDef::print_def(uint32_t idx, PrintStream &stream) {
     switch (formatter_type) {
         case FormatterType::kAngles: break;
         case FormatterType::kDataFrame: break;
+        case FormatterType::kTelemetry: break;
         case FormatterType::kPosition: {
             stream.printf("object%d ", input_idx);
             switch (coord_sys_type) {
@@ -98,10 +337,23 @@ void FormatterDef::print_def(uint32_t idx, PrintStream &stream) {
                     break;
                 }
             }
+            if (offset[0] != 0.f || offset[1] != 0.f || offset[2] != 0.f)
+                stream.printf("offset %.4f %.4f %.4f ", offset[0], offset[1], offset[2]);
+            if (formatter_subtype == FormatterSubtype::kPosUblox)
+                stream.printf("origin %.7f %.7f %.3f ", geo_origin.lat_e7 * 1e-7, geo_origin.lon_e7 * 1e-7,
+                              geo_origin.alt_mm * 1e-3);
             break;
         }
     }
 
+    if (rate_hz)
+        stream.printf(rate_average ? "rate %d avg " : "rate %d ", rate_hz);
+
+    if (drop_policy != DropPolicy::kDropOldest)
+        for (uint32_t i = 0; i < sizeof(drop_policies) / sizeof(drop_policies[0]); i++)
+            if ((uint32_t)drop_policy == drop_policies[i].idx)
+                stream.printf("drop %s ", drop_policies[i].word);
+
     // Print output idx.
     if (output_idx == 0)
         stream.printf("> usb_serial\n");
@@ -128,6 +380,7 @@ bool FormatterDef::parse_def(uint32_t idx, HashedWord *input_words, PrintStream
     switch (formatter_type) {
         case FormatterType::kAngles: break;
         case FormatterType::kDataFrame: break;
+        case FormatterType::kTelemetry: break;
         case FormatterType::kPosition: {
             if (*input_words != "object#"_hash) {
                 err_stream.printf("Need object for position stream type.\n");
@@ -146,10 +399,79 @@ bool FormatterDef::parse_def(uint32_t idx, HashedWord *input_words, PrintStream
                 }
                 input_words++;
             }
+
+            offset[0] = offset[1] = offset[2] = 0.f;
+            if (*input_words == "offset"_hash) {
+                input_words++;
+                for (int i = 0; i < vec3d_size; i++, input_words++)
+                    if (!input_words->as_float(&offset[i])) {
+                        err_stream.printf("Expected 3 coordinates after 'offset' keyword.\n");
+                        return false;
+                    }
+            }
+
+            geo_origin = {};
+            if (formatter_subtype == FormatterSubtype::kPosUblox) {
+                double lat, lon, alt;
+                if (coord_sys_type != CoordSysType::kNED) {
+                    err_stream.printf("GPS emulation needs 'ned' coordinate system.\n");
+                    return false;
+                }
+                if (*input_words != "origin"_hash || !(input_words+1)->as_double(&lat) ||
+                    !(input_words+2)->as_double(&lon) || !(input_words+3)->as_double(&alt)) {
+                    err_stream.printf("Expected 'origin <lat> <lon> <alt>' for GPS emulation.\n");
+                    return false;
+                }
+                if (fabs(lat) > 90.0 || fabs(lon) > 180.0 || fabs(alt) > 100000.0) {
+                    err_stream.printf("Origin is out of range.\n");
+                    return false;
+                }
+                input_words += 4;
+                geo_origin.lat_e7 = (int32_t)lround(lat * 1e7);
+                geo_origin.lon_e7 = (int32_t)lround(lon * 1e7);
+                geo_origin.alt_mm = (int32_t)lround(alt * 1e3);
+            }
             break;
         }
     }
 
+    rate_hz = 0;
+    rate_average = false;
+    if (*input_words == "rate"_hash) {
+        input_words++;
+        uint32_t rate;
+        if (!input_words->as_uint32(&rate) || rate < 1 || rate > 1000) {
+            err_stream.printf("Expected rate in Hz (1-1000) after 'rate' keyword.\n");
+            return false;
+        }
+        rate_hz = rate;
+        input_words++;
+        if (*input_words == "avg"_hash) {
+            if (formatter_type != FormatterType::kPosition) {
+                err_stream.printf("Averaging is only supported for position streams.\n");
+                return false;
+            }
+            rate_average = true;
+            input_words++;
+        }
+    }
+
+    drop_policy = DropPolicy::kDropOldest;
+    if (*input_words == "drop"_hash) {
+        input_words++;
+        bool policy_found = false;
+        for (uint32_t i = 0; i < sizeof(drop_policies) / sizeof(drop_policies[0]); i++)
+            if (*input_words == drop_policies[i]) {
+                drop_policy = (DropPolicy)drop_policies[i].idx;
+                policy_found = true;
+            }
+        if (!policy_found) {
+            err_stream.printf("Expected 'oldest', 'newest' or 'never' after 'drop' keyword.\n");
+            return false;
+        }
+        input_words++;
+    }
+
     if (*input_words++ != ">"_hash) {
         err_stream.printf("Expected '>' symbol\n"); return false;
     }
@@ -1,16 +1,23 @@
 #include "geometry.h"
 #include <math.h>
 #include <assert.h>
+#include <string.h>
 #include <algorithm>
 
 #include <arm_math.h>
 #include "primitives/string_utils.h"
 #include "message_logging.h"
 #include "led_state.h"
+#include "binary_protocol.h"
 
 
 bool intersect_lines(const vec3d &orig1, const vec3d &vec1, const vec3d &orig2, const vec3d &vec2, vec3d *res, float *dist);
 void calc_ray_vec(const BaseStationGeometryDef &bs, float angle1, float angle2, vec3d &ray, vec3d &origin);
+bool intersect_planes_weighted(const Vector<BaseStationGeometryDef, num_base_stations> &base_stations,
+                               const SensorAngles &sens, vec3d &pos, float (&covariance)[6]);
+
+// Positions with larger uncertainty (sum of variances along axes) are considered invalid and not sent downstream.
+constexpr float max_position_variance = 0.05f * 0.05f;  // m^2
 
 
 GeometryBuilder::GeometryBuilder(uint32_t idx, const GeometryBuilderDef &geo_def,
@@ -34,6 +41,10 @@ PointGeometryBuilder::PointGeometryBuilder(uint32_t idx, const GeometryBuilderDe
 
 
 void PointGeometryBuilder::consume(const SensorAnglesFrame& f) {
+    produce(*process(f));
+}
+
+const ObjectPosition *PointGeometryBuilder::process(const SensorAnglesFrame& f) {
     // First 2 angles - x, y of station B; second 2 angles - x, y of station C.
     // Coordinate system: Y - Up;  X ->  Z v  (to the viewer)
     // Station 'looks' to inverse Z axis (vector 0;0;-1).
@@ -59,22 +70,23 @@ void PointGeometryBuilder::consume(const SensorAnglesFrame& f) {
             
             intersect_lines(origin1, ray1, origin2, ray2, &pos_.pos, &pos_.pos_delta);
 
+            // Refine the position taking into account angle uncertainties and get its covariance.
+            if (!intersect_planes_weighted(base_stations_, sens, pos_.pos, pos_.pos_covariance) ||
+                pos_.pos_covariance[0] + pos_.pos_covariance[3] + pos_.pos_covariance[5] > max_position_variance)
+                pos_.fix_level = FixLevel::kPartialVis;
+
             // Translate object position depending on the position of sensor relative to object.
             for (int i = 0; i < vec3d_size; i++)
                 pos_.pos[i] -= sens_def.pos[i];
-            
         } else {
             // Angles too stale - cannot calculate position anymore.
             pos_.fix_level = FixLevel::kPartialVis;
         }
     }
 
-    produce(pos_);
-}
-
-void PointGeometryBuilder::do_work(Timestamp cur_time) {
     // TODO: Make compatible with multiple geometry objects.
     set_led_state(pos_.fix_level >= FixLevel::kStaleFix ? LedState::kFixFound : LedState::kNoFix);
+    return &pos_;
 }
 
 bool PointGeometryBuilder::debug_cmd(HashedWord *input_words) {
@@ -88,6 +100,11 @@ void PointGeometryBuilder::debug_print(PrintStream &stream) {
     producer_debug_print(this, stream);
 }
 
+void PointGeometryBuilder::collect_telemetry(BinaryTelemetryPacket &packet) {
+    if (object_idx_ < telemetry_max_objects)
+        packet.object_fix_levels[object_idx_] = (uint16_t)pos_.fix_level;
+}
+
 void vec_cross_product(const vec3d &a, const vec3d &b, vec3d &res) {
     res[0] = a[1]*b[2] - a[2]*b[1];
     res[1] = a[2]*b[0] - a[0]*b[2];
@@ -168,53 +185,189 @@ bool intersect_lines(const vec3d &orig1, const vec3d &vec1, const vec3d &orig2,
     return true;
 }
 
-// ======= CoordinateSystemConverter ==========================================
-CoordinateSystemConverter::CoordinateSystemConverter(float mat[9]) {
-    memcpy(mat_, mat, sizeof(mat_));
+// Weighted least squares intersection of the 4 laser planes (2 per base station). Each plane is weighted by the
+// inverse variance of point-to-plane distance, which is angle variance times squared distance to the rotor axis.
+// 'pos' is used as the initial estimate to calculate these distances and is replaced with the result.
+// Covariance of the result is the inverse of the normal matrix.
+bool intersect_planes_weighted(const Vector<BaseStationGeometryDef, num_base_stations> &base_stations,
+                               const SensorAngles &sens, vec3d &pos, float (&covariance)[6]) {
+    float a[6] = {}; // Normal matrix, upper triangle: xx, xy, xz, yy, yz, zz.
+    vec3d rhs = {};
+    for (uint32_t b = 0; b < num_base_stations; b++) {
+        const BaseStationGeometryDef &bs = base_stations[b];
+
+        // Current estimate in base station local coordinates.
+        vec3d d = {pos[0] - bs.origin[0], pos[1] - bs.origin[1], pos[2] - bs.origin[2]};
+        vec3d l;
+        for (int i = 0; i < 3; i++)
+            l[i] = bs.mat[0*3 + i] * d[0] + bs.mat[1*3 + i] * d[1] + bs.mat[2*3 + i] * d[2];
+
+        for (int j = 0; j < 2; j++) {
+            uint32_t phase = b * 2 + j;
+            float angle = sens.angles[phase];
+            // Plane normals in local coordinates (see calc_ray_vec) and distances to the rotor axes (Y and X).
+            vec3d n_local = {};
+            float axis_dist_sq;
+            if (j == 0) {
+                n_local[0] = arm_cos_f32(angle); n_local[2] = -arm_sin_f32(angle);
+                axis_dist_sq = l[0]*l[0] + l[2]*l[2];
+            } else {
+                n_local[1] = arm_cos_f32(angle); n_local[2] = arm_sin_f32(angle);
+                axis_dist_sq = l[1]*l[1] + l[2]*l[2];
+            }
+            vec3d n;
+            for (int i = 0; i < 3; i++)
+                n[i] = bs.mat[i*3 + 0] * n_local[0] + bs.mat[i*3 + 1] * n_local[1] + bs.mat[i*3 + 2] * n_local[2];
+
+            float variance = sens.angle_variances[phase] * axis_dist_sq;
+            if (!(variance > 0.f))
+                return false;
+            float w = 1.f / variance;
+            float n_dot_o = n[0] * bs.origin[0] + n[1] * bs.origin[1] + n[2] * bs.origin[2];
+            a[0] += w * n[0] * n[0]; a[1] += w * n[0] * n[1]; a[2] += w * n[0] * n[2];
+            a[3] += w * n[1] * n[1]; a[4] += w * n[1] * n[2]; a[5] += w * n[2] * n[2];
+            for (int i = 0; i < 3; i++)
+                rhs[i] += w * n[i] * n_dot_o;
+        }
+    }
+
+    // Invert symmetric 3x3 matrix using cofactors.
+    float c00 = a[3]*a[5] - a[4]*a[4], c01 = a[2]*a[4] - a[1]*a[5], c02 = a[1]*a[4] - a[2]*a[3];
+    float det = a[0]*c00 + a[1]*c01 + a[2]*c02;
+    if (!(fabsf(det) > 0.f))
+        return false;
+    float inv_det = 1.f / det;
+    covariance[0] = c00 * inv_det;
+    covariance[1] = c01 * inv_det;
+    covariance[2] = c02 * inv_det;
+    covariance[3] = (a[0]*a[5] - a[2]*a[2]) * inv_det;
+    covariance[4] = (a[1]*a[2] - a[0]*a[4]) * inv_det;
+    covariance[5] = (a[0]*a[3] - a[1]*a[1]) * inv_det;
+
+    const float *c = covariance;
+    pos[0] = c[0] * rhs[0] + c[1] * rhs[1] + c[2] * rhs[2];
+    pos[1] = c[1] * rhs[0] + c[3] * rhs[1] + c[4] * rhs[2];
+    pos[2] = c[2] * rhs[0] + c[4] * rhs[1] + c[5] * rhs[2];
+    return true;
 }
 
-std::unique_ptr<CoordinateSystemConverter> CoordinateSystemConverter::create(CoordSysType type, const CoordSysDef& def) {
-    switch (type) {
-        case CoordSysType::kDefault: return nullptr; // Do nothing.
-        case CoordSysType::kNED: return CoordinateSystemConverter::NED(def);
-        default: throw_printf("Unknown coord sys type: %d", type);
-    }
+// ======= CoordinateTransform ================================================
+static void quat_mult(const float (&a)[4], const float (&b)[4], float (&res)[4]) {
+    res[0] = a[0]*b[0] - a[1]*b[1] - a[2]*b[2] - a[3]*b[3];
+    res[1] = a[0]*b[1] + a[1]*b[0] + a[2]*b[3] - a[3]*b[2];
+    res[2] = a[0]*b[2] - a[1]*b[3] + a[2]*b[0] + a[3]*b[1];
+    res[3] = a[0]*b[3] + a[1]*b[2] - a[2]*b[1] + a[3]*b[0];
 }
 
-std::unique_ptr<CoordinateSystemConverter> CoordinateSystemConverter::NED(const CoordSysDef &def) {
-    float ne_angle = def.ned.north_angle / 360.0f * (float)M_PI;
-    float mat[9] = {
-        // Convert Y up -> Z down; then rotate XY around Z clockwise and inverse X & Y
-        -arm_cos_f32(ne_angle), 0.0f,  arm_sin_f32(ne_angle),
-        -arm_sin_f32(ne_angle), 0.0f, -arm_cos_f32(ne_angle),
-        0.0f,          -1.0f,            0.0f,
-    };
-    return std::make_unique<CoordinateSystemConverter>(mat);
+CoordinateTransform CoordinateTransform::identity() {
+    return {{1.f, 0.f, 0.f,  0.f, 1.f, 0.f,  0.f, 0.f, 1.f}, {0.f, 0.f, 0.f}, {1.f, 0.f, 0.f, 0.f}};
 }
 
-void CoordinateSystemConverter::consume(const ObjectPosition& pos) {
-    ObjectPosition out_pos(pos);
+CoordinateTransform CoordinateTransform::translation(const vec3d &offset) {
+    CoordinateTransform res = identity();
+    memcpy(res.offset, offset, sizeof(res.offset));
+    return res;
+}
 
-    // Convert position
-    arm_matrix_instance_f32 src_mat = {3, 1, const_cast<float*>(pos.pos)};
-    arm_matrix_instance_f32 dest_mat = {3, 1, out_pos.pos};
-    arm_matrix_instance_f32 rotation_mat = {3, 3, mat_};
-    arm_mat_mult_f32(&rotation_mat, &src_mat, &dest_mat);
+CoordinateTransform CoordinateTransform::rotation(const float (&m)[9]) {
+    CoordinateTransform res = identity();
+    memcpy(res.mat, m, sizeof(res.mat));
+
+    // Convert rotation matrix to quaternion, choosing the numerically stable branch.
+    float trace = m[0] + m[4] + m[8];
+    float *q = res.q_rot;
+    if (trace > 0.f) {
+        float s = sqrtf(trace + 1.f) * 2.f;
+        q[0] = 0.25f * s;
+        q[1] = (m[7] - m[5]) / s;
+        q[2] = (m[2] - m[6]) / s;
+        q[3] = (m[3] - m[1]) / s;
+    } else if (m[0] > m[4] && m[0] > m[8]) {
+        float s = sqrtf(1.f + m[0] - m[4] - m[8]) * 2.f;
+        q[0] = (m[7] - m[5]) / s;
+        q[1] = 0.25f * s;
+        q[2] = (m[1] + m[3]) / s;
+        q[3] = (m[2] + m[6]) / s;
+    } else if (m[4] > m[8]) {
+        float s = sqrtf(1.f + m[4] - m[0] - m[8]) * 2.f;
+        q[0] = (m[2] - m[6]) / s;
+        q[1] = (m[1] + m[3]) / s;
+        q[2] = 0.25f * s;
+        q[3] = (m[5] + m[7]) / s;
+    } else {
+        float s = sqrtf(1.f + m[8] - m[0] - m[4]) * 2.f;
+        q[0] = (m[3] - m[1]) / s;
+        q[1] = (m[2] + m[6]) / s;
+        q[2] = (m[5] + m[7]) / s;
+        q[3] = 0.25f * s;
+    }
+    return res;
+}
 
-    // TODO: Convert quaternion.
-    assert(pos.q[0] == 1.0f);
+CoordinateTransform CoordinateTransform::coord_sys(CoordSysType type, const CoordSysDef &def) {
+    switch (type) {
+        case CoordSysType::kDefault: return identity();
+        case CoordSysType::kNED: {
+            // Needs angle between North and X axis, in degrees.
+            float ne_angle = def.ned.north_angle / 360.0f * (float)M_PI;
+            float mat[9] = {
+                // Convert Y up -> Z down; then rotate XY around Z clockwise and inverse X & Y
+                -arm_cos_f32(ne_angle), 0.0f,  arm_sin_f32(ne_angle),
+                -arm_sin_f32(ne_angle), 0.0f, -arm_cos_f32(ne_angle),
+                0.0f,          -1.0f,            0.0f,
+            };
+            return rotation(mat);
+        }
+        default: throw_printf("Unknown coord sys type: %d", type);
+    }
+}
 
-    produce(out_pos);
+CoordinateTransform CoordinateTransform::for_stream(CoordSysType type, const CoordSysDef &def, const vec3d &offset) {
+    // Same as coord_sys(type, def).then(translation(offset)), without the temporaries.
+    CoordinateTransform res = coord_sys(type, def);
+    for (int i = 0; i < 3; i++)
+        res.offset[i] += offset[i];
+    return res;
 }
 
-bool CoordinateSystemConverter::debug_cmd(HashedWord *input_words) {
-    if (*input_words++ == "coord"_hash) {
-        return producer_debug_cmd(this, input_words, "ObjectPosition");
+CoordinateTransform CoordinateTransform::then(const CoordinateTransform &next) const {
+    // next(this(p)) = next.mat * (mat * p + offset) + next.offset
+    CoordinateTransform res;
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++)
+            res.mat[i*3 + j] = next.mat[i*3 + 0] * mat[j] + next.mat[i*3 + 1] * mat[3 + j] + next.mat[i*3 + 2] * mat[6 + j];
+        res.offset[i] = next.mat[i*3 + 0] * offset[0] + next.mat[i*3 + 1] * offset[1] + next.mat[i*3 + 2] * offset[2] + next.offset[i];
     }
-    return false;
+    quat_mult(next.q_rot, q_rot, res.q_rot);
+    return res;
 }
-void CoordinateSystemConverter::debug_print(PrintStream &stream) {
-    producer_debug_print(this, stream);
+
+bool CoordinateTransform::is_identity() const {
+    CoordinateTransform ident = identity();
+    return memcmp(mat, ident.mat, sizeof(mat)) == 0 && memcmp(offset, ident.offset, sizeof(offset)) == 0;
+}
+
+void CoordinateTransform::apply(const ObjectPosition &in, ObjectPosition *out) const {
+    *out = in;
+    for (int i = 0; i < vec3d_size; i++)
+        out->pos[i] = mat[i*3 + 0] * in.pos[0] + mat[i*3 + 1] * in.pos[1] + mat[i*3 + 2] * in.pos[2] + offset[i];
+
+    // Rotate covariance: mat * cov * mat^T. Translation doesn't affect it.
+    const float *c = in.pos_covariance;
+    float cov[9] = {c[0], c[1], c[2],  c[1], c[3], c[4],  c[2], c[4], c[5]};
+    float tmp[9];  // mat * cov
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            tmp[i*3 + j] = mat[i*3 + 0] * cov[0*3 + j] + mat[i*3 + 1] * cov[1*3 + j] + mat[i*3 + 2] * cov[2*3 + j];
+    static const int upper_idx[6][2] = {{0, 0}, {0, 1}, {0, 2}, {1, 1}, {1, 2}, {2, 2}};
+    for (int k = 0; k < 6; k++) {
+        int i = upper_idx[k][0], j = upper_idx[k][1];
+        out->pos_covariance[k] = tmp[i*3 + 0] * mat[j*3 + 0] + tmp[i*3 + 1] * mat[j*3 + 1] + tmp[i*3 + 2] * mat[j*3 + 2];
+    }
+
+    // Unit quaternion means there's no rotation information, so keep it that way.
+    if (in.q[0] != 1.0f)
+        quat_mult(q_rot, in.q, out->q);
 }
 
 
@@ -291,3 +444,59 @@ bool GeometryBuilderDef::parse_def(uint32_t idx, HashedWord *input_words, PrintS
     }
     return true;
 }
+
+// ======  GeoConverter  ======================================================
+// WGS84 ellipsoid parameters.
+static constexpr double wgs84_a = 6378137.0;             // Semi-major axis, meters.
+static constexpr double wgs84_e2 = 6.69437999014e-3;     // First eccentricity squared.
+
+GeoConverter::GeoConverter(const GeoOrigin &origin)
+    : origin_(origin) {
+    // Double precision is needed here as ECEF coordinates are millions of meters; it's only done once.
+    double lat = origin.lat_e7 * 1e-7 * M_PI / 180.0, lon = origin.lon_e7 * 1e-7 * M_PI / 180.0;
+    double h = origin.alt_mm * 1e-3;
+    double sin_lat = sin(lat), cos_lat = cos(lat), sin_lon = sin(lon), cos_lon = cos(lon);
+    double w = 1.0 - wgs84_e2 * sin_lat * sin_lat;
+    double prime_vertical_r = wgs84_a / sqrt(w);                   // N
+    double meridian_r = wgs84_a * (1.0 - wgs84_e2) / (w * sqrt(w));  // M
+
+    double deg_e7_per_rad = 1e7 * 180.0 / M_PI;
+    lat_e7_per_m_ = (float)(deg_e7_per_rad / (meridian_r + h));
+    // Longitude is undefined at the poles; keep the East offsets from blowing up.
+    lon_e7_per_m_ = (float)(deg_e7_per_rad / ((prime_vertical_r + h) * std::max(cos_lat, 1e-6)));
+
+    origin_ecef_cm_[0] = (int32_t)lround((prime_vertical_r + h) * cos_lat * cos_lon * 100.0);
+    origin_ecef_cm_[1] = (int32_t)lround((prime_vertical_r + h) * cos_lat * sin_lon * 100.0);
+    origin_ecef_cm_[2] = (int32_t)lround((prime_vertical_r * (1.0 - wgs84_e2) + h) * sin_lat * 100.0);
+
+    const double mat[9] = {
+        -sin_lat * cos_lon, -sin_lon, -cos_lat * cos_lon,
+        -sin_lat * sin_lon,  cos_lon, -cos_lat * sin_lon,
+         cos_lat,            0.0,     -sin_lat,
+    };
+    for (int i = 0; i < 9; i++)
+        ned_to_ecef_[i] = (float)mat[i];
+}
+
+void GeoConverter::ned_to_llh(const vec3d &ned, int32_t *lat_e7, int32_t *lon_e7, int32_t *alt_mm) const {
+    *lat_e7 = origin_.lat_e7 + (int32_t)lroundf(ned[0] * lat_e7_per_m_);
+    *alt_mm = origin_.alt_mm - (int32_t)lroundf(ned[2] * 1000.f);
+
+    // Wrap longitude around the antimeridian.
+    int64_t lon = (int64_t)origin_.lon_e7 + lroundf(ned[1] * lon_e7_per_m_);
+    if (lon > 1800000000) lon -= 3600000000LL;
+    else if (lon < -1800000000) lon += 3600000000LL;
+    *lon_e7 = (int32_t)lon;
+}
+
+void GeoConverter::rotate_ned_to_ecef(const vec3d &ned, float *ecef) const {
+    for (int i = 0; i < 3; i++)
+        ecef[i] = ned_to_ecef_[i*3+0] * ned[0] + ned_to_ecef_[i*3+1] * ned[1] + ned_to_ecef_[i*3+2] * ned[2];
+}
+
+void GeoConverter::ned_to_ecef_cm(const vec3d &ned, int32_t *ecef_cm) const {
+    float delta[3];
+    rotate_ned_to_ecef(ned, delta);
+    for (int i = 0; i < 3; i++)
+        ecef_cm[i] = origin_ecef_cm_[i] + (int32_t)lroundf(delta[i] * 100.f);
+}
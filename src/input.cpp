@@ -1,11 +1,12 @@
 #include "input.h"
 #include "message_logging.h"
+#include "binary_protocol.h"
 
 // Multiplexer method to create input node of correct type.
 // Throws exceptions on incorrect values.
-std::unique_ptr<InputNode> InputNode::create(uint32_t idx, const InputDef &def) {
+ArenaPtr<InputNode> InputNode::create(Arena &arena, uint32_t idx, const InputDef &def) {
     for (auto creator_fn : InputNode::CreatorRegistrar::iterate())
-        if (auto node = creator_fn(idx, def))
+        if (auto node = creator_fn(arena, idx, def))
             return node;
     throw_printf("Unknown/unimplemented input type: %d", def.input_type);
 }
@@ -13,7 +14,9 @@ std::unique_ptr<InputNode> InputNode::create(uint32_t idx, const InputDef &def)
 
 InputNode::InputNode(uint32_t input_idx)
     : input_idx_(input_idx)
-    , pulses_buf_() {   
+    , pulses_buf_()
+    , num_pulses_(0)
+    , num_dropped_pulses_(0) {
 }
 
 // In all types of inputs, pulses come from irq handlers. We don't want to run any other code in 
@@ -21,16 +24,24 @@ InputNode::InputNode(uint32_t input_idx)
 void InputNode::do_work(Timestamp cur_time) {
     Pulse p;
     while (pulses_buf_.dequeue(&p)) {
+        num_pulses_++;
         produce(p);
     }
 }
 
+// Pulses are enqueued in irq context, which also wakes us up.
+Timestamp InputNode::next_work_time(Timestamp cur_time) {
+    return pulses_buf_.empty() ? cur_time + max_sleep_time : cur_time;
+}
+
 void InputNode::enqueue_pulse(Timestamp start_time, TimeDelta len) {
-    pulses_buf_.enqueue({
+    bool enqueued = pulses_buf_.enqueue({
         .input_idx = input_idx_,
         .start_time = start_time,
         .pulse_len = len,
     });
+    if (!enqueued)
+        num_dropped_pulses_++;
 }
 
 bool InputNode::debug_cmd(HashedWord *input_words) {
@@ -47,6 +58,13 @@ void InputNode::debug_print(PrintStream &stream) {
     producer_debug_print<Pulse>(this, stream);
 }
 
+void InputNode::collect_telemetry(BinaryTelemetryPacket &packet) {
+    if (input_idx_ < telemetry_max_sensors) {
+        packet.sensor_pulses[input_idx_] = num_pulses_;
+        packet.sensor_pulses_dropped[input_idx_] = (uint16_t)num_dropped_pulses_;
+    }
+}
+
 
 // ====  InputDef I/O ================================
 #include "primitives/string_utils.h"
@@ -92,8 +110,8 @@ bool InputDef::parse_def(uint32_t idx, HashedWord *input_words, PrintStream &err
         if (i == kInputTypeCount) {
             err_stream.printf("Unknown input type. Supported types: 'port_irq', 'tim', 'cmp'.\n"); return false;
         }
+        input_words++;
     }
-    input_words++;
 
     if (input_type == InputType::kCMP) {
         // For comparators, also read initial threshold level.
@@ -1,7 +1,7 @@
 #include "formatters.h"
 #include <assert.h>
 #include <common/mavlink.h>
-#include "print_helpers.h"
+#include <algorithm>
 
 // Communication parameters of this system.
 mavlink_system_t mavlink_system = {
@@ -9,13 +9,24 @@ mavlink_system_t mavlink_system = {
     .compid = 1,
 };
 
-GeometryMavlinkFormatter::GeometryMavlinkFormatter(uint32_t idx, const FormatterDef &def)
-    : GeometryFormatter(idx, def)
+// Control messages (TIMESYNC replies) are sent as a separate non-data stream so that they are never dropped or
+// replaced in polling mode.
+constexpr uint32_t mavlink_control_stream_flag = 0x2000;
+
+GeometryMavlinkFormatter::GeometryMavlinkFormatter(uint32_t idx, const FormatterDef &def,
+                                                   const CoordinateTransform &transform)
+    : GeometryFormatter(idx, def, transform)
     , current_tx_seq_(0)
     , last_message_timestamp_()
     , last_pos_{0, 0, 0}
+    , last_pos_variance_{0, 0, 0}
+    , velocity_{0, 0, 0}
+    , velocity_variance_{0, 0, 0}
+    , velocity_valid_(false)
     , debug_print_state_(false)
-    , debug_late_messages_(0) {
+    , debug_late_messages_(0)
+    , debug_timesync_requests_(0)
+    , rx_len_(0) {
 
 }
 
@@ -23,8 +34,9 @@ bool GeometryMavlinkFormatter::position_valid(const ObjectPosition& g) {
     if (g.fix_level < FixLevel::kStaleFix)
         return false;
     
-    // Filter out outliers.
-    constexpr float max_position_jump = 0.05; // meters
+    // Filter out outliers. Allowed jump grows with time between positions, so that rate-limited streams still pass.
+    constexpr float max_speed = 1.5f;  // m/s
+    float max_position_jump = std::max(0.05f, max_speed * ((g.time - last_message_timestamp_) / TimeDelta(1, sec)));
     bool is_valid = false;
     if ((g.time - last_message_timestamp_) > TimeDelta(500, msec) ||
         (fabsf(g.pos[0] - last_pos_[0]) < max_position_jump &&
@@ -32,7 +44,8 @@ bool GeometryMavlinkFormatter::position_valid(const ObjectPosition& g) {
          fabsf(g.pos[2] - last_pos_[2]) < max_position_jump)) {
         is_valid = true;
     }
-    if ((g.time - last_message_timestamp_) > TimeDelta(50, ms))
+    TimeDelta late_threshold = std::max(TimeDelta(50, ms), TimeDelta(def_.rate_hz ? 1500 / def_.rate_hz : 0, ms));
+    if ((g.time - last_message_timestamp_) > late_threshold)
         debug_late_messages_++;
 
     last_message_timestamp_ = g.time;
@@ -41,34 +54,211 @@ bool GeometryMavlinkFormatter::position_valid(const ObjectPosition& g) {
     return is_valid;
 }
 
-void GeometryMavlinkFormatter::consume(const ObjectPosition& g) {
-    // Send the data to given stream. 
-    // NOTE: The sending is synchronous, i.e. it won't return before the sending completes.
-    // We might want to introduce a buffering here.
+// Estimate velocity as a difference between consecutive positions. Needs to be called before position_valid().
+void GeometryMavlinkFormatter::update_velocity(const ObjectPosition& g) {
+    constexpr TimeDelta max_velocity_dt(250, msec);  // Allows stream rates down to 4 Hz.
+    TimeDelta dt = g.time - last_message_timestamp_;
+    velocity_valid_ = g.fix_level >= FixLevel::kFullFix && TimeDelta() < dt && dt < max_velocity_dt;
+    float dt_sec = dt / TimeDelta(1, sec);
+    const float pos_variance[3] = {g.pos_covariance[0], g.pos_covariance[3], g.pos_covariance[5]};
+    for (int i = 0; i < 3; i++) {
+        if (velocity_valid_) {
+            velocity_[i] = (g.pos[i] - last_pos_[i]) / dt_sec;
+            velocity_variance_[i] = (pos_variance[i] + last_pos_variance_[i]) / (dt_sec * dt_sec);
+        }
+        last_pos_variance_[i] = pos_variance[i];
+    }
+}
+
+void GeometryMavlinkFormatter::format(const ObjectPosition& g) {
+    update_velocity(g);
 
     // First, filter out outliers.
     if (!position_valid(g))
         return;
 
-    mavlink_att_pos_mocap_t packet;
+    switch (def_.formatter_subtype) {
+        case FormatterSubtype::kPosMavlinkVision:   send_vision_position_estimate(g); break;
+        case FormatterSubtype::kPosMavlinkOdometry: send_odometry(g); break;
+        default:                                    send_att_pos_mocap(g); break;
+    }
+}
 
-    // TODO: Use our time here. Someday.
-    // Zero will be converted to the time of receive.
-    packet.time_usec = 0;
+// Fill upper triangle of 6x6 pose covariance matrix (x, y, z, roll, pitch, yaw). We only know the position part.
+static void fill_pose_covariance(const ObjectPosition& g, float *covariance) {
+    const float *c = g.pos_covariance;
+    for (int i = 0; i < 21; i++)
+        covariance[i] = 0;
+    covariance[0] = c[0]; covariance[1] = c[1]; covariance[2] = c[2];
+    covariance[6] = c[3]; covariance[7] = c[4];
+    covariance[11] = c[5];
+    if (g.q[0] == 1.0f)  // No rotation information.
+        covariance[15] = covariance[18] = covariance[20] = NAN;
+}
+
+void GeometryMavlinkFormatter::send_att_pos_mocap(const ObjectPosition& g) {
+    mavlink_att_pos_mocap_t packet;
+    packet.time_usec = g.time.get_value_64(usec);
     packet.x = g.pos[0];
     packet.y = g.pos[1];
     packet.z = g.pos[2];
     mav_array_memcpy(packet.q, g.q, sizeof(float)*4);
+#if MAVLINK_MSG_ID_ATT_POS_MOCAP_LEN > MAVLINK_MSG_ID_ATT_POS_MOCAP_MIN_LEN
+    fill_pose_covariance(g, packet.covariance);
+#endif
     send_message(MAVLINK_MSG_ID_ATT_POS_MOCAP, (const char *)&packet, g.time,
                  MAVLINK_MSG_ID_ATT_POS_MOCAP_MIN_LEN, 
                  MAVLINK_MSG_ID_ATT_POS_MOCAP_LEN, 
-                 MAVLINK_MSG_ID_ATT_POS_MOCAP_CRC);
+                 MAVLINK_MSG_ID_ATT_POS_MOCAP_CRC, node_idx_);
+}
+
+void GeometryMavlinkFormatter::send_vision_position_estimate(const ObjectPosition& g) {
+    mavlink_vision_position_estimate_t packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.usec = g.time.get_value_64(usec);
+    packet.x = g.pos[0];
+    packet.y = g.pos[1];
+    packet.z = g.pos[2];
+
+    // Convert quaternion to Euler angles.
+    const float *q = g.q;
+    packet.roll = atan2f(2 * (q[0]*q[1] + q[2]*q[3]), 1 - 2 * (q[1]*q[1] + q[2]*q[2]));
+    float sin_pitch = 2 * (q[0]*q[2] - q[3]*q[1]);
+    packet.pitch = asinf(sin_pitch > 1.f ? 1.f : sin_pitch < -1.f ? -1.f : sin_pitch);
+    packet.yaw = atan2f(2 * (q[0]*q[3] + q[1]*q[2]), 1 - 2 * (q[2]*q[2] + q[3]*q[3]));
+#if MAVLINK_MSG_ID_VISION_POSITION_ESTIMATE_LEN > MAVLINK_MSG_ID_VISION_POSITION_ESTIMATE_MIN_LEN
+    fill_pose_covariance(g, packet.covariance);
+#endif
+    send_message(MAVLINK_MSG_ID_VISION_POSITION_ESTIMATE, (const char *)&packet, g.time,
+                 MAVLINK_MSG_ID_VISION_POSITION_ESTIMATE_MIN_LEN, 
+                 MAVLINK_MSG_ID_VISION_POSITION_ESTIMATE_LEN, 
+                 MAVLINK_MSG_ID_VISION_POSITION_ESTIMATE_CRC, node_idx_);
+}
+
+void GeometryMavlinkFormatter::send_odometry(const ObjectPosition& g) {
+    static_assert(sizeof(mavlink_odometry_t) <= sizeof(tx_packet_), "ODOMETRY packet doesn't fit tx_packet_");
+    memset(tx_packet_, 0, sizeof(mavlink_odometry_t));
+    mavlink_odometry_t &packet = *reinterpret_cast<mavlink_odometry_t *>(tx_packet_);
+    packet.time_usec = g.time.get_value_64(usec);
+    packet.frame_id = def_.coord_sys_type == CoordSysType::kNED ? MAV_FRAME_LOCAL_NED : MAV_FRAME_LOCAL_FRD;
+    packet.child_frame_id = MAV_FRAME_BODY_FRD;
+    packet.x = g.pos[0];
+    packet.y = g.pos[1];
+    packet.z = g.pos[2];
+    mav_array_memcpy(packet.q, g.q, sizeof(float)*4);
+    fill_pose_covariance(g, packet.pose_covariance);
+
+    // Velocity is expressed in child (body) frame, so rotate it by inverse of q.
+    if (velocity_valid_) {
+        const float *q = g.q;
+        const float rot[9] = {  // Rotation matrix of q, body -> local.
+            1 - 2*(q[2]*q[2] + q[3]*q[3]), 2*(q[1]*q[2] - q[0]*q[3]),     2*(q[1]*q[3] + q[0]*q[2]),
+            2*(q[1]*q[2] + q[0]*q[3]),     1 - 2*(q[1]*q[1] + q[3]*q[3]), 2*(q[2]*q[3] - q[0]*q[1]),
+            2*(q[1]*q[3] - q[0]*q[2]),     2*(q[2]*q[3] + q[0]*q[1]),     1 - 2*(q[1]*q[1] + q[2]*q[2]),
+        };
+        float *vel = &packet.vx;
+        for (int i = 0; i < 3; i++)
+            vel[i] = rot[0*3+i] * velocity_[0] + rot[1*3+i] * velocity_[1] + rot[2*3+i] * velocity_[2];
+
+        // Variance is rotation-independent only approximately; use the largest one for all axes.
+        float max_variance = velocity_variance_[0];
+        for (int i = 1; i < 3; i++)
+            if (velocity_variance_[i] > max_variance)
+                max_variance = velocity_variance_[i];
+        packet.velocity_covariance[0] = packet.velocity_covariance[6] = packet.velocity_covariance[11] = max_variance;
+        packet.rollspeed = packet.pitchspeed = packet.yawspeed = NAN;
+        packet.velocity_covariance[15] = packet.velocity_covariance[18] = packet.velocity_covariance[20] = NAN;
+    } else {
+        packet.vx = packet.vy = packet.vz = NAN;
+        packet.rollspeed = packet.pitchspeed = packet.yawspeed = NAN;
+        packet.velocity_covariance[0] = NAN;  // Unknown.
+    }
+    packet.estimator_type = MAV_ESTIMATOR_TYPE_MOCAP;
+    send_message(MAVLINK_MSG_ID_ODOMETRY, (const char *)&packet, g.time,
+                 MAVLINK_MSG_ID_ODOMETRY_MIN_LEN, 
+                 MAVLINK_MSG_ID_ODOMETRY_LEN, 
+                 MAVLINK_MSG_ID_ODOMETRY_CRC, node_idx_);
+}
+
+// ======  Incoming messages  =================================================
+// We only need to answer TIMESYNC requests, so instead of full mavlink parser we just find frames and check their crc.
+void GeometryMavlinkFormatter::consume(const DataChunk &chunk) {
+    for (uint32_t i = 0; i < chunk.data.size(); i++) {
+        uint8_t c = chunk.data[i];
+        if (rx_len_ == 0 && c != MAVLINK_STX && c != MAVLINK_STX_MAVLINK1)
+            continue;  // Wait for start of the frame.
+        rx_buf_[rx_len_++] = c;
+
+        // Calculate full frame length when we know it.
+        uint32_t frame_len = max_mavlink_frame_len;
+        if (rx_buf_[0] == MAVLINK_STX && rx_len_ >= 3)
+            frame_len = MAVLINK_NUM_HEADER_BYTES + rx_buf_[1] + MAVLINK_NUM_CHECKSUM_BYTES +
+                        ((rx_buf_[2] & MAVLINK_IFLAG_SIGNED) ? MAVLINK_SIGNATURE_BLOCK_LEN : 0);
+        else if (rx_buf_[0] == MAVLINK_STX_MAVLINK1 && rx_len_ >= 2)
+            frame_len = MAVLINK_CORE_HEADER_MAVLINK1_LEN + 1 + rx_buf_[1] + MAVLINK_NUM_CHECKSUM_BYTES;
+
+        if (rx_len_ >= frame_len) {
+            process_rx_frame(chunk.time);
+            rx_len_ = 0;
+        }
+    }
+}
+
+void GeometryMavlinkFormatter::process_rx_frame(Timestamp time) {
+    bool mavlink1 = rx_buf_[0] == MAVLINK_STX_MAVLINK1;
+    uint32_t header_len = mavlink1 ? MAVLINK_CORE_HEADER_MAVLINK1_LEN : MAVLINK_CORE_HEADER_LEN;
+    uint32_t payload_len = rx_buf_[1];
+    uint32_t msgid = mavlink1 ? rx_buf_[5] : rx_buf_[7] | rx_buf_[8] << 8 | rx_buf_[9] << 16;
+    if (msgid != MAVLINK_MSG_ID_TIMESYNC || payload_len > MAVLINK_MSG_ID_TIMESYNC_LEN)
+        return;
+
+    const uint8_t *payload = &rx_buf_[header_len + 1];
+    uint16_t checksum = crc_calculate(&rx_buf_[1], header_len);
+    crc_accumulate_buffer(&checksum, (const char *)payload, payload_len);
+    crc_accumulate(MAVLINK_MSG_ID_TIMESYNC_CRC, &checksum);
+    if (payload[payload_len] != (checksum & 0xFF) || payload[payload_len + 1] != (checksum >> 8))
+        return;
+
+    // Payload can be trimmed, so zero-fill the rest.
+    mavlink_timesync_t request;
+    memset(&request, 0, sizeof(request));
+    memcpy(&request, payload, payload_len);
+    if (request.tc1 != 0)
+        return;  // This is a response to somebody else's request.
+
+    // Reply with our time of receiving the request, in nanoseconds. The autopilot will use it to estimate the
+    // offset between our clocks and convert time_usec of our messages.
+    mavlink_timesync_t reply;
+    memset(&reply, 0, sizeof(reply));
+    reply.tc1 = (int64_t)time.get_value_64(usec) * 1000;
+    reply.ts1 = request.ts1;
+    send_message(MAVLINK_MSG_ID_TIMESYNC, (const char *)&reply, time,
+                 MAVLINK_MSG_ID_TIMESYNC_MIN_LEN, 
+                 MAVLINK_MSG_ID_TIMESYNC_LEN, 
+                 MAVLINK_MSG_ID_TIMESYNC_CRC, node_idx_ | mavlink_control_stream_flag);
+    debug_timesync_requests_++;
 }
 
 // Derived from _mav_finalize_message_chan_send
 // We reimplement it here to avoid depending on channel machinery, SHA256 signatures and too large stack usage.
+// Append data to the chunk, producing it when full.
+static void append_to_chunk(Producer<DataChunk> *producer, DataChunk &chunk, const char *data, uint32_t len) {
+    while (len > 0) {
+        if (chunk.data.full()) {
+            producer->produce(chunk);
+            chunk.data.clear();
+        }
+        uint32_t write_len = std::min(len, (uint32_t)(chunk.data.max_size() - chunk.data.size()));
+        memcpy(&chunk.data[chunk.data.size()], data, write_len);
+        chunk.data.set_size(chunk.data.size() + write_len);
+        data += write_len;
+        len -= write_len;
+    }
+}
+
 void GeometryMavlinkFormatter::send_message(uint32_t msgid, const char *packet, Timestamp time, 
-                                            uint8_t min_length, uint8_t length, uint8_t crc_extra)
+                                            uint8_t min_length, uint8_t length, uint8_t crc_extra,
+                                            uint32_t stream_idx)
 {
 	char buf[MAVLINK_NUM_HEADER_BYTES];
 	char ck[2];
@@ -105,10 +295,16 @@ void GeometryMavlinkFormatter::send_message(uint32_t msgid, const char *packet,
 	ck[0] = (uint8_t)(checksum & 0xFF);
 	ck[1] = (uint8_t)(checksum >> 8);
 
-    DataChunkPrintStream printer(this, time, node_idx_, true);
-	printer.write(buf, header_len+1);
-    printer.write(packet, length);
-    printer.write(ck, 2);
+    // Write the frame directly to DataChunk-s; the output node will queue them.
+    DataChunk chunk;
+    chunk.time = time;
+    chunk.stream_idx = stream_idx;
+    chunk.last_chunk = false;
+    append_to_chunk(this, chunk, buf, header_len+1);
+    append_to_chunk(this, chunk, packet, length);
+    append_to_chunk(this, chunk, ck, 2);
+    chunk.last_chunk = true;
+    produce(chunk);
 }
 
 bool GeometryMavlinkFormatter::debug_cmd(HashedWord *input_words) {
@@ -128,6 +324,9 @@ void GeometryMavlinkFormatter::debug_print(PrintStream &stream) {
     if (debug_print_state_) {
         if (debug_late_messages_ > 0)
             stream.printf("Late Mavlink messages: %d\n", debug_late_messages_);
+        if (debug_timesync_requests_ > 0)
+            stream.printf("Mavlink TIMESYNC requests: %d\n", debug_timesync_requests_);
         debug_late_messages_ = 0;
+        debug_timesync_requests_ = 0;
     }
 }
\ No newline at end of file
@@ -12,67 +12,195 @@
 template<typename T>
 inline void print_value(PrintStream &stream, const T& val); 
 
+// Prints "<name><idx>" or just "<name>" if idx is -1.
+inline void print_name_idx(PrintStream &stream, const char *name, uint32_t idx) {
+    stream.print(name);
+    if (idx != (uint32_t)-1)
+        stream.print_uint(idx);
+}
+
 template<>
 inline void print_value<Pulse>(PrintStream &stream, const Pulse& val) {
-    stream.printf("\nsensor %d, time %dus, len %d ", val.input_idx, val.start_time.get_value(usec), val.pulse_len.get_value(usec));
+    stream.print("\nsensor ");
+    stream.print_uint(val.input_idx);
+    stream.print(", time ");
+    stream.print_int(val.start_time.get_value(usec));
+    stream.print("us, len ");
+    stream.print_int(val.pulse_len.get_value(usec));
+    stream.print(' ');
 }
 
 template<>
 inline void print_value<SensorAnglesFrame>(PrintStream &stream, const SensorAnglesFrame& val) {
-    stream.printf("\n%dms: cycle %u, fix %02d, angles ", 
-                  val.time.get_value(msec), val.cycle_idx, (int)val.fix_level / 100);
+    stream.print('\n');
+    stream.print_int(val.time.get_value(msec));
+    stream.print("ms: cycle ");
+    stream.print_uint(val.cycle_idx);
+    stream.print(", fix ");
+    stream.print_uint((int)val.fix_level / 100, 2);
+    stream.print(", angles ");
     for (uint32_t i = 0; i < val.sensors.size(); i++) {
         auto sens = val.sensors[i];
         for (int32_t phase = 0; phase < num_cycle_phases; phase++) {
             int32_t phase_delta = phase - val.phase_id;
             if (phase_delta > 0) phase_delta -= num_cycle_phases;
-            if (sens.updated_cycles[phase] == val.cycle_idx + phase_delta)
-                stream.printf("%c%.4f ", (phase == val.phase_id) ? '*' : ' ', sens.angles[phase]);
-            else
-                stream.printf(" ------ ");
+            if (sens.updated_cycles[phase] == val.cycle_idx + phase_delta) {
+                stream.print((phase == val.phase_id) ? '*' : ' ');
+                stream.print_fixed(sens.angles[phase], 4);
+                stream.print(' ');
+            } else
+                stream.print(" ------ ");
         }
     }
 }
 
 template<>
 inline void print_value<DataFrameBit>(PrintStream &stream, const DataFrameBit& val) {
-    stream.printf("\n%dms: base %d, cycle %d, bit %d ", 
-                  val.time.get_value(msec), val.base_station_idx, val.cycle_idx, val.bit);
+    stream.print('\n');
+    stream.print_int(val.time.get_value(msec));
+    stream.print("ms: base ");
+    stream.print_uint(val.base_station_idx);
+    stream.print(", cycle ");
+    stream.print_uint(val.cycle_idx);
+    stream.print(", bit ");
+    stream.print_uint(val.bit);
+    stream.print(' ');
 }
 
 template<>
 inline void print_value<DataFrame>(PrintStream &stream, const DataFrame& frame) {
-    stream.printf("\n%dms: ", frame.time.get_value(msec));
+    stream.print('\n');
+    stream.print_int(frame.time.get_value(msec));
+    stream.print("ms: ");
     const DecodedDataFrame *df = reinterpret_cast<const DecodedDataFrame *>(&frame.bytes[0]);
     if (frame.bytes.size() == 33 && df->protocol == DecodedDataFrame::cur_protocol) {
-        stream.printf("fw %u, id 0x%08x, desync %u, hw %u, accel [%d, %d, %d], mode %c, faults %u ", 
-            (uint32_t)df->fw_version, df->id, (uint32_t)df->sys_unlock_count, (uint32_t)df->hw_version, 
-            (int32_t)df->accel_dir[0], (int32_t)df->accel_dir[1], (int32_t)df->accel_dir[2],
-            df->mode_current+'A', (uint32_t)df->sys_faults);
-        for (uint32_t i = 0; i < num_base_stations; i++)
-            stream.printf("\n    fcal%d: phase %.4f, tilt %.4f, curve %.4f, gibphase %.4f, gibmag %.4f ", 
-                i, (float)df->fcal_phase[i], (float)df->fcal_tilt[i], (float)df->fcal_curve[i], (float)df->fcal_gibphase[i], (float)df->fcal_gibmag[i]);
+        stream.print("fw ");        stream.print_uint(df->fw_version);
+        stream.print(", id 0x");    stream.print_hex(df->id, 8);
+        stream.print(", desync ");  stream.print_uint(df->sys_unlock_count);
+        stream.print(", hw ");      stream.print_uint(df->hw_version);
+        stream.print(", accel [");
+        for (int i = 0; i < 3; i++) {
+            if (i > 0) stream.print(", ");
+            stream.print_int(df->accel_dir[i]);
+        }
+        stream.print("], mode ");   stream.print((char)(df->mode_current+'A'));
+        stream.print(", faults ");  stream.print_uint(df->sys_faults);
+        stream.print(' ');
+        for (uint32_t i = 0; i < num_base_stations; i++) {
+            stream.print("\n    fcal");    stream.print_uint(i);
+            stream.print(": phase ");      stream.print_fixed((float)df->fcal_phase[i], 4);
+            stream.print(", tilt ");       stream.print_fixed((float)df->fcal_tilt[i], 4);
+            stream.print(", curve ");      stream.print_fixed((float)df->fcal_curve[i], 4);
+            stream.print(", gibphase ");   stream.print_fixed((float)df->fcal_gibphase[i], 4);
+            stream.print(", gibmag ");     stream.print_fixed((float)df->fcal_gibmag[i], 4);
+            stream.print(' ');
+        }
     } else {
         // Unknown protocol.
-        stream.printf("bytes ");
-        for (uint32_t i = 0; i < frame.bytes.size(); i++)
-            stream.printf("%02X ", frame.bytes[i]);
+        stream.print("bytes ");
+        for (uint32_t i = 0; i < frame.bytes.size(); i++) {
+            stream.print_hex(frame.bytes[i], 2, true);
+            stream.print(' ');
+        }
     }
 }
 
 template<>
 inline void print_value<ObjectPosition>(PrintStream &stream, const ObjectPosition& val) {
-    stream.printf("\n%dms: fix %2d, pos %.4f %.4f %.4f, dist %.4f ", val.time.get_value(msec), 
-                                            (int)val.fix_level/100, val.pos[0], val.pos[1], val.pos[2], val.pos_delta);
-    if (val.q[0] != 1.0f)
-        stream.printf(" Q %.4f %.4f %.4f %.4f ", val.q[0], val.q[1], val.q[2], val.q[3]);
+    stream.print('\n');
+    stream.print_int(val.time.get_value(msec));
+    stream.print("ms: fix ");
+    if ((int)val.fix_level < 1000)
+        stream.print(' ');  // Padded to 2 chars.
+    stream.print_uint((int)val.fix_level/100);
+    stream.print(", pos");
+    for (int i = 0; i < 3; i++) {
+        stream.print(' ');
+        stream.print_fixed(val.pos[i], 4);
+    }
+    stream.print(", dist ");
+    stream.print_fixed(val.pos_delta, 4);
+    stream.print(' ');
+    if (val.q[0] != 1.0f) {
+        stream.print(" Q");
+        for (int i = 0; i < 4; i++) {
+            stream.print(' ');
+            stream.print_fixed(val.q[i], 4);
+        }
+        stream.print(' ');
+    }
 }
 
 template<>
 inline void print_value<DataChunk>(PrintStream &stream, const DataChunk& chunk) {
-    stream.printf("\n%dms: stream %d, data ", chunk.time.get_value(msec), chunk.stream_idx);
-    for (uint32_t i = 0; i < chunk.data.size(); i++)
-        stream.printf("%02x ", chunk.data[i]);
+    stream.print('\n');
+    stream.print_int(chunk.time.get_value(msec));
+    stream.print("ms: stream ");
+    stream.print_uint(chunk.stream_idx);
+    stream.print(", data ");
+    for (uint32_t i = 0; i < chunk.data.size(); i++) {
+        stream.print_hex(chunk.data[i], 2);
+        stream.print(' ');
+    }
+}
+
+
+// Fields of messages that logged values can be filtered by.
+enum class LogField {
+    kSensor,  // Input index of a pulse.
+    kLen,     // Pulse length, us.
+    kFix,     // FixLevel value, e.g. 800.
+    kBase,    // Base station index.
+    kStream,  // Stream index of a DataChunk.
+};
+
+// Gets a field of the message for filtering. Returns false if the message doesn't have it.
+// Specialize this function for messages that have filterable fields below.
+template<typename T>
+inline bool log_field(const T& val, LogField field, uint32_t *res) { return false; }
+
+template<>
+inline bool log_field<Pulse>(const Pulse& val, LogField field, uint32_t *res) {
+    switch (field) {
+        case LogField::kSensor: *res = val.input_idx; return true;
+        case LogField::kLen:    *res = val.pulse_len.get_value(usec); return true;
+        default: return false;
+    }
+}
+
+template<>
+inline bool log_field<SensorAnglesFrame>(const SensorAnglesFrame& val, LogField field, uint32_t *res) {
+    if (field != LogField::kFix) return false;
+    *res = (uint32_t)val.fix_level;
+    return true;
+}
+
+template<>
+inline bool log_field<ObjectPosition>(const ObjectPosition& val, LogField field, uint32_t *res) {
+    if (field != LogField::kFix) return false;
+    *res = (uint32_t)val.fix_level;
+    return true;
+}
+
+template<>
+inline bool log_field<DataFrameBit>(const DataFrameBit& val, LogField field, uint32_t *res) {
+    if (field != LogField::kBase) return false;
+    *res = val.base_station_idx;
+    return true;
+}
+
+template<>
+inline bool log_field<DataFrame>(const DataFrame& val, LogField field, uint32_t *res) {
+    if (field != LogField::kBase) return false;
+    *res = val.base_station_idx;
+    return true;
+}
+
+template<>
+inline bool log_field<DataChunk>(const DataChunk& val, LogField field, uint32_t *res) {
+    if (field != LogField::kStream) return false;
+    *res = val.stream_idx;
+    return true;
 }
 
 
@@ -82,68 +210,156 @@ public:
     virtual void print_logs(PrintStream &stream) = 0;
 };
 
+// Base class of loggers that only log values matching given conditions, and optionally only each n-th of them.
+// Filter is given after the logger type, e.g. 'sensor0 pulses show len > 50 every 10' or 'angles count fix < 200'.
+// Conditions and sampling are checked before the value is copied anywhere, so they're cheap enough to keep logging
+// enabled under load.
 template<typename T>
-class CountingProducerLogger : public PrintableProduceLogger<T> {
+class FilteringProduceLogger : public PrintableProduceLogger<T> {
+    constexpr static int kMaxConditions = 4;
 public:
-    CountingProducerLogger(const char *name, uint32_t idx): name_(name), idx_(idx), counter_(0) {}
-    virtual void log_produce(const T& val) {
-        counter_++;
+    FilteringProduceLogger(const char *name, uint32_t idx)
+        : name_(name), idx_(idx), num_matched_(0), sample_every_(1), num_conditions_(0) {}
+
+    // Parses filter words up to the end of the command. Returns false if they are invalid for this message type.
+    bool parse_filter(HashedWord *input_words) {
+        T probe = {};
+        uint32_t unused;
+        while (*input_words) {
+            if (*input_words == "every"_hash) {
+                input_words++;
+                if (!input_words->as_uint32(&sample_every_) || sample_every_ == 0)
+                    return false;
+                input_words++;
+                continue;
+            }
+
+            Condition cond;
+            switch (*input_words++) {
+                case "sensor"_hash: cond.field = LogField::kSensor; break;
+                case "len"_hash:    cond.field = LogField::kLen; break;
+                case "fix"_hash:    cond.field = LogField::kFix; break;
+                case "base"_hash:   cond.field = LogField::kBase; break;
+                case "stream"_hash: cond.field = LogField::kStream; break;
+                default: return false;
+            }
+            switch (*input_words++) {
+                case "<"_hash: cond.op = '<'; break;
+                case ">"_hash: cond.op = '>'; break;
+                case "="_hash: cond.op = '='; break;
+                default: return false;
+            }
+            if (!input_words->as_uint32(&cond.value) || !log_field(probe, cond.field, &unused) ||
+                num_conditions_ == kMaxConditions)
+                return false;
+            input_words++;
+            conditions_[num_conditions_++] = cond;
+        }
+        return true;
     }
-    virtual void print_logs(PrintStream &stream) {
-        uint32_t has_idx = idx_ != (uint32_t)-1;
-        stream.printf("%s%.*u: %d items\n", name_, has_idx, has_idx && idx_, counter_);
-        counter_ = 0;
+
+    virtual void log_produce(const T& val) final {
+        for (uint32_t i = 0; i < num_conditions_; i++) {
+            const Condition &cond = conditions_[i];
+            uint32_t field = 0;
+            log_field(val, cond.field, &field);
+            if (cond.op == '<' ? field >= cond.value : cond.op == '>' ? field <= cond.value : field != cond.value)
+                return;
+        }
+        if (num_matched_++ % sample_every_ == 0)
+            log_sample(val);
     }
-private:
+
+protected:
+    // Called for logged values: the ones matching the conditions, sampled.
+    virtual void log_sample(const T& val) = 0;
+
     const char *name_;
     uint32_t idx_;
-    uint32_t counter_;
+    uint32_t num_matched_;  // Values matching the conditions, reset on print.
+
+private:
+    struct Condition {
+        LogField field;
+        char op;  // '<', '>' or '='
+        uint32_t value;
+    };
+    uint32_t sample_every_;
+    uint32_t num_conditions_;
+    Condition conditions_[kMaxConditions];
 };
 
 template<typename T>
-class PrintingProducerLogger : public PrintableProduceLogger<T> {
-    constexpr static int kValuesToKeep = 16;
+class CountingProducerLogger : public FilteringProduceLogger<T> {
 public:
-    PrintingProducerLogger(const char *name, uint32_t idx): name_(name), idx_(idx), counter_(0) {}
-    virtual void log_produce(const T& val) {
-        if (log_.full()) 
-            log_.pop_front();  // Ensure we have space to write, we're more interested in recent values.
-        log_.enqueue(val);
-        counter_++;
+    CountingProducerLogger(const char *name, uint32_t idx): FilteringProduceLogger<T>(name, idx) {}
+    virtual void print_logs(PrintStream &stream) {
+        print_name_idx(stream, this->name_, this->idx_);
+        stream.print(": ");
+        stream.print_uint(this->num_matched_);
+        stream.print(" items\n");
+        this->num_matched_ = 0;
     }
+
+protected:
+    virtual void log_sample(const T& val) {}
+};
+
+template<typename T>
+class PrintingProducerLogger : public FilteringProduceLogger<T> {
+    constexpr static int kValuesToKeep = 16;
+public:
+    PrintingProducerLogger(const char *name, uint32_t idx): FilteringProduceLogger<T>(name, idx) {}
     virtual void print_logs(PrintStream &stream) {
         bool first = true;
-        uint32_t has_idx = idx_ != (uint32_t)-1;
-        stream.printf("%s%.*u: ", name_, has_idx, has_idx && idx_);
+        print_name_idx(stream, this->name_, this->idx_);
+        stream.print(": ");
         while (!log_.empty()) {
             if (first) {
                 first = false;
             } else {
-                stream.printf("| ");
+                stream.print("| ");
             }
             print_value(stream, log_.front());
             log_.pop_front();
         }
         if (!first) {
-            stream.printf("(%d total)\n", counter_);
-            counter_ = 0;
+            stream.print('(');
+            stream.print_uint(this->num_matched_);
+            stream.print(" total)\n");
+            this->num_matched_ = 0;
         } else {
-            stream.printf("accumulating..\n");
+            stream.print("accumulating..\n");
         }
     }
+
+protected:
+    virtual void log_sample(const T& val) {
+        if (log_.full()) 
+            log_.pop_front();  // Ensure we have space to write, we're more interested in recent values.
+        log_.enqueue(val);
+    }
+
 private:
-    const char *name_;
-    uint32_t idx_;
-    uint32_t counter_;
     CircularBuffer<T, kValuesToKeep> log_;
 };
 
 
+// Replaces the logger of the producer with a new one of given type, if the filter after it is valid.
+template<template<typename> class Logger, typename T>
+bool set_filtered_logger(Producer<T> *producer, HashedWord *filter_words, const char *name, uint32_t idx) {
+    auto logger = std::make_unique<Logger<T>>(name, idx);
+    if (!logger->parse_filter(filter_words))
+        return false;
+    producer->set_logger(std::move(logger));
+    return true;
+}
+
 template<typename T>
 bool producer_debug_cmd(Producer<T> *producer, HashedWord *input_words, const char *name, uint32_t idx = -1) {
     switch (input_words[0].hash) {
-        case static_hash("count"): producer->set_logger(std::make_unique<CountingProducerLogger<T>>(name, idx)); return true;
-        case static_hash("show"):  producer->set_logger(std::make_unique<PrintingProducerLogger<T>>(name, idx)); return true;
+        case static_hash("count"): return set_filtered_logger<CountingProducerLogger>(producer, input_words + 1, name, idx);
+        case static_hash("show"):  return set_filtered_logger<PrintingProducerLogger>(producer, input_words + 1, name, idx);
         case static_hash("off"):   producer->set_logger(nullptr); return true;
     }
     return false;
@@ -1,26 +1,325 @@
 #include "outputs.h"
+#include "message_logging.h"
+#include "binary_protocol.h"
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
 
+// Received bytes are sent to consumers when the chunk is full or after this time from the last byte.
+constexpr TimeDelta max_time_from_last_byte(1, msec);
+
+// ======  TxQueueBase  =======================================================
+void TxQueueBase::push(const DataChunk &chunk) {
+    uint32_t len = chunk.data.size();
+    uint32_t write_pos = write_idx_ % buf_size_;
+    uint32_t first_part = std::min(len, buf_size_ - write_pos);  // Bytes before the wrap around.
+    memcpy(&buf_[write_pos], &chunk.data[0], first_part);
+    memcpy(&buf_[0], &chunk.data[first_part], len - first_part);
+
+    if (!continues_message()) {
+        messages_[msg_write_idx_ % max_messages_] = Message{write_idx_, write_idx_, chunk.stream_idx, chunk.time, false};
+        msg_write_idx_++;
+    }
+    Message &msg = message(num_messages() - 1);
+    write_idx_ += len;
+    msg.end_idx = write_idx_;
+    msg.complete = chunk.last_chunk;
+    stats_.peak_size = std::max(stats_.peak_size, size());
+}
+
+bool TxQueueBase::erase(uint32_t i) {
+    Message &msg = message(i);
+    if ((int32_t)(read_idx_ - msg.start_idx) > 0)
+        return false;  // Already (partially) sent.
+
+    // Shift the bytes after the message to close the gap.
+    uint32_t len = msg.end_idx - msg.start_idx;
+    for (uint32_t idx = msg.end_idx; idx != write_idx_; idx++)
+        buf_[(idx - len) % buf_size_] = buf_[idx % buf_size_];
+    write_idx_ -= len;
+
+    // Remove the message record and shift the following ones.
+    for (uint32_t j = i; j + 1 < num_messages(); j++) {
+        message(j) = message(j + 1);
+        message(j).start_idx -= len;
+        message(j).end_idx -= len;
+    }
+    msg_write_idx_--;
+    return true;
+}
+
+void TxQueueBase::copy_from(const TxQueueBase &other) {
+    assert(buf_size_ == other.buf_size_ && max_messages_ == other.max_messages_);
+    memcpy(buf_, other.buf_, buf_size_);
+    memcpy(messages_, other.messages_, max_messages_ * sizeof(Message));
+    read_idx_ = other.read_idx_;
+    write_idx_ = other.write_idx_;
+    msg_read_idx_ = other.msg_read_idx_;
+    msg_write_idx_ = other.msg_write_idx_;
+    stats_ = other.stats_;
+}
+
+uint32_t TxQueueBase::front_bytes(const uint8_t **data) {
+    if (num_messages() == 0)
+        return 0;
+    uint32_t read_pos = read_idx_ % buf_size_;
+    *data = &buf_[read_pos];
+    return std::min(message(0).end_idx - read_idx_, buf_size_ - read_pos);
+}
+
+bool TxQueueBase::pop_sent(Message *msg) {
+    if (num_messages() == 0)
+        return false;
+    Message &front = message(0);
+    if (!front.complete || (int32_t)(read_idx_ - front.end_idx) < 0)
+        return false;
+    *msg = front;
+    msg_read_idx_++;
+    return true;
+}
+
+// ======  OutputNode  ========================================================
 OutputNode::OutputNode(uint32_t idx, const OutputDef& def)
     : node_idx_(idx)
     , def_(def)
     , chunk_{}
     , exclusive_mode_(false)
-    , exclusive_stream_idx_(0) {
+    , exclusive_stream_idx_(0)
+    , receiving_message_(false)
+    , dropping_message_(false)
+    , poll_slots_(nullptr)
+    , print_tx_stats_(false)
+    , stats_{}
+    , data_bytes_dropped_(0) {
+    for (uint32_t i = 0; i < max_num_inputs; i++) {
+        drop_policies_[i] = DropPolicy::kNeverDrop;
+        is_data_stream_[i] = false;
+    }
 }
 
-std::unique_ptr<OutputNode> OutputNode::create(uint32_t idx, const OutputDef& def) {
+void OutputNode::continue_from(const OutputNode &prev) {
+    assert(node_idx_ == prev.node_idx_);
+    data_tx_queue_.copy_from(prev.data_tx_queue_);
+    debug_tx_queue_.copy_from(prev.debug_tx_queue_);
+    receiving_message_ = prev.receiving_message_;
+    dropping_message_ = prev.dropping_message_;
+    exclusive_mode_ = prev.exclusive_mode_;
+    exclusive_stream_idx_ = prev.exclusive_stream_idx_;
+    chunk_ = prev.chunk_;  // Received bytes not sent to consumers yet.
+    data_bytes_dropped_ = prev.data_bytes_dropped_;
+    if (poll_slots_ && prev.poll_slots_)
+        for (uint32_t i = 0; i < max_num_inputs; i++)
+            poll_slots_[i] = prev.poll_slots_[i];
+}
+
+ArenaPtr<OutputNode> OutputNode::create(Arena &arena, uint32_t idx, const OutputDef& def) {
     for (auto creator_fn : OutputNode::CreatorRegistrar::iterate())
-        if (auto node = creator_fn(idx, def))
+        if (auto node = creator_fn(arena, idx, def)) {
+            if (def.polling)
+                node->allocate_poll_slots(arena);
             return node;
+        }
     throw_printf("Invalid output with index: %d", idx);
 }
 
+void OutputNode::set_drop_policy(uint32_t stream_idx, DropPolicy policy) {
+    if (stream_idx < max_num_inputs) {
+        drop_policies_[stream_idx] = policy;
+        is_data_stream_[stream_idx] = true;
+    }
+}
+
+DropPolicy OutputNode::drop_policy(uint32_t stream_idx) {
+    return stream_idx < max_num_inputs ? drop_policies_[stream_idx] : DropPolicy::kNeverDrop;
+}
+
+OutputNode::StreamStats &OutputNode::stream_stats(uint32_t stream_idx) {
+    return stats_[stream_idx < max_num_inputs && is_data_stream_[stream_idx] ? stream_idx : max_num_inputs];
+}
+
+TxQueueBase &OutputNode::tx_queue(uint32_t stream_idx) {
+    if (stream_idx < max_num_inputs && is_data_stream_[stream_idx])
+        return data_tx_queue_;
+    return debug_tx_queue_;
+}
+
+void OutputNode::drop(uint32_t stream_idx, uint32_t len) {
+    stream_stats(stream_idx).bytes_dropped += len;
+    data_bytes_dropped_ += len;
+}
+
+void OutputNode::allocate_poll_slots(Arena &arena) {
+    static_assert(std::is_trivially_destructible<PollSlot>(), "Poll slots are left in the arena without destruction");
+    poll_slots_ = static_cast<PollSlot *>(arena.allocate(sizeof(PollSlot) * max_num_inputs, alignof(PollSlot)));
+    for (uint32_t i = 0; i < max_num_inputs; i++)
+        new (&poll_slots_[i]) PollSlot();
+}
+
 void OutputNode::consume(const DataChunk &chunk) {
     if (exclusive_mode_ && exclusive_stream_idx_ != chunk.stream_idx)
         return;
-    
-    // NOTE: This will wait until we can fit data into write buffer. Can cause a delay.
-    write(&chunk.data[0], chunk.data.size());
+
+    if (poll_slots_ && chunk.stream_idx < max_num_inputs && is_data_stream_[chunk.stream_idx])
+        store_poll_chunk(chunk);
+    else
+        send_chunk(chunk);
+}
+
+void OutputNode::send_chunk(const DataChunk &chunk) {
+    uint32_t size = chunk.data.size();
+    bool continues_message = receiving_message_;
+    receiving_message_ = !chunk.last_chunk;
+    if (dropping_message_) {
+        // Beginning of this message was dropped; drop the rest too.
+        drop(chunk.stream_idx, size);
+        dropping_message_ = !chunk.last_chunk;
+        return;
+    }
+
+    // Fast path: a whole message, nothing is queued and the hardware can take it right away.
+    if (!continues_message && chunk.last_chunk && !data_tx_queue_.num_messages() && !debug_tx_queue_.num_messages()
+            && write_available() >= size) {
+        write(&chunk.data[0], size);
+        stream_stats(chunk.stream_idx).bytes_sent += size;
+        return;
+    }
+
+    TxQueueBase &queue = tx_queue(chunk.stream_idx);
+    if (!make_room(chunk, queue, chunk.time)) {
+        drop(chunk.stream_idx, size);
+        dropping_message_ = !chunk.last_chunk;
+        return;
+    }
+    queue.push(chunk);
+}
+
+// Accumulate the message in the pending buffer of the stream's slot and make it the latest when it's complete.
+void OutputNode::store_poll_chunk(const DataChunk &chunk) {
+    PollSlot &slot = poll_slots_[chunk.stream_idx];
+    if (slot.pending.empty())
+        slot.overflow = false;
+    if (slot.pending.size() + chunk.data.size() <= slot.pending.max_size()) {
+        for (uint32_t i = 0; i < chunk.data.size(); i++)
+            slot.pending.push(chunk.data[i]);
+    } else {
+        slot.overflow = true;
+    }
+
+    if (chunk.last_chunk) {
+        if (!slot.overflow) {
+            slot.latest = slot.pending;
+            slot.time = chunk.time;
+        } else {
+            drop(chunk.stream_idx, slot.pending.size() + chunk.data.size());
+        }
+        slot.pending.clear();
+    }
+}
+
+// Send the latest complete message of each data stream.
+void OutputNode::send_poll_reply() {
+    for (uint32_t stream_idx = 0; stream_idx < max_num_inputs; stream_idx++) {
+        PollSlot &slot = poll_slots_[stream_idx];
+        DataChunk chunk;
+        chunk.time = slot.time;
+        chunk.stream_idx = stream_idx;
+        for (uint32_t pos = 0; pos < slot.latest.size(); pos += max_bytes_in_data_chunk) {
+            uint32_t len = std::min(slot.latest.size() - pos, (unsigned long)max_bytes_in_data_chunk);
+            chunk.data.set_size(len);
+            memcpy(&chunk.data[0], &slot.latest[pos], len);
+            chunk.last_chunk = pos + len == slot.latest.size();
+            send_chunk(chunk);
+        }
+    }
+}
+
+// Ensure there's enough space in the queue for the chunk, dropping messages or waiting according to the policy.
+// Returns false if the chunk needs to be dropped.
+bool OutputNode::make_room(const DataChunk &chunk, TxQueueBase &queue, Timestamp cur_time) {
+    DropPolicy policy = drop_policy(chunk.stream_idx);
+    if (!queue.can_fit(chunk.data.size()))
+        queue.stats().num_full++;
+    while (!queue.can_fit(chunk.data.size())) {
+        bool freed = false;
+        switch (policy) {
+            case DropPolicy::kNeverDrop:
+                freed = send_queued(cur_time, true);
+                break;
+
+            case DropPolicy::kDropOldest:
+                // Drop oldest message of the same stream that is complete and not being sent yet.
+                for (uint32_t i = 0; i < queue.num_messages() && !freed; i++) {
+                    TxQueueBase::Message &msg = queue.message(i);
+                    if (msg.stream_idx == chunk.stream_idx && msg.complete) {
+                        uint32_t len = msg.end_idx - msg.start_idx;
+                        if ((freed = queue.erase(i)))
+                            drop(chunk.stream_idx, len);
+                    }
+                }
+                break;
+
+            case DropPolicy::kDropNewest:
+                break;
+        }
+        if (!freed) {
+            // Can't make room. Also drop the beginning of the current message, if possible.
+            if (queue.continues_message()) {
+                uint32_t last = queue.num_messages() - 1;
+                TxQueueBase::Message &msg = queue.message(last);
+                uint32_t len = msg.end_idx - msg.start_idx;
+                if (queue.erase(last))
+                    drop(chunk.stream_idx, len);
+                else
+                    msg.complete = true;  // Already being sent; leave it truncated.
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+// Choose the queue to send from: finish the message being sent, then data streams, then debug output.
+TxQueueBase *OutputNode::next_tx_queue() {
+    if (data_tx_queue_.front_started())
+        return &data_tx_queue_;
+    if (debug_tx_queue_.front_started())
+        return &debug_tx_queue_;
+    if (data_tx_queue_.size() > 0)
+        return &data_tx_queue_;
+    if (debug_tx_queue_.size() > 0)
+        return &debug_tx_queue_;
+    return nullptr;
+}
+
+// Write queued bytes to the hardware. If blocking is false, only write what the hardware can accept right away.
+// Returns true if anything was written.
+bool OutputNode::send_queued(Timestamp cur_time, bool blocking) {
+    bool written_any = false;
+    while (TxQueueBase *queue = next_tx_queue()) {
+        const uint8_t *data;
+        size_t len = queue->front_bytes(&data);
+        if (!blocking)
+            len = std::min(len, write_available());
+        if (len == 0)
+            break;  // Hardware is busy or we wait for the rest of the message being sent.
+        size_t written = write(data, len);
+        if (written == 0)
+            break;
+        queue->advance(written);
+        written_any = true;
+
+        // Update stats for the messages that were sent completely.
+        TxQueueBase::Message msg;
+        while (queue->pop_sent(&msg)) {
+            StreamStats &stats = stream_stats(msg.stream_idx);
+            stats.bytes_sent += msg.end_idx - msg.start_idx;
+            if (cur_time - msg.time > stats.peak_latency)
+                stats.peak_latency = cur_time - msg.time;
+        }
+        if (blocking)
+            break;  // Caller will call us again if needed.
+    }
+    return written_any;
 }
 
 void OutputNode::consume(const OutputCommand& cmd) {
@@ -30,18 +329,45 @@ void OutputNode::consume(const OutputCommand& cmd) {
     }
 }
 
+Timestamp OutputNode::next_work_time(Timestamp cur_time) {
+    if (data_tx_queue_.num_messages() || debug_tx_queue_.num_messages() || read_available())
+        return cur_time;
+    if (!chunk_.data.empty())
+        return chunk_.time + max_time_from_last_byte + TimeDelta(1, usec);
+    return cur_time + max_sleep_time;
+}
+
 void OutputNode::do_work(Timestamp cur_time) {
-    // Accumulate bytes read from the stream_ in the chunk_.
+    // Send queued data as the hardware accepts it.
+    send_queued(cur_time, false);
+
+    // Read available bytes from the stream_ directly into the chunk_.
+    bool poll_requested = false;
     while (!chunk_.data.full()) {
-        int c = read();
-        if (c < 0)
+        uint32_t old_size = chunk_.data.size();
+        uint8_t *data = &chunk_.data[old_size];
+        uint32_t len = read(data, chunk_.data.max_size() - old_size);
+        if (len == 0)
             break;
-        chunk_.time = cur_time;  // Store the time of the last byte read.
-        chunk_.data.push(c);
+        if (poll_slots_) {
+            // Remove poll requests from the received data.
+            uint32_t kept = 0;
+            for (uint32_t i = 0; i < len; i++) {
+                if (data[i] == poll_request_byte)
+                    poll_requested = true;
+                else
+                    data[kept++] = data[i];
+            }
+            len = kept;
+        }
+        if (len > 0)
+            chunk_.time = cur_time;  // Store the time of the last byte read.
+        chunk_.data.set_size(old_size + len);
     }
+    if (poll_requested)
+        send_poll_reply();
 
     // Send chunk if data is full or time from last byte is over given threshold.
-    constexpr TimeDelta max_time_from_last_byte(1, msec);
     if (chunk_.data.full() || (!chunk_.data.empty() && cur_time - chunk_.time > max_time_from_last_byte)) {
         chunk_.last_chunk = !chunk_.data.full();
         chunk_.stream_idx = node_idx_;
@@ -51,21 +377,68 @@ void OutputNode::do_work(Timestamp cur_time) {
 }
 
 
+bool OutputNode::debug_cmd(HashedWord *input_words) {
+    if (*input_words == "output#"_hash && input_words->idx == node_idx_) {
+        input_words++;
+        switch (*input_words) {
+            case "tx"_hash: print_tx_stats_ = true; return true;
+            case "off"_hash: print_tx_stats_ = false; break;  // Also turn off the logger below.
+        }
+        return producer_debug_cmd(this, input_words, "DataChunk", node_idx_);
+    }
+    return false;
+}
+
+void OutputNode::debug_print(PrintStream &stream) {
+    producer_debug_print(this, stream);
+    if (print_tx_stats_) {
+        TxQueueBase::Stats &data_stats = data_tx_queue_.stats(), &debug_stats = debug_tx_queue_.stats();
+        stream.printf("Output%d: in queue %u data bytes (peak %u, full %u times), %u debug bytes (peak %u, full %u times)\n",
+            node_idx_, data_tx_queue_.size(), data_stats.peak_size, data_stats.num_full,
+            debug_tx_queue_.size(), debug_stats.peak_size, debug_stats.num_full);
+        data_stats = debug_stats = TxQueueBase::Stats{};
+        for (uint32_t i = 0; i <= max_num_inputs; i++) {
+            StreamStats &stats = stats_[i];
+            if (!stats.bytes_sent && !stats.bytes_dropped)
+                continue;
+            if (i < max_num_inputs)
+                stream.printf("  stream%d", i);
+            else
+                stream.printf("  debug");
+            stream.printf(": sent %u bytes, dropped %u bytes, peak latency %dms\n", 
+                stats.bytes_sent, stats.bytes_dropped, stats.peak_latency.get_value(msec));
+            stats = StreamStats{};
+        }
+    }
+}
+
+void OutputNode::collect_telemetry(BinaryTelemetryPacket &packet) {
+    if (node_idx_ < telemetry_max_outputs) {
+        uint32_t queued = data_tx_queue_.size() + debug_tx_queue_.size();
+        packet.output_queue_bytes[node_idx_] = queued < 0xFFFF ? (uint16_t)queued : 0xFFFF;
+        packet.output_bytes_dropped[node_idx_] = data_bytes_dropped_;
+    }
+}
 
 // ======  OutputDef I/O  =====================================================
 
+// Format: usb_serial [off|poll]
+//         serial<idx> <bitrate> [poll]
 void OutputDef::print_def(uint32_t idx, PrintStream &stream) {
     if (idx == 0 && !active) {
         stream.printf("usb_serial off\n");
+    } else if (idx == 0 && polling) {
+        stream.printf("usb_serial poll\n");
     } else if (idx != 0 && active) {
-        stream.printf("serial%d %d\n", idx, bitrate);
+        stream.printf("serial%d %d%s\n", idx, bitrate, polling ? " poll" : "");
     }
 }
 
 bool OutputDef::parse_def(uint32_t idx, HashedWord *input_words, PrintStream &err_stream) {
     if (idx == 0 || idx == (uint32_t)-1) {
-        // usb_serial: do nothing unless turned off.
+        // usb_serial: do nothing unless turned off or switched to polling mode.
         active = (*input_words != "off"_hash);
+        polling = (*input_words == "poll"_hash);
         return true;
     } else if (idx < num_outputs) {
         // hardware serial
@@ -74,6 +447,8 @@ bool OutputDef::parse_def(uint32_t idx, HashedWord *input_words, PrintStream &er
             err_stream.printf("Invalid bitrate: %d. Needs to be in 300-115200 range.\n", bitrate);
             return false;
         }
+        input_words++;
+        polling = (*input_words == "poll"_hash);
         return true;            
     }
     return false;
@@ -0,0 +1,76 @@
+#include "primitives/arena.h"
+
+std::atomic<size_t> Arena::total_reserved_(0);
+std::atomic<size_t> Arena::peak_total_reserved_(0);
+
+Arena::Arena(size_t block_size)
+    : block_size_(block_size)
+    , blocks_(nullptr)
+    , cur_(0)
+    , end_(0)
+    , bytes_used_(0)
+    , bytes_reserved_(0)
+    , num_blocks_(0) {
+}
+
+Arena::~Arena() {
+    while (Block *block = blocks_) {
+        blocks_ = block->next;
+        ::operator delete(block);
+    }
+    total_reserved_.fetch_sub(bytes_reserved_, std::memory_order_relaxed);
+}
+
+Arena::Block *Arena::add_block(size_t size) {
+    size_t alloc_size = sizeof(Block) + size;
+    Block *block = static_cast<Block *>(::operator new(alloc_size));
+    block->size = size;
+    bytes_reserved_ += alloc_size;
+    num_blocks_++;
+    size_t total = total_reserved_.fetch_add(alloc_size, std::memory_order_relaxed) + alloc_size;
+    size_t peak = peak_total_reserved_.load(std::memory_order_relaxed);
+    while (total > peak && !peak_total_reserved_.compare_exchange_weak(peak, total, std::memory_order_relaxed)) {}
+    return block;
+}
+
+void *Arena::allocate(size_t size, size_t align) {
+    if (size > block_size_ / 2) {
+        // Dedicated block, linked after the current one so that its free space isn't lost.
+        Block *block = add_block(size + align);
+        if (blocks_) {
+            block->next = blocks_->next;
+            blocks_->next = block;
+        } else {
+            block->next = nullptr;
+            blocks_ = block;
+            cur_ = end_ = reinterpret_cast<uintptr_t>(block + 1) + block->size;
+        }
+        uintptr_t start = reinterpret_cast<uintptr_t>(block + 1);
+        uintptr_t pos = (start + align - 1) & ~(uintptr_t)(align - 1);
+        bytes_used_ += pos + size - start;
+        return reinterpret_cast<void *>(pos);
+    }
+
+    uintptr_t pos = (cur_ + align - 1) & ~(uintptr_t)(align - 1);
+    if (!blocks_ || pos + size > end_) {
+        Block *block = add_block(block_size_);
+        block->next = blocks_;
+        blocks_ = block;
+        cur_ = reinterpret_cast<uintptr_t>(block + 1);
+        end_ = cur_ + block->size;
+        pos = (cur_ + align - 1) & ~(uintptr_t)(align - 1);
+    }
+    bytes_used_ += pos + size - cur_;
+    cur_ = pos + size;
+    return reinterpret_cast<void *>(pos);
+}
+
+bool Arena::contains(const void *ptr) const {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(ptr);
+    for (const Block *block = blocks_; block; block = block->next) {
+        uintptr_t start = reinterpret_cast<uintptr_t>(block + 1);
+        if (addr >= start && addr < start + block->size)
+            return true;
+    }
+    return false;
+}
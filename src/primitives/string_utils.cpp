@@ -3,10 +3,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
 #include <utility>
 
+// Static scratch buffers are per thread on hosts, where several pipelines can run at once (see tools/analyzer).
+#ifdef __arm__
+#define SCRATCH_BUFFER static
+#else
+#define SCRATCH_BUFFER static thread_local
+#endif
+
 int PrintStream::printf(const char *format, ...) {
-    static char printf_buf[256];
+    SCRATCH_BUFFER char printf_buf[256];
     va_list args;
     va_start(args, format);
     int len = vsnprintf(printf_buf, sizeof(printf_buf), format, args);
@@ -16,9 +24,117 @@ int PrintStream::printf(const char *format, ...) {
     return len;
 }
 
+void PrintStream::print(const char *str) {
+    write(str, strlen(str));
+}
+
+void PrintStream::print_uint(uint32_t val, uint32_t min_digits) {
+    char buf[max_formatted_number_len];
+    write(buf, format_uint(buf, val, min_digits) - buf);
+}
+
+void PrintStream::print_int(int32_t val) {
+    char buf[max_formatted_number_len];
+    write(buf, format_int(buf, val) - buf);
+}
+
+void PrintStream::print_hex(uint32_t val, uint32_t min_digits, bool uppercase) {
+    char buf[max_formatted_number_len];
+    write(buf, format_hex(buf, val, min_digits, uppercase) - buf);
+}
+
+void PrintStream::print_fixed(float val, uint32_t decimals) {
+    char buf[max_formatted_number_len];
+    write(buf, format_fixed(buf, val, decimals) - buf);
+}
+
+// ======  Number formatting  =================================================
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+char *format_uint(char *buf, uint32_t val, uint32_t min_digits) {
+    // Write digits backwards into a temp buffer, two at a time, then copy them out.
+    char tmp[10];
+    char *p = tmp + sizeof(tmp);
+    while (val >= 100) {
+        uint32_t pair = (val % 100) * 2;
+        val /= 100;
+        *--p = digit_pairs[pair + 1];
+        *--p = digit_pairs[pair];
+    }
+    if (val >= 10) {
+        *--p = digit_pairs[val * 2 + 1];
+        *--p = digit_pairs[val * 2];
+    } else {
+        *--p = '0' + val;
+    }
+    uint32_t len = tmp + sizeof(tmp) - p;
+    if (min_digits > max_formatted_number_len / 2)
+        min_digits = max_formatted_number_len / 2;
+    for (; len < min_digits; min_digits--)
+        *buf++ = '0';
+    memcpy(buf, p, len);
+    return buf + len;
+}
+
+char *format_int(char *buf, int32_t val) {
+    if (val < 0) {
+        *buf++ = '-';
+        return format_uint(buf, 0u - (uint32_t)val);
+    }
+    return format_uint(buf, val);
+}
+
+char *format_hex(char *buf, uint32_t val, uint32_t min_digits, bool uppercase) {
+    const char *hex_digits = uppercase ? "0123456789ABCDEF" : "0123456789abcdef";
+    uint32_t len = 1;
+    while (len < 8 && (val >> (len * 4)))
+        len++;
+    if (len < min_digits)
+        len = min_digits < 8 ? min_digits : 8;
+    for (uint32_t i = len; i > 0; i--)
+        *buf++ = hex_digits[(val >> ((i - 1) * 4)) & 0xF];
+    return buf;
+}
+
+char *format_fixed(char *buf, float val, uint32_t decimals) {
+    static const uint32_t powers_of_10[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+    if (decimals > 6)
+        decimals = 6;
+    if (val != val) {  // NaN
+        memcpy(buf, "nan", 3);
+        return buf + 3;
+    }
+    if (val < 0.f) {
+        *buf++ = '-';
+        val = -val;
+    }
+    if (!(val < 4294967296.f)) {  // Also catches infinity.
+        memcpy(buf, "ovf", 3);
+        return buf + 3;
+    }
+
+    // Split into integer and fractional parts first to keep the precision of float.
+    uint32_t int_part = (uint32_t)val;
+    uint32_t scale = powers_of_10[decimals];
+    uint32_t frac_part = (uint32_t)((val - (float)int_part) * (float)scale + 0.5f);
+    if (frac_part >= scale) {  // Rounding carried over to the integer part.
+        frac_part -= scale;
+        int_part++;
+    }
+    buf = format_uint(buf, int_part);
+    if (decimals > 0) {
+        *buf++ = '.';
+        buf = format_uint(buf, frac_part, decimals);
+    }
+    return buf;
+}
+
 // Parses provided string to null-terminated array of trimmed strings.
 char **parse_words(char *str) {
-    static char *words[max_words+1];
+    SCRATCH_BUFFER char *words[max_words+1];
     int i = 0;
     char *word;
     while ((word = next_word(&str)) && i < max_words) {
@@ -69,6 +185,14 @@ bool parse_float(const char *str, float *res) {
     return (*endparse == 0);
 }
 
+bool parse_double(const char *str, double *res) {
+    if (!str || *str == 0)
+        return false;
+    char *endparse;
+    *res = strtod(str, &endparse);
+    return (*endparse == 0);
+}
+
 // Returns true if the word is suffixed by a valid number.
 bool suffixed_by_int(char *word, char **first_digit, uint32_t *value) {
     char *p = word + strlen(word); // \0 char after the word.
@@ -80,7 +204,7 @@ bool suffixed_by_int(char *word, char **first_digit, uint32_t *value) {
 
 // Return a static, zero-terminated array of hashes of provided words.
 HashedWord *hash_words(char *str) {
-    static HashedWord hashes[max_words+1];
+    SCRATCH_BUFFER HashedWord hashes[max_words+1];
     uint32_t i = 0;
     for (char *cur_word; (cur_word = next_word(&str)) && i < max_words; i++) {
         if (cur_word[0] == '#') break;  // Comment.
@@ -105,7 +229,7 @@ HashedWord *hash_words(char *str) {
 // Throws custom exception with a printf-formatted string. Uses static buffer to avoid mem allocation
 // and std::string-related errors.
 [[noreturn]] void throw_printf(const char* format, ...) {
-    static char throw_printf_message[128];
+    SCRATCH_BUFFER char throw_printf_message[128];
     va_list args;
     va_start(args, format);
     vsnprintf(throw_printf_message, sizeof(throw_printf_message), format, args);
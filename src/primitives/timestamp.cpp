@@ -19,3 +19,37 @@ uint32_t Timestamp::get_value(TimeUnit tu) const {
     }
     return cur_time_in_tu + delta_in_tu;
 }
+
+uint64_t MillisWrapCounter::extend(uint32_t millis) {
+    uint32_t quarter = millis >> 30;
+    uint32_t state = state_.load(std::memory_order_relaxed);
+    while (true) {
+        uint32_t wraps = state >> 3, prev_quarter = state & 3;
+        if (state & seen_flag) {
+            switch ((quarter - prev_quarter) & 3) {
+                case 0:  // Same quarter, nothing changed.
+                    return (uint64_t)wraps << 32 | millis;
+                case 3:  // Stale value from before the latest one; it might be from before the wrap too.
+                    return (uint64_t)(wraps - (quarter > prev_quarter)) << 32 | millis;
+            }
+        }
+
+        // First value, or moved forward, possibly over the wrap.
+        uint32_t new_wraps = wraps + ((state & seen_flag) && quarter < prev_quarter);
+        if (state_.compare_exchange_weak(state, new_wraps << 3 | seen_flag | quarter, std::memory_order_relaxed))
+            return (uint64_t)new_wraps << 32 | millis;
+    }
+}
+
+static MillisWrapCounter millis_wrap_counter;
+
+uint64_t Timestamp::cur_time_millis_64() {
+    return millis_wrap_counter.extend(Timestamp::cur_time_millis());
+}
+
+uint64_t Timestamp::get_value_64(TimeUnit tu) const {
+    uint64_t cur_millis_64 = Timestamp::cur_time_millis_64();
+    Timestamp ts_cur_millis((uint32_t)cur_millis_64 * msec);
+    int32_t delta_in_tu = (*this - ts_cur_millis).get_value(tu);
+    return cur_millis_64 * msec / tu + delta_in_tu;
+}
@@ -1,5 +1,6 @@
 #include "pulse_processor.h"
 #include "message_logging.h"
+#include "binary_protocol.h"
 #include <math.h>
 
 // Pulse classification parameters.
@@ -16,6 +17,11 @@ constexpr TimeDelta short_pulse_min_time = angle_center_len - cycle_period / 3;
 constexpr TimeDelta short_pulse_max_time = angle_center_len + cycle_period / 3;
 constexpr TimeDelta cycle_processing_point = short_pulse_max_time + TimeDelta(100, usec); // time from start of the cycle.
 
+// Angle jitter estimation parameters.
+constexpr float default_angle_variance = 1.5e-4f * 1.5e-4f;  // ~1 timer tick of jitter.
+constexpr float min_angle_variance = 1e-5f * 1e-5f;
+constexpr float angle_variance_smoothing = 1.0f / 16;  // Exponential moving average factor.
+
 enum CycleFixLevels {  // Unscoped enum because we use it more like set of constants.
     kCycleFixNone = 0,
     kCycleFixCandidate = 1,  // From here we have a valid cycle_start_time_
@@ -32,10 +38,14 @@ PulseProcessor::PulseProcessor(uint32_t num_inputs)
     , unclassified_long_pulses_{}
     , phase_classifier_{}
     , angles_frame_{}
+    , angle_history_{}
     , time_from_last_long_pulse_(0, usec)
     , debug_print_state_(false) {
     angles_frame_.sensors.set_size(num_inputs);
     angles_frame_.phase_id = -1;
+    for (uint32_t i = 0; i < num_inputs; i++)
+        for (int j = 0; j < num_cycle_phases; j++)
+            angles_frame_.sensors[i].angle_variances[j] = default_angle_variance;
 }
 
 void PulseProcessor::consume(const Pulse& p) {
@@ -93,7 +103,7 @@ void PulseProcessor::process_short_pulse(const Pulse &p) {
     }
 }
 
-void PulseProcessor::process_cycle_fix(Timestamp cur_time) {
+bool PulseProcessor::process_cycle_fix(Timestamp cur_time) {
     TimeDelta pulse_start_corrections[num_base_stations] = {}, pulse_lens[num_base_stations] = {};
 
     // Check if we have long pulses from at least one base station.
@@ -162,27 +172,49 @@ void PulseProcessor::process_cycle_fix(Timestamp cur_time) {
 
         // Calculate the angles for inputs where we saw short pulses.
         for (uint32_t i = 0; i < num_inputs_; i++) 
-            if (short_pulses[i]) {
-                SensorAngles &angles = angles_frame_.sensors[i];
-                angles.angles[cycle_phase] = (short_pulse_timings[i] - angle_center_len) / cycle_period * (float)M_PI;
-                angles.updated_cycles[cycle_phase] = cycle_idx_;
-            }
+            if (short_pulses[i])
+                update_angle(i, cycle_phase, (short_pulse_timings[i] - angle_center_len) / cycle_period * (float)M_PI);
     }
 
     // Send the data down the pipeline every 4th cycle (30Hz). Can be increased to 120Hz if needed.
-    if ((cycle_phase >= 0) ? (cycle_phase == 3) : (cycle_idx_ % 4 == 0)) {
+    bool send_frame = (cycle_phase >= 0) ? (cycle_phase == 3) : (cycle_idx_ % 4 == 0);
+    if (send_frame) {
         angles_frame_.time = cycle_start_time_;
         angles_frame_.fix_level = (cycle_phase >= 0 && cycle_fix_level_ >= kCycleFixAcquired)
                                         ? FixLevel::kCycleSynced : FixLevel::kCycleSyncing;
         angles_frame_.cycle_idx = cycle_idx_;
         angles_frame_.phase_id = cycle_phase;
-        Producer<SensorAnglesFrame>::produce(angles_frame_);
     }
     
     // Prepare for the next cycle.
     reset_cycle_pulses();
     cycle_start_time_ += cycle_period + pulse_start_corrections[0];
     cycle_idx_++;
+    return send_frame;
+}
+
+void PulseProcessor::update_angle(uint32_t input_idx, int cycle_phase, float angle) {
+    SensorAngles &angles = angles_frame_.sensors[input_idx];
+    AngleHistory &history = angle_history_[input_idx][cycle_phase];
+
+    // Estimate angle jitter from the second difference of consecutive angles. This cancels out linear motion and
+    // for white noise its variance is 6 times the angle variance.
+    if (angles.updated_cycles[cycle_phase] + num_cycle_phases != cycle_idx_)
+        history.len = 0;  // Missed a cycle; restart the history.
+    if (history.len == 2) {
+        float d2 = angle - 2 * history.prev[0] + history.prev[1];
+        float &variance = angles.angle_variances[cycle_phase];
+        variance += (d2 * d2 / 6 - variance) * angle_variance_smoothing;
+        if (variance < min_angle_variance)
+            variance = min_angle_variance;
+    }
+    history.prev[1] = history.prev[0];
+    history.prev[0] = angle;
+    if (history.len < 2)
+        history.len++;
+
+    angles.angles[cycle_phase] = angle;
+    angles.updated_cycles[cycle_phase] = cycle_idx_;
 }
 
 void PulseProcessor::reset_cycle_pulses() {
@@ -193,9 +225,15 @@ void PulseProcessor::reset_cycle_pulses() {
 }
 
 void PulseProcessor::do_work(Timestamp cur_time) {
+    if (const SensorAnglesFrame *frame = process_time(cur_time))
+        Producer<SensorAnglesFrame>::produce(*frame);
+}
+
+const SensorAnglesFrame *PulseProcessor::process_time(Timestamp cur_time) {
     if (cycle_fix_level_ >= kCycleFixCandidate) {
         if (cur_time - cycle_start_time_ > cycle_processing_point) {
-            process_cycle_fix(cur_time);
+            if (process_cycle_fix(cur_time))
+                return &angles_frame_;
         }
     } else {  // No fix.
         if (throttle_ms(TimeDelta(1000, ms), cur_time, &cycle_start_time_)) {
@@ -204,9 +242,16 @@ void PulseProcessor::do_work(Timestamp cur_time) {
             angles_frame_.fix_level = FixLevel::kNoSignals;
             angles_frame_.cycle_idx = 0;
             angles_frame_.phase_id = 0;
-            Producer<SensorAnglesFrame>::produce(angles_frame_);
+            return &angles_frame_;
         }
     }
+    return nullptr;
+}
+
+Timestamp PulseProcessor::next_work_time(Timestamp cur_time) {
+    if (cycle_fix_level_ >= kCycleFixCandidate)
+        return cycle_start_time_ + cycle_processing_point + TimeDelta(1, usec);
+    return cycle_start_time_ + TimeDelta(1000, ms);
 }
 
 bool PulseProcessor::debug_cmd(HashedWord *input_words) {
@@ -222,6 +267,12 @@ bool PulseProcessor::debug_cmd(HashedWord *input_words) {
     return false;
 }
 
+void PulseProcessor::collect_telemetry(BinaryTelemetryPacket &packet) {
+    packet.cycle_fix_level = (uint16_t)cycle_fix_level_;
+    packet.cycle_idx = cycle_idx_;
+    phase_classifier_.collect_telemetry(packet);
+}
+
 void PulseProcessor::debug_print(PrintStream &stream) {
     phase_classifier_.debug_print(stream);
     producer_debug_print<SensorAnglesFrame>(this, stream);
@@ -230,6 +281,13 @@ void PulseProcessor::debug_print(PrintStream &stream) {
         stream.printf("PulseProcessor: fix %d, cycle id %d, num pulses %d %d %d %d, time from last pulse %d\n", 
             cycle_fix_level_, cycle_idx_, cycle_long_pulses_[0].size(), cycle_long_pulses_[1].size(), 
             cycle_short_pulses_.size(), unclassified_long_pulses_.size(), time_from_last_long_pulse_.get_value(usec));
+        for (uint32_t i = 0; i < num_inputs_; i++) {
+            const SensorAngles &angles = angles_frame_.sensors[i];
+            stream.printf("  sensor %d angle jitter, urad:", i);
+            for (int j = 0; j < num_cycle_phases; j++)
+                stream.printf(" %d", (int)(sqrtf(angles.angle_variances[j]) * 1e6f));
+            stream.printf("\n");
+        }
     }
 }
 
@@ -0,0 +1,22 @@
+#include "pulse_trace.h"
+#include <stdlib.h>
+
+TraceLineType parse_trace_line(const char *line, TracePulse *pulse) {
+    while (*line == ' ' || *line == '\t')
+        line++;
+    if (*line == '#' || *line == 0 || *line == '\r' || *line == '\n')
+        return TraceLineType::kComment;
+
+    char *end;
+    pulse->pin = strtoul(line, &end, 10);
+    const char *start = end;
+    pulse->start_us = strtoul(start, &end, 10);
+    pulse->start_frac = 0;
+    if (*end == '.')
+        pulse->start_frac = strtof(end, &end);
+    const char *len_str = end;
+    pulse->len_us = strtof(len_str, &end);
+    if (start == line || len_str == start || end == len_str || pulse->len_us < 0 || pulse->len_us > 100000)
+        return TraceLineType::kInvalid;
+    return TraceLineType::kPulse;
+}
@@ -4,11 +4,93 @@
 #include "vive_sensors_pipeline.h"
 #include "led_state.h"
 #include "print_helpers.h"
+#include <stddef.h>
 
-constexpr uint32_t current_settings_version = 0xbabe0000 + sizeof(PersistentSettings);
-constexpr uint32_t initial_eeprom_addr = 0;
+// Settings are stored as one SettingsStorage record per definition, plus a header record with the number of
+// definitions of each kind. Records only change when their definition does, so a 'write' after editing a single
+// sensor rewrites just that sensor (and nothing if nothing changed).
+// Layout versions: definition structs must only be extended by appending fields. Records with an older version are
+// then read into the prefix of the current struct, with new fields zeroed. Increase settings_record_version with each
+// change, and convert the payload in read_record() if appending isn't enough.
+constexpr uint8_t settings_record_version = 1;
 
-static_assert(sizeof(PersistentSettings) < 1500, "PersistentSettings must fit into EEPROM with some leeway");
+enum SettingsRecordType : uint8_t {
+    kHeaderRecord = 0,
+    kInputRecord,
+    kBaseStationRecord,
+    kGeoBuilderRecord,
+    kFormatterRecord,
+    kOutputRecord,
+};
+
+struct SettingsHeaderRecord {
+    uint8_t is_configured;
+    uint8_t num_inputs, num_base_stations, num_geo_builders, num_formatters, num_outputs;
+};
+
+// Pre-records format: version word at address 0 followed by the raw PersistentSettings block, as laid out by the
+// last firmware that used it. This layout is frozen here; don't change it together with the definition structs.
+namespace legacy {
+struct InputDef {
+    uint32_t pin;
+    bool pulse_polarity;
+    InputType input_type;
+    uint32_t initial_cmp_threshold;
+};
+struct BaseStationGeometryDef {
+    float mat[9];
+    vec3d origin;
+};
+struct SensorLocalGeometry {
+    uint32_t input_idx;
+    vec3d pos;
+};
+struct GeometryBuilderDef {
+    unsigned long sensors_size;  // Vector<> layout: size, then elements.
+    SensorLocalGeometry sensors[4];
+};
+struct FormatterDef {
+    FormatterType formatter_type;
+    FormatterSubtype formatter_subtype;
+    uint32_t input_idx;
+    uint32_t output_idx;
+    CoordSysType coord_sys_type;
+    CoordSysDef coord_sys_params;
+};
+struct OutputDef {
+    bool active;
+    uint32_t bitrate;
+};
+struct PersistentSettings {
+    bool is_configured;
+    unsigned long inputs_size;
+    InputDef inputs[max_num_inputs];
+    unsigned long base_stations_size;
+    BaseStationGeometryDef base_stations[num_base_stations];
+    unsigned long geo_builders_size;
+    GeometryBuilderDef geo_builders[max_num_inputs];
+    unsigned long formatters_size;
+    FormatterDef formatters[max_num_inputs];
+    unsigned long outputs_size;
+    OutputDef outputs[num_outputs];
+};
+}  // namespace legacy
+
+constexpr uint32_t legacy_settings_version = 0xbabe0000 + sizeof(legacy::PersistentSettings);
+constexpr uint32_t legacy_eeprom_addr = 0;
+
+static_assert(sizeof(InputDef) <= settings_max_payload && sizeof(BaseStationGeometryDef) <= settings_max_payload &&
+              sizeof(GeometryBuilderDef) <= settings_max_payload && sizeof(FormatterDef) <= settings_max_payload &&
+              sizeof(OutputDef) <= settings_max_payload, "Each definition must fit into a settings record");
+
+// Records of maximal settings, with their headers, must always be rewritable.
+template<typename T>
+constexpr uint32_t records_size(uint32_t count) { return count * (settings_record_header_size + sizeof(T)); }
+constexpr uint32_t max_settings_size =
+    records_size<SettingsHeaderRecord>(1) + records_size<InputDef>(max_num_inputs) +
+    records_size<BaseStationGeometryDef>(num_base_stations) + records_size<GeometryBuilderDef>(max_num_inputs) +
+    records_size<FormatterDef>(max_num_inputs) + records_size<OutputDef>(num_outputs);
+static_assert(max_settings_size <= settings_capacity, "Maximal settings must fit into settings storage");
 static_assert(std::is_trivially_copyable<PersistentSettings>(), "All definitions must be trivially copyable to be bitwise-stored");
 
 /* Example settings
@@ -24,50 +106,230 @@ serial1 57600
 stream2 mavlink object0 ned 110 > serial1
 */
 
-PersistentSettings settings;
-
 PersistentSettings::PersistentSettings() {
     reset();
     read_from_eeprom();
 }
 
+static bool read_record(SettingsStorage &storage, uint8_t type, uint8_t idx, void *dest, uint32_t size) {
+    uint8_t version;
+    memset(dest, 0, size);
+    int32_t len = storage.read(type, idx, &version, dest, size);
+    return len >= 0 && version <= settings_record_version;
+}
+
+template<typename T, unsigned arr_len>
+static bool read_records(SettingsStorage &storage, uint8_t type, uint32_t count, Vector<T, arr_len> &arr) {
+    if (count > arr_len)
+        return false;
+    arr.set_size(count);
+    for (uint32_t i = 0; i < count; i++)
+        if (!read_record(storage, type, i, &arr[i], sizeof(T)))
+            return false;
+    return true;
+}
+
+template<typename T, unsigned arr_len>
+static bool write_records(SettingsStorage &storage, uint8_t type, const Vector<T, arr_len> &arr) {
+    for (uint32_t i = 0; i < arr.size(); i++)
+        if (!storage.write(type, i, settings_record_version, &arr[i], sizeof(T)))
+            return false;
+    storage.forget(type, arr.size());
+    return true;
+}
+
+// Definitions are read in place. If any of them can't be read, settings are reset instead of being left half-read.
 bool PersistentSettings::read_from_eeprom() {
-    uint32_t eeprom_addr = initial_eeprom_addr, version;
-    eeprom_read(eeprom_addr, &version, sizeof(version)); eeprom_addr += sizeof(version);
-    if (version == current_settings_version) {
-        // Normal initialization: Just copy block of data.
-        eeprom_read(eeprom_addr, this, sizeof(*this));
+    if (!storage_.load()) {
+        // Nothing stored in records yet: convert settings written by previous firmware, if any.
+        if (!read_legacy_settings())
+            return false;
+        write_to_eeprom();
         return true;
-    } 
-    // Unknown version.
-    return false;
+    }
+
+    SettingsHeaderRecord header;
+    bool valid = read_record(storage_, kHeaderRecord, 0, &header, sizeof(header)) &&
+        read_records(storage_, kInputRecord, header.num_inputs, inputs_) &&
+        read_records(storage_, kBaseStationRecord, header.num_base_stations, base_stations_) &&
+        read_records(storage_, kGeoBuilderRecord, header.num_geo_builders, geo_builders_) &&
+        read_records(storage_, kFormatterRecord, header.num_formatters, formatters_) &&
+        read_records(storage_, kOutputRecord, header.num_outputs, outputs_);
+    if (!valid) {
+        reset();
+        return false;
+    }
+    is_configured_ = header.is_configured;
+    return true;
 }
 
-void PersistentSettings::write_to_eeprom() {
-    uint32_t version = current_settings_version;
-    uint32_t eeprom_addr = initial_eeprom_addr;
-    eeprom_write(eeprom_addr, &version, sizeof(version));  eeprom_addr += sizeof(version);
-    eeprom_write(eeprom_addr, this, sizeof(*this));
+// Reads fields of legacy::PersistentSettings one by one, converting them to current definitions.
+template<typename T>
+static T read_legacy(uint32_t offset) {
+    T val;
+    eeprom_read(legacy_eeprom_addr + sizeof(uint32_t) + offset, &val, sizeof(val));
+    return val;
 }
+#define LEGACY_OFFSET(field) offsetof(legacy::PersistentSettings, field)
 
-void PersistentSettings::restart_in_configuration_mode() {
-    is_configured_ = false;
-    write_to_eeprom();
+bool PersistentSettings::read_legacy_settings() {
+    uint32_t version;
+    eeprom_read(legacy_eeprom_addr, &version, sizeof(version));
+    if (version != legacy_settings_version)
+        return false;
+
+    reset();
+    is_configured_ = read_legacy<bool>(LEGACY_OFFSET(is_configured));
+    uint32_t num_inputs = read_legacy<unsigned long>(LEGACY_OFFSET(inputs_size));
+    uint32_t num_base_stations = read_legacy<unsigned long>(LEGACY_OFFSET(base_stations_size));
+    uint32_t num_geo_builders = read_legacy<unsigned long>(LEGACY_OFFSET(geo_builders_size));
+    uint32_t num_formatters = read_legacy<unsigned long>(LEGACY_OFFSET(formatters_size));
+    uint32_t num_outputs = read_legacy<unsigned long>(LEGACY_OFFSET(outputs_size));
+    if (num_inputs > inputs_.max_size() || num_base_stations > base_stations_.max_size() ||
+        num_geo_builders > geo_builders_.max_size() || num_formatters > formatters_.max_size() ||
+        num_outputs > outputs_.max_size()) {
+        reset();
+        return false;
+    }
+
+    for (uint32_t i = 0; i < num_inputs; i++) {
+        auto old = read_legacy<legacy::InputDef>(LEGACY_OFFSET(inputs) + i * sizeof(legacy::InputDef));
+        InputDef def = {};
+        def.pin = old.pin;
+        def.pulse_polarity = old.pulse_polarity;
+        def.input_type = old.input_type;
+        def.initial_cmp_threshold = old.initial_cmp_threshold;
+        inputs_.push(def);
+    }
+    for (uint32_t i = 0; i < num_base_stations; i++) {
+        auto old = read_legacy<legacy::BaseStationGeometryDef>(
+            LEGACY_OFFSET(base_stations) + i * sizeof(legacy::BaseStationGeometryDef));
+        BaseStationGeometryDef def = {};
+        memcpy(def.mat, old.mat, sizeof(def.mat));
+        memcpy(def.origin, old.origin, sizeof(def.origin));
+        base_stations_.push(def);
+    }
+    for (uint32_t i = 0; i < num_geo_builders; i++) {
+        // Sensors are read one by one to keep stack usage low.
+        uint32_t builder_offset = LEGACY_OFFSET(geo_builders) + i * sizeof(legacy::GeometryBuilderDef);
+        uint32_t sensors_offset = builder_offset + offsetof(legacy::GeometryBuilderDef, sensors);
+        uint32_t num_sensors =
+            read_legacy<unsigned long>(builder_offset + offsetof(legacy::GeometryBuilderDef, sensors_size));
+        geo_builders_.set_size(i + 1);
+        Vector<SensorLocalGeometry, 4> &sensors = geo_builders_[i].sensors;
+        sensors.clear();
+        for (uint32_t j = 0; j < num_sensors && j < sensors.max_size(); j++) {
+            auto old = read_legacy<legacy::SensorLocalGeometry>(
+                sensors_offset + j * sizeof(legacy::SensorLocalGeometry));
+            sensors.set_size(j + 1);
+            sensors[j].input_idx = old.input_idx;
+            memcpy(sensors[j].pos, old.pos, sizeof(old.pos));
+        }
+    }
+    for (uint32_t i = 0; i < num_formatters; i++) {
+        auto old = read_legacy<legacy::FormatterDef>(LEGACY_OFFSET(formatters) + i * sizeof(legacy::FormatterDef));
+        FormatterDef def = {};  // New fields default to zero, same as when not given in a command.
+        def.formatter_type = old.formatter_type;
+        def.formatter_subtype = old.formatter_subtype;
+        def.input_idx = old.input_idx;
+        def.output_idx = old.output_idx;
+        def.coord_sys_type = old.coord_sys_type;
+        def.coord_sys_params = old.coord_sys_params;
+        formatters_.push(def);
+    }
+    outputs_.set_size(num_outputs);
+    for (uint32_t i = 0; i < num_outputs; i++) {
+        auto old = read_legacy<legacy::OutputDef>(LEGACY_OFFSET(outputs) + i * sizeof(legacy::OutputDef));
+        outputs_[i] = OutputDef{};
+        outputs_[i].active = old.active;
+        outputs_[i].bitrate = old.bitrate;
+    }
+    return true;
+}
+#undef LEGACY_OFFSET
+
+// Definitions are written before the header, so the stored counts never refer to definitions that weren't written.
+bool PersistentSettings::write_to_eeprom() const {
+    SettingsHeaderRecord header = {
+        is_configured_, (uint8_t)inputs_.size(), (uint8_t)base_stations_.size(), (uint8_t)geo_builders_.size(),
+        (uint8_t)formatters_.size(), (uint8_t)outputs_.size()};
+    return write_records(storage_, kInputRecord, inputs_) &&
+           write_records(storage_, kBaseStationRecord, base_stations_) &&
+           write_records(storage_, kGeoBuilderRecord, geo_builders_) &&
+           write_records(storage_, kFormatterRecord, formatters_) &&
+           write_records(storage_, kOutputRecord, outputs_) &&
+           storage_.write(kHeaderRecord, 0, settings_record_version, &header, sizeof(header));
+}
+
+// Settings in memory are left intact; they are re-read from EEPROM after restart. Only the stored header record
+// changes, so the stored definitions are kept as they are.
+void PersistentSettings::restart_in_configuration_mode() const {
+    SettingsHeaderRecord header;
+    if (read_record(storage_, kHeaderRecord, 0, &header, sizeof(header))) {
+        header.is_configured = false;
+        storage_.write(kHeaderRecord, 0, settings_record_version, &header, sizeof(header));
+    }
     restart_system();
 }
 
-// Initialize settings.
+// Initialize settings. Storage keeps its state, as it describes EEPROM contents.
 void PersistentSettings::reset() {
-    memset(this, 0, sizeof(*this));
+    is_configured_ = false;
+    inputs_.clear();
+    base_stations_.clear();
+    geo_builders_.clear();
+    formatters_.clear();
 
     // Defaults.
     outputs_.set_size(num_outputs);
+    for (uint32_t i = 0; i < num_outputs; i++)
+        outputs_[i] = OutputDef{};
     outputs_[0].active = true;
 }
 
+// Checks that definitions are consistent with each other: no shared pins, all referenced sensors, objects and outputs
+// exist. Nothing is allocated, so it's cheap to run after each changed definition. Platform-specific restrictions
+// (which pins/timers can be used) are only checked by validate_setup() when the input nodes are created.
+bool PersistentSettings::validate_defs(PrintStream &error_stream) const {
+    for (uint32_t i = 0; i < inputs_.size(); i++)
+        for (uint32_t j = 0; j < i; j++)
+            if (inputs_[i].pin == inputs_[j].pin) {
+                error_stream.printf("Validation error: Pin %d is used by both sensor%d and sensor%d.\n", inputs_[i].pin, j, i);
+                return false;
+            }
+
+    if (geo_builders_.size() > 0 && base_stations_.size() != num_base_stations) {
+        error_stream.printf("Validation error: 2 base stations must be defined to use geometry builders.\n");
+        return false;
+    }
+    for (uint32_t i = 0; i < geo_builders_.size(); i++)
+        for (uint32_t j = 0; j < geo_builders_[i].sensors.size(); j++)
+            if (geo_builders_[i].sensors[j].input_idx >= inputs_.size()) {
+                error_stream.printf("Validation error: Object %d uses undefined sensor%d.\n", 
+                                    i, geo_builders_[i].sensors[j].input_idx);
+                return false;
+            }
+
+    for (uint32_t i = 0; i < formatters_.size(); i++) {
+        const FormatterDef &def = formatters_[i];
+        if (def.formatter_type == FormatterType::kPosition && def.input_idx >= geo_builders_.size()) {
+            error_stream.printf("Validation error: Stream %d uses undefined object%d.\n", i, def.input_idx);
+            return false;
+        }
+        if (def.output_idx >= outputs_.size() || !outputs_[def.output_idx].active) {
+            error_stream.printf("Validation error: Uninitialized output %d given for stream %d\n", def.output_idx, i);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Full validation: creates the pipeline and then deletes it without calling start(), so hardware is not touched. It
+// still allocates memory for all nodes, so it's only done before the settings are written or used.
 bool PersistentSettings::validate_setup(PrintStream &error_stream) {
+    if (!validate_defs(error_stream))
+        return false;
     try {
-        // Try to create the pipeline and then delete it.
         std::unique_ptr<Pipeline> pipeline = create_vive_sensor_pipeline(*this);
         return true;
     }
@@ -81,7 +343,8 @@ bool PersistentSettings::validate_setup(PrintStream &error_stream) {
 }
 
 template<typename T, unsigned arr_len>
-void PersistentSettings::set_value(Vector<T, arr_len> &arr, uint32_t idx, HashedWord *input_words, PrintStream &stream) {
+bool PersistentSettings::set_value(Vector<T, arr_len> &arr, uint32_t idx, HashedWord *input_words, PrintStream &stream,
+                                   DefinitionValidator *validator) {
     if (idx <= arr.size() && idx < arr_len) {
         T def;
         if (def.parse_def(idx, input_words, stream)) {
@@ -91,10 +354,11 @@ void PersistentSettings::set_value(Vector<T, arr_len> &arr, uint32_t idx, Hashed
             else
                 std::swap(arr[idx], def);
 
-            if (validate_setup(stream)) {
+            if (validate_defs(stream) && (!validator || validator->validate(*this, stream))) {
                 // Success.
                 stream.printf("Updated: ");
                 arr[idx].print_def(idx, stream);
+                return true;
             } else {
                 // Validation failed. Undo.
                 if (push_new)
@@ -105,12 +369,27 @@ void PersistentSettings::set_value(Vector<T, arr_len> &arr, uint32_t idx, Hashed
         }
     } else
         stream.printf("Index too large. Next available index: %d.\n", arr.size());
+    return false;
+}
+
+bool PersistentSettings::set_definition(HashedWord *input_words, PrintStream &stream, DefinitionValidator *validator) {
+    uint32_t idx = input_words->idx;
+    switch (*input_words++) {
+    case "sensor#"_hash: return set_value(inputs_, idx, input_words, stream, validator);
+    case "base#"_hash: return set_value(base_stations_, idx, input_words, stream, validator);
+    case "object#"_hash: return set_value(geo_builders_, idx, input_words, stream, validator);
+    case "stream#"_hash: return set_value(formatters_, idx, input_words, stream, validator);
+    case "usb_serial"_hash:
+    case "serial#"_hash:
+        return set_value(outputs_, idx == (uint32_t)-1 ? 0 : idx, input_words, stream, validator);
+    }
+    stream.printf("Unknown definition '%s'.\n", input_words[-1].word);
+    return false;
 }
 
 bool PersistentSettings::process_command(char *input_cmd, PrintStream &stream) {
     HashedWord *input_words = hash_words(input_cmd);
     if (*input_words && input_words->word[0] != '#') { // Do nothing on comments and empty lines.
-        uint32_t idx = input_words->idx;
         switch (*input_words++) {
         case "view"_hash:
             // Print all current settings.
@@ -129,28 +408,6 @@ bool PersistentSettings::process_command(char *input_cmd, PrintStream &stream) {
                 formatters_[i].print_def(i, stream);
             break;
         
-        case "sensor#"_hash:
-            set_value(inputs_, idx, input_words, stream);
-            break;
-        
-        case "base#"_hash:
-            set_value(base_stations_, idx, input_words, stream);
-            break;
-
-        case "object#"_hash:
-            set_value(geo_builders_, idx, input_words, stream);
-            break;
-        
-        case "stream#"_hash:
-            set_value(formatters_, idx, input_words, stream);
-            break;
-
-        case "usb_serial"_hash:
-        case "serial#"_hash:
-            if (idx == (uint32_t)-1) idx = 0;
-            set_value(outputs_, idx, input_words, stream);
-            break;
-        
         case "reset"_hash:
             reset();
             stream.printf("Reset successful.\n");
@@ -166,7 +423,10 @@ bool PersistentSettings::process_command(char *input_cmd, PrintStream &stream) {
         case "write"_hash:
             if (!validate_setup(stream)) break;
             is_configured_ = true;
-            write_to_eeprom();
+            if (!write_to_eeprom()) {
+                stream.printf("Write to EEPROM failed: not enough space for all definitions.\n");
+                break;
+            }
             stream.printf("Write to EEPROM successful. Type 'continue' to start using it.\n");
             break;
 
@@ -180,6 +440,15 @@ bool PersistentSettings::process_command(char *input_cmd, PrintStream &stream) {
             is_configured_ = true;
             return false;
 
+        case "sensor#"_hash:
+        case "base#"_hash:
+        case "object#"_hash:
+        case "stream#"_hash:
+        case "usb_serial"_hash:
+        case "serial#"_hash:
+            set_definition(input_words - 1, stream);
+            break;
+
         default:
             stream.printf("Unknown command '%s'. Valid commands: view, <module> <settings>, reset, reload, write, validate, continue.\n", (input_words-1)->word);
         }
@@ -213,17 +482,22 @@ private:
 
     virtual void do_work(Timestamp cur_time) {
         update_led_pattern(cur_time);
+        last_led_update_ = cur_time;
+    }
+    virtual Timestamp next_work_time(Timestamp cur_time) {
+        return last_led_update_ + led_update_period;
     }
 
     PersistentSettings *settings_;
     Pipeline *pipeline_;
+    Timestamp last_led_update_;
 };
 
 std::unique_ptr<Pipeline> PersistentSettings::create_configuration_pipeline(uint32_t stream_idx) {
     auto pipeline = std::make_unique<Pipeline>();
 
-    auto reader = pipeline->add_back(std::make_unique<SettingsReaderWriterNode>(this, pipeline.get()));
-    auto output_node = pipeline->add_back(OutputNode::create(stream_idx, OutputDef{}));
+    auto reader = pipeline->emplace_back<SettingsReaderWriterNode>(this, pipeline.get());
+    auto output_node = pipeline->add_back(OutputNode::create(pipeline->arena(), stream_idx, OutputDef{}));
     reader->pipe(output_node);
     output_node->pipe(reader);
 
@@ -0,0 +1,304 @@
+#include "settings_storage.h"
+#include "binary_protocol.h"
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+
+constexpr uint16_t page_magic = 0x5e77;
+constexpr uint8_t end_of_records = 0xFF;
+constexpr uint32_t payload_chunk_size = 16;  // Stored payloads are processed in chunks to keep stack usage low.
+constexpr uint32_t log_size = settings_num_pages * settings_page_data_size;
+
+// Free space kept after each write. Reusing the tail page needs space for its live records: they can take the rest of
+// the page and continue into the next one. Power loss while copying them can leave one more unfinished copy.
+constexpr uint32_t reuse_reserve = settings_page_data_size + 2 * settings_max_record_size - 1;
+static_assert(settings_max_payload <= 0xFF, "Payload length is stored in a byte");
+static_assert(settings_max_record_size <= settings_page_data_size, "Records may only continue into the next page");
+
+SettingsStorage::SettingsStorage()
+    : latest_{}
+    , tail_(settings_page_data_size)
+    , head_(settings_page_data_size)
+    , last_page_(0) {
+}
+
+// ====  Log positions  =======================================================
+// Page with given seq holds log positions [seq * settings_page_data_size, (seq + 1) * settings_page_data_size).
+// Seqs start with 1, so position 0 is never used.
+
+static uint32_t page_addr(uint32_t seq) {
+    return (seq - 1) % settings_num_pages * settings_page_size;
+}
+
+uint32_t SettingsStorage::eeprom_addr(uint32_t pos) {
+    return page_addr(pos / settings_page_data_size) + sizeof(PageHeader) + pos % settings_page_data_size;
+}
+
+// Calls fn(offset, len) for parts of given log range, split at page boundaries.
+template<typename Fn>
+static void for_each_page_part(uint32_t pos, uint32_t len, Fn fn) {
+    for (uint32_t offset = 0; offset < len;) {
+        uint32_t part_len = std::min(len - offset, settings_page_data_size - (pos + offset) % settings_page_data_size);
+        fn(offset, part_len);
+        offset += part_len;
+    }
+}
+
+void SettingsStorage::read_log(uint32_t pos, void *dest, uint32_t len) {
+    for_each_page_part(pos, len, [&](uint32_t offset, uint32_t part_len) {
+        eeprom_read(eeprom_addr(pos + offset), (uint8_t *)dest + offset, part_len);
+    });
+}
+
+void SettingsStorage::write_log(uint32_t pos, const void *src, uint32_t len) {
+    for_each_page_part(pos, len, [&](uint32_t offset, uint32_t part_len) {
+        eeprom_write(eeprom_addr(pos + offset), (const uint8_t *)src + offset, part_len);
+    });
+}
+
+uint16_t SettingsStorage::page_check(const PageHeader &header) {
+    return crc16_ccitt((const uint8_t *)&header, offsetof(PageHeader, check)) ^ page_magic;
+}
+
+// Whether the page at given seq's place was started with that seq, i.e. holds its part of the log.
+bool SettingsStorage::read_page_header(uint32_t seq, PageHeader *header) {
+    eeprom_read(page_addr(seq), header, sizeof(*header));
+    return header->seq == seq && header->check == page_check(*header) && header->first <= settings_page_data_size;
+}
+
+// Returns the end of the page if the page is not valid.
+uint32_t SettingsStorage::first_record(uint32_t seq) {
+    PageHeader header;
+    uint32_t page_pos = seq * settings_page_data_size;
+    return page_pos + (read_page_header(seq, &header) ? header.first : settings_page_data_size);
+}
+
+// The header is written first: until then, the page holds the oldest page of the log, which must stay intact. If the
+// end marker isn't written after it, records of the page's previous use fail the CRC check, as it includes position.
+void SettingsStorage::start_page(uint32_t seq, uint32_t first) {
+    PageHeader header = {seq, (uint16_t)first, 0};
+    header.check = page_check(header);
+    eeprom_write(page_addr(seq), &header, sizeof(header));
+    if (first < settings_page_data_size)
+        eeprom_write(page_addr(seq) + sizeof(header) + first, &end_of_records, 1);
+    last_page_ = seq;
+}
+
+// ====  Reading  =============================================================
+
+// Calls fn(pos, header) for each record in [from, to), in the order they were written, until it returns false.
+// Returns the position where it stopped.
+template<typename Fn>
+uint32_t SettingsStorage::scan(uint32_t from, uint32_t to, Fn fn) {
+    uint32_t pos = from;
+    while (pos + sizeof(RecordHeader) <= to) {
+        RecordHeader header;
+        read_log(pos, &header, sizeof(header));
+        if (header.type >= settings_max_record_types || header.idx >= settings_max_record_idx ||
+            header.len > settings_max_payload || pos + sizeof(header) + header.len > to) {
+            // End of records in this page. After power loss, the next page starts past the unfinished record.
+            uint32_t next_seq = pos / settings_page_data_size + 1;
+            if (next_seq * settings_page_data_size >= to)
+                break;
+            pos = first_record(next_seq);
+            continue;
+        }
+        if (!fn(pos, header))
+            break;
+        pos += sizeof(header) + header.len;
+    }
+    return std::min(pos, to);
+}
+
+bool SettingsStorage::load() {
+    memset(latest_, 0, sizeof(latest_));
+    tail_ = head_ = settings_page_data_size;
+    last_page_ = 0;
+
+    // Pages in use have consecutive seqs, ending with the newest one.
+    PageHeader header;
+    for (uint32_t page = 0; page < settings_num_pages; page++) {
+        eeprom_read(page * settings_page_size, &header, sizeof(header));
+        uint32_t seq = header.seq;
+        if (seq && seq != 0xFFFFFFFF && read_page_header(seq, &header))
+            last_page_ = std::max(last_page_, seq);
+    }
+    if (!last_page_)
+        return false;
+    uint32_t first_seq = last_page_;
+    while (first_seq > 1 && last_page_ - first_seq + 1 < settings_num_pages &&
+           read_page_header(first_seq - 1, &header))
+        first_seq--;
+
+    // A record with a bad CRC can only be the last one, interrupted by power loss: the log ends there.
+    tail_ = first_record(first_seq);
+    head_ = scan(tail_, (last_page_ + 1) * settings_page_data_size, [this](uint32_t pos, const RecordHeader &) {
+        RecordHeader header;
+        if (!check_record(pos, &header))
+            return false;
+        latest_[header.type][header.idx] = pos;
+        return true;
+    });
+    return true;
+}
+
+// Calls fn(chunk, offset, chunk_len) for consecutive chunks of the payload of the record at given position.
+template<typename Fn>
+void SettingsStorage::read_payload_chunks(uint32_t pos, uint32_t len, Fn fn) {
+    uint8_t chunk[payload_chunk_size];
+    for (uint32_t offset = 0; offset < len; offset += sizeof(chunk)) {
+        uint32_t chunk_len = std::min(len - offset, (uint32_t)sizeof(chunk));
+        read_log(pos + sizeof(RecordHeader) + offset, chunk, chunk_len);
+        fn(chunk, offset, chunk_len);
+    }
+}
+
+// CRC of the record position and header fields; payload is added to it.
+uint16_t SettingsStorage::header_crc(uint32_t pos, const RecordHeader &header) {
+    uint16_t crc = crc16_ccitt((const uint8_t *)&pos, sizeof(pos));
+    return crc16_ccitt((const uint8_t *)&header, offsetof(RecordHeader, crc), crc);
+}
+
+bool SettingsStorage::check_record(uint32_t pos, RecordHeader *header) {
+    read_log(pos, header, sizeof(*header));
+    uint16_t crc = header_crc(pos, *header);
+    read_payload_chunks(pos, header->len, [&](const uint8_t *chunk, uint32_t, uint32_t len) {
+        crc = crc16_ccitt(chunk, len, crc);
+    });
+    return header->crc == crc;
+}
+
+int32_t SettingsStorage::read(uint8_t type, uint8_t idx, uint8_t *version, void *dest, uint32_t max_len) {
+    if (type >= settings_max_record_types || idx >= settings_max_record_idx || !latest_[type][idx])
+        return -1;
+
+    RecordHeader header;
+    uint32_t pos = latest_[type][idx];
+    if (!check_record(pos, &header)) {
+        // Latest copy is damaged: fall back to the newest intact one.
+        pos = 0;
+        scan(tail_, head_, [&](uint32_t rec_pos, const RecordHeader &rec_header) {
+            if (rec_header.type == type && rec_header.idx == idx && rec_pos != latest_[type][idx] &&
+                check_record(rec_pos, &header))
+                pos = rec_pos;
+            return true;
+        });
+        if (!pos || !check_record(pos, &header))
+            return -1;
+    }
+
+    *version = header.version;
+    read_log(pos + sizeof(header), dest, std::min((uint32_t)header.len, max_len));
+    return header.len;
+}
+
+// ====  Writing  =============================================================
+
+// Starts pages the record at head_ will take, including the one its end marker goes to.
+void SettingsStorage::begin_record(uint32_t size) {
+    uint32_t end = head_ + size;
+    assert(end <= tail_ / settings_page_data_size * settings_page_data_size + log_size);  // Tail page isn't reused.
+    for (uint32_t seq = last_page_ + 1; seq <= (end - 1) / settings_page_data_size; seq++) {
+        uint32_t page_pos = seq * settings_page_data_size;
+        start_page(seq, head_ >= page_pos ? head_ - page_pos : std::min(end - page_pos, settings_page_data_size));
+    }
+}
+
+// Appends the record to the log. The header is written last, after the end marker was moved past the record, so a
+// record interrupted by power loss is never seen.
+void SettingsStorage::put_record(uint8_t type, uint8_t idx, uint8_t version, const uint8_t *payload, uint32_t len) {
+    RecordHeader header = {type, idx, version, (uint8_t)len, 0};
+    begin_record(sizeof(header) + len);
+    header.crc = crc16_ccitt(payload, len, header_crc(head_, header));
+    write_log(head_ + sizeof(header), payload, len);
+    finish_record(header);
+}
+
+// Same as put_record(), with the payload copied from a stored record. CRC changes, as it includes the position.
+void SettingsStorage::copy_record(uint32_t src_pos, RecordHeader header) {
+    begin_record(sizeof(header) + header.len);
+    uint32_t payload_pos = head_ + sizeof(header);
+    uint16_t crc = header_crc(head_, header);
+    read_payload_chunks(src_pos, header.len, [&](const uint8_t *chunk, uint32_t offset, uint32_t len) {
+        write_log(payload_pos + offset, chunk, len);
+        crc = crc16_ccitt(chunk, len, crc);
+    });
+    header.crc = crc;
+    finish_record(header);
+}
+
+// Writes the header of a record whose payload is already written after head_.
+void SettingsStorage::finish_record(const RecordHeader &header) {
+    uint32_t pos = head_;
+    head_ = pos + sizeof(header) + header.len;
+    if (head_ < (last_page_ + 1) * settings_page_data_size)
+        write_log(head_, &end_of_records, 1);
+    write_log(pos, &header, sizeof(header));
+    latest_[header.type][header.idx] = pos;
+}
+
+// Size of the log minus its used part. Part of the tail page before tail_ is counted as free, but it can only be
+// reused together with the rest of the page.
+uint32_t SettingsStorage::free_space() const {
+    return log_size - (head_ - tail_);
+}
+
+// Copies live records starting in the tail page to the end of the log, so the page can be reused. Doesn't decrease
+// free space. Returns false if there's nothing to reuse or not enough space to copy the records.
+bool SettingsStorage::reuse_tail_page() {
+    if (tail_ == head_)
+        return false;
+    uint32_t page_pos = tail_ / settings_page_data_size * settings_page_data_size;
+    uint32_t page_end = page_pos + settings_page_data_size;
+    uint32_t live_size = 0;
+    scan(tail_, head_, [&](uint32_t pos, const RecordHeader &header) {
+        if (pos >= page_end)
+            return false;
+        if (latest_[header.type][header.idx] == pos)
+            live_size += sizeof(header) + header.len;
+        return true;
+    });
+    if (head_ + live_size > page_pos + log_size)
+        return false;
+
+    tail_ = scan(tail_, head_, [&](uint32_t pos, const RecordHeader &stored) {
+        if (pos >= page_end)
+            return false;
+        RecordHeader header;
+        if (latest_[stored.type][stored.idx] == pos && check_record(pos, &header))
+            copy_record(pos, header);
+        return true;
+    });
+    return true;
+}
+
+bool SettingsStorage::write(uint8_t type, uint8_t idx, uint8_t version, const void *data, uint32_t len) {
+    if (type >= settings_max_record_types || idx >= settings_max_record_idx || len > settings_max_payload)
+        return false;
+
+    if (uint32_t pos = latest_[type][idx]) {
+        RecordHeader stored;
+        bool same = check_record(pos, &stored) && stored.version == version && stored.len == len;
+        if (same)
+            read_payload_chunks(pos, len, [&](const uint8_t *chunk, uint32_t offset, uint32_t n) {
+                same = same && !memcmp(chunk, (const uint8_t *)data + offset, n);
+            });
+        if (same)
+            return true;
+    }
+
+    // Keep enough free space to reuse a page after this record. Reusing all pages once removes all old copies;
+    // after that it only moves live records around.
+    uint32_t size = sizeof(RecordHeader) + len;
+    for (uint32_t i = 0; free_space() < size + reuse_reserve; i++)
+        if (i > settings_num_pages || !reuse_tail_page())
+            return false;
+    put_record(type, idx, version, (const uint8_t *)data, len);
+    return true;
+}
+
+void SettingsStorage::forget(uint8_t type, uint8_t first_idx) {
+    for (uint32_t idx = first_idx; idx < settings_max_record_idx; idx++)
+        latest_[type][idx] = 0;
+}
@@ -1,159 +1,236 @@
-// NOTE: This file is not used at the moment.
-
-// See https://github.com/iNavFlight/inav/blob/master/src/main/io/gps_ublox.c
+// GPS emulation: sends position as a u-blox receiver would, so that it can be used by flight controllers that only
+// accept GPS input. See https://github.com/iNavFlight/inav/blob/master/src/main/io/gps_ublox.c
 // UBLOX: https://www.u-blox.com/sites/default/files/products/documents/u-blox6_ReceiverDescrProtSpec_%28GPS.G6-SW-10018%29_Public.pdf
-
-// Binary protocol.
-// First receive a bunch of data. Ignore.
-// Then, 5Hz send POSLLH (required), VELNED (required), SOL - sats.
-
+//
 // Binary protocol:
 // 0xB5, 0x62, <class>, <msg>, <16 bit length (le)>, <payload>, <checksum a>, <checksum b>
 // checksum is from class to end of payload.
+// Receivers ignore configuration messages we don't answer, so we just send POSLLH, VELNED and SOL (for sats & fix).
+#include "formatters.h"
+#include <math.h>
+#include <string.h>
 
-static const int MAX_UBLOX_PAYLOAD_SIZE = 100;  // 100 bytes should be enough for all used messages
-static const float DISTANCE_BETWEEN_TWO_LONGITUDE_POINTS_AT_EQUATOR = 11.1320f;  // in mm
-
-typedef struct {
+struct __attribute__((packed)) ubx_header {
     uint8_t preamble1;
     uint8_t preamble2;
     uint8_t msg_class;
     uint8_t msg_id;
     uint16_t length;
-} ubx_header;
-
-typedef struct {
-    ubx_header header;
-    uint8_t payload[MAX_UBLOX_PAYLOAD_SIZE+2];
-} ubx_packet;
+};
 
-typedef struct {                   // GPS msToW
-    uint32_t time;
+struct __attribute__((packed)) ubx_nav_solution {
+    uint32_t time;                   // GPS ms ToW
     int32_t time_nsec;
     int16_t week;
-    uint8_t fix_type;              // see enum ubs_nav_fix_type   <--
-    uint8_t fix_status;            // see ubx_nav_status_bits   <--
-    int32_t ecef_x;
-    int32_t ecef_y;
-    int32_t ecef_z;
-    uint32_t position_accuracy_3d;
-    int32_t ecef_x_velocity;
-    int32_t ecef_y_velocity;
-    int32_t ecef_z_velocity;
-    uint32_t speed_accuracy;
-    uint16_t position_DOP;           // cm  dilution of position <--
+    uint8_t fix_type;                // see enum ubs_nav_fix_type
+    uint8_t fix_status;              // see ubx_nav_status_bits
+    int32_t ecef_x;                  // cm
+    int32_t ecef_y;                  // cm
+    int32_t ecef_z;                  // cm
+    uint32_t position_accuracy_3d;   // cm
+    int32_t ecef_x_velocity;         // cm/s
+    int32_t ecef_y_velocity;         // cm/s
+    int32_t ecef_z_velocity;         // cm/s
+    uint32_t speed_accuracy;         // cm/s
+    uint16_t position_DOP;           // 0.01
     uint8_t res;
-    uint8_t satellites;              // number of sats   <--
+    uint8_t satellites;              // number of sats
     uint32_t res2;
-} ubx_nav_solution;
+};
 
-typedef struct {
+struct __attribute__((packed)) ubx_nav_posllh {
     uint32_t time;                // GPS ms ToW
-    int32_t longitude;            // degrees * 1e7   <--
-    int32_t latitude;             // degrees * 1e7   <--
+    int32_t longitude;            // degrees * 1e7
+    int32_t latitude;             // degrees * 1e7
     int32_t altitude_ellipsoid;   // mm
-    int32_t altitude_msl;         // mm  sea level <--
-    uint32_t horizontal_accuracy; // mm  one sigma estimated position error <--
-    uint32_t vertical_accuracy;   // mm  one sigma estimated position error <--
-} ubx_nav_posllh;
-
-typedef struct {
-    uint32_t time;              // GPS msToW
-    int32_t ned_north;          // cm/s  <--
-    int32_t ned_east;           // cm/s  <--
-    int32_t ned_down;           // cm/s  <--
-    uint32_t speed_3d;
-    uint32_t speed_2d;          // cm/s   <--
-    int32_t heading_2d;         // deg * 1e5   <--
-    uint32_t speed_accuracy;
-    uint32_t heading_accuracy;
-} ubx_nav_velned;
+    int32_t altitude_msl;         // mm  sea level
+    uint32_t horizontal_accuracy; // mm  one sigma estimated position error
+    uint32_t vertical_accuracy;   // mm  one sigma estimated position error
+};
+
+struct __attribute__((packed)) ubx_nav_velned {
+    uint32_t time;              // GPS ms ToW
+    int32_t ned_north;          // cm/s
+    int32_t ned_east;           // cm/s
+    int32_t ned_down;           // cm/s
+    uint32_t speed_3d;          // cm/s
+    uint32_t speed_2d;          // cm/s
+    int32_t heading_2d;         // deg * 1e5
+    uint32_t speed_accuracy;    // cm/s
+    uint32_t heading_accuracy;  // deg * 1e5
+};
+
+static_assert(sizeof(ubx_nav_solution) == 52, "Wrong NAV-SOL size");
+static_assert(sizeof(ubx_nav_posllh) == 28, "Wrong NAV-POSLLH size");
+static_assert(sizeof(ubx_nav_velned) == 36, "Wrong NAV-VELNED size");
+static_assert(sizeof(ubx_header) + sizeof(ubx_nav_solution) + 2 <= max_bytes_in_data_chunk,
+              "Each UBX packet must fit into a DataChunk");
 
 enum ubx_protocol_bytes {
     PREAMBLE1 = 0xb5,
     PREAMBLE2 = 0x62,
     CLASS_NAV = 0x01,
-    CLASS_ACK = 0x05,
-    CLASS_CFG = 0x06,
-    CLASS_MON = 0x0A,
-    MSG_ACK_NACK = 0x00,
-    MSG_ACK_ACK = 0x01,
     MSG_NAV_POSLLH = 0x2,
-    MSG_NAV_STATUS = 0x3,
     MSG_NAV_SOL = 0x6,
-    MSG_NAV_PVT = 0x7,
     MSG_NAV_VELNED = 0x12,
-    MSG_NAV_SVINFO = 0x30,
-    MSG_CFG_PRT = 0x00,
-    MSG_CFG_RATE = 0x08,
-    MSG_CFG_SET_RATE = 0x01,
-    MSG_CFG_NAV_SETTINGS = 0x24
 };
 
 enum ubs_nav_fix_type {
     FIX_NONE = 0,
-    FIX_DEAD_RECKONING = 1,
-    FIX_2D = 2,
     FIX_3D = 3,
-    FIX_GPS_DEAD_RECKONING = 4,
-    FIX_TIME = 5
 };
 
 enum ubx_nav_status_bits {
-    NAV_STATUS_FIX_VALID = 1
+    NAV_STATUS_FIX_VALID = 1,
+    NAV_STATUS_WEEK_VALID = 4,
+    NAV_STATUS_TOW_VALID = 8,
 };
 
-void send_ublox_packet(PrintStream &stream, uint8_t msg_class, uint8_t msg_id, const void *payload, uint8_t payload_len) {
-    ubx_packet packet = {{PREAMBLE1, PREAMBLE2, msg_class, msg_id, payload_len}, {}};
+constexpr uint32_t ms_per_gps_week = 7 * 24 * 3600 * 1000;
+constexpr TimeDelta ublox_min_period(1000 / ublox_max_rate_hz, msec);
 
-    memcpy(packet.payload, payload, payload_len);
+// Flight controllers judge GPS quality by number of satellites and DOP, so we make them up from our fix level.
+static uint8_t fake_num_satellites(FixLevel fix_level) {
+    if (fix_level >= FixLevel::kFullFix) return 12;
+    if (fix_level >= FixLevel::kStaleFix) return 6;
+    if (fix_level >= FixLevel::kCycleSynced) return 3;
+    return 0;
+}
 
-    // Calculate checksum
-    uint8_t ck_a = 0, ck_b = 0;
-    for (int i = -4; i < payload_len; i++) // -4 is because we should start with msg_class in header.
-        ck_b += (ck_a += packet.payload[i]);
+static uint32_t clamp_to_uint32(float val) {
+    return val < 4e9f ? (uint32_t)val : 4000000000u;
+}
 
-    packet.payload[payload_len] = ck_a;
-    packet.payload[payload_len+1] = ck_b;
+GeometryUbloxFormatter::GeometryUbloxFormatter(uint32_t idx, const FormatterDef &def,
+                                               const CoordinateTransform &transform)
+    : GeometryFormatter(idx, def, transform)
+    , geo_(def.geo_origin)
+    , last_sent_time_(Timestamp() - ublox_min_period)
+    , last_pos_time_()
+    , last_pos_{0, 0, 0}
+    , velocity_{0, 0, 0}
+    , velocity_variance_(0)
+    , velocity_valid_(false) {
+}
 
-    // Write the whole packet.
-    stream.write((const uint8_t *)&packet, sizeof(packet.header) + payload_len + 2);
+// Estimate velocity as a difference between consecutive full fixes.
+void GeometryUbloxFormatter::update_velocity(const ObjectPosition& g) {
+    if (g.fix_level < FixLevel::kFullFix) {
+        velocity_valid_ = false;
+        return;
+    }
+    constexpr TimeDelta max_velocity_dt(250, msec);  // Allows stream rates down to 4 Hz.
+    TimeDelta dt = g.time - last_pos_time_;
+    velocity_valid_ = TimeDelta() < dt && dt < max_velocity_dt;
+    if (velocity_valid_) {
+        float dt_sec = dt / TimeDelta(1, sec);
+        for (int i = 0; i < 3; i++)
+            velocity_[i] = (g.pos[i] - last_pos_[i]) / dt_sec;
+        float pos_variance = g.pos_covariance[0] + g.pos_covariance[3] + g.pos_covariance[5];
+        velocity_variance_ = 2 * pos_variance / (dt_sec * dt_sec);
+    }
+    last_pos_time_ = g.time;
+    for (int i = 0; i < 3; i++)
+        last_pos_[i] = g.pos[i];
 }
 
-// all arguments in mm and mm/s
-void send_ublox_ned_position(PrintStream &stream, bool fix_valid, float *pos, float *vel) {
-    const static int origin_lat = 1000000; // .1 degree
-    const static int origin_lon = 1000000; // .1 degree
-    const static int accuracy = 10; // mm
+void GeometryUbloxFormatter::format(const ObjectPosition& g) {
+    update_velocity(g);
+    if (g.time - last_sent_time_ < ublox_min_period)
+        return;
+    last_sent_time_ = g.time;
+
+    uint64_t time_ms = g.time.get_value_64(msec);
+    uint32_t time_of_week = time_ms % ms_per_gps_week;
+    bool fix_valid = g.fix_level >= FixLevel::kStaleFix;
+    bool velocity_valid = fix_valid && velocity_valid_;
+    float speed_stddev_cm = velocity_valid ? sqrtf(velocity_variance_) * 100.f : 0.f;
 
     ubx_nav_solution sol = {};
+    sol.time = time_of_week;
+    sol.week = (int16_t)(time_ms / ms_per_gps_week);
+    sol.fix_status = NAV_STATUS_WEEK_VALID | NAV_STATUS_TOW_VALID;
+    sol.satellites = fake_num_satellites(g.fix_level);
+    sol.position_DOP = 9999;
     if (fix_valid) {
         sol.fix_type = FIX_3D;
-        sol.fix_status = NAV_STATUS_FIX_VALID;
-        sol.position_DOP = accuracy / 10; // cm
-        sol.satellites = 10;
-    } else {
-        sol.fix_type = FIX_NONE;
-    }
-    send_ublox_packet(stream, CLASS_NAV, MSG_NAV_SOL, &sol, sizeof(sol));
-
-    if (fix_valid) {
-        ubx_nav_posllh posllh = {};
-        posllh.longitude = origin_lon + (int)(pos[1] / DISTANCE_BETWEEN_TWO_LONGITUDE_POINTS_AT_EQUATOR); // deg * 1e7
-        posllh.latitude  = origin_lat + (int)(pos[0] / DISTANCE_BETWEEN_TWO_LONGITUDE_POINTS_AT_EQUATOR); // deg * 1e7
-        posllh.altitude_msl = -(int)pos[3];     // mm
-        posllh.horizontal_accuracy = accuracy;  // mm
-        posllh.vertical_accuracy = accuracy;    // mm
-        send_ublox_packet(stream, CLASS_NAV, MSG_NAV_POSLLH, &posllh, sizeof(posllh));
-
-        ubx_nav_velned velned = {};
-        velned.ned_north = (int)(vel[0] * .1); // cm/s
-        velned.ned_east = (int)(vel[1] * .1);  // cm/s
-        velned.ned_down = (int)(vel[2] * .1);  // cm/s
-
-        velned.speed_2d = 0;   // cm/s         TODO. Not really used.
-        velned.heading_2d = 0; // deg * 1e-5   TODO. Not really used.
-        send_ublox_packet(stream, CLASS_NAV, MSG_NAV_VELNED, &velned, sizeof(velned));
+        sol.fix_status |= NAV_STATUS_FIX_VALID;
+        sol.position_DOP = g.fix_level >= FixLevel::kFullFix ? 100 : 500;
+
+        int32_t ecef_cm[3];
+        geo_.ned_to_ecef_cm(g.pos, ecef_cm);
+        sol.ecef_x = ecef_cm[0];
+        sol.ecef_y = ecef_cm[1];
+        sol.ecef_z = ecef_cm[2];
+        float pos_variance = g.pos_covariance[0] + g.pos_covariance[3] + g.pos_covariance[5];
+        sol.position_accuracy_3d = clamp_to_uint32(ceilf(sqrtf(pos_variance) * 100.f));
+        if (velocity_valid) {
+            float ecef_velocity[3];
+            geo_.rotate_ned_to_ecef(velocity_, ecef_velocity);
+            sol.ecef_x_velocity = (int32_t)lroundf(ecef_velocity[0] * 100.f);
+            sol.ecef_y_velocity = (int32_t)lroundf(ecef_velocity[1] * 100.f);
+            sol.ecef_z_velocity = (int32_t)lroundf(ecef_velocity[2] * 100.f);
+            sol.speed_accuracy = clamp_to_uint32(ceilf(speed_stddev_cm));
+        }
     }
+    send_packet(CLASS_NAV, MSG_NAV_SOL, &sol, sizeof(sol), g.time);
+
+    if (!fix_valid)
+        return;
+
+    ubx_nav_posllh posllh = {};
+    posllh.time = time_of_week;
+    int32_t lat_e7, lon_e7, alt_mm;
+    geo_.ned_to_llh(g.pos, &lat_e7, &lon_e7, &alt_mm);
+    posllh.latitude = lat_e7;
+    posllh.longitude = lon_e7;
+    posllh.altitude_ellipsoid = alt_mm;
+    posllh.altitude_msl = alt_mm;  // We don't know geoid height; origin altitude is used as-is.
+    posllh.horizontal_accuracy = clamp_to_uint32(ceilf(sqrtf(g.pos_covariance[0] + g.pos_covariance[3]) * 1000.f));
+    posllh.vertical_accuracy = clamp_to_uint32(ceilf(sqrtf(g.pos_covariance[5]) * 1000.f));
+    send_packet(CLASS_NAV, MSG_NAV_POSLLH, &posllh, sizeof(posllh), g.time);
+
+    if (!velocity_valid)
+        return;
+
+    ubx_nav_velned velned = {};
+    velned.time = time_of_week;
+    velned.ned_north = (int32_t)lroundf(velocity_[0] * 100.f);
+    velned.ned_east = (int32_t)lroundf(velocity_[1] * 100.f);
+    velned.ned_down = (int32_t)lroundf(velocity_[2] * 100.f);
+    float speed_2d = sqrtf(velocity_[0] * velocity_[0] + velocity_[1] * velocity_[1]);
+    velned.speed_2d = (uint32_t)lroundf(speed_2d * 100.f);
+    velned.speed_3d = (uint32_t)lroundf(sqrtf(speed_2d * speed_2d + velocity_[2] * velocity_[2]) * 100.f);
+    float heading = atan2f(velocity_[1], velocity_[0]) * (180.f / (float)M_PI);
+    if (heading < 0.f)
+        heading += 360.f;
+    velned.heading_2d = (int32_t)lroundf(heading * 1e5f);
+    velned.speed_accuracy = clamp_to_uint32(ceilf(speed_stddev_cm));
+    velned.heading_accuracy = 180 * 100000;  // Heading is derived from velocity; don't let anyone rely on it.
+    send_packet(CLASS_NAV, MSG_NAV_VELNED, &velned, sizeof(velned), g.time);
 }
 
+void GeometryUbloxFormatter::send_packet(uint8_t msg_class, uint8_t msg_id, const void *payload, uint16_t payload_len,
+                                         Timestamp time) {
+    // Write the packet directly to the chunk to avoid extra copies.
+    DataChunk chunk;
+    chunk.time = time;
+    chunk.stream_idx = node_idx_;
+    chunk.last_chunk = true;
+    uint8_t *buf = &chunk.data[0];
+
+    ubx_header header = {PREAMBLE1, PREAMBLE2, msg_class, msg_id, payload_len};
+    memcpy(buf, &header, sizeof(header));
+    memcpy(buf + sizeof(header), payload, payload_len);
+
+    // 8-bit Fletcher checksum over class, id, length and payload.
+    uint8_t ck_a = 0, ck_b = 0;
+    for (uint32_t i = 2; i < sizeof(header) + payload_len; i++)
+        ck_b += (ck_a += buf[i]);
+    uint32_t len = sizeof(header) + payload_len;
+    buf[len++] = ck_a;
+    buf[len++] = ck_b;
+
+    chunk.data.set_size(len);
+    produce(chunk);
+}
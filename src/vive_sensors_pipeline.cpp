@@ -2,56 +2,116 @@
 
 #include "data_frame_decoder.h"
 #include "debug_node.h"
+#include "flight_recorder.h"
 #include "formatters.h"
 #include "geometry.h"
 #include "input.h"
 #include "outputs.h"
 #include "pulse_processor.h"
 
-#include <vector>
 
-// Create Pipeline specialized for Vive Sensors, using provided configuration settings.
-// In this function we create and interconnect all needed WorkerNodes to make project work.
-// NOTE: This function will also be called for validation purposes, so no hardware changes should be made.
-// (move all hardware changes to start() methods)
-std::unique_ptr<Pipeline> create_vive_sensor_pipeline(const PersistentSettings &settings) {
+// Part of the pipeline running in one thread.
+struct Stage {
+    Pipeline *pipeline;
+    PipelineThread *thread;
+};
 
-    // Create pipeline itself.
-    auto pipeline = std::make_unique<Pipeline>();
+// Connect producer in one stage to a consumer in another one. Values cross threads through a ThreadBridge that
+// works in the consumer's pipeline.
+template<typename T>
+void connect(Producer<T> *producer, const Stage &from, Consumer<T> *consumer, const Stage &to) {
+    if (from.pipeline == to.pipeline) {
+        producer->pipe(consumer);
+    } else {
+        auto bridge = to.pipeline->emplace_front<ThreadBridge<T>>(to.thread);
+        producer->pipe(bridge);
+        bridge->pipe(consumer);
+    }
+}
 
-    // Create central element PulseProcessor.
-    auto pulse_processor = pipeline->add_back(std::make_unique<PulseProcessor>(settings.inputs().size()));
+// Max number of definitions of each kind, as limited by PersistentSettings.
+template<typename Defs>
+constexpr uint32_t max_defs(const Defs &(PersistentSettings::*)() const) { return Defs::capacity; }
 
-    // Create input nodes as configured.
-    std::vector<InputNode *> inputs;
-    for (uint32_t i = 0; i < settings.inputs().size(); i++) {
-        auto &def = settings.inputs()[i];
-        auto node = pipeline->add_front(InputNode::create(i, def));
-        node->pipe(pulse_processor);
-        inputs.push_back(node);
-    }    
+constexpr uint32_t max_geo_builders = max_defs(&PersistentSettings::geo_builders);
+constexpr uint32_t max_formatters = max_defs(&PersistentSettings::formatters);
 
-    // Create geometry builders as configured.
-    std::vector<GeometryBuilder *> geometry_builders;
-    for (uint32_t i = 0; i < settings.geo_builders().size(); i++) {
-        auto &def = settings.geo_builders()[i];
-        auto node = pipeline->add_back(std::make_unique<PointGeometryBuilder>(i, def, settings.base_stations()));
-        pulse_processor->Producer<SensorAnglesFrame>::pipe(node);
-        geometry_builders.push_back(node);
+// Producer::pipe() throws when there are more consumers than MaxConsumers (see messages.h) allows. Max fan-out of each
+// producer created below, with the max number of definitions:
+//   PulseProcessor angles: each geometry builder, each angles formatter and the flight recorder.
+//   PointGeometryBuilder positions: each position formatter and the flight recorder.
+//   OutputNode input data: each formatter sending to it that needs replies (e.g. mavlink) and the debug node.
+static_assert(MaxConsumers<SensorAnglesFrame>::value >= max_geo_builders + max_formatters + 1,
+              "Not enough room for consumers of angles");
+static_assert(MaxConsumers<ObjectPosition>::value >= max_formatters + 1, "Not enough room for consumers of positions");
+static_assert(MaxConsumers<DataChunk>::value >= max_formatters + 1, "Not enough room for consumers of output data");
+
+// ====  Streams  =============================================================
+
+// Nodes the streams get their values from. They are created once and keep working while the streams are rebuilt.
+struct StreamSources {
+    Stage main_stage;
+    PulseProcessor *pulse_processor;
+    Vector<GeometryBuilder *, max_num_inputs> geometry_builders;
+    Vector<Stage, max_num_inputs> geometry_stages;
+    FlightRecorder *recorder;
+};
+
+// Formatters, output nodes and the debug node, in a nested pipeline that can be replaced as a whole while the main
+// pipeline runs. It has its own arena, so memory of replaced nodes is returned.
+// Formatters working in the main thread are connected to their sources separately, in connect_sources(), so that the
+// replacement can be created (and validated) while the current streams still work.
+class StreamsPipeline : public Pipeline {
+public:
+    void connect_sources(const StreamSources &sources) {
+        for (uint32_t i = 0; i < angle_consumers.size(); i++)
+            sources.pulse_processor->Producer<SensorAnglesFrame>::pipe(angle_consumers[i]);
+        for (uint32_t i = 0; i < position_consumers.size(); i++)
+            sources.geometry_builders[position_consumers[i].geo_idx]->pipe(position_consumers[i].consumer);
+        for (uint32_t i = 0; i < num_outputs; i++)
+            if (outputs[i])
+                sources.recorder->output(i).pipe(outputs[i]);
+    }
+    void disconnect_sources(const StreamSources &sources) {
+        for (uint32_t i = 0; i < angle_consumers.size(); i++)
+            sources.pulse_processor->Producer<SensorAnglesFrame>::unpipe(angle_consumers[i]);
+        for (uint32_t i = 0; i < position_consumers.size(); i++)
+            sources.geometry_builders[position_consumers[i].geo_idx]->unpipe(position_consumers[i].consumer);
+        for (uint32_t i = 0; i < num_outputs; i++)
+            if (outputs[i])
+                sources.recorder->output(i).unpipe(outputs[i]);
     }
 
-    // Create Data Frame Decoders for all defined base stations.
-    for (uint32_t i = 0; i < settings.base_stations().size(); i++) {
-        auto node = pipeline->add_back(std::make_unique<DataFrameDecoder>(i));
-        pulse_processor->Producer<DataFrameBit>::pipe(node);
+    // Takes over queued output data and debug modes of the streams this pipeline replaces.
+    void continue_from(const StreamsPipeline &prev) {
+        for (uint32_t i = 0; i < num_outputs; i++)
+            if (outputs[i] && prev.outputs[i])
+                outputs[i]->continue_from(*prev.outputs[i]);
+        if (debug_node && prev.debug_node)
+            debug_node->continue_from(*prev.debug_node);
     }
 
+    struct PositionLink {
+        uint32_t geo_idx;
+        Consumer<ObjectPosition> *consumer;
+    };
+    Vector<Consumer<SensorAnglesFrame> *, max_num_inputs> angle_consumers;
+    Vector<PositionLink, max_num_inputs> position_consumers;
+    OutputNode *outputs[num_outputs] = {};
+    DebugNode *debug_node = nullptr;
+};
+
+static std::unique_ptr<StreamsPipeline> create_streams(const PersistentSettings &settings, const StreamSources &sources,
+                                                       Pipeline *main_pipeline, LiveSettings *live_settings) {
+    auto streams = std::make_unique<StreamsPipeline>();
+    Stage streams_stage = {streams.get(), sources.main_stage.thread};
+
     // Create Output Nodes
-    std::vector<std::unique_ptr<OutputNode>> output_nodes(num_outputs);
+    ArenaPtr<OutputNode> output_nodes[num_outputs];
     for (uint32_t i = 0; i < settings.outputs().size(); i++) {
         auto &def = settings.outputs()[i];
         if (def.active) {
-            output_nodes[i] = OutputNode::create(i, def);
+            output_nodes[i] = OutputNode::create(streams->arena(), i, def);
             // NOTE: We defer adding node to the pipeline until after formatter nodes.
         }
     }
@@ -60,57 +120,216 @@ std::unique_ptr<Pipeline> create_vive_sensor_pipeline(const PersistentSettings &
     for (uint32_t i = 0; i < settings.formatters().size(); i++) {
         auto &def = settings.formatters()[i];
         FormatterNode *formatter;
+        Stage stage = streams_stage;
         switch (def.formatter_type) {
             case FormatterType::kAngles: {
-                auto node = pipeline->add_back(std::make_unique<SensorAnglesTextFormatter>(i, def));
-                pulse_processor->Producer<SensorAnglesFrame>::pipe(node);
+                auto node = streams->emplace_back<SensorAnglesTextFormatter>(i, def);
+                streams->angle_consumers.push(node);
                 formatter = node;
                 break;
             }
             // TODO: case FormatterType::kDataFrame:
             case FormatterType::kPosition: {
-                if (def.input_idx >= geometry_builders.size())
+                if (def.input_idx >= sources.geometry_builders.size())
                     throw_printf("Geometry builder g%d not found.", def.input_idx);
-                Producer<ObjectPosition> *geometry_source = geometry_builders[def.input_idx];
-
-                // Convert coordinate system if needed.
-                if (auto coord_conv = CoordinateSystemConverter::create(def.coord_sys_type, def.coord_sys_params)) {
-                    auto node = pipeline->add_back(std::move(coord_conv));
-                    geometry_source->pipe(node); 
-                    geometry_source = node;
-                }
-
-                // Instantiate the concrete subtype of a geometry formatter.
-                auto node = pipeline->add_back(GeometryFormatter::create(i, def));
-                geometry_source->pipe(node); 
+
+                // Instantiate the concrete subtype of a geometry formatter. It works in the same thread as its source:
+                // in a worker pipeline, if any, it's connected right away.
+                const Stage &geometry_stage = sources.geometry_stages[def.input_idx];
+                if (geometry_stage.pipeline != sources.main_stage.pipeline)
+                    stage = geometry_stage;
+                // Coordinate conversions of the stream are composed into one transform.
+                auto node = stage.pipeline->add_back(GeometryFormatter::create(stage.pipeline->arena(), i, def));
+                if (stage.pipeline == streams.get())
+                    streams->position_consumers.push({def.input_idx, node});
+                else
+                    sources.geometry_builders[def.input_idx]->pipe(node);
                 formatter = node;
                 break;
             }
+            case FormatterType::kTelemetry: {
+                // Collects counters of the whole main pipeline, including these streams.
+                formatter = streams->emplace_back<TelemetryFormatter>(i, def, main_pipeline);
+                break;
+            }
             default: 
                 throw_printf("Unknown formatter type: %d", def.formatter_type);
         }
 
         // pipe formatter to the output.
-        if (def.output_idx < output_nodes.size() && output_nodes[def.output_idx])
-            formatter->pipe(output_nodes[def.output_idx].get());
-        else
+        if (def.output_idx < num_outputs && output_nodes[def.output_idx]) {
+            connect<DataChunk>(formatter, stage, output_nodes[def.output_idx].get(), streams_stage);
+            output_nodes[def.output_idx]->set_drop_policy(i, def.drop_policy);
+            if (Consumer<DataChunk> *consumer = formatter->output_data_consumer())
+                connect<DataChunk>(output_nodes[def.output_idx].get(), streams_stage, consumer, stage);
+        } else
             throw_printf("Uninitialized output %d given for stream %d", def.output_idx, i);
     }
 
     // Add Output Nodes to pipeline. It's preferable to do it last to keep the order of execution straight.
-    std::vector<OutputNode *> outputs(num_outputs);
-    for (uint32_t i = 0; i < output_nodes.size(); i++)
+    for (uint32_t i = 0; i < num_outputs; i++)
         if (output_nodes[i])
-            outputs[i] = pipeline->add_back(std::move(output_nodes[i]));
+            streams->outputs[i] = streams->add_back(std::move(output_nodes[i]));
 
     // Append Debug node to make it possible to print what's going on.
     // TODO: Make it configurable which output to pipe to.
-    if (OutputNode *debug_output = outputs[0]) {
-        auto debug_node = pipeline->add_back(std::make_unique<DebugNode>(pipeline.get()));
+    if (OutputNode *debug_output = streams->outputs[0]) {
+        auto debug_node = streams->emplace_back<DebugNode>(main_pipeline, live_settings);
         debug_node->Producer<DataChunk>::pipe(debug_output);
         debug_node->Producer<OutputCommand>::pipe(debug_output);
         debug_output->pipe(debug_node);
+        streams->debug_node = debug_node;
+    }
+
+    return streams;
+}
+
+// Owns the streams pipeline and replaces it when stream or output definitions change, so the rest of the pipeline
+// (and PulseProcessor's cycle lock in particular) isn't affected. Other changes still need a restart.
+// Changes are applied to the settings the pipeline was created with. The replacement continues where the current
+// output and debug nodes are: queued data, exclusive and debug modes are carried over.
+// NOTE: With worker threads, position formatters are in worker pipelines and can't be replaced safely from the main
+// thread, so live changes are disabled.
+class StreamsNode : public WorkerNode, public LiveSettings, public DefinitionValidator {
+public:
+    StreamsNode(PersistentSettings &settings, const StreamSources &sources, Pipeline *main_pipeline)
+        : settings_(settings)
+        , sources_(sources)
+        , main_pipeline_(main_pipeline)
+        , streams_(create_streams(settings_, sources_, main_pipeline_, this)) {
+        streams_->connect_sources(sources_);
+    }
+
+    virtual const PersistentSettings &settings() const { return settings_; }
+
+    virtual void change(HashedWord *input_words, PrintStream &stream) {
+        switch (*input_words) {
+        case "stream#"_hash:
+        case "usb_serial"_hash:
+        case "serial#"_hash:
+            break;
+        default:
+            stream.printf("Only streams and outputs can be changed live. Use '!' to restart in configuration mode.\n");
+            return;
+        }
+        for (uint32_t i = 0; i < sources_.geometry_stages.size(); i++)
+            if (sources_.geometry_stages[i].pipeline != sources_.main_stage.pipeline) {
+                stream.printf("Live changes are not supported with worker threads.\n");
+                return;
+            }
+
+        // The definition is changed in place and restored if validate() fails.
+        if (settings_.set_definition(input_words, stream, this))
+            stream.printf("Streams will be restarted. Use 'save' to keep the change after reboot.\n");
     }
 
+    // Creates the replacement right away to report errors; it's started in do_work(), outside of the calls of the
+    // current nodes.
+    virtual bool validate(const PersistentSettings &settings, PrintStream &error_stream) {
+        try {
+            next_streams_ = create_streams(settings, sources_, main_pipeline_, this);
+        }
+        catch (const ValidationException &e) {
+            error_stream.printf("Validation error: %s\n", e.what());
+            return false;
+        }
+        return true;
+    }
+
+    virtual void do_work(Timestamp cur_time) {
+        if (next_streams_) {
+            // Current nodes are deleted before the new ones are started, as they use the same hardware.
+            streams_->disconnect_sources(sources_);
+            next_streams_->continue_from(*streams_);
+            streams_ = std::move(next_streams_);
+            streams_->connect_sources(sources_);
+            streams_->start();
+        }
+        streams_->do_work(cur_time);
+    }
+    virtual Timestamp next_work_time(Timestamp cur_time) {
+        return next_streams_ ? cur_time : streams_->next_work_time(cur_time);
+    }
+    virtual void start() { streams_->start(); }
+    virtual bool debug_cmd(HashedWord *input_words) { return streams_->debug_cmd(input_words); }
+    virtual void debug_print(PrintStream &stream) { streams_->debug_print(stream); }
+    virtual void collect_telemetry(BinaryTelemetryPacket &packet) { streams_->collect_telemetry(packet); }
+
+private:
+    PersistentSettings &settings_;
+    StreamSources sources_;
+    Pipeline *main_pipeline_;
+    std::unique_ptr<StreamsPipeline> streams_;
+    std::unique_ptr<StreamsPipeline> next_streams_;
+};
+
+
+// ====  Pipeline  ============================================================
+
+// Create Pipeline specialized for Vive Sensors, using provided configuration settings.
+// In this function we create and interconnect all needed WorkerNodes to make project work.
+// NOTE: This function will also be called for validation purposes, so no hardware changes should be made.
+// (move all hardware changes to start() methods)
+std::unique_ptr<Pipeline> create_vive_sensor_pipeline(PersistentSettings &settings, PipelineThreads *threads) {
+
+    // Create pipeline itself.
+    auto pipeline = std::make_unique<Pipeline>();
+    // Sources are copied by StreamsNode, so this one is only needed here; arena keeps it off the stack.
+    ArenaPtr<StreamSources> sources_ptr = pipeline->arena().make<StreamSources>();
+    StreamSources &sources = *sources_ptr;
+    sources.main_stage = {pipeline.get(), threads ? threads->main_thread() : nullptr};
+
+    // Create central element PulseProcessor.
+    auto pulse_processor = pipeline->emplace_back<PulseProcessor>(settings.inputs().size());
+    sources.pulse_processor = pulse_processor;
+
+    // Flight recorder keeps recent pulses, angles and positions. It's connected to each source after the nodes
+    // processing its values, so it gets them first and records are in the order the values were produced.
+    Vector<uint32_t, max_num_inputs> input_pins;
+    for (uint32_t i = 0; i < settings.inputs().size(); i++)
+        input_pins.push(settings.inputs()[i].pin);
+    auto recorder = pipeline->emplace_back<FlightRecorder>(input_pins);
+    sources.recorder = recorder;
+
+    // Create input nodes as configured.
+    for (uint32_t i = 0; i < settings.inputs().size(); i++) {
+        auto &def = settings.inputs()[i];
+        auto node = pipeline->add_front(InputNode::create(pipeline->arena(), i, def));
+        node->pipe(pulse_processor);
+        node->pipe(recorder);
+    }    
+
+    // Create geometry builders as configured. They are distributed between worker threads, if any.
+    for (uint32_t i = 0; i < settings.geo_builders().size(); i++) {
+        auto &def = settings.geo_builders()[i];
+        Stage stage = sources.main_stage;
+        if (threads && threads->num_workers() > 0) {
+            uint32_t worker_idx = i % threads->num_workers();
+            stage = {threads->worker_pipeline(worker_idx), threads->worker(worker_idx)};
+        }
+        auto node = stage.pipeline->emplace_back<PointGeometryBuilder>(i, def, settings.base_stations());
+        connect<SensorAnglesFrame>(pulse_processor, sources.main_stage, node, stage);
+        sources.geometry_builders.push(node);
+        sources.geometry_stages.push(stage);
+        connect<ObjectPosition>(node, stage, recorder, sources.main_stage);
+    }
+    pulse_processor->Producer<SensorAnglesFrame>::pipe(recorder);
+
+    // Debug commands, debug print and telemetry reach nodes of the worker pipelines through call bridges.
+    for (uint32_t i = 0; threads && i < threads->num_workers(); i++) {
+        Pipeline *worker_pipeline = threads->worker_pipeline(i);
+        auto target = worker_pipeline->emplace_front<PipelineCallTarget>(worker_pipeline);
+        pipeline->emplace_back<PipelineCallBridge>(target, threads->worker(i));
+    }
+
+    // Create Data Frame Decoders for all defined base stations.
+    for (uint32_t i = 0; i < settings.base_stations().size(); i++) {
+        auto node = pipeline->emplace_back<DataFrameDecoder>(i);
+        pulse_processor->Producer<DataFrameBit>::pipe(node);
+    }
+
+    // Formatters, outputs and debug node go last to keep the order of execution straight.
+    pipeline->emplace_back<StreamsNode>(settings, sources, pipeline.get());
+
     return pipeline;
 }
@@ -0,0 +1,379 @@
+// Micro-benchmarks. They are hidden from the default test run; use 'main-test [benchmark]' to run them.
+// NOTE: Numbers are only meaningful relative to each other; host CPU is much faster than the target MCUs.
+#include <catch.hpp>
+#include "formatters.h"
+#include "outputs.h"
+#include "primitives/workers.h"
+#include "primitives/static_pipeline.h"
+#include "pulse_processor.h"
+#include "thread_bridge.h"
+#include <stdio.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+namespace {
+
+// Counts the bytes sent by a producer.
+struct ByteCounter : Consumer<DataChunk> {
+    virtual void consume(const DataChunk &chunk) { bytes += chunk.data.size(); }
+    uint64_t bytes = 0;
+};
+
+// Output that counts written bytes. Hardware accepts 'chunk_limit' bytes between do_work() calls.
+class CountingOutputNode : public OutputNode {
+public:
+    CountingOutputNode(size_t chunk_limit) : OutputNode(1, OutputDef{true, 115200, false}), bytes(0),
+        chunk_limit_(chunk_limit), available_(chunk_limit) {}
+    virtual size_t write(const uint8_t *buffer, size_t size) {
+        bytes += size;
+        available_ -= std::min(available_, size);
+        return size;
+    }
+    virtual size_t read(uint8_t *buffer, size_t size) { return 0; }
+    virtual size_t write_available() { return available_; }
+    virtual void do_work(Timestamp cur_time) {
+        available_ = chunk_limit_;
+        OutputNode::do_work(cur_time);
+    }
+    uint64_t bytes;
+
+private:
+    size_t chunk_limit_, available_;
+};
+
+// Pipeline stage passing ObjectPosition-s through. First stage generates them in do_work(), last one counts them.
+struct RelayNode : WorkerNode, Consumer<ObjectPosition>, Producer<ObjectPosition> {
+    RelayNode(bool source) : source(source), received(0) {}
+    virtual void do_work(Timestamp cur_time) {
+        if (source)
+            produce(ObjectPosition{cur_time, 0, FixLevel::kFullFix, {}, 0.f, {1.f, 0.f, 0.f, 0.f}, {}});
+    }
+    virtual void consume(const ObjectPosition &pos) {
+        received++;
+        produce(pos);
+    }
+    bool source;
+    uint64_t received;
+};
+
+// Counts chunks that end a message; can be read from another thread.
+struct MessageCounter : Consumer<DataChunk> {
+    virtual void consume(const DataChunk &chunk) {
+        if (chunk.last_chunk)
+            messages.fetch_add(1, std::memory_order_relaxed);
+    }
+    std::atomic<uint64_t> messages{0};
+};
+
+// Worker threads of the benchmark never sleep, so there's nothing to wake up.
+struct SpinningThread : PipelineThread {
+    virtual void wake() {}
+};
+
+// Records the values it consumes.
+template<typename T>
+struct Recorder : Consumer<T> {
+    virtual void consume(const T &val) { values.push_back(val); }
+    std::vector<T> values;
+};
+
+// Pulses of one sensor lit by 2 base stations, as in a real recording: each cycle has sync flashes of both base
+// stations and a sweep of the active one. Sync pulse lengths encode the phase of the cycle.
+std::vector<Pulse> synthetic_pulses(uint32_t num_cycles) {
+    const float sync_lens_us[4][2] = {{65.5f, 107.2f}, {75.9f, 117.6f}, {107.2f, 65.5f}, {117.6f, 75.9f}};
+    const int sweep_offsets_us[4] = {4000, 4037, 4074, 4111};
+    const TimeDelta cycle_period(25000, (TimeUnit)1);  // 8333.3us
+    std::vector<Pulse> pulses;
+    Timestamp start = Timestamp() + TimeDelta(1000, msec);
+    for (uint32_t i = 0; i < num_cycles; i++, start += cycle_period) {
+        int phase = i % 4;
+        pulses.push_back({0, start, TimeDelta((int)(sync_lens_us[phase][0] * usec), (TimeUnit)1)});
+        pulses.push_back({0, start + TimeDelta(410, usec), TimeDelta((int)(sync_lens_us[phase][1] * usec), (TimeUnit)1)});
+        pulses.push_back({0, start + TimeDelta(sweep_offsets_us[phase], usec), TimeDelta((int)(12.5f * usec), (TimeUnit)1)});
+    }
+    return pulses;
+}
+
+// Base stations from the example settings.
+Vector<BaseStationGeometryDef, num_base_stations> example_base_stations() {
+    Vector<BaseStationGeometryDef, num_base_stations> base_stations;
+    base_stations.push({{-0.841840f, 0.332160f, -0.425400f, -0.046900f, 0.740190f, 0.670760f, 0.537680f, 0.584630f,
+                         -0.607540f}, {-1.528180f, 2.433750f, -1.969390f}});
+    base_stations.push({{0.458350f, -0.649590f, 0.606590f, 0.028970f, 0.693060f, 0.720300f, -0.888300f, -0.312580f,
+                         0.336480f}, {1.718700f, 2.543170f, 0.725060f}});
+    return base_stations;
+}
+
+// Run 'fn' 'iterations' times and return average time in nanoseconds.
+template<typename Fn>
+double measure_ns(uint32_t iterations, Fn fn) {
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < iterations; i++)
+        fn(i);
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+}
+
+}  // namespace
+
+TEST_CASE("Position formatters: bytes per frame and encode cost", "[.][benchmark]") {
+    const uint32_t iterations = 100000;
+    const FormatterSubtype subtypes[] = {FormatterSubtype::kPosText, FormatterSubtype::kPosMavlink,
+                                         FormatterSubtype::kPosBinary};
+    const char *names[] = {"text", "mavlink", "binary"};
+
+    for (int t = 0; t < 3; t++) {
+        FormatterDef def = {};
+        def.formatter_type = FormatterType::kPosition;
+        def.formatter_subtype = subtypes[t];
+        Arena arena;
+        auto formatter = GeometryFormatter::create(arena, 0, def, CoordinateTransform::identity());
+        ByteCounter counter;
+        formatter->pipe(&counter);
+
+        ObjectPosition pos = {Timestamp(), 0, FixLevel::kFullFix, {1.2345f, -0.5432f, 2.1f}, 0.001f,
+                              {1.f, 0.f, 0.f, 0.f}, {1e-6f, 0.f, 0.f, 1e-6f, 0.f, 1e-6f}};
+        double ns = measure_ns(iterations, [&](uint32_t i) {
+            pos.pos[0] += 1e-5f;  // Small movements to pass mavlink outlier filter and vary the text.
+            formatter->consume(pos);
+        });
+        printf("%-8s %6.1f bytes/frame %8.1f ns/frame\n", names[t], (double)counter.bytes / iterations, ns);
+    }
+}
+
+TEST_CASE("Number formatting: format_fixed vs vsnprintf", "[.][benchmark]") {
+    struct BufferStream : PrintStream {
+        virtual size_t write(const char *buffer, size_t size) { len += size; return size; }
+        size_t len = 0;
+    } stream;
+    const uint32_t iterations = 1000000;
+    float val = -12.3456f;
+
+    double printf_ns = measure_ns(iterations, [&](uint32_t i) {
+        stream.printf("%.4f\t%u", val + i * 1e-4f, i);
+    });
+    size_t printf_len = stream.len;
+    stream.len = 0;
+    double fast_ns = measure_ns(iterations, [&](uint32_t i) {
+        stream.print_fixed(val + i * 1e-4f, 4);
+        stream.print('\t');
+        stream.print_uint(i);
+    });
+    REQUIRE(stream.len == printf_len);
+    printf("vsnprintf %8.1f ns/call\nfast      %8.1f ns/call\n", printf_ns, fast_ns);
+}
+
+TEST_CASE("Formatter to output throughput", "[.][benchmark]") {
+    const uint32_t iterations = 100000;
+    const FormatterSubtype subtypes[] = {FormatterSubtype::kPosText, FormatterSubtype::kPosBinary};
+    const char *names[] = {"text", "binary"};
+    // Fast path writes directly; limited hardware buffer makes every message go through the queue.
+    const size_t chunk_limits[] = {(size_t)-1, 16};
+    const char *modes[] = {"direct", "queued"};
+
+    for (int t = 0; t < 2; t++)
+        for (int m = 0; m < 2; m++) {
+            FormatterDef def = {};
+            def.formatter_type = FormatterType::kPosition;
+            def.formatter_subtype = subtypes[t];
+            Arena arena;
+            auto formatter = GeometryFormatter::create(arena, 0, def, CoordinateTransform::identity());
+            CountingOutputNode output(chunk_limits[m]);
+            output.set_drop_policy(0, DropPolicy::kNeverDrop);
+            formatter->pipe(&output);
+
+            ObjectPosition pos = {Timestamp(), 0, FixLevel::kFullFix, {1.2345f, -0.5432f, 2.1f}, 0.001f,
+                                  {1.f, 0.f, 0.f, 0.f}, {1e-6f, 0.f, 0.f, 1e-6f, 0.f, 1e-6f}};
+            double ns = measure_ns(iterations, [&](uint32_t i) {
+                pos.pos[0] += 1e-5f;
+                formatter->consume(pos);
+                output.do_work(Timestamp());
+            });
+            REQUIRE(output.bytes > 0);
+            double bytes_per_frame = (double)output.bytes / iterations;
+            printf("%-6s %-6s %8.1f ns/frame %8.1f MB/s\n", names[t], modes[m], ns, bytes_per_frame / ns * 1e3);
+        }
+}
+
+TEST_CASE("Pipeline message throughput", "[.][benchmark]") {
+    const uint32_t iterations = 1000000;
+    const int num_stages = 5;
+
+    Pipeline pipeline;
+    RelayNode *stages[num_stages];
+    for (int i = 0; i < num_stages; i++) {
+        stages[i] = pipeline.emplace_back<RelayNode>(i == 0);
+        if (i > 0)
+            stages[i - 1]->pipe(stages[i]);
+    }
+
+    double ns = measure_ns(iterations, [&](uint32_t i) {
+        pipeline.do_work(Timestamp());
+    });
+    REQUIRE(stages[num_stages - 1]->received == iterations);
+    printf("%d stages: %8.1f ns/message %8.2f M messages/s\n", num_stages, ns, 1e3 / ns);
+}
+
+TEST_CASE("Pipeline scaling with worker threads", "[.][benchmark]") {
+    const uint32_t iterations = 20000;
+    const uint32_t num_objects = 8;
+    const uint32_t worker_counts[] = {0, 1, 2, 4};
+
+    for (uint32_t num_workers : worker_counts) {
+        // Main pipeline produces positions of all objects; object i is formatted in worker i % num_workers.
+        SpinningThread worker_threads[4];
+        Pipeline main_pipeline, worker_pipelines[4];
+        MessageCounter counter;
+        std::vector<ThreadBridge<ObjectPosition> *> bridges;
+        for (uint32_t i = 0; i < num_objects; i++) {
+            auto source = main_pipeline.emplace_back<RelayNode>(true);
+            FormatterDef def = {};
+            def.formatter_type = FormatterType::kPosition;
+            def.formatter_subtype = FormatterSubtype::kPosText;
+            Pipeline &pipeline = num_workers > 0 ? worker_pipelines[i % num_workers] : main_pipeline;
+            auto formatter = pipeline.add_back(GeometryFormatter::create(pipeline.arena(), i, def, CoordinateTransform::identity()));
+            formatter->pipe(&counter);
+            if (num_workers > 0) {
+                auto bridge = pipeline.emplace_back<ThreadBridge<ObjectPosition>>(&worker_threads[i % num_workers]);
+                bridges.push_back(bridge);
+                source->pipe(bridge);
+                bridge->pipe(formatter);
+            } else {
+                source->pipe(formatter);
+            }
+        }
+
+        std::atomic<bool> stop(false);
+        std::vector<std::thread> threads;
+        for (uint32_t w = 0; w < num_workers; w++)
+            threads.emplace_back([&, w]() {
+                while (!stop.load(std::memory_order_relaxed)) {
+                    worker_pipelines[w].do_work(Timestamp());
+                    if (worker_pipelines[w].next_work_time(Timestamp()) != Timestamp())
+                        std::this_thread::yield();  // Idle; matters when there are fewer cores than threads.
+                }
+            });
+
+        auto start = std::chrono::steady_clock::now();
+        for (uint32_t i = 0; i < iterations; i++)
+            main_pipeline.do_work(Timestamp());
+        // Bridges drop positions when a worker falls behind; they count too.
+        auto num_handled = [&]() {
+            uint64_t num = counter.messages.load(std::memory_order_relaxed);
+            for (auto bridge : bridges)
+                num += bridge->dropped_messages();
+            return num;
+        };
+        while (num_handled() < (uint64_t)iterations * num_objects)
+            std::this_thread::yield();
+        auto end = std::chrono::steady_clock::now();
+        stop = true;
+        for (auto &thread : threads)
+            thread.join();
+
+        double ns = std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+        uint64_t dropped = num_handled() - counter.messages.load();
+        printf("%u objects, %u worker threads (%u cores): %8.1f ns/frame, %.1f%% dropped\n", num_objects, num_workers,
+               std::thread::hardware_concurrency(), ns, 100.0 * dropped / (iterations * num_objects));
+    }
+}
+
+TEST_CASE("Static vs dynamic pipeline: cost per pulse and per frame", "[.][benchmark]") {
+    const uint32_t num_cycles = 100000;
+    const std::vector<Pulse> pulses = synthetic_pulses(num_cycles);
+    const auto base_stations = example_base_stations();
+    GeometryBuilderDef geo_def = {};
+    geo_def.sensors.push({0, {0.f, 0.f, 0.f}});
+    FormatterDef formatter_def = {};
+    formatter_def.formatter_type = FormatterType::kPosition;
+    formatter_def.formatter_subtype = FormatterSubtype::kPosBinary;
+    const CoordinateTransform transform = CoordinateTransform::identity();
+    const size_t output_chunk_limit = 1 << 20;
+
+    // Angle frames produced from the pulses, to measure the frame path alone.
+    Recorder<SensorAnglesFrame> frames;
+    {
+        PulseProcessor pulse_processor(1);
+        pulse_processor.Producer<SensorAnglesFrame>::pipe(&frames);
+        for (const Pulse &pulse : pulses) {
+            pulse_processor.consume(pulse);
+            pulse_processor.do_work(pulse.start_time);
+        }
+    }
+    REQUIRE(frames.values.size() > num_cycles / 5);  // Full set of angles every 4 cycles.
+
+    // Dynamic: nodes in a Pipeline, connected with pipe(); pulses enter through Consumer<Pulse>, like from inputs.
+    uint64_t dynamic_bytes[2];
+    double dynamic_pulse_ns, dynamic_frame_ns;
+    {
+        Pipeline pipeline;
+        auto pulse_processor = pipeline.emplace_back<PulseProcessor>(1);
+        auto builder = pipeline.emplace_back<PointGeometryBuilder>(0, geo_def, base_stations);
+        auto formatter = pipeline.emplace_back<GeometryBinaryFormatter>(0, formatter_def, transform);
+        auto output = pipeline.emplace_back<CountingOutputNode>(output_chunk_limit);
+        output->set_drop_policy(0, DropPolicy::kNeverDrop);
+        pulse_processor->Producer<SensorAnglesFrame>::pipe(builder);
+        builder->pipe(formatter);
+        formatter->pipe(output);
+
+        Consumer<Pulse> *input = pulse_processor;
+        dynamic_pulse_ns = measure_ns(pulses.size(), [&](uint32_t i) {
+            input->consume(pulses[i]);
+            pipeline.do_work(pulses[i].start_time);
+        });
+        dynamic_bytes[0] = output->bytes;
+    }
+    {
+        Pipeline pipeline;
+        auto builder = pipeline.emplace_back<PointGeometryBuilder>(0, geo_def, base_stations);
+        auto formatter = pipeline.emplace_back<GeometryBinaryFormatter>(0, formatter_def, transform);
+        auto output = pipeline.emplace_back<CountingOutputNode>(output_chunk_limit);
+        output->set_drop_policy(0, DropPolicy::kNeverDrop);
+        builder->pipe(formatter);
+        formatter->pipe(output);
+
+        Consumer<SensorAnglesFrame> *input = builder;
+        dynamic_frame_ns = measure_ns(frames.values.size(), [&](uint32_t i) {
+            input->consume(frames.values[i]);
+            pipeline.do_work(frames.values[i].time);
+        });
+        dynamic_bytes[1] = output->bytes;
+    }
+
+    // Static: the same nodes as a StaticPipeline chain, values pass between them with direct calls. The frame path
+    // starts at the geometry builder.
+    uint64_t static_bytes[2];
+    double static_pulse_ns, static_frame_ns;
+    {
+        StaticPipeline<PulseProcessor, PointGeometryBuilder, GeometryBinaryFormatter, CountingOutputNode> pipeline(
+            std::forward_as_tuple(1), std::forward_as_tuple(0, geo_def, base_stations),
+            std::forward_as_tuple(0, formatter_def, transform), std::forward_as_tuple(output_chunk_limit));
+        pipeline.node<3>().set_drop_policy(0, DropPolicy::kNeverDrop);
+        static_pulse_ns = measure_ns(pulses.size(), [&](uint32_t i) {
+            pipeline.consume(pulses[i]);
+            pipeline.do_work(pulses[i].start_time);
+        });
+        static_bytes[0] = pipeline.node<3>().bytes;
+    }
+    {
+        StaticPipeline<PointGeometryBuilder, GeometryBinaryFormatter, CountingOutputNode> pipeline(
+            std::forward_as_tuple(0, geo_def, base_stations), std::forward_as_tuple(0, formatter_def, transform),
+            std::forward_as_tuple(output_chunk_limit));
+        pipeline.node<2>().set_drop_policy(0, DropPolicy::kNeverDrop);
+        static_frame_ns = measure_ns(frames.values.size(), [&](uint32_t i) {
+            pipeline.consume(frames.values[i]);
+            pipeline.do_work(frames.values[i].time);
+        });
+        static_bytes[1] = pipeline.node<2>().bytes;
+    }
+
+    // Both pipelines must have done the same work.
+    REQUIRE(dynamic_bytes[0] > 0);
+    REQUIRE(static_bytes[0] == dynamic_bytes[0]);
+    REQUIRE(static_bytes[1] == dynamic_bytes[1]);
+    printf("dynamic %8.1f ns/pulse %8.1f ns/frame\n", dynamic_pulse_ns, dynamic_frame_ns);
+    printf("static  %8.1f ns/pulse %8.1f ns/frame\n", static_pulse_ns, static_frame_ns);
+}
@@ -2,8 +2,15 @@
 #include "primitives/timestamp.h"
 #include "primitives/string_utils.h"
 #include "input.h"
+#include "primitives/workers.h"
+#include "settings.h"
+#include "debug_node.h"
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <algorithm>
+#include <thread>
 
 void set_led_state(LedState state) {
     // Do nothing
@@ -19,3 +26,40 @@ Timestamp Timestamp::cur_time() {
 uint32_t Timestamp::cur_time_millis() {
     return 0;
 }
+
+void wait_for_event(Timestamp deadline) {
+    std::this_thread::yield();  // Let other threads of thread bridge tests run.
+}
+
+void print_platform_memory_info(PrintStream &stream) {
+}
+
+void restart_system() {
+}
+
+// EEPROM in RAM. Starts erased, so settings start clean; tests that write to it erase it afterwards.
+uint8_t mock_eeprom[2048];
+uint32_t mock_eeprom_bytes_written = 0;
+uint32_t mock_eeprom_bytes_left = UINT32_MAX;  // Simulates power loss: further writes are dropped.
+
+void mock_eeprom_erase() {
+    memset(mock_eeprom, 0xFF, sizeof(mock_eeprom));
+    mock_eeprom_bytes_written = 0;
+    mock_eeprom_bytes_left = UINT32_MAX;
+}
+
+static bool mock_eeprom_initialized = (mock_eeprom_erase(), true);
+
+void eeprom_read(uint32_t eeprom_addr, void *dest, uint32_t len) {
+    assert(eeprom_addr + len <= sizeof(mock_eeprom));
+    memcpy(dest, mock_eeprom + eeprom_addr, len);
+}
+
+void eeprom_write(uint32_t eeprom_addr, const void *src, uint32_t len) {
+    assert(eeprom_addr + len <= sizeof(mock_eeprom));
+    len = std::min(len, mock_eeprom_bytes_left);
+    memcpy(mock_eeprom + eeprom_addr, src, len);
+    mock_eeprom_bytes_written += len;
+    if (mock_eeprom_bytes_left != UINT32_MAX)
+        mock_eeprom_bytes_left -= len;
+}
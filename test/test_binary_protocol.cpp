@@ -0,0 +1,147 @@
+#include <catch.hpp>
+#include "binary_protocol.h"
+#include "formatters.h"
+#include <math.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+
+TEST_CASE("COBS encoding round trips and has no zeros inside") {
+    std::mt19937 rng(1);
+    for (uint32_t len : {0, 1, 5, 253, 254, 255, 600}) {
+        std::vector<uint8_t> src(len), encoded(len + len / 254 + 1), decoded(encoded.size());
+        for (auto &b : src)
+            b = rng() % 4 == 0 ? 0 : rng() & 0xFF;
+        uint32_t encoded_len = cobs_encode(src.data(), len, encoded.data());
+        REQUIRE(encoded_len <= encoded.size());
+        for (uint32_t i = 0; i < encoded_len; i++)
+            REQUIRE(encoded[i] != 0);
+        REQUIRE(cobs_decode(encoded.data(), encoded_len, decoded.data()) == (int32_t)len);
+        REQUIRE(std::equal(src.begin(), src.end(), decoded.begin()));
+    }
+}
+
+TEST_CASE("Quaternion compression keeps precision") {
+    float q[4] = {0.3f, -0.5f, 0.7f, 0.1f};
+    float norm = sqrtf(q[0]*q[0] + q[1]*q[1] + q[2]*q[2] + q[3]*q[3]);
+    for (auto &v : q) v /= norm;
+
+    float res[4];
+    unpack_quaternion(pack_quaternion(q), res);
+    for (int i = 0; i < 4; i++)
+        REQUIRE(fabsf(res[i] - q[i]) < 0.002f);
+
+    float neg_q[4] = {-q[0], -q[1], -q[2], -q[3]};  // Same rotation.
+    unpack_quaternion(pack_quaternion(neg_q), res);
+    for (int i = 0; i < 4; i++)
+        REQUIRE(fabsf(res[i] - q[i]) < 0.002f);
+}
+
+struct ChunkCollector : Consumer<DataChunk> {
+    virtual void consume(const DataChunk &chunk) {
+        for (uint32_t i = 0; i < chunk.data.size(); i++)
+            data.push_back(chunk.data[i]);
+    }
+    std::vector<uint8_t> data;
+};
+
+TEST_CASE("Binary formatter produces decodable frames") {
+    FormatterDef def = {};
+    def.formatter_type = FormatterType::kPosition;
+    def.formatter_subtype = FormatterSubtype::kPosBinary;
+    Arena arena;
+    auto formatter = GeometryFormatter::create(arena, 0, def, CoordinateTransform::identity());
+    ChunkCollector collector;
+    formatter->pipe(&collector);
+
+    ObjectPosition pos = {Timestamp(), 1, FixLevel::kFullFix, {1.2345f, -0.5f, 2.f}, 0.f, {1.f, 0.f, 0.f, 0.f},
+                          {1e-6f, 0.f, 0.f, 1e-6f, 0.f, 2e-6f}};
+    formatter->consume(pos);
+    formatter->consume(pos);
+
+    REQUIRE(collector.data.size() <= 2 * binary_position_frame_max_size);
+    REQUIRE(collector.data.back() == 0);
+    auto delimiter = std::find(collector.data.begin(), collector.data.end(), 0);
+    BinaryPositionPacket packet;
+    REQUIRE(decode_position_frame(collector.data.data(), delimiter - collector.data.begin(), &packet));
+    REQUIRE(packet.object_idx == 1);
+    REQUIRE(packet.fix_level == (uint16_t)FixLevel::kFullFix);
+    REQUIRE(packet.seq == 0);
+    REQUIRE(packet.pos_mm[0] == 1235);
+    REQUIRE(packet.pos_mm[1] == -500);
+    REQUIRE(packet.pos_mm[2] == 2000);
+    REQUIRE(packet.pos_stddev_um == 2000);
+
+    // Corrupted frame is rejected.
+    collector.data[3] ^= 0x10;
+    REQUIRE(!decode_position_frame(collector.data.data(), delimiter - collector.data.begin(), &packet));
+}
+
+TEST_CASE("Telemetry formatter sends counters of its source periodically") {
+    struct TestSource : WorkerNode {
+        virtual void collect_telemetry(BinaryTelemetryPacket &packet) {
+            packet.cycle_fix_level = (uint16_t)FixLevel::kCycleSynced;
+            packet.sensor_pulses[2] = 123456;
+            packet.output_bytes_dropped[3] = 42;
+        }
+    } source;
+    FormatterDef def = {};
+    def.formatter_type = FormatterType::kTelemetry;
+    def.rate_hz = 10;
+    TelemetryFormatter formatter(0, def, &source);
+    struct LastChunkCounter : ChunkCollector {
+        virtual void consume(const DataChunk &chunk) {
+            ChunkCollector::consume(chunk);
+            messages += chunk.last_chunk;
+        }
+        uint32_t messages = 0;
+    } collector;
+    formatter.pipe(&collector);
+
+    Timestamp start;
+    REQUIRE(formatter.next_work_time(start) == start);
+    formatter.do_work(start);
+    REQUIRE(formatter.next_work_time(start) == start + TimeDelta(100, msec));
+    formatter.do_work(start + TimeDelta(100, msec));
+    REQUIRE(collector.messages == 2);  // Frame is larger than a chunk, but each is sent as one message.
+
+    auto delimiter = std::find(collector.data.begin(), collector.data.end(), 0);
+    REQUIRE(delimiter - collector.data.begin() + 1 <= (int)binary_telemetry_frame_max_size);
+    BinaryTelemetryPacket packet;
+    BinaryPositionPacket position;
+    REQUIRE(!decode_position_frame(collector.data.data(), delimiter - collector.data.begin(), &position));
+    REQUIRE(decode_telemetry_frame(collector.data.data(), delimiter - collector.data.begin(), &packet));
+    REQUIRE(packet.seq == 0);
+    REQUIRE(packet.cycle_fix_level == (uint16_t)FixLevel::kCycleSynced);
+    REQUIRE(packet.sensor_pulses[2] == 123456);
+    REQUIRE(packet.sensor_pulses[1] == 0);
+    REQUIRE(packet.output_bytes_dropped[3] == 42);
+
+    REQUIRE(decode_telemetry_frame(&*(delimiter + 1), collector.data.end() - delimiter - 2, &packet));
+    REQUIRE(packet.seq == 1);
+    REQUIRE(packet.time_usec == TimeDelta(100, msec).get_value(usec));
+}
+
+TEST_CASE("Telemetry formatter keeps its rate when run by a pipeline") {
+    for (uint32_t rate_hz : {1, 20}) {
+        FormatterDef def = {};
+        def.formatter_type = FormatterType::kTelemetry;
+        def.rate_hz = rate_hz;
+        Pipeline pipeline;
+        WorkerNode *source = pipeline.emplace_back<WorkerNode>();
+        TelemetryFormatter *formatter = pipeline.emplace_back<TelemetryFormatter>(0, def, source);
+        struct MessageCounter : Consumer<DataChunk> {
+            virtual void consume(const DataChunk &chunk) { messages += chunk.last_chunk; }
+            uint32_t messages = 0;
+        } counter;
+        formatter->pipe(&counter);
+
+        // Other nodes make the pipeline run often.
+        Timestamp time;
+        for (int i = 0; i < 3000; i++, time += TimeDelta(1, msec)) {
+            pipeline.do_work(time);
+            REQUIRE(pipeline.next_work_time(time) - time <= max_sleep_time);
+        }
+        REQUIRE(counter.messages == 3 * rate_hz);
+    }
+}
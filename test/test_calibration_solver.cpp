@@ -0,0 +1,113 @@
+#include <catch.hpp>
+#include "calibration_solver.h"
+#include <math.h>
+#include <random>
+
+using namespace calibration;
+
+// Defined in geometry.cpp
+void calc_ray_vec(const BaseStationGeometryDef &bs, float angle1, float angle2, vec3d &ray, vec3d &origin);
+
+static Mat3 rotation(double yaw, double pitch) {  // Rotate around Y axis, then around X axis.
+    Mat3 ry = {cos(yaw), 0, sin(yaw), 0, 1, 0, -sin(yaw), 0, cos(yaw)};
+    Mat3 rx = {1, 0, 0, 0, cos(pitch), -sin(pitch), 0, sin(pitch), cos(pitch)};
+    Mat3 res;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            res[i*3+j] = ry[i*3+0]*rx[0*3+j] + ry[i*3+1]*rx[1*3+j] + ry[i*3+2]*rx[2*3+j];
+    return res;
+}
+
+TEST_CASE("Angles prediction is consistent with calc_ray_vec") {
+    Pose base = {rotation(0.3, -0.4), {1, 2, 3}};
+    Vec3 pt = {0.2, -0.1, 0.5};
+    double angles[2];
+    CalibrationSolver::predict_angles(base, pt, angles);
+
+    BaseStationGeometryDef def;
+    for (int i = 0; i < 9; i++) def.mat[i] = base.rot[i];
+    for (int i = 0; i < 3; i++) def.origin[i] = base.pos[i];
+    vec3d ray, origin;
+    calc_ray_vec(def, angles[0], angles[1], ray, origin);
+
+    Vec3 expected = {pt[0] - base.pos[0], pt[1] - base.pos[1], pt[2] - base.pos[2]};
+    double len = sqrt(expected[0]*expected[0] + expected[1]*expected[1] + expected[2]*expected[2]);
+    for (int i = 0; i < 3; i++)
+        REQUIRE(ray[i] == Approx(expected[i] / len).epsilon(1e-4));
+}
+
+TEST_CASE("Calibration solver recovers base station geometry from a moving rig") {
+    std::vector<Vec3> rig = {{0, 0, 0}, {0.1, 0, 0}, {0, 0.08, 0}, {0.1, 0.08, 0.02}};
+    Pose true_bases[num_base_stations] = {
+        {rotation(0.6, -0.5), {2, 2.2, 3}},
+        {rotation(-2.5, -0.4), {-2, 2.4, -2.5}},
+    };
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> pos_dist(-1, 1), angle_dist(-0.5, 0.5);
+    std::normal_distribution<double> noise(0, 1e-4);
+
+    std::vector<CalibrationFrame> frames;
+    for (uint32_t f = 0; f < 200; f++) {
+        // First frame is the reference one: rig is at the origin.
+        Pose rig_pose = {rotation(0, 0), {0, 0, 0}};
+        if (f > 0)
+            rig_pose = {rotation(angle_dist(rng) * 2, angle_dist(rng)), {pos_dist(rng), pos_dist(rng) + 1, pos_dist(rng)}};
+
+        CalibrationFrame frame = {f * 33, {}};
+        for (uint32_t s = 0; s < rig.size(); s++) {
+            Vec3 pt;
+            for (int i = 0; i < 3; i++)
+                pt[i] = rig_pose.rot[i*3+0]*rig[s][0] + rig_pose.rot[i*3+1]*rig[s][1] + rig_pose.rot[i*3+2]*rig[s][2] +
+                        rig_pose.pos[i];
+            for (uint32_t b = 0; b < num_base_stations; b++) {
+                AngleSample sample = {s, b, {}};
+                CalibrationSolver::predict_angles(true_bases[b], pt, sample.angles);
+                if (f > 0) {
+                    sample.angles[0] += noise(rng);
+                    sample.angles[1] += noise(rng);
+                }
+                frame.samples.push_back(sample);
+            }
+        }
+        frames.push_back(frame);
+    }
+    // Add a few outliers, like reflections.
+    frames[10].samples[0].angles[0] += 0.05;
+    frames[20].samples[3].angles[1] -= 0.1;
+
+    CalibrationSolver solver(rig, frames, 4);
+    std::string error;
+    REQUIRE(solver.initialize_base_stations(&error));
+    SolverSummary summary = solver.solve(100, &error);
+    REQUIRE(error.empty());
+    REQUIRE(summary.converged);
+    REQUIRE(summary.num_frames == 200);
+    REQUIRE(summary.final_rms < summary.initial_rms);
+
+    for (uint32_t b = 0; b < num_base_stations; b++) {
+        BaseStationGeometryDef def = solver.base_station_def(b);
+        for (int i = 0; i < 3; i++)
+            REQUIRE(fabs(def.origin[i] - true_bases[b].pos[i]) < 0.01);
+        for (int i = 0; i < 9; i++)
+            REQUIRE(fabs(def.mat[i] - true_bases[b].rot[i]) < 0.005);
+    }
+}
+
+TEST_CASE("Angles lines are parsed with missing values") {
+    uint32_t sensor_idx, time_ms;
+    int32_t fix_level;
+    double angles[num_cycle_phases];
+    bool valid[num_cycle_phases];
+    REQUIRE(parse_angles_line("ANG1\t12345\t200\t0.1234\t-0.5000\t\t0.0100\n", &sensor_idx, &time_ms, &fix_level,
+                              angles, valid));
+    REQUIRE(sensor_idx == 1);
+    REQUIRE(time_ms == 12345);
+    REQUIRE(fix_level == 200);
+    REQUIRE(valid[0]); REQUIRE(angles[0] == Approx(0.1234));
+    REQUIRE(valid[1]); REQUIRE(angles[1] == Approx(-0.5));
+    REQUIRE(!valid[2]);
+    REQUIRE(valid[3]); REQUIRE(angles[3] == Approx(0.01));
+
+    REQUIRE(!parse_angles_line("POS0\t1\t2\n", &sensor_idx, &time_ms, &fix_level, angles, valid));
+}
@@ -0,0 +1,149 @@
+#include <catch.hpp>
+#include "flight_recorder.h"
+#include "trace_analyzer.h"
+#include "primitives/string_utils.h"
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct TextCollector : Consumer<DataChunk> {
+    virtual void consume(const DataChunk &chunk) {
+        text.append((const char *)&chunk.data[0], chunk.data.size());
+    }
+    std::string text;
+};
+
+std::vector<std::string> dump_lines(FlightRecorder &recorder, TextCollector &collector) {
+    Timestamp time;
+    for (int i = 0; i < 100000 && collector.text.find("# End") == std::string::npos; i++)
+        recorder.do_work(time);
+    std::vector<std::string> lines;
+    std::istringstream stream(collector.text);
+    for (std::string line; std::getline(stream, line);)
+        lines.push_back(line + "\n");
+    collector.text.clear();
+    return lines;
+}
+
+FlightRecorder *make_recorder(std::unique_ptr<FlightRecorder> &holder, TextCollector &collector) {
+    Vector<uint32_t, max_num_inputs> pins;
+    pins.push(14);
+    pins.push(15);
+    holder = std::make_unique<FlightRecorder>(pins);
+    holder->output(1).pipe(&collector);
+    return holder.get();
+}
+
+bool run_cmd(FlightRecorder &recorder, const char *cmd) {
+    char buf[64];
+    strcpy(buf, cmd);
+    return recorder.debug_cmd(hash_words(buf));
+}
+
+}  // namespace
+
+TEST_CASE("Flight recorder dumps a replayable trace") {
+    std::unique_ptr<FlightRecorder> holder;
+    TextCollector collector;
+    FlightRecorder &recorder = *make_recorder(holder, collector);
+
+    Timestamp start = Timestamp() + TimeDelta(1000000, usec);
+    recorder.consume(Pulse{0, start, TimeDelta(65, usec)});
+    recorder.consume(Pulse{1, start + TimeDelta(410, usec) + TimeDelta(1, (TimeUnit)1), TimeDelta(12, usec)});
+
+    SensorAnglesFrame frame = {};
+    frame.time = start + TimeDelta(500, usec);
+    frame.fix_level = FixLevel::kCycleSynced;
+    frame.cycle_idx = 1234;
+    frame.phase_id = 2;
+    frame.sensors.set_size(2);
+    frame.sensors[0].angles[2] = -0.12345f;
+    frame.sensors[0].updated_cycles[2] = 1234;
+    frame.sensors[1].updated_cycles[2] = 1230;  // Stale.
+    recorder.consume(frame);
+
+    ObjectPosition pos = {frame.time, 1, FixLevel::kFullFix, {0.1f, -2.f, 1.2345f}, 0.f, {1.f, 0.f, 0.f, 0.f}, {}};
+    recorder.consume(pos);
+
+    REQUIRE(recorder.size() < 40);  // Compact records.
+    REQUIRE(run_cmd(recorder, "recorder dump > serial1"));
+    auto lines = dump_lines(recorder, collector);
+    REQUIRE(lines.size() == 6);
+    REQUIRE(lines[0].find("# Flight recorder dump") == 0);
+    REQUIRE(lines[3] == "# ANG 1000500 cycle 1234 phase 2 fix 200 -0.12345 -\n");
+    REQUIRE(lines[4] == "# OBJ1 1000500 fix 1000 pos 0.1000 -2.0000 1.2345\n");
+    REQUIRE(lines[5] == "# End of flight recorder dump\n");
+
+    // Pulses are in the trace format with pins instead of input indexes.
+    TracePulse pulse;
+    REQUIRE(parse_trace_line(lines[1].c_str(), &pulse) == TraceLineType::kPulse);
+    REQUIRE(pulse.pin == 14);
+    REQUIRE(pulse.start_us == 1000000);
+    REQUIRE(pulse.len_us == Approx(65.f));
+    REQUIRE(parse_trace_line(lines[2].c_str(), &pulse) == TraceLineType::kPulse);
+    REQUIRE(pulse.pin == 15);
+    REQUIRE(pulse.start_us == 1000410);
+    REQUIRE(pulse.start_frac == Approx(0.33f));
+    REQUIRE(pulse.len_us == Approx(12.f));
+    REQUIRE(parse_trace_line(lines[3].c_str(), &pulse) == TraceLineType::kComment);
+
+    // Dumped records are not repeated.
+    REQUIRE(recorder.size() == 0);
+}
+
+TEST_CASE("Flight recorder keeps the latest records") {
+    std::unique_ptr<FlightRecorder> holder;
+    TextCollector collector;
+    FlightRecorder &recorder = *make_recorder(holder, collector);
+
+    Timestamp start;
+    const uint32_t num_pulses = 10000;
+    for (uint32_t i = 0; i < num_pulses; i++)
+        recorder.consume(Pulse{i % 2, start + TimeDelta(i * 250, usec), TimeDelta(10 + i % 100, usec)});
+    REQUIRE(recorder.size() <= flight_recorder_size);
+    REQUIRE(recorder.size() > flight_recorder_size - 10);
+
+    REQUIRE(run_cmd(recorder, "recorder dump > serial1"));
+    auto lines = dump_lines(recorder, collector);
+    REQUIRE(lines.size() > 1000);
+
+    // Times are restored correctly after the oldest records were dropped.
+    uint32_t first = num_pulses - (lines.size() - 2);
+    for (uint32_t i = 1; i < lines.size() - 1; i++) {
+        TracePulse pulse;
+        REQUIRE(parse_trace_line(lines[i].c_str(), &pulse) == TraceLineType::kPulse);
+        uint32_t idx = first + i - 1;
+        REQUIRE(pulse.pin == 14 + idx % 2);
+        REQUIRE(pulse.start_us == idx * 250);
+        REQUIRE(pulse.len_us == Approx(10 + idx % 100));
+    }
+}
+
+TEST_CASE("Flight recorder dumps automatically on fix loss") {
+    std::unique_ptr<FlightRecorder> holder;
+    TextCollector collector;
+    FlightRecorder &recorder = *make_recorder(holder, collector);
+    REQUIRE(run_cmd(recorder, "recorder auto > serial1"));
+
+    ObjectPosition pos = {Timestamp(), 0, FixLevel::kFullFix, {}, 0.f, {1.f, 0.f, 0.f, 0.f}, {}};
+    recorder.consume(pos);
+    pos.fix_level = FixLevel::kStaleFix;
+    recorder.consume(pos);
+    REQUIRE(collector.text.empty());
+
+    pos.fix_level = FixLevel::kPartialVis;
+    recorder.consume(pos);
+    REQUIRE(collector.text == "# Flight recorder dump, 15 bytes, 0 ms: object0 lost fix\n");
+    auto lines = dump_lines(recorder, collector);
+    REQUIRE(lines.size() == 5);
+    REQUIRE(lines[3] == "# OBJ0 0 fix 500\n");
+
+    REQUIRE(run_cmd(recorder, "recorder auto off"));
+    pos.fix_level = FixLevel::kFullFix;
+    recorder.consume(pos);
+    pos.fix_level = FixLevel::kNoSignals;
+    recorder.consume(pos);
+    REQUIRE(collector.text.empty());
+}
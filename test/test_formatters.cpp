@@ -0,0 +1,107 @@
+#include <catch.hpp>
+#include "formatters.h"
+#include <string>
+#include <vector>
+
+namespace {
+
+struct LineCollector : Consumer<DataChunk> {
+    virtual void consume(const DataChunk &chunk) {
+        cur.append((const char *)&chunk.data[0], chunk.data.size());
+        if (chunk.last_chunk) {
+            lines.push_back(cur);
+            cur.clear();
+        }
+    }
+    std::vector<std::string> lines;
+    std::string cur;
+};
+
+struct StringPrintStream : PrintStream {
+    virtual size_t write(const char *buffer, size_t size) { str.append(buffer, size); return size; }
+    std::string str;
+};
+
+FormatterDef position_def(uint16_t rate_hz, bool rate_average) {
+    FormatterDef def = {};
+    def.formatter_type = FormatterType::kPosition;
+    def.formatter_subtype = FormatterSubtype::kPosText;
+    def.rate_hz = rate_hz;
+    def.rate_average = rate_average;
+    return def;
+}
+
+ObjectPosition position_at(uint32_t time_ms, float x) {
+    return {Timestamp() + TimeDelta(time_ms, msec), 0, FixLevel::kFullFix, {x, 0.f, 0.f}, 0.f, {1.f, 0.f, 0.f, 0.f},
+            {}};
+}
+
+}  // namespace
+
+TEST_CASE("Rate limit keeps steady cadence") {
+    Arena arena;
+    auto formatter = GeometryFormatter::create(arena, 0, position_def(10, false), CoordinateTransform::identity());
+    LineCollector collector;
+    formatter->pipe(&collector);
+
+    // 30 Hz input with some jitter for 1 second.
+    for (uint32_t i = 0; i < 30; i++)
+        formatter->consume(position_at(i * 33 + (i % 3), 0.f));
+    REQUIRE(collector.lines.size() == 10);
+
+    // The latest frame after each period boundary is sent; no catching up after a gap.
+    collector.lines.clear();
+    formatter->consume(position_at(5000, 0.f));
+    formatter->consume(position_at(5050, 0.f));
+    formatter->consume(position_at(5100, 0.f));
+    REQUIRE(collector.lines.size() == 2);
+    REQUIRE(collector.lines[0].compare(0, 9, "OBJ0\t5000") == 0);
+    REQUIRE(collector.lines[1].compare(0, 9, "OBJ0\t5100") == 0);
+}
+
+TEST_CASE("Rate limit averages positions") {
+    Arena arena;
+    auto formatter = GeometryFormatter::create(arena, 0, position_def(10, true), CoordinateTransform::identity());
+    LineCollector collector;
+    formatter->pipe(&collector);
+
+    formatter->consume(position_at(0, 5.f));  // First one is sent right away.
+    for (uint32_t i = 1; i <= 4; i++)
+        formatter->consume(position_at(i * 25, (float)i));
+    REQUIRE(collector.lines.size() == 2);
+    // Average of 1, 2, 3, 4 at average time of 25, 50, 75, 100 ms.
+    REQUIRE(collector.lines[1] == "OBJ0\t62\t1000\t2.5000\t0.0000\t0.0000\t0.0000\n");
+
+    // Positions without a fix are not averaged.
+    ObjectPosition no_fix = position_at(150, 100.f);
+    no_fix.fix_level = FixLevel::kCycleSynced;
+    formatter->consume(no_fix);
+    formatter->consume(position_at(200, 7.f));
+    REQUIRE(collector.lines.size() == 3);
+    REQUIRE(collector.lines[2] == "OBJ0\t200\t1000\t7.0000\t0.0000\t0.0000\t0.0000\n");
+}
+
+TEST_CASE("Rate option is parsed and printed") {
+    char line[] = "position object0 rate 10 avg drop newest > serial2";
+    FormatterDef def = {};
+    StringPrintStream err;
+    REQUIRE(def.parse_def(3, hash_words(line), err));
+    REQUIRE(def.rate_hz == 10);
+    REQUIRE(def.rate_average);
+
+    StringPrintStream out;
+    def.print_def(3, out);
+    REQUIRE(out.str == "stream3 position object0 rate 10 avg drop newest > serial2\n");
+
+    char angles_avg[] = "angles rate 10 avg > usb_serial";
+    REQUIRE(!def.parse_def(3, hash_words(angles_avg), err));
+    char zero_rate[] = "angles rate 0 > usb_serial";
+    REQUIRE(!def.parse_def(3, hash_words(zero_rate), err));
+
+    char telemetry[] = "telemetry rate 5 > serial1";
+    REQUIRE(def.parse_def(4, hash_words(telemetry), err));
+    REQUIRE(def.formatter_type == FormatterType::kTelemetry);
+    out.str.clear();
+    def.print_def(4, out);
+    REQUIRE(out.str == "stream4 telemetry rate 5 > serial1\n");
+}
@@ -0,0 +1,147 @@
+#include <catch.hpp>
+#include "geometry.h"
+#include <math.h>
+#include <vector>
+
+// Defined in geometry.cpp
+bool intersect_planes_weighted(const Vector<BaseStationGeometryDef, num_base_stations> &base_stations,
+                               const SensorAngles &sens, vec3d &pos, float (&covariance)[6]);
+
+namespace {
+
+// Two base stations looking at the origin from +Z and +X directions.
+Vector<BaseStationGeometryDef, num_base_stations> test_base_stations() {
+    Vector<BaseStationGeometryDef, num_base_stations> base_stations;
+    base_stations.push({{1, 0, 0,  0, 1, 0,  0, 0, 1}, {0, 0, 3}});
+    base_stations.push({{0, 0, 1,  0, 1, 0,  -1, 0, 0}, {3, 0, 0}});
+    return base_stations;
+}
+
+// Angles of both base stations to a sensor at 'target'.
+SensorAngles sensor_angles(const Vector<BaseStationGeometryDef, num_base_stations> &base_stations,
+                           const vec3d &target) {
+    SensorAngles sens = {};
+    for (int b = 0; b < num_base_stations; b++) {
+        const BaseStationGeometryDef &bs = base_stations[b];
+        float d[3], l[3];
+        for (int i = 0; i < 3; i++)
+            d[i] = target[i] - bs.origin[i];
+        for (int i = 0; i < 3; i++)
+            l[i] = bs.mat[0*3 + i] * d[0] + bs.mat[1*3 + i] * d[1] + bs.mat[2*3 + i] * d[2];
+        sens.angles[b*2 + 0] = atan2f(-l[0], -l[2]);
+        sens.angles[b*2 + 1] = atan2f(l[1], -l[2]);
+    }
+    for (int i = 0; i < num_cycle_phases; i++)
+        sens.angle_variances[i] = 1e-8f;
+    return sens;
+}
+
+struct PositionRecorder : Consumer<ObjectPosition> {
+    virtual void consume(const ObjectPosition &pos) { positions.push_back(pos); }
+    std::vector<ObjectPosition> positions;
+};
+
+}  // namespace
+
+TEST_CASE("CoordinateTransform composes translations and rotations in order") {
+    CoordSysDef ned_def;
+    ned_def.ned.north_angle = 0.f;
+    vec3d sensor_offset = {-0.1f, 0.f, 0.f}, user_offset = {0.f, 0.f, 1.f};
+    CoordinateTransform transform = CoordinateTransform::translation(sensor_offset)
+        .then(CoordinateTransform::coord_sys(CoordSysType::kNED, ned_def))
+        .then(CoordinateTransform::translation(user_offset));
+    REQUIRE(!transform.is_identity());
+
+    ObjectPosition pos = {Timestamp(), 0, FixLevel::kFullFix, {1.f, 2.f, 3.f}, 0.f, {1.f, 0.f, 0.f, 0.f}};
+    ObjectPosition res;
+    transform.apply(pos, &res);
+
+    // NED with zero north angle: N = -X, E = -Z, D = -Y.
+    REQUIRE(res.pos[0] == Approx(-0.9f));
+    REQUIRE(res.pos[1] == Approx(-3.f));
+    REQUIRE(res.pos[2] == Approx(-2.f + 1.f));
+    REQUIRE(res.q[0] == 1.f);  // No rotation info stays that way.
+
+    // Orientation is rotated by the same rotation as position. Object turned 90 deg around X has its X, Y, Z axes
+    // along X, Z, -Y of Vive coordinates, which are (-1, 0, 0), (0, -1, 0) and (0, 0, 1) in NED. That's a turn by
+    // 180 deg around D, i.e. q = (0, 0, 0, 1).
+    pos.q[0] = sqrtf(0.5f); pos.q[1] = sqrtf(0.5f);
+    transform.apply(pos, &res);
+    REQUIRE(fabsf(res.q[0]) < 1e-6f);
+    REQUIRE(fabsf(res.q[1]) < 1e-6f);
+    REQUIRE(fabsf(res.q[2]) < 1e-6f);
+    REQUIRE(fabsf(res.q[3]) == Approx(1.f));  // q and -q are the same rotation.
+}
+
+TEST_CASE("CoordinateTransform::for_stream matches the composed chain") {
+    CoordSysDef ned_def;
+    ned_def.ned.north_angle = 30.f;
+    vec3d user_offset = {1.f, 2.f, 3.f};
+    CoordinateTransform chain = CoordinateTransform::coord_sys(CoordSysType::kNED, ned_def)
+        .then(CoordinateTransform::translation(user_offset));
+    CoordinateTransform transform = CoordinateTransform::for_stream(CoordSysType::kNED, ned_def, user_offset);
+
+    for (int i = 0; i < 9; i++)
+        REQUIRE(transform.mat[i] == chain.mat[i]);
+    for (int i = 0; i < vec3d_size; i++)
+        REQUIRE(transform.offset[i] == Approx(chain.offset[i]));
+    for (int i = 0; i < 4; i++)
+        REQUIRE(transform.q_rot[i] == Approx(chain.q_rot[i]));
+}
+
+TEST_CASE("CoordinateTransform::rotation is consistent with its matrix") {
+    float mat[9] = {0.f, -1.f, 0.f,  1.f, 0.f, 0.f,  0.f, 0.f, 1.f};  // 90 deg around Z.
+    CoordinateTransform transform = CoordinateTransform::rotation(mat);
+    REQUIRE(transform.q_rot[0] == Approx(0.7071068f));
+    REQUIRE(transform.q_rot[3] == Approx(0.7071068f));
+    REQUIRE(CoordinateTransform::identity().is_identity());
+}
+
+TEST_CASE("Weighted plane intersection finds the point and its covariance") {
+    Vector<BaseStationGeometryDef, num_base_stations> base_stations = test_base_stations();
+    vec3d target = {0.1f, 0.2f, -0.1f};
+    SensorAngles sens = sensor_angles(base_stations, target);
+
+    vec3d pos = {0.f, 0.f, 0.f};
+    float cov[6];
+    REQUIRE(intersect_planes_weighted(base_stations, sens, pos, cov));
+    for (int i = 0; i < 3; i++)
+        REQUIRE(fabsf(pos[i] - target[i]) < 1e-3f);
+    REQUIRE(cov[0] > 0.f);
+    REQUIRE(cov[3] > 0.f);
+    REQUIRE(cov[5] > 0.f);
+
+    // Covariance scales with angle variance.
+    for (int i = 0; i < num_cycle_phases; i++)
+        sens.angle_variances[i] = 4e-8f;
+    float cov4[6];
+    REQUIRE(intersect_planes_weighted(base_stations, sens, pos, cov4));
+    REQUIRE(cov4[0] == Approx(cov[0] * 4));
+    REQUIRE(cov4[3] == Approx(cov[3] * 4));
+}
+
+TEST_CASE("PointGeometryBuilder compensates position of the sensor on the object") {
+    Vector<BaseStationGeometryDef, num_base_stations> base_stations = test_base_stations();
+    GeometryBuilderDef def = {};
+    def.sensors.push({0, {0.05f, 0.f, -0.02f}});
+    PointGeometryBuilder builder(0, def, base_stations);
+    PositionRecorder recorder;
+    builder.pipe(&recorder);
+
+    vec3d sensor_pos = {0.1f, 0.2f, -0.1f};
+    SensorAnglesFrame frame = {};
+    frame.fix_level = FixLevel::kCycleSynced;
+    frame.cycle_idx = 100;
+    frame.phase_id = 3;
+    frame.sensors.push(sensor_angles(base_stations, sensor_pos));
+    for (int i = 0; i < num_cycle_phases; i++)
+        frame.sensors[0].updated_cycles[i] = frame.cycle_idx - (num_cycle_phases - 1 - i);
+    builder.consume(frame);
+
+    // All consumers (formatters, flight recorder) get the object position: sensor position minus its offset.
+    REQUIRE(recorder.positions.size() == 1);
+    const ObjectPosition &pos = recorder.positions[0];
+    REQUIRE(pos.fix_level == FixLevel::kFullFix);
+    for (int i = 0; i < 3; i++)
+        REQUIRE(fabsf(pos.pos[i] - (sensor_pos[i] - def.sensors[0].pos[i])) < 1e-3f);
+}
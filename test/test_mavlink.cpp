@@ -0,0 +1,224 @@
+#include <catch.hpp>
+#include "formatters.h"
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+namespace {
+
+struct ChunkCollector : Consumer<DataChunk> {
+    virtual void consume(const DataChunk &chunk) {
+        for (uint32_t i = 0; i < chunk.data.size(); i++)
+            bytes.push_back(chunk.data[i]);
+        stream_idx = chunk.stream_idx;
+        last_chunk = chunk.last_chunk;
+    }
+    std::vector<uint8_t> bytes;
+    uint32_t stream_idx = 0;
+    bool last_chunk = false;
+};
+
+// CRC-16/MCRF4XX as used by mavlink.
+uint16_t mavlink_crc(const uint8_t *data, uint32_t len, uint16_t crc = 0xFFFF) {
+    for (uint32_t i = 0; i < len; i++) {
+        uint8_t tmp = data[i] ^ (uint8_t)(crc & 0xFF);
+        tmp ^= (tmp << 4);
+        crc = (crc >> 8) ^ (tmp << 8) ^ (tmp << 3) ^ (tmp >> 4);
+    }
+    return crc;
+}
+
+// Returns the zero-padded payload of the mavlink v2 frame starting at bytes[0]; trailing zeros are trimmed in frames.
+std::vector<uint8_t> frame_payload(const std::vector<uint8_t> &bytes, uint32_t msgid, uint32_t payload_len) {
+    REQUIRE(bytes.size() >= 12);
+    REQUIRE(bytes[0] == 0xFD);
+    REQUIRE((bytes[7] | bytes[8] << 8 | bytes[9] << 16) == msgid);
+    REQUIRE(bytes[1] <= payload_len);
+    REQUIRE(bytes.size() >= 12u + bytes[1]);
+    std::vector<uint8_t> payload(payload_len, 0);
+    memcpy(payload.data(), &bytes[10], bytes[1]);
+    return payload;
+}
+
+float payload_float(const std::vector<uint8_t> &payload, uint32_t offset) {
+    float res;
+    memcpy(&res, &payload[offset], sizeof(res));
+    return res;
+}
+
+ObjectPosition full_fix_position(Timestamp time, float x, float y, float z, const float q[4]) {
+    ObjectPosition pos = {};
+    pos.time = time;
+    pos.fix_level = FixLevel::kFullFix;
+    pos.pos[0] = x; pos.pos[1] = y; pos.pos[2] = z;
+    for (int i = 0; i < 4; i++)
+        pos.q[i] = q[i];
+    pos.pos_covariance[0] = 0.01f;  // xx
+    pos.pos_covariance[3] = 0.02f;  // yy
+    pos.pos_covariance[5] = 0.04f;  // zz
+    return pos;
+}
+
+}  // namespace
+
+TEST_CASE("Millis wrap counter extends millis to 64 bits") {
+    MillisWrapCounter counter;
+    REQUIRE(counter.extend(0xF0000000u) == 0xF0000000ull);
+    REQUIRE(counter.extend(0xFFFFFFF0u) == 0xFFFFFFF0ull);
+    REQUIRE(counter.extend(0x10u) == 0x100000010ull);
+
+    // Value read before the wrap by another thread keeps its wrap count and doesn't change the state.
+    REQUIRE(counter.extend(0xFFFFFFF8u) == 0xFFFFFFF8ull);
+    REQUIRE(counter.extend(0x20u) == 0x100000020ull);
+
+    // Seeing the clock once every quarter of the period is enough to count all wraps.
+    uint64_t millis = 0x100000020ull;
+    for (int i = 0; i < 9; i++) {
+        millis += 0x40000000u;
+        REQUIRE(counter.extend((uint32_t)millis) == millis);
+    }
+    REQUIRE(millis >> 32 == 3);
+}
+
+TEST_CASE("Mavlink ODOMETRY has body frame velocity and covariances") {
+    FormatterDef def = {};
+    def.formatter_type = FormatterType::kPosition;
+    def.formatter_subtype = FormatterSubtype::kPosMavlinkOdometry;
+    Arena arena;
+    auto formatter = GeometryFormatter::create(arena, 0, def, CoordinateTransform::identity());
+    ChunkCollector collector;
+    formatter->pipe(&collector);
+
+    // Object is rotated 90 deg around z, so its body x axis is the local y axis. It moves along local x by 10 cm
+    // in 100 ms, which is 1 m/s along body -y.
+    const float s = sqrtf(0.5f);
+    const float q[4] = {s, 0, 0, s};
+    Timestamp time = Timestamp() + TimeDelta(1000, ms);
+    formatter->consume(full_fix_position(time, 0, 0, 0, q));
+    std::vector<uint8_t> payload = frame_payload(collector.bytes, 331, 233);
+    REQUIRE(std::isnan(payload_float(payload, 36)));  // No velocity yet.
+    REQUIRE(std::isnan(payload_float(payload, 144)));
+
+    collector.bytes.clear();
+    formatter->consume(full_fix_position(time + TimeDelta(100, ms), 0.1f, 0, 0, q));
+    payload = frame_payload(collector.bytes, 331, 233);
+    REQUIRE(payload_float(payload, 8) == Approx(0.1f));
+    for (int i = 0; i < 4; i++)
+        REQUIRE(payload_float(payload, 20 + 4*i) == q[i]);
+
+    // vx, vy, vz in body frame; angular speeds unknown.
+    REQUIRE(fabsf(payload_float(payload, 36)) < 1e-5f);
+    REQUIRE(payload_float(payload, 40) == Approx(-1));
+    REQUIRE(fabsf(payload_float(payload, 44)) < 1e-5f);
+    for (int i = 0; i < 3; i++)
+        REQUIRE(std::isnan(payload_float(payload, 48 + 4*i)));
+
+    // Upper triangles of 6x6 matrices: diagonal of the position part is at 0, 6, 11 and of the rotation part at 15,
+    // 18, 20. Position variances are known; rotation is known too, so its variance is not NaN.
+    const uint32_t pose_covariance = 60, velocity_covariance = 144;
+    REQUIRE(payload_float(payload, pose_covariance + 4*0) == 0.01f);
+    REQUIRE(payload_float(payload, pose_covariance + 4*6) == 0.02f);
+    REQUIRE(payload_float(payload, pose_covariance + 4*11) == 0.04f);
+    REQUIRE(payload_float(payload, pose_covariance + 4*1) == 0);
+    REQUIRE(payload_float(payload, pose_covariance + 4*15) == 0);
+
+    // Velocity variance is the largest of (var(t0) + var(t1)) / dt^2, i.e. 2 * 0.04 / 0.01.
+    for (int i : {0, 6, 11})
+        REQUIRE(payload_float(payload, velocity_covariance + 4*i) == Approx(8));
+    REQUIRE(payload_float(payload, velocity_covariance + 4*1) == 0);
+    for (int i : {15, 18, 20})
+        REQUIRE(std::isnan(payload_float(payload, velocity_covariance + 4*i)));
+
+    REQUIRE(payload[229] == 12);  // child_frame_id: MAV_FRAME_BODY_FRD
+    REQUIRE(payload[231] == 6);   // estimator_type: MAV_ESTIMATOR_TYPE_MOCAP
+}
+
+TEST_CASE("Mavlink VISION_POSITION_ESTIMATE has Euler angles of the rotation") {
+    FormatterDef def = {};
+    def.formatter_type = FormatterType::kPosition;
+    def.formatter_subtype = FormatterSubtype::kPosMavlinkVision;
+    Arena arena;
+    auto formatter = GeometryFormatter::create(arena, 0, def, CoordinateTransform::identity());
+    ChunkCollector collector;
+    formatter->pipe(&collector);
+
+    // Quaternion of intrinsic z-y'-x'' rotation by yaw, pitch and roll.
+    const float roll = 0.3f, pitch = -0.2f, yaw = 2.5f;
+    float cr = cosf(roll / 2), sr = sinf(roll / 2), cp = cosf(pitch / 2), sp = sinf(pitch / 2);
+    float cy = cosf(yaw / 2), sy = sinf(yaw / 2);
+    const float q[4] = {
+        cr*cp*cy + sr*sp*sy,
+        sr*cp*cy - cr*sp*sy,
+        cr*sp*cy + sr*cp*sy,
+        cr*cp*sy - sr*sp*cy,
+    };
+    formatter->consume(full_fix_position(Timestamp() + TimeDelta(1000, ms), 1, 2, -3, q));
+    std::vector<uint8_t> payload = frame_payload(collector.bytes, 102, 117);
+    REQUIRE(payload_float(payload, 8) == 1);
+    REQUIRE(payload_float(payload, 12) == 2);
+    REQUIRE(payload_float(payload, 16) == -3);
+    REQUIRE(payload_float(payload, 20) == Approx(roll));
+    REQUIRE(payload_float(payload, 24) == Approx(pitch));
+    REQUIRE(payload_float(payload, 28) == Approx(yaw));
+    REQUIRE(payload_float(payload, 32) == 0.01f);  // covariance[0], xx
+}
+
+TEST_CASE("Mavlink formatter answers TIMESYNC requests") {
+    FormatterDef def = {};
+    def.formatter_type = FormatterType::kPosition;
+    def.formatter_subtype = FormatterSubtype::kPosMavlinkOdometry;
+    Arena arena;
+    auto formatter = GeometryFormatter::create(arena, 3, def, CoordinateTransform::identity());
+    Consumer<DataChunk> *input = formatter->output_data_consumer();
+    REQUIRE(input != nullptr);
+    ChunkCollector collector;
+    formatter->pipe(&collector);
+
+    // TIMESYNC request: tc1 = 0, ts1 = 0x0102030405060708. Mavlink v2 frame, msgid 111, crc_extra 34.
+    const int64_t ts1 = 0x0102030405060708ll;
+    uint8_t payload[16] = {};
+    memcpy(&payload[8], &ts1, sizeof(ts1));
+    std::vector<uint8_t> frame = {0xFD, sizeof(payload), 0, 0, 7, 1, 1, 111, 0, 0};
+    frame.insert(frame.end(), payload, payload + sizeof(payload));
+    uint16_t crc = mavlink_crc(&frame[1], frame.size() - 1);
+    uint8_t crc_extra = 34;
+    crc = mavlink_crc(&crc_extra, 1, crc);
+    frame.push_back(crc & 0xFF);
+    frame.push_back(crc >> 8);
+
+    // Send it in two chunks with some garbage before.
+    DataChunk chunk = {};
+    const uint8_t garbage[] = {'a', 0x55, 0};
+    for (uint8_t c : garbage) chunk.data.push(c);
+    for (uint32_t i = 0; i < 10; i++) chunk.data.push(frame[i]);
+    input->consume(chunk);
+    REQUIRE(collector.bytes.empty());
+    chunk.data.clear();
+    for (uint32_t i = 10; i < frame.size(); i++) chunk.data.push(frame[i]);
+    input->consume(chunk);
+
+    // Reply echoes ts1 and is sent as a control stream, not as stream data.
+    std::vector<uint8_t> &reply = collector.bytes;
+    REQUIRE(reply.size() >= 12);
+    REQUIRE(reply[0] == 0xFD);
+    REQUIRE(reply[7] == 111);
+    REQUIRE(collector.last_chunk);
+    REQUIRE(collector.stream_idx != 3);
+    uint8_t reply_payload[16] = {};
+    memcpy(reply_payload, &reply[10], reply[1]);
+    int64_t reply_ts1;
+    memcpy(&reply_ts1, &reply_payload[8], sizeof(reply_ts1));
+    REQUIRE(reply_ts1 == ts1);
+    uint16_t reply_crc = mavlink_crc(&reply[1], 9 + reply[1]);
+    reply_crc = mavlink_crc(&crc_extra, 1, reply_crc);
+    REQUIRE(reply[10 + reply[1]] == (reply_crc & 0xFF));
+    REQUIRE(reply[11 + reply[1]] == (reply_crc >> 8));
+
+    // Corrupted frames are ignored.
+    collector.bytes.clear();
+    frame[12] ^= 1;
+    chunk.data.clear();
+    for (uint8_t c : frame) chunk.data.push(c);
+    input->consume(chunk);
+    REQUIRE(collector.bytes.empty());
+}
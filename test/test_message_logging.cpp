@@ -0,0 +1,102 @@
+#include <catch.hpp>
+#include "data_frame_decoder.h"
+#include "geometry.h"
+#include "input.h"
+#include "primitives/string_utils.h"
+#include <string.h>
+#include <algorithm>
+#include <string>
+
+namespace {
+
+struct StringPrintStream : PrintStream {
+    virtual size_t write(const char *buffer, size_t size) { str.append(buffer, size); return size; }
+    std::string str;
+};
+
+class TestInputNode : public InputNode {
+public:
+    TestInputNode() : InputNode(0) {}
+    void add_pulses(uint32_t num, TimeDelta len) {
+        Timestamp time;
+        for (uint32_t i = 0; i < num; i++)
+            enqueue_pulse(time, len);
+        do_work(time);
+    }
+};
+
+bool run_cmd(WorkerNode &node, const char *cmd) {
+    char buf[64];
+    strcpy(buf, cmd);
+    return node.debug_cmd(hash_words(buf));
+}
+
+std::string print_logs(WorkerNode &node) {
+    StringPrintStream stream;
+    node.debug_print(stream);
+    return stream.str;
+}
+
+}  // namespace
+
+TEST_CASE("Producer loggers filter and sample values") {
+    TestInputNode node;
+
+    REQUIRE(run_cmd(node, "sensor0 pulses count"));
+    node.add_pulses(3, TimeDelta(10, usec));
+    node.add_pulses(2, TimeDelta(100, usec));
+    REQUIRE(print_logs(node) == "Pulse0: 5 items\n");
+
+    REQUIRE(run_cmd(node, "sensor0 pulses count len > 50"));
+    node.add_pulses(3, TimeDelta(10, usec));
+    node.add_pulses(2, TimeDelta(100, usec));
+    REQUIRE(print_logs(node) == "Pulse0: 2 items\n");
+
+    REQUIRE(run_cmd(node, "sensor0 pulses count len < 50 sensor = 0"));
+    node.add_pulses(3, TimeDelta(10, usec));
+    node.add_pulses(2, TimeDelta(100, usec));
+    REQUIRE(print_logs(node) == "Pulse0: 3 items\n");
+
+    // Sampled values are copied and printed; all matching ones are counted.
+    REQUIRE(run_cmd(node, "sensor0 pulses show len > 50 every 10"));
+    node.add_pulses(20, TimeDelta(100, usec));
+    node.add_pulses(20, TimeDelta(10, usec));
+    std::string logs = print_logs(node);
+    REQUIRE(logs.find("(20 total)") != std::string::npos);
+    REQUIRE(std::count(logs.begin(), logs.end(), '|') == 1);  // 2 values shown.
+
+    // Fields that pulses don't have and malformed filters are rejected.
+    REQUIRE(!run_cmd(node, "sensor0 pulses show fix < 800"));
+    REQUIRE(!run_cmd(node, "sensor0 pulses show len 50"));
+    REQUIRE(!run_cmd(node, "sensor0 pulses show every 0"));
+    REQUIRE(!run_cmd(node, "sensor0 pulses show color = 1"));
+    REQUIRE(run_cmd(node, "sensor0 pulses off"));
+    REQUIRE(print_logs(node) == "");
+}
+
+TEST_CASE("Logged positions and data frames keep their printf format") {
+    // Same format as "\n%dms: fix %2d, pos %.4f %.4f %.4f, dist %.4f ".
+    GeometryBuilderDef geo_def = {};
+    geo_def.sensors.push({});
+    Vector<BaseStationGeometryDef, num_base_stations> base_stations;
+    for (uint32_t i = 0; i < num_base_stations; i++)
+        base_stations.push({});
+    PointGeometryBuilder builder(0, geo_def, base_stations);
+    REQUIRE(run_cmd(builder, "geom0 show"));
+    ObjectPosition pos = {};
+    pos.fix_level = FixLevel::kStaleFix;
+    pos.pos[0] = 1.5f; pos.pos[1] = -2; pos.pos[2] = 0.25f;
+    pos.pos_delta = 0.01f;
+    pos.q[0] = 1;
+    builder.produce(pos);
+    REQUIRE(print_logs(builder) == "ObjectPosition0: \n0ms: fix  8, pos 1.5000 -2.0000 0.2500, dist 0.0100 (1 total)\n");
+
+    // Bytes of unknown frames are in uppercase hex, like "%02X ".
+    DataFrameDecoder decoder(1);
+    REQUIRE(run_cmd(decoder, "dataframe1 show"));
+    DataFrame frame = {};
+    frame.bytes.push(0xAB);
+    frame.bytes.push(0x05);
+    decoder.produce(frame);
+    REQUIRE(print_logs(decoder) == "DataFrame1: \n0ms: bytes AB 05 (1 total)\n");
+}
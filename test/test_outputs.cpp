@@ -0,0 +1,205 @@
+#include <catch.hpp>
+#include "outputs.h"
+#include <string>
+
+namespace {
+
+// Output that accepts a limited number of bytes on each do_work, like a slow UART.
+class MockOutputNode : public OutputNode {
+public:
+    MockOutputNode(bool polling = false) : OutputNode(1, OutputDef{true, 9600, polling}), available(0) {
+        if (polling)
+            allocate_poll_slots(arena);
+    }
+
+    virtual size_t write(const uint8_t *buffer, size_t size) {
+        // Blocking write: takes everything.
+        written.append((const char *)buffer, size);
+        available -= std::min(available, size);
+        return size;
+    }
+    virtual size_t read(uint8_t *buffer, size_t size) {
+        size_t len = input.copy((char *)buffer, size);
+        input.erase(0, len);
+        return len;
+    }
+    virtual size_t write_available() { return available; }
+
+    Arena arena;
+    std::string written, input;
+    size_t available;
+};
+
+DataChunk make_chunk(uint32_t stream_idx, const std::string &str, bool last_chunk = true) {
+    DataChunk chunk = {};
+    chunk.stream_idx = stream_idx;
+    chunk.last_chunk = last_chunk;
+    chunk.data.set_size(str.size());
+    for (uint32_t i = 0; i < str.size(); i++)
+        chunk.data[i] = str[i];
+    return chunk;
+}
+
+}  // namespace
+
+TEST_CASE("Output node queues data until the hardware accepts it") {
+    MockOutputNode node;
+    node.available = 3;
+    node.consume(make_chunk(0, "abcdef"));
+    REQUIRE(node.written == "");
+
+    node.do_work(Timestamp());
+    REQUIRE(node.written == "abc");
+    node.available = 100;
+    node.do_work(Timestamp());
+    REQUIRE(node.written == "abcdef");
+
+    // When queue is empty and the hardware has space, chunks are written right away.
+    node.consume(make_chunk(0, "gh"));
+    REQUIRE(node.written == "abcdefgh");
+}
+
+TEST_CASE("Output node drop policies") {
+    MockOutputNode node;
+    node.set_drop_policy(0, DropPolicy::kDropOldest);
+    node.set_drop_policy(1, DropPolicy::kDropNewest);
+    const std::string msg(60, 'x');
+
+    SECTION("Drop oldest keeps the most recent messages") {
+        uint32_t num_msgs = tx_queue_size / msg.size() + 5;
+        for (uint32_t i = 0; i < num_msgs; i++)
+            node.consume(make_chunk(0, msg.substr(2) + std::to_string(i % 10) + "\n"));
+        node.available = 100000;
+        node.do_work(Timestamp());
+        REQUIRE(node.written.size() == tx_queue_size / msg.size() * msg.size());
+        REQUIRE(node.written.substr(node.written.size() - 2) == std::to_string((num_msgs - 1) % 10) + "\n");
+    }
+
+    SECTION("Drop newest keeps the first messages") {
+        for (uint32_t i = 0; i < tx_queue_size / msg.size() + 5; i++)
+            node.consume(make_chunk(1, msg.substr(2) + std::to_string(i % 10) + "\n"));
+        node.available = 100000;
+        node.do_work(Timestamp());
+        REQUIRE(node.written.size() == tx_queue_size / msg.size() * msg.size());
+        REQUIRE(node.written.substr(msg.size() - 2, 2) == "0\n");
+    }
+
+    SECTION("Multi-chunk messages are dropped as a whole") {
+        for (uint32_t i = 0; i < tx_queue_size / msg.size(); i++)
+            node.consume(make_chunk(1, msg));
+        node.consume(make_chunk(1, "begin", false));  // Doesn't fit.
+        node.consume(make_chunk(1, "end"));
+        node.available = 100000;
+        node.do_work(Timestamp());
+        REQUIRE(node.written.find("begin") == std::string::npos);
+        REQUIRE(node.written.find("end") == std::string::npos);
+    }
+
+    SECTION("Streams without policy are never dropped") {
+        for (uint32_t i = 0; i < tx_queue_size / msg.size() + 5; i++)
+            node.consume(make_chunk(0x1000, msg));
+        REQUIRE(node.written.size() + debug_tx_queue_size >= (tx_queue_size / msg.size() + 5) * msg.size());
+        node.available = 100000;
+        node.do_work(Timestamp());
+        REQUIRE(node.written.size() == (tx_queue_size / msg.size() + 5) * msg.size());
+    }
+}
+
+TEST_CASE("Output node sends data streams before debug output without interleaving messages") {
+    MockOutputNode node;
+    node.set_drop_policy(0, DropPolicy::kDropOldest);
+    node.available = 0;
+    node.consume(make_chunk(0x1000, "debug1 ", false));
+    node.consume(make_chunk(0x1000, "debug1end\n"));
+    node.consume(make_chunk(0x1000, "debug2\n"));
+    node.consume(make_chunk(0, "pos1\n"));
+
+    // Data goes first.
+    node.available = 3;
+    node.do_work(Timestamp());
+    REQUIRE(node.written == "pos");
+
+    // Position received while debug message is being sent waits until the debug message is done.
+    node.available = 8;
+    node.do_work(Timestamp());
+    node.consume(make_chunk(0, "pos2\n"));
+    node.available = 100;
+    node.do_work(Timestamp());
+    REQUIRE(node.written == "pos1\ndebug1 debug1end\npos2\ndebug2\n");
+}
+
+TEST_CASE("Output node in polling mode sends latest complete messages on request") {
+    MockOutputNode node(true);
+    node.set_drop_policy(0, DropPolicy::kDropOldest);
+    node.available = 100;
+    node.consume(make_chunk(0, "pos1\n"));
+    node.consume(make_chunk(0, "pos2 ", false));
+    node.consume(make_chunk(0, "part2\n"));
+    node.consume(make_chunk(0x1000, "debug\n"));  // Non-data streams are sent as usual.
+    node.do_work(Timestamp());
+    REQUIRE(node.written == "debug\n");
+
+    node.input = "\x05";
+    node.do_work(Timestamp());
+    REQUIRE(node.written == "debug\npos2 part2\n");
+
+    // Incomplete messages are not sent.
+    node.consume(make_chunk(0, "pos3 ", false));
+    node.input = "\x05";
+    node.do_work(Timestamp());
+    REQUIRE(node.written == "debug\npos2 part2\npos2 part2\n");
+}
+
+TEST_CASE("Output node reads input in bulk and strips poll requests") {
+    struct Collector : Consumer<DataChunk> {
+        virtual void consume(const DataChunk &chunk) { received.append((const char *)&chunk.data[0], chunk.data.size()); }
+        std::string received;
+    } collector;
+    MockOutputNode node(true);
+    node.Producer<DataChunk>::pipe(&collector);
+    node.available = 100;
+
+    node.input = "ab\x05" "cd" + std::string(100, 'x');
+    node.do_work(Timestamp());  // Chunk is full: sent right away.
+    REQUIRE(collector.received == "abcd" + std::string(max_bytes_in_data_chunk - 4, 'x'));
+    node.do_work(Timestamp());
+    node.do_work(Timestamp() + TimeDelta(2, msec));  // Rest is sent after a pause.
+    REQUIRE(collector.received == "abcd" + std::string(100, 'x'));
+    REQUIRE(node.input.empty());
+}
+
+TEST_CASE("Output node counts transmit queue exhaustion") {
+    struct StringPrintStream : PrintStream {
+        virtual size_t write(const char *buffer, size_t size) { str.append(buffer, size); return size; }
+        std::string str;
+    } out;
+    MockOutputNode node;
+    node.set_drop_policy(0, DropPolicy::kDropNewest);
+    for (uint32_t i = 0; i < tx_queue_size / 60 + 2; i++)
+        node.consume(make_chunk(0, std::string(60, 'x')));
+
+    char cmd[] = "output1 tx";
+    REQUIRE(node.debug_cmd(hash_words(cmd)));
+    node.debug_print(out);
+    REQUIRE(out.str.find("in queue 1020 data bytes (peak 1020, full 2 times)") != std::string::npos);
+}
+
+TEST_CASE("Output node takes over queued data and exclusive mode of the node it replaces") {
+    MockOutputNode prev;
+    prev.set_drop_policy(0, DropPolicy::kDropOldest);
+    prev.consume(make_chunk(0, "pos1\n"));
+    prev.consume(make_chunk(0x1000, "debug1\n"));
+    prev.consume(make_chunk(0x1000, "debug2\n"));
+    prev.available = 8;
+    prev.do_work(Timestamp());  // debug1 is partially sent.
+    REQUIRE(prev.written == "pos1\ndeb");
+    prev.consume(OutputCommand{.type = OutputCommandType::kMakeExclusive, .stream_idx = 0x1000});
+
+    MockOutputNode node;
+    node.set_drop_policy(0, DropPolicy::kDropOldest);
+    node.continue_from(prev);
+    node.consume(make_chunk(0, "pos2\n"));  // Dropped in exclusive mode.
+    node.available = 100;
+    node.do_work(Timestamp());
+    REQUIRE(node.written == "ug1\ndebug2\n");
+}
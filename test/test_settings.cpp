@@ -0,0 +1,357 @@
+#include <catch.hpp>
+#include "settings.h"
+#include <string>
+#include <string.h>
+
+namespace {
+
+struct StringPrintStream : PrintStream {
+    virtual size_t write(const char *buffer, size_t size) { str.append(buffer, size); return size; }
+    std::string str;
+};
+
+std::string run_command(PersistentSettings &settings, const char *cmd) {
+    std::string cmd_str(cmd);
+    StringPrintStream stream;
+    settings.process_command(&cmd_str[0], stream);
+    return stream.str.substr(0, stream.str.rfind("config> "));
+}
+
+}  // namespace
+
+TEST_CASE("Settings changes are checked against other definitions") {
+    PersistentSettings settings;
+    REQUIRE(run_command(settings, "sensor0 pin 12 positive") == "Updated: sensor0 pin 12 positive cmp 20\n");
+    REQUIRE(run_command(settings, "sensor1 pin 12 negative") == 
+            "Validation error: Pin 12 is used by both sensor0 and sensor1.\n");
+    REQUIRE(settings.inputs().size() == 1);
+
+    REQUIRE(run_command(settings, "object0 sensor0") == 
+            "Validation error: 2 base stations must be defined to use geometry builders.\n");
+    run_command(settings, "base0 origin 0 0 0 matrix 1 0 0 0 1 0 0 0 1");
+    run_command(settings, "base1 origin 0 0 0 matrix 1 0 0 0 1 0 0 0 1");
+    REQUIRE(run_command(settings, "object0 sensor1") == "Validation error: Object 0 uses undefined sensor1.\n");
+    REQUIRE(run_command(settings, "object0 sensor0").find("Updated: ") == 0);
+
+    REQUIRE(run_command(settings, "stream0 position object1 > usb_serial") == 
+            "Validation error: Stream 0 uses undefined object1.\n");
+    REQUIRE(run_command(settings, "stream0 position object0 > serial1") == 
+            "Validation error: Uninitialized output 1 given for stream 0\n");
+    REQUIRE(run_command(settings, "stream0 position object0 > usb_serial").find("Updated: ") == 0);
+    REQUIRE(settings.formatters().size() == 1);
+}
+
+TEST_CASE("Pipeline is only constructed on final validation") {
+    // There are no input nodes in tests, so constructing the pipeline fails. Changing definitions doesn't notice that.
+    PersistentSettings settings;
+    REQUIRE(run_command(settings, "sensor0 pin 12 positive") == "Updated: sensor0 pin 12 positive cmp 20\n");
+    REQUIRE(run_command(settings, "validate").find("Validation error: Unknown/unimplemented input type") == 0);
+    REQUIRE(run_command(settings, "write").find("Validation error: ") == 0);
+    REQUIRE(settings.needs_configuration());
+}
+
+// EEPROM in RAM, see platform_mocks.cpp.
+extern uint8_t mock_eeprom[2048];
+extern uint32_t mock_eeprom_bytes_written;
+void mock_eeprom_erase();
+
+TEST_CASE("Settings storage only writes changed records") {
+    mock_eeprom_erase();
+    SettingsStorage storage;
+    REQUIRE(!storage.load());
+
+    uint32_t a = 1, b = 2, val;
+    uint8_t version;
+    REQUIRE(storage.read(1, 0, &version, &val, sizeof(val)) == -1);
+    REQUIRE(storage.write(1, 0, 3, &a, sizeof(a)));
+    REQUIRE(storage.write(1, 1, 3, &b, sizeof(b)));
+
+    uint32_t bytes_written = mock_eeprom_bytes_written;
+    REQUIRE(storage.write(1, 0, 3, &a, sizeof(a)));
+    REQUIRE(mock_eeprom_bytes_written == bytes_written);
+    REQUIRE(storage.write(1, 0, 4, &a, sizeof(a)));  // Version is part of the record.
+    REQUIRE(mock_eeprom_bytes_written > bytes_written);
+
+    SettingsStorage reloaded;
+    REQUIRE(reloaded.load());
+    REQUIRE(reloaded.read(1, 0, &version, &val, sizeof(val)) == sizeof(val));
+    REQUIRE((val == a && version == 4));
+    REQUIRE(reloaded.read(1, 1, &version, &val, 2) == sizeof(val));  // Truncated to given length.
+    REQUIRE(reloaded.read(2, 0, &version, &val, sizeof(val)) == -1);
+    mock_eeprom_erase();
+}
+
+TEST_CASE("Settings storage rotates pages and keeps live records") {
+    mock_eeprom_erase();
+    SettingsStorage storage;
+    uint8_t big[settings_max_payload] = {7}, val[settings_max_payload];
+    uint8_t version;
+    REQUIRE(storage.write(0, 0, 1, big, sizeof(big)));
+    REQUIRE(storage.write(0, 1, 1, big, 50));
+
+    // Many rewrites of a single record go around all pages several times.
+    for (uint32_t i = 0; i < 1000; i++)
+        REQUIRE(storage.write(1, 0, 1, &i, sizeof(i)));
+    for (uint32_t page = 0; page < settings_num_pages; page++) {
+        uint32_t page_seq;
+        memcpy(&page_seq, &mock_eeprom[page * settings_page_size], sizeof(page_seq));
+        REQUIRE((page_seq > settings_num_pages && page_seq != 0xFFFFFFFF));  // All pages were reused.
+    }
+
+    storage.forget(0, 1);
+    SettingsStorage reloaded;
+    REQUIRE(reloaded.load());
+    uint32_t last;
+    REQUIRE(reloaded.read(1, 0, &version, &last, sizeof(last)) == sizeof(last));
+    REQUIRE(last == 999);
+    REQUIRE(reloaded.read(0, 0, &version, val, sizeof(val)) == sizeof(big));
+    REQUIRE(val[0] == 7);
+    REQUIRE(reloaded.read(0, 1, &version, val, sizeof(val)) == 50);
+    mock_eeprom_erase();
+}
+
+TEST_CASE("Settings storage keeps live records when full") {
+    mock_eeprom_erase();
+    SettingsStorage storage;
+    uint8_t rec[settings_max_payload], val[settings_max_payload];
+    uint8_t version;
+    uint32_t num_written = 0;
+    for (; num_written < settings_max_record_types * settings_max_record_idx; num_written++) {
+        memset(rec, num_written, sizeof(rec));
+        if (!storage.write(num_written / settings_max_record_idx, num_written % settings_max_record_idx, 1, rec,
+                           sizeof(rec)))
+            break;
+    }
+    REQUIRE(num_written * settings_max_record_size >= settings_capacity);
+    REQUIRE(num_written < settings_max_record_types * settings_max_record_idx);
+
+    SettingsStorage reloaded;
+    REQUIRE(reloaded.load());
+    for (uint32_t i = 0; i < num_written; i++) {
+        REQUIRE(reloaded.read(i / settings_max_record_idx, i % settings_max_record_idx, &version, val, sizeof(val)) ==
+                sizeof(val));
+        REQUIRE((val[0] == i && val[sizeof(val) - 1] == i));
+    }
+    mock_eeprom_erase();
+}
+
+namespace {
+
+// Records of maximal PersistentSettings: type, count and size of each kind.
+struct TestRecordKind {
+    uint8_t type;
+    uint32_t count;
+    uint32_t size;
+};
+const TestRecordKind max_settings_records[] = {
+    {1, max_num_inputs, sizeof(InputDef)},
+    {2, num_base_stations, sizeof(BaseStationGeometryDef)},
+    {3, max_num_inputs, sizeof(GeometryBuilderDef)},
+    {4, max_num_inputs, sizeof(FormatterDef)},
+    {5, num_outputs, sizeof(OutputDef)},
+    {0, 1, 6},  // Header.
+};
+
+// Payload of a record in given rewrite round; all bytes differ between rounds.
+void fill_record(uint8_t *payload, uint32_t size, uint8_t type, uint32_t idx, uint32_t round) {
+    for (uint32_t i = 0; i < size; i++)
+        payload[i] = (uint8_t)(type * 31 + idx * 7 + round + i);
+}
+
+bool check_records(SettingsStorage &storage, const uint32_t *rounds) {
+    uint8_t payload[settings_max_payload], expected[settings_max_payload], version;
+    for (auto &kind : max_settings_records)
+        for (uint32_t idx = 0; idx < kind.count; idx++) {
+            fill_record(expected, kind.size, kind.type, idx, rounds[kind.type * settings_max_record_idx + idx]);
+            if (storage.read(kind.type, idx, &version, payload, sizeof(payload)) != (int32_t)kind.size ||
+                memcmp(payload, expected, kind.size))
+                return false;
+        }
+    return true;
+}
+
+}  // namespace
+
+extern uint32_t mock_eeprom_bytes_left;
+
+TEST_CASE("Settings storage rewrites maximal settings indefinitely") {
+    mock_eeprom_erase();
+    SettingsStorage storage;
+    uint8_t payload[settings_max_payload];
+    uint32_t rounds[settings_max_record_types * settings_max_record_idx] = {};
+
+    // All records are written, then records are changed one at a time or all at once, in varying order.
+    for (uint32_t round = 0; round < 300; round++) {
+        for (auto &kind : max_settings_records)
+            for (uint32_t idx = 0; idx < kind.count; idx++) {
+                if (round % 5 != 0 && (kind.type + idx + round) % 7 != 0)
+                    continue;
+                rounds[kind.type * settings_max_record_idx + idx] = round;
+                fill_record(payload, kind.size, kind.type, idx, round);
+                REQUIRE(storage.write(kind.type, idx, 1, payload, kind.size));
+            }
+        REQUIRE(check_records(storage, rounds));
+    }
+    SettingsStorage reloaded;
+    REQUIRE(reloaded.load());
+    REQUIRE(check_records(reloaded, rounds));
+
+    // Power loss at any point of a write keeps either the old or the new contents of the record, and all others.
+    for (uint32_t bytes_left = 0; bytes_left < 2 * settings_capacity; bytes_left += 3) {
+        uint8_t eeprom_before[sizeof(mock_eeprom)];
+        memcpy(eeprom_before, mock_eeprom, sizeof(mock_eeprom));
+        REQUIRE(reloaded.load());
+
+        // Writing all records of a new round reuses pages, so power loss hits copying of live records too.
+        uint32_t round = 1000 + bytes_left;
+        mock_eeprom_bytes_left = bytes_left;
+        for (auto &kind : max_settings_records)
+            for (uint32_t idx = 0; idx < kind.count; idx++) {
+                fill_record(payload, kind.size, kind.type, idx, round);
+                reloaded.write(kind.type, idx, 1, payload, kind.size);
+            }
+        mock_eeprom_bytes_left = UINT32_MAX;
+
+        SettingsStorage after;
+        REQUIRE(after.load());
+        uint32_t new_rounds[settings_max_record_types * settings_max_record_idx];
+        for (auto &kind : max_settings_records)
+            for (uint32_t idx = 0; idx < kind.count; idx++) {
+                uint32_t i = kind.type * settings_max_record_idx + idx;
+                uint8_t version, expected[settings_max_payload];
+                REQUIRE(after.read(kind.type, idx, &version, payload, sizeof(payload)) == (int32_t)kind.size);
+                fill_record(expected, kind.size, kind.type, idx, round);
+                new_rounds[i] = memcmp(payload, expected, kind.size) ? rounds[i] : round;
+            }
+        REQUIRE(check_records(after, new_rounds));
+
+        // Storage keeps working after the power loss.
+        for (auto &kind : max_settings_records)
+            for (uint32_t idx = 0; idx < kind.count; idx++) {
+                fill_record(payload, kind.size, kind.type, idx, round + 1);
+                REQUIRE(after.write(kind.type, idx, 1, payload, kind.size));
+                new_rounds[kind.type * settings_max_record_idx + idx] = round + 1;
+            }
+        REQUIRE(check_records(after, new_rounds));
+        memcpy(mock_eeprom, eeprom_before, sizeof(mock_eeprom));
+    }
+    mock_eeprom_erase();
+}
+
+TEST_CASE("Settings storage falls back to previous copy of a damaged record") {
+    mock_eeprom_erase();
+    SettingsStorage storage;
+    uint32_t val = 1;
+    uint8_t version;
+    REQUIRE(storage.write(0, 0, 1, &val, sizeof(val)));
+    val = 2;
+    REQUIRE(storage.write(0, 0, 1, &val, sizeof(val)));
+
+    // Corrupt payload of the latest copy: the second record of the first page, after 8-byte page header and 6-byte
+    // record headers.
+    uint32_t payload_addr = 8 + 6 + sizeof(val) + 6;
+    REQUIRE(mock_eeprom[payload_addr] == 2);
+    mock_eeprom[payload_addr] = 3;
+
+    SettingsStorage reloaded;
+    REQUIRE(reloaded.load());
+    REQUIRE(reloaded.read(0, 0, &version, &val, sizeof(val)) == sizeof(val));
+    REQUIRE(val == 1);
+    mock_eeprom_erase();
+}
+
+// Writes a field of the settings block of previous firmware: version word, then raw PersistentSettings.
+template<typename T>
+static void put_legacy(uint32_t offset, T val) {
+    memcpy(mock_eeprom + sizeof(uint32_t) + offset, &val, sizeof(val));
+}
+
+TEST_CASE("Settings of previous firmware are converted to records") {
+    // Layout on 64-bit hosts, where Vector sizes take 8 bytes. Unused bytes are zero, as the block was memset.
+    mock_eeprom_erase();
+    memset(mock_eeprom, 0, sizeof(uint32_t) + 1072);
+    uint32_t legacy_version = 0xbabe0000 + 1072;
+    memcpy(mock_eeprom, &legacy_version, sizeof(legacy_version));
+    put_legacy<bool>(0, true);           // is_configured
+    put_legacy<uint64_t>(8, 2);          // inputs: 16 bytes each
+    put_legacy<uint32_t>(16 + 0, 12);    //   sensor0 pin 12 positive cmp 20
+    put_legacy<bool>(16 + 4, true);
+    put_legacy<uint32_t>(16 + 12, 20);
+    put_legacy<uint32_t>(32 + 0, 13);    //   sensor1 pin 13 negative tim
+    put_legacy<uint32_t>(32 + 8, (uint32_t)InputType::kTimer);
+    put_legacy<uint64_t>(144, 1);        // base_stations: 48 bytes each
+    put_legacy<float>(152 + 0, 1.0f);    //   mat[0]
+    put_legacy<float>(152 + 40, 2.5f);   //   origin[1]
+    put_legacy<uint64_t>(248, 1);        // geo_builders: 72 bytes each
+    put_legacy<uint64_t>(256 + 0, 1);    //   1 sensor: 16 bytes each
+    put_legacy<uint32_t>(256 + 8, 1);    //   sensor1
+    put_legacy<float>(256 + 8 + 12, -0.5f);  // pos[2]
+    put_legacy<uint64_t>(832, 1);        // formatters: 24 bytes each
+    put_legacy<uint32_t>(840 + 0, (uint32_t)FormatterType::kPosition);
+    put_legacy<uint32_t>(840 + 4, (uint32_t)FormatterSubtype::kPosMavlink);
+    put_legacy<uint32_t>(840 + 12, 1);   //   > serial1
+    put_legacy<uint32_t>(840 + 16, (uint32_t)CoordSysType::kNED);
+    put_legacy<float>(840 + 20, 110.0f); //   north angle
+    put_legacy<uint64_t>(1032, num_outputs);  // outputs: 8 bytes each
+    put_legacy<bool>(1040, true);
+    put_legacy<bool>(1048, true);
+    put_legacy<uint32_t>(1048 + 4, 57600);
+
+    PersistentSettings converted;
+    REQUIRE(!converted.needs_configuration());
+    REQUIRE(converted.inputs().size() == 2);
+    REQUIRE((converted.inputs()[0].pin == 12 && converted.inputs()[0].pulse_polarity &&
+             converted.inputs()[0].input_type == InputType::kCMP && converted.inputs()[0].initial_cmp_threshold == 20));
+    REQUIRE((converted.inputs()[1].pin == 13 && !converted.inputs()[1].pulse_polarity &&
+             converted.inputs()[1].input_type == InputType::kTimer));
+    REQUIRE(converted.base_stations().size() == 1);
+    REQUIRE((converted.base_stations()[0].mat[0] == 1.0f && converted.base_stations()[0].origin[1] == 2.5f));
+    REQUIRE(converted.geo_builders().size() == 1);
+    REQUIRE(converted.geo_builders()[0].sensors.size() == 1);
+    REQUIRE(converted.geo_builders()[0].sensors[0].input_idx == 1);
+    REQUIRE(converted.geo_builders()[0].sensors[0].pos[2] == -0.5f);
+    REQUIRE(converted.formatters().size() == 1);
+    const FormatterDef &stream = converted.formatters()[0];
+    REQUIRE((stream.formatter_type == FormatterType::kPosition &&
+             stream.formatter_subtype == FormatterSubtype::kPosMavlink && stream.output_idx == 1));
+    REQUIRE((stream.coord_sys_type == CoordSysType::kNED && stream.coord_sys_params.ned.north_angle == 110.0f));
+    REQUIRE((stream.rate_hz == 0 && stream.drop_policy == DropPolicy::kDropOldest));  // New fields are defaults.
+    REQUIRE(converted.outputs().size() == num_outputs);
+    REQUIRE((converted.outputs()[0].active && converted.outputs()[1].active && !converted.outputs()[2].active));
+    REQUIRE(converted.outputs()[1].bitrate == 57600);
+    REQUIRE(!converted.outputs()[1].polling);
+
+    uint32_t bytes_written = mock_eeprom_bytes_written;
+    PersistentSettings loaded;
+    REQUIRE(mock_eeprom_bytes_written == bytes_written);  // Already converted.
+    REQUIRE(!loaded.needs_configuration());
+    REQUIRE(loaded.inputs().size() == 2);
+    REQUIRE(loaded.inputs()[1].pin == 13);
+    REQUIRE(loaded.formatters()[0].coord_sys_params.ned.north_angle == 110.0f);
+    REQUIRE(loaded.outputs()[1].bitrate == 57600);
+
+    // Only the header record is rewritten.
+    loaded.restart_in_configuration_mode();
+    REQUIRE(mock_eeprom_bytes_written - bytes_written < 16);
+    PersistentSettings restarted;
+    REQUIRE(restarted.needs_configuration());
+    REQUIRE(restarted.inputs().size() == 2);
+    mock_eeprom_erase();
+}
+
+TEST_CASE("Settings are reset when stored definitions can't be read") {
+    mock_eeprom_erase();
+    PersistentSettings settings;
+    run_command(settings, "sensor0 pin 12 positive");
+    run_command(settings, "sensor1 pin 13 negative");
+    REQUIRE(settings.write_to_eeprom());
+
+    // Damage the stored records by overwriting the first page.
+    PersistentSettings loaded;
+    REQUIRE(loaded.inputs().size() == 2);
+    memset(mock_eeprom + 8, 0x00, settings_page_size - 8);
+    REQUIRE(run_command(loaded, "reload") == "No valid configuration found in EEPROM.\n");
+    REQUIRE(loaded.inputs().size() == 0);
+    REQUIRE(loaded.needs_configuration());
+    mock_eeprom_erase();
+}
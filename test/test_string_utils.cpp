@@ -0,0 +1,82 @@
+#include <catch.hpp>
+#include "primitives/string_utils.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <random>
+
+static std::string fmt_uint(uint32_t val, uint32_t min_digits = 1) {
+    char buf[max_formatted_number_len];
+    return std::string(buf, format_uint(buf, val, min_digits));
+}
+static std::string fmt_int(int32_t val) {
+    char buf[max_formatted_number_len];
+    return std::string(buf, format_int(buf, val));
+}
+static std::string fmt_hex(uint32_t val, uint32_t min_digits = 1, bool uppercase = false) {
+    char buf[max_formatted_number_len];
+    return std::string(buf, format_hex(buf, val, min_digits, uppercase));
+}
+static std::string fmt_fixed(float val, uint32_t decimals) {
+    char buf[max_formatted_number_len];
+    return std::string(buf, format_fixed(buf, val, decimals));
+}
+
+TEST_CASE("Integers are formatted like printf") {
+    REQUIRE(fmt_uint(0) == "0");
+    REQUIRE(fmt_uint(7) == "7");
+    REQUIRE(fmt_uint(42) == "42");
+    REQUIRE(fmt_uint(100) == "100");
+    REQUIRE(fmt_uint(4294967295u) == "4294967295");
+    REQUIRE(fmt_uint(3, 2) == "03");
+    REQUIRE(fmt_uint(123, 2) == "123");
+    REQUIRE(fmt_int(0) == "0");
+    REQUIRE(fmt_int(-1) == "-1");
+    REQUIRE(fmt_int(-2147483647 - 1) == "-2147483648");
+    REQUIRE(fmt_hex(0) == "0");
+    REQUIRE(fmt_hex(0xab, 2) == "ab");
+    REQUIRE(fmt_hex(0x5, 2) == "05");
+    REQUIRE(fmt_hex(0x1234abcd, 8) == "1234abcd");
+    REQUIRE(fmt_hex(0xffffffff) == "ffffffff");
+    REQUIRE(fmt_hex(0xab, 2, true) == "AB");
+
+    std::mt19937 rng(1);
+    char buf[32];
+    for (int i = 0; i < 1000; i++) {
+        uint32_t val = rng() >> (rng() % 32);
+        snprintf(buf, sizeof(buf), "%u", val);
+        REQUIRE(fmt_uint(val) == buf);
+        snprintf(buf, sizeof(buf), "%d", (int32_t)val);
+        REQUIRE(fmt_int((int32_t)val) == buf);
+        snprintf(buf, sizeof(buf), "%x", val);
+        REQUIRE(fmt_hex(val) == buf);
+        snprintf(buf, sizeof(buf), "%02X", val);
+        REQUIRE(fmt_hex(val, 2, true) == buf);
+    }
+}
+
+TEST_CASE("Floats are formatted with fixed precision") {
+    REQUIRE(fmt_fixed(0.f, 4) == "0.0000");
+    REQUIRE(fmt_fixed(1.2345f, 4) == "1.2345");
+    REQUIRE(fmt_fixed(-0.5f, 4) == "-0.5000");
+    REQUIRE(fmt_fixed(0.99999f, 4) == "1.0000");
+    REQUIRE(fmt_fixed(-0.00001f, 4) == "-0.0000");
+    REQUIRE(fmt_fixed(110.f, 1) == "110.0");
+    REQUIRE(fmt_fixed(2.6f, 0) == "3");
+    REQUIRE(fmt_fixed(NAN, 4) == "nan");
+    REQUIRE(fmt_fixed(INFINITY, 4) == "ovf");
+    REQUIRE(fmt_fixed(-1e10f, 4) == "-ovf");
+
+    // Compare with printf; allow the last digit to differ only at rounding ties.
+    std::mt19937 rng(2);
+    std::uniform_real_distribution<float> dist(-1000.f, 1000.f);
+    char buf[32];
+    for (int i = 0; i < 10000; i++) {
+        float val = dist(rng) / (float)(1 << (rng() % 12));
+        snprintf(buf, sizeof(buf), "%.4f", val);
+        std::string res = fmt_fixed(val, 4);
+        if (res != buf)
+            REQUIRE(fabs(strtod(res.c_str(), nullptr) - strtod(buf, nullptr)) <= 1.01e-4);
+        REQUIRE(fabs(strtod(res.c_str(), nullptr) - val) <= 0.5e-4 + fabs(val) * 1e-7);
+    }
+}
@@ -0,0 +1,62 @@
+#include <catch.hpp>
+#include "trace_analyzer.h"
+
+TEST_CASE("Trace lines are parsed like pulse source lines") {
+    TracePulse pulse;
+    REQUIRE(parse_trace_line("3 1000410.25 107.2\n", &pulse) == TraceLineType::kPulse);
+    REQUIRE(pulse.pin == 3);
+    REQUIRE(pulse.start_us == 1000410);
+    REQUIRE(pulse.start_frac == Approx(0.25f));
+    REQUIRE(pulse.len_us == Approx(107.2f));
+
+    REQUIRE(parse_trace_line("  # comment", &pulse) == TraceLineType::kComment);
+    REQUIRE(parse_trace_line("\n", &pulse) == TraceLineType::kComment);
+    REQUIRE(parse_trace_line("3 1000", &pulse) == TraceLineType::kInvalid);
+    REQUIRE(parse_trace_line("3 1000 -5", &pulse) == TraceLineType::kInvalid);
+}
+
+TEST_CASE("Trace analyzer follows trace time across wrap-arounds and jumps") {
+    PersistentSettings settings;  // No sensors: only pulses and time are counted.
+    TraceAnalyzer analyzer(settings);
+    analyzer.feed_line("0 4294967000 10\n");
+    analyzer.feed_line("0 500000 10\n");    // Wraps around; 0.5s later.
+    analyzer.feed_line("0 499990 10\n");    // Slightly out of order.
+    analyzer.feed_line("0 90000000 10\n");  // Jump is counted as 1s.
+    analyzer.feed_line("garbage\n");
+    TraceSummary summary = analyzer.finish();
+
+    REQUIRE(summary.num_traces == 1);
+    REQUIRE(summary.num_pulses == 4);
+    REQUIRE(summary.invalid_lines == 1);
+    REQUIRE(summary.time_jumps == 1);
+    REQUIRE(summary.duration == Approx(0.500296 + 1.0));
+}
+
+TEST_CASE("Trace summaries are merged") {
+    TraceSummary a = {}, b = {};
+    a.num_traces = b.num_traces = 1;
+    a.duration = 10; b.duration = 5;
+    a.num_sensors = 1; b.num_sensors = 2;
+    a.sensors[0] = {6e-8, 1};
+    b.sensors[0] = {18e-8, 3};
+    b.sensors[1] = {6e-8, 1};
+    a.num_objects = b.num_objects = 1;
+    a.objects[0].num_dropouts = 1; a.objects[0].dropout_time = a.objects[0].max_dropout_time = 0.5;
+    b.objects[0].num_dropouts = 2; b.objects[0].dropout_time = 0.6; b.objects[0].max_dropout_time = 0.4;
+    b.objects[0].sum_sq_step = 2e-6; b.objects[0].num_steps = 1;
+    a.base_stations[0] = {10, 9};
+    b.base_stations[0] = {10, 10};
+
+    a.merge(b);
+    REQUIRE(a.num_traces == 2);
+    REQUIRE(a.duration == 15);
+    REQUIRE(a.num_sensors == 2);
+    REQUIRE(a.angle_jitter(0) == Approx(1e-4f));
+    REQUIRE(a.angle_jitter(1) == Approx(1e-4f));
+    REQUIRE(a.objects[0].num_dropouts == 3);
+    REQUIRE(a.objects[0].dropout_time == Approx(1.1));
+    REQUIRE(a.objects[0].max_dropout_time == 0.5);
+    REQUIRE(a.position_noise(0) == Approx(1e-3f));
+    REQUIRE(a.base_stations[0].frames_decoded == 19);
+    REQUIRE(a.base_stations[0].frames_started == 20);
+}
@@ -0,0 +1,189 @@
+#include <catch.hpp>
+#include "formatters.h"
+#include <math.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct PacketCollector : Consumer<DataChunk> {
+    virtual void consume(const DataChunk &chunk) {
+        REQUIRE(chunk.last_chunk);  // Every UBX packet is sent in its own chunk.
+        packets.emplace_back(&chunk.data[0], &chunk.data[0] + chunk.data.size());
+    }
+    std::vector<std::vector<uint8_t>> packets;
+};
+
+struct StringPrintStream : PrintStream {
+    virtual size_t write(const char *buffer, size_t size) { str.append(buffer, size); return size; }
+    std::string str;
+};
+
+// Reference WGS84 geodetic -> ECEF conversion, meters.
+void llh_to_ecef(double lat_deg, double lon_deg, double h, double *ecef) {
+    const double a = 6378137.0, e2 = 6.69437999014e-3;
+    double lat = lat_deg * M_PI / 180.0, lon = lon_deg * M_PI / 180.0;
+    double n = a / sqrt(1.0 - e2 * sin(lat) * sin(lat));
+    ecef[0] = (n + h) * cos(lat) * cos(lon);
+    ecef[1] = (n + h) * cos(lat) * sin(lon);
+    ecef[2] = (n * (1.0 - e2) + h) * sin(lat);
+}
+
+// Exact ECEF of a point given in NED coordinates around the origin.
+void ned_to_ecef_reference(const GeoOrigin &origin, const vec3d &ned, double *ecef) {
+    double lat = origin.lat_e7 * 1e-7 * M_PI / 180.0, lon = origin.lon_e7 * 1e-7 * M_PI / 180.0;
+    llh_to_ecef(origin.lat_e7 * 1e-7, origin.lon_e7 * 1e-7, origin.alt_mm * 1e-3, ecef);
+    double n[3] = {-sin(lat) * cos(lon), -sin(lat) * sin(lon), cos(lat)};
+    double e[3] = {-sin(lon), cos(lon), 0};
+    double d[3] = {-cos(lat) * cos(lon), -cos(lat) * sin(lon), -sin(lat)};
+    for (int i = 0; i < 3; i++)
+        ecef[i] += n[i] * ned[0] + e[i] * ned[1] + d[i] * ned[2];
+}
+
+bool checksum_valid(const std::vector<uint8_t> &packet) {
+    if (packet.size() < 8 || packet[0] != 0xB5 || packet[1] != 0x62)
+        return false;
+    uint32_t payload_len = packet[4] | packet[5] << 8;
+    if (packet.size() != payload_len + 8)
+        return false;
+    uint8_t ck_a = 0, ck_b = 0;
+    for (uint32_t i = 2; i < packet.size() - 2; i++)
+        ck_b += (ck_a += packet[i]);
+    return packet[packet.size() - 2] == ck_a && packet[packet.size() - 1] == ck_b;
+}
+
+template<typename T>
+T read_field(const std::vector<uint8_t> &packet, uint32_t payload_offset) {
+    T res;
+    memcpy(&res, &packet[6 + payload_offset], sizeof(res));
+    return res;
+}
+
+}  // namespace
+
+TEST_CASE("GeoConverter matches reference geodetic conversions") {
+    // Origin itself.
+    GeoOrigin origin = {450000000, 450000000, 0};
+    GeoConverter geo(origin);
+    vec3d zero = {0, 0, 0};
+    int32_t ecef_cm[3];
+    geo.ned_to_ecef_cm(zero, ecef_cm);
+    REQUIRE(ecef_cm[0] == 319441915);  // 3194419.145 m
+    REQUIRE(ecef_cm[1] == 319441915);
+    REQUIRE(ecef_cm[2] == 448734841);  // 4487348.409 m
+
+    // Points around a few origins: converting resulting LLH back to ECEF must give the exact NED point.
+    const GeoOrigin origins[] = {
+        {450000000, 450000000, 0},
+        {374275000, -1221697000, 30000},
+        {-338688000, 1512093000, -20000},
+        {0, 1799999000, 100000},
+    };
+    const vec3d points[] = {{100.f, -50.f, -10.f}, {-80.f, 120.f, 5.f}, {3.2f, 1.1f, -0.7f}};
+    for (auto &o : origins) {
+        GeoConverter conv(o);
+        for (auto &p : points) {
+            double expected[3];
+            ned_to_ecef_reference(o, p, expected);
+
+            int32_t lat_e7, lon_e7, alt_mm;
+            conv.ned_to_llh(p, &lat_e7, &lon_e7, &alt_mm);
+            double actual[3];
+            llh_to_ecef(lat_e7 * 1e-7, lon_e7 * 1e-7, alt_mm * 1e-3, actual);
+            for (int i = 0; i < 3; i++)
+                REQUIRE(fabs(actual[i] - expected[i]) < 0.02);  // 1e-7 deg is ~1.1cm.
+
+            conv.ned_to_ecef_cm(p, ecef_cm);
+            for (int i = 0; i < 3; i++)
+                REQUIRE(fabs(ecef_cm[i] * 0.01 - expected[i]) < 0.02);
+        }
+    }
+}
+
+TEST_CASE("Ublox formatter sends valid throttled packets") {
+    FormatterDef def = {};
+    def.formatter_type = FormatterType::kPosition;
+    def.formatter_subtype = FormatterSubtype::kPosUblox;
+    def.geo_origin = {374275000, -1221697000, 30000};
+    Arena arena;
+    auto formatter = GeometryFormatter::create(arena, 2, def, CoordinateTransform::identity());
+    PacketCollector collector;
+    formatter->pipe(&collector);
+
+    // Move North at 1 m/s with 100 Hz positions for 0.3 sec.
+    ObjectPosition pos = {Timestamp(), 0, FixLevel::kFullFix, {0.f, 2.f, -1.f}, 0.f, {1.f, 0.f, 0.f, 0.f},
+                          {1e-4f, 0.f, 0.f, 1e-4f, 0.f, 4e-4f}};
+    for (int i = 0; i < 30; i++) {
+        pos.time = Timestamp() + TimeDelta(10 * i, msec);
+        pos.pos[0] = 0.01f * i;
+        formatter->consume(pos);
+    }
+
+    // 10 Hz: at 0ms (no velocity yet), 100ms and 200ms.
+    auto &packets = collector.packets;
+    REQUIRE(packets.size() == 2 + 3 + 3);
+    for (auto &packet : packets)
+        REQUIRE(checksum_valid(packet));
+
+    // NAV-SOL
+    const std::vector<uint8_t> &sol = packets[2];
+    REQUIRE(sol[2] == 0x01);
+    REQUIRE(sol[3] == 0x06);
+    REQUIRE(read_field<uint32_t>(sol, 0) == 100);  // iTOW
+    REQUIRE(sol[6 + 10] == 3);                     // 3D fix
+    REQUIRE((sol[6 + 11] & 1) == 1);               // Fix valid
+    REQUIRE(sol[6 + 47] == 12);                    // Satellites
+
+    // NAV-POSLLH
+    const std::vector<uint8_t> &posllh = packets[3];
+    REQUIRE(posllh[3] == 0x02);
+    GeoConverter geo(def.geo_origin);
+    vec3d expected_pos = {0.1f, 2.f, -1.f};
+    int32_t lat_e7, lon_e7, alt_mm;
+    geo.ned_to_llh(expected_pos, &lat_e7, &lon_e7, &alt_mm);
+    REQUIRE(read_field<int32_t>(posllh, 4) == lon_e7);
+    REQUIRE(read_field<int32_t>(posllh, 8) == lat_e7);
+    REQUIRE(read_field<int32_t>(posllh, 12) == 31000);
+    REQUIRE(read_field<uint32_t>(posllh, 20) == 15);  // Horizontal accuracy, mm.
+    REQUIRE(read_field<uint32_t>(posllh, 24) == 20);  // Vertical accuracy, mm.
+
+    // NAV-VELNED
+    const std::vector<uint8_t> &velned = packets[4];
+    REQUIRE(velned[3] == 0x12);
+    REQUIRE(read_field<int32_t>(velned, 4) == 100);  // North, cm/s
+    REQUIRE(read_field<int32_t>(velned, 8) == 0);
+    REQUIRE(read_field<int32_t>(velned, 12) == 0);
+    REQUIRE(read_field<uint32_t>(velned, 20) == 100);  // 2d speed
+    REQUIRE(read_field<int32_t>(velned, 24) == 0);     // Heading: North
+
+    // Without a fix only NAV-SOL is sent, with no satellites.
+    packets.clear();
+    pos.time += TimeDelta(200, msec);
+    pos.fix_level = FixLevel::kCycleSyncing;
+    formatter->consume(pos);
+    REQUIRE(packets.size() == 1);
+    REQUIRE(packets[0][3] == 0x06);
+    REQUIRE(packets[0][6 + 10] == 0);
+    REQUIRE(packets[0][6 + 47] == 0);
+}
+
+TEST_CASE("Ublox stream definition requires NED and origin") {
+    char line[] = "ublox object0 ned 90 origin 37.4275 -122.1697 30.5 > serial1";
+    FormatterDef def = {};
+    StringPrintStream err;
+    REQUIRE(def.parse_def(6, hash_words(line), err));
+    REQUIRE(def.formatter_subtype == FormatterSubtype::kPosUblox);
+    REQUIRE(def.geo_origin.lat_e7 == 374275000);
+    REQUIRE(def.geo_origin.lon_e7 == -1221697000);
+    REQUIRE(def.geo_origin.alt_mm == 30500);
+
+    StringPrintStream out;
+    def.print_def(6, out);
+    REQUIRE(out.str == "stream6 ublox object0 ned 90.0 origin 37.4275000 -122.1697000 30.500 > serial1\n");
+
+    char no_origin[] = "ublox object0 ned 90 > serial1";
+    REQUIRE(!def.parse_def(6, hash_words(no_origin), err));
+    char no_ned[] = "ublox object0 origin 37.4275 -122.1697 30.5 > serial1";
+    REQUIRE(!def.parse_def(6, hash_words(no_ned), err));
+}
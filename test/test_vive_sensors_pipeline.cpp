@@ -0,0 +1,179 @@
+#include <catch.hpp>
+#include "vive_sensors_pipeline.h"
+#include <string>
+
+// EEPROM in RAM, see platform_mocks.cpp.
+void mock_eeprom_erase();
+
+namespace {
+
+// Everything written by test outputs, as they can be replaced.
+std::string written;
+
+// Output that reads from a string.
+class TestOutputNode : public OutputNode {
+public:
+    TestOutputNode(uint32_t idx, const OutputDef &def) : OutputNode(idx, def) {}
+
+    virtual size_t write(const uint8_t *buffer, size_t size) {
+        written.append((const char *)buffer, size);
+        return size;
+    }
+    virtual size_t read(uint8_t *buffer, size_t size) {
+        size_t len = input.copy((char *)buffer, size);
+        input.erase(0, len);
+        return len;
+    }
+    virtual size_t write_available() { return 1024; }
+
+    std::string input;
+};
+
+TestOutputNode *last_output = nullptr;
+uint32_t num_outputs_created = 0;
+
+OutputNode::CreatorRegistrar output_creator([](Arena &arena, uint32_t idx, const OutputDef &def) -> ArenaPtr<OutputNode> {
+    auto node = arena.make<TestOutputNode>(idx, def);
+    last_output = node.get();
+    num_outputs_created++;
+    return std::move(node);
+});
+
+// Inputs of 'port_irq' type are available in these tests; other types still fail, see test_settings.cpp.
+class TestInputNode : public InputNode {
+public:
+    TestInputNode(uint32_t idx) : InputNode(idx) {}
+};
+
+InputNode::CreatorRegistrar input_creator([](Arena &arena, uint32_t idx, const InputDef &def) -> ArenaPtr<InputNode> {
+    if (def.input_type != InputType::kPort)
+        return nullptr;
+    return arena.make<TestInputNode>(idx);
+});
+
+struct NullPrintStream : PrintStream {
+    virtual size_t write(const char *buffer, size_t size) { return size; }
+};
+
+void run_command(PersistentSettings &settings, const std::string &cmd) {
+    std::string cmd_str(cmd);
+    NullPrintStream stream;
+    settings.process_command(&cmd_str[0], stream);
+}
+
+// Max number of sensors and objects, each object tracking one sensor.
+void add_max_objects(PersistentSettings &settings) {
+    for (int i = 0; i < max_num_inputs; i++)
+        run_command(settings, "sensor" + std::to_string(i) + " pin " + std::to_string(i) + " positive port_irq");
+    run_command(settings, "base0 origin 0 0 0 matrix 1 0 0 0 1 0 0 0 1");
+    run_command(settings, "base1 origin 0 0 0 matrix 1 0 0 0 1 0 0 0 1");
+    for (int i = 0; i < max_num_inputs; i++)
+        run_command(settings, "object" + std::to_string(i) + " sensor" + std::to_string(i));
+    REQUIRE(settings.geo_builders().size() == max_num_inputs);
+}
+
+}  // namespace
+
+TEST_CASE("Pipeline with max fan-out of producers is created") {
+    mock_eeprom_erase();
+    {
+        // Angles go to all geometry builders, all streams and the flight recorder.
+        PersistentSettings settings;
+        add_max_objects(settings);
+        for (int i = 0; i < max_num_inputs; i++)
+            run_command(settings, "stream" + std::to_string(i) + " angles > usb_serial");
+        REQUIRE(settings.formatters().size() == max_num_inputs);
+        REQUIRE_NOTHROW(create_vive_sensor_pipeline(settings));
+    }
+    {
+        // Positions of one object go to all streams and the flight recorder.
+        PersistentSettings settings;
+        add_max_objects(settings);
+        for (int i = 0; i < max_num_inputs; i++)
+            run_command(settings, "stream" + std::to_string(i) + " position object0 > usb_serial");
+        REQUIRE(settings.formatters().size() == max_num_inputs);
+        REQUIRE_NOTHROW(create_vive_sensor_pipeline(settings));
+    }
+    {
+        // Data received by the output goes to all mavlink streams and the debug node.
+        PersistentSettings settings;
+        add_max_objects(settings);
+        for (int i = 0; i < max_num_inputs; i++)
+            run_command(settings, "stream" + std::to_string(i) + " mavlink object" + std::to_string(i) + " > usb_serial");
+        REQUIRE(settings.formatters().size() == max_num_inputs);
+        REQUIRE_NOTHROW(create_vive_sensor_pipeline(settings));
+    }
+}
+
+TEST_CASE("Streams and outputs are changed while the pipeline runs") {
+    mock_eeprom_erase();
+    PersistentSettings settings;  // Only usb_serial output.
+    auto pipeline = create_vive_sensor_pipeline(settings);
+    pipeline->start();
+    TestOutputNode *output = last_output;
+    uint32_t created = num_outputs_created;
+
+    Timestamp time;
+    auto send_line = [&](const char *line) {
+        written.clear();
+        last_output->input += line;
+        for (int i = 0; i < 3; i++) {
+            time += TimeDelta(10, msec);
+            pipeline->do_work(time);
+        }
+        return written;
+    };
+
+    REQUIRE(send_line("set sensor0 pin 12 positive\n").find("Only streams and outputs can be changed live") != std::string::npos);
+    REQUIRE(send_line("set stream0 position object0 > usb_serial\n").find("Validation error: Stream 0 uses undefined object0") != std::string::npos);
+    REQUIRE(num_outputs_created == created);
+
+    std::string reply = send_line("set stream0 angles > usb_serial\n");
+    REQUIRE(reply.find("Updated: stream0 angles") != std::string::npos);
+    REQUIRE(reply.find("Streams will be restarted") != std::string::npos);
+    REQUIRE(num_outputs_created == created + 1);
+    REQUIRE(last_output != output);  // Replaced, after the reply was sent.
+    REQUIRE(settings.formatters().size() == 1);  // Changes are applied to the settings the pipeline was created with.
+
+    // The new debug node works and has the changed settings.
+    REQUIRE(send_line("save\n").find("Settings written to EEPROM.") != std::string::npos);
+    {
+        PersistentSettings saved;
+        REQUIRE(saved.formatters().size() == 1);
+        REQUIRE(saved.formatters()[0].formatter_type == FormatterType::kAngles);
+    }
+
+    // Restart in configuration mode keeps the saved definitions.
+    REQUIRE(send_line("!\n").find("Unknown command") == std::string::npos);
+    {
+        PersistentSettings saved;
+        REQUIRE(saved.needs_configuration());
+        REQUIRE(saved.formatters().size() == 1);
+    }
+    mock_eeprom_erase();
+}
+
+TEST_CASE("Debug and exclusive modes are kept when streams are changed") {
+    mock_eeprom_erase();
+    PersistentSettings settings;  // Only usb_serial output.
+    auto pipeline = create_vive_sensor_pipeline(settings);
+    pipeline->start();
+
+    Timestamp time;
+    auto send_line = [&](const char *line) {
+        written.clear();
+        last_output->input += line;
+        for (int i = 0; i < 30; i++) {
+            time += TimeDelta(10, msec);
+            pipeline->do_work(time);
+        }
+        return written;
+    };
+
+    send_line("x\n");
+    REQUIRE(send_line("set stream0 telemetry rate 10 > usb_serial\n").find("Streams will be restarted") != std::string::npos);
+    REQUIRE(send_line("\n") == "debug> ");  // Still in debug mode; telemetry is not sent in exclusive mode.
+
+    send_line("o\n");
+    REQUIRE(send_line("").size() > 0);  // Telemetry is sent when the output is not exclusive anymore.
+}
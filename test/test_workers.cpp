@@ -0,0 +1,344 @@
+#include <catch.hpp>
+#include "primitives/workers.h"
+#include "primitives/static_pipeline.h"
+#include "thread_bridge.h"
+#include "binary_protocol.h"
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Node that wants to work at given time and counts do_work() calls.
+struct ScheduledNode : WorkerNode {
+    ScheduledNode(Timestamp work_time) : work_time(work_time), calls(0) {}
+    virtual void do_work(Timestamp cur_time) { calls++; }
+    virtual Timestamp next_work_time(Timestamp cur_time) { return work_time; }
+    Timestamp work_time;
+    uint32_t calls;
+};
+
+// Node that counts its destructions.
+struct DestructedNode : WorkerNode {
+    DestructedNode(uint32_t *destructed) : destructed(destructed) {}
+    ~DestructedNode() { (*destructed)++; }
+    uint32_t *destructed;
+};
+
+// Thread that is never put to sleep: tests poll the pipelines themselves.
+struct PollingThread : PipelineThread {
+    virtual void wake() { wakes++; }
+    std::atomic<uint32_t> wakes{0};
+};
+
+// Records the values it consumes.
+template<typename T>
+struct Recorder : Consumer<T> {
+    virtual void consume(const T &val) { values.push_back(val); }
+    std::vector<T> values;
+};
+
+// Nodes of a static pipeline; they count virtual calls. Source passes values on and sends the number of its do_work()
+// calls when it's due.
+struct SourceNode : ScheduledNode, Consumer<int>, Producer<int> {
+    SourceNode(Timestamp work_time) : ScheduledNode(work_time) {}
+    virtual void consume(const int &val) { virtual_calls++; produce(*process(val)); }
+    virtual void do_work(Timestamp cur_time) { virtual_calls++; produce(*process_time(cur_time)); }
+    const int *process(const int &val) { value = val; return &value; }
+    const int *process_time(Timestamp cur_time) { value = ++calls; return &value; }
+    int value = 0;
+    uint32_t virtual_calls = 0;
+};
+
+// Node that only works when it consumes input.
+struct IdleNode : WorkerNode {
+    virtual Timestamp next_work_time(Timestamp cur_time) { return cur_time + max_sleep_time; }
+};
+
+struct DoublingNode : IdleNode, Consumer<int>, Producer<int> {
+    virtual void consume(const int &val) { virtual_calls++; if (auto out = process(val)) produce(*out); }
+    const int *process(const int &val) {  // Odd values are not passed on.
+        doubled = val * 2;
+        return val % 2 ? nullptr : &doubled;
+    }
+    int doubled = 0;
+    uint32_t virtual_calls = 0;
+};
+
+struct RecorderNode : IdleNode, Recorder<int> {};
+
+struct StringPrintStream : PrintStream {
+    virtual size_t write(const char *buffer, size_t size) { str.append(buffer, size); return size; }
+    std::string str;
+};
+
+// Node that records the threads its debug and telemetry functions are called in.
+struct CalledNode : WorkerNode {
+    virtual bool debug_cmd(HashedWord *input_words) {
+        thread = std::this_thread::get_id();
+        return *input_words == "ping"_hash;
+    }
+    virtual void debug_print(PrintStream &stream) {
+        thread = std::this_thread::get_id();
+        stream.printf("worker node\n");
+    }
+    virtual void collect_telemetry(BinaryTelemetryPacket &packet) {
+        thread = std::this_thread::get_id();
+        packet.object_fix_levels[0] = 2;
+    }
+    std::thread::id thread;
+};
+
+DataChunk make_chunk(uint8_t byte, bool last_chunk) {
+    DataChunk chunk = {Timestamp(), {}, 0, last_chunk};
+    chunk.data.push(byte);
+    return chunk;
+}
+
+}  // namespace
+
+TEST_CASE("Pipeline calls nodes only when they are due") {
+    Pipeline pipeline;
+    Timestamp start = Timestamp() + TimeDelta(1000, msec);
+    pipeline.emplace_back<WorkerNode>();
+    auto later = pipeline.emplace_back<ScheduledNode>(start + TimeDelta(10, msec));
+
+    pipeline.do_work(start);
+    REQUIRE(later->calls == 0);
+    REQUIRE(pipeline.next_work_time(start) == start);  // Default node always wants to work.
+
+    pipeline.do_work(start + TimeDelta(10, msec));
+    REQUIRE(later->calls == 1);
+
+    // Deadline further than we ever sleep is stale, so the node is called.
+    later->work_time = start - TimeDelta(1000, sec);
+    pipeline.do_work(start);
+    REQUIRE(later->calls == 2);
+}
+
+TEST_CASE("Pipeline sleeps until the earliest node deadline") {
+    Pipeline pipeline;
+    Timestamp start = Timestamp() + TimeDelta(1000, msec);
+    pipeline.emplace_back<ScheduledNode>(start + TimeDelta(30, msec));
+    pipeline.emplace_back<ScheduledNode>(start + TimeDelta(20, msec));
+    REQUIRE(pipeline.next_work_time(start) == start + TimeDelta(20, msec));
+
+    // Without nodes that need to work, sleep time is limited.
+    Pipeline idle;
+    REQUIRE(idle.next_work_time(start) == start + max_sleep_time);
+}
+
+TEST_CASE("Pipeline nodes live in its arena") {
+    uint32_t destructed = 0;
+    {
+        Pipeline pipeline;
+        for (int i = 0; i < 40; i++)
+            REQUIRE(pipeline.arena().contains(pipeline.emplace_back<DestructedNode>(&destructed)));
+        REQUIRE(pipeline.arena().bytes_used() >= 40 * sizeof(DestructedNode));
+        REQUIRE(pipeline.arena().bytes_reserved() >= pipeline.arena().bytes_used());
+        REQUIRE(Arena::peak_total_reserved() >= pipeline.arena().bytes_reserved());
+
+        // Node list outgrows its initial capacity, but stays in the arena too.
+        REQUIRE(pipeline.arena().num_blocks() <= 2);
+        REQUIRE(destructed == 0);
+    }
+    REQUIRE(destructed == 40);
+}
+
+TEST_CASE("Static pipeline passes values along its chain with direct calls") {
+    Timestamp start = Timestamp() + TimeDelta(1000, msec);
+    StaticPipeline<SourceNode, DoublingNode, RecorderNode> pipeline(
+        std::forward_as_tuple(start + TimeDelta(10, msec)), std::tuple<>(), std::tuple<>());
+    Recorder<int> piped;  // Consumers piped at runtime see the values too.
+    pipeline.node<1>().pipe(&piped);
+
+    REQUIRE(pipeline.next_work_time(start) == start + TimeDelta(10, msec));
+    pipeline.do_work(start);
+    REQUIRE(pipeline.node<0>().calls == 0);
+    pipeline.do_work(start + TimeDelta(10, msec));  // Tick 1 is odd and stops at the doubling node.
+    pipeline.do_work(start + TimeDelta(10, msec));
+    REQUIRE(pipeline.node<2>().values == std::vector<int>{4});
+
+    pipeline.consume(3);
+    pipeline.consume(4);
+    REQUIRE(pipeline.node<2>().values == (std::vector<int>{4, 8}));
+    REQUIRE(piped.values == (std::vector<int>{4, 8}));
+    REQUIRE(pipeline.node<0>().virtual_calls == 0);
+    REQUIRE(pipeline.node<1>().virtual_calls == 0);
+}
+
+TEST_CASE("Arena aligns allocations and gives large ones their own block") {
+    Arena arena(256);
+    void *small = arena.allocate(3, 1);
+    void *aligned = arena.allocate(8, 8);
+    REQUIRE(reinterpret_cast<uintptr_t>(aligned) % 8 == 0);
+    REQUIRE(arena.num_blocks() == 1);
+
+    void *large = arena.allocate(1000, 8);
+    REQUIRE(arena.num_blocks() == 2);
+    REQUIRE(arena.contains(large));
+
+    // Small allocations continue in the first block.
+    void *next = arena.allocate(8, 8);
+    REQUIRE(arena.num_blocks() == 2);
+    REQUIRE(reinterpret_cast<uintptr_t>(next) == reinterpret_cast<uintptr_t>(aligned) + 8);
+    REQUIRE(arena.contains(small));
+    REQUIRE(!arena.contains(&arena));
+}
+
+TEST_CASE("Thread bridge forwards only complete messages") {
+    PollingThread consumer_thread;
+    ThreadBridge<DataChunk> bridge(&consumer_thread);
+    Recorder<DataChunk> recorder;
+    bridge.pipe(&recorder);
+    Timestamp cur_time = Timestamp() + TimeDelta(1000, msec);
+
+    bridge.consume(make_chunk(1, false));
+    REQUIRE(bridge.next_work_time(cur_time) == cur_time + max_sleep_time);
+    bridge.do_work(cur_time);
+    REQUIRE(recorder.values.empty());
+
+    bridge.consume(make_chunk(2, true));
+    REQUIRE(consumer_thread.wakes == 1);
+    REQUIRE(bridge.next_work_time(cur_time) == cur_time);
+    bridge.do_work(cur_time);
+    REQUIRE(recorder.values.size() == 2);
+    REQUIRE(recorder.values[0].data[0] == 1);
+    REQUIRE(recorder.values[1].data[0] == 2);
+    REQUIRE(bridge.next_work_time(cur_time) == cur_time + max_sleep_time);
+}
+
+TEST_CASE("Thread bridge drops whole messages when its queue is full") {
+    PollingThread consumer_thread;
+    ThreadBridge<DataChunk> bridge(&consumer_thread);
+    Recorder<DataChunk> recorder;
+    bridge.pipe(&recorder);
+
+    for (uint32_t i = 0; i < thread_bridge_capacity - 1; i++)
+        bridge.consume(make_chunk(i, true));
+
+    // Only the first chunk of this message fits; it's taken back and the rest is dropped too.
+    bridge.consume(make_chunk(100, false));
+    bridge.consume(make_chunk(101, false));
+    bridge.consume(make_chunk(102, true));
+    REQUIRE(bridge.dropped_messages() == 1);
+    REQUIRE(consumer_thread.wakes == thread_bridge_capacity - 1);
+
+    bridge.do_work(Timestamp());
+    REQUIRE(recorder.values.size() == thread_bridge_capacity - 1);
+    for (uint32_t i = 0; i < thread_bridge_capacity - 1; i++)
+        REQUIRE(recorder.values[i].data[0] == i);
+
+    // Next message goes through whole.
+    bridge.consume(make_chunk(200, false));
+    bridge.consume(make_chunk(201, true));
+    bridge.do_work(Timestamp());
+    REQUIRE(recorder.values.size() == thread_bridge_capacity + 1);
+    REQUIRE(recorder.values[thread_bridge_capacity - 1].data[0] == 200);
+    REQUIRE(recorder.values[thread_bridge_capacity].data[0] == 201);
+    REQUIRE(bridge.dropped_messages() == 1);
+
+    StringPrintStream stream;
+    bridge.debug_print(stream);
+    REQUIRE(stream.str == "Thread bridge: peak queue 63/64, dropped messages 1\n");
+}
+
+TEST_CASE("Thread bridges in both directions don't block each other when full") {
+    // Each thread sends to the other one without draining its own bridge, like main and worker threads do when both
+    // are busy. Waiting for space would deadlock them.
+    const uint32_t num_values = 3 * thread_bridge_capacity;
+    PollingThread threads[2];
+    ThreadBridge<ObjectPosition> to_worker(&threads[1]), to_main(&threads[0]);
+    Recorder<ObjectPosition> worker_recorder, main_recorder;
+    to_worker.pipe(&worker_recorder);
+    to_main.pipe(&main_recorder);
+
+    auto send = [num_values](ThreadBridge<ObjectPosition> *bridge) {
+        ObjectPosition pos = {};
+        for (uint32_t i = 0; i < num_values; i++) {
+            pos.object_idx = i;
+            bridge->consume(pos);
+        }
+    };
+    std::thread main_thread(send, &to_worker), worker_thread(send, &to_main);
+    main_thread.join();
+    worker_thread.join();
+
+    REQUIRE(to_worker.dropped_messages() == num_values - thread_bridge_capacity);
+    REQUIRE(to_main.dropped_messages() == num_values - thread_bridge_capacity);
+    to_worker.do_work(Timestamp());
+    to_main.do_work(Timestamp());
+    REQUIRE(worker_recorder.values.size() == thread_bridge_capacity);
+    REQUIRE(main_recorder.values.size() == thread_bridge_capacity);
+    for (uint32_t i = 0; i < thread_bridge_capacity; i++) {
+        REQUIRE(worker_recorder.values[i].object_idx == i);
+        REQUIRE(main_recorder.values[i].object_idx == i);
+    }
+}
+
+TEST_CASE("Thread bridge keeps order across threads") {
+    const uint32_t num_values = 10000;  // Much more than the queue capacity, so some values may be dropped.
+    PollingThread consumer_thread;
+    Pipeline pipeline;
+    auto bridge = pipeline.emplace_back<ThreadBridge<ObjectPosition>>(&consumer_thread);
+    Recorder<ObjectPosition> recorder;
+    bridge->pipe(&recorder);
+
+    std::atomic<bool> done(false);
+    std::thread producer([&]() {
+        ObjectPosition pos = {};
+        for (uint32_t i = 0; i < num_values; i++) {
+            pos.object_idx = i;
+            bridge->consume(pos);
+        }
+        done = true;
+    });
+    while (!done || bridge->next_work_time(Timestamp()) == Timestamp()) {
+        pipeline.do_work(Timestamp());
+        std::this_thread::yield();
+    }
+    producer.join();
+
+    // Every value is either forwarded in order or counted as dropped.
+    REQUIRE(recorder.values.size() + bridge->dropped_messages() == num_values);
+    for (uint32_t i = 1; i < recorder.values.size(); i++)
+        REQUIRE(recorder.values[i].object_idx > recorder.values[i - 1].object_idx);
+}
+
+TEST_CASE("Pipeline call bridge makes calls in the thread of the other pipeline") {
+    PollingThread worker_thread;
+    Pipeline worker_pipeline;
+    auto target = worker_pipeline.emplace_front<PipelineCallTarget>(&worker_pipeline);
+    auto node = worker_pipeline.emplace_back<CalledNode>();
+    Pipeline main_pipeline;
+    main_pipeline.emplace_back<PipelineCallBridge>(target, &worker_thread);
+
+    std::atomic<bool> stop{false};
+    std::thread worker([&]() {
+        while (!stop) {
+            worker_pipeline.do_work(Timestamp());
+            std::this_thread::yield();
+        }
+    });
+
+    StringPrintStream stream;
+    main_pipeline.debug_print(stream);
+    REQUIRE(stream.str == "worker node\n");
+    REQUIRE(node->thread == worker.get_id());
+    node->thread = std::thread::id();
+
+    char ping[] = "ping", other[] = "other";
+    REQUIRE(main_pipeline.debug_cmd(hash_words(ping)));
+    REQUIRE(!main_pipeline.debug_cmd(hash_words(other)));
+    REQUIRE(node->thread == worker.get_id());
+    node->thread = std::thread::id();
+
+    BinaryTelemetryPacket packet = {};
+    main_pipeline.collect_telemetry(packet);
+    REQUIRE(packet.object_fix_levels[0] == 2);
+    REQUIRE(node->thread == worker.get_id());
+    REQUIRE(worker_thread.wakes == 4);
+
+    stop = true;
+    worker.join();
+}
@@ -0,0 +1,151 @@
+// Analyze a directory of recorded pulse traces in parallel and print a report with per-trace and merged statistics.
+// Usage: analyze-traces [--jobs <N>] [--summaries <dir>] <settings file> <trace dir>
+//   Settings file has configuration commands, as printed by 'view' in configuration mode.
+//   Each trace is analyzed by its own pipeline on a pool of N threads (default: number of cores).
+//   With --summaries, the summary of each trace is also written to <dir>/<trace name>.summary.
+#include "trace_analyzer.h"
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Collects the reply to a configuration command.
+struct ReplyPrintStream : PrintStream {
+    virtual size_t write(const char *buffer, size_t size) { reply.append(buffer, size); return size; }
+    std::string reply;
+};
+
+bool is_confirmation(const std::string &reply) {
+    for (const char *prefix : {"Updated:", "Reset successful", "Write to EEPROM successful", "Validation successful"})
+        if (!reply.compare(0, strlen(prefix), prefix))
+            return true;
+    return reply.empty();
+}
+
+// Commands are applied like in configuration mode. Replies other than confirmations are errors.
+bool read_settings(const char *path, PersistentSettings *settings) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "Can't open settings file %s\n", path);
+        return false;
+    }
+    bool ok = true;
+    char line[512];
+    for (uint32_t line_num = 1; fgets(line, sizeof(line), f); line_num++) {
+        ReplyPrintStream stream;
+        bool keep_going = settings->process_command(line, stream);
+        std::string reply = stream.reply.substr(0, stream.reply.rfind("config> "));
+        if (!is_confirmation(reply)) {
+            fprintf(stderr, "%s:%u: %s", path, line_num, reply.c_str());
+            ok = false;
+        }
+        if (!keep_going)
+            break;
+    }
+    fclose(f);
+    return ok;
+}
+
+std::vector<std::string> list_traces(const char *dir_path) {
+    std::vector<std::string> names;
+    if (DIR *dir = opendir(dir_path)) {
+        while (dirent *entry = readdir(dir)) {
+            std::string path = std::string(dir_path) + "/" + entry->d_name;
+            struct stat st;
+            if (entry->d_name[0] != '.' && stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+                names.push_back(entry->d_name);
+        }
+        closedir(dir);
+    }
+    std::sort(names.begin(), names.end());
+    return names;
+}
+
+struct TraceResult {
+    TraceSummary summary;
+    std::string error;
+};
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    uint32_t num_jobs = std::max(std::thread::hardware_concurrency(), 1u);
+    const char *summaries_dir = nullptr;
+    std::vector<const char *> args;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && !strcmp(argv[i], "--jobs"))
+            num_jobs = std::max(atoi(argv[++i]), 1);
+        else if (i + 1 < argc && !strcmp(argv[i], "--summaries"))
+            summaries_dir = argv[++i];
+        else
+            args.push_back(argv[i]);
+    }
+    if (args.size() != 2) {
+        fprintf(stderr, "Usage: %s [--jobs <N>] [--summaries <dir>] <settings file> <trace dir>\n", argv[0]);
+        return 2;
+    }
+
+    PersistentSettings settings;
+    if (!read_settings(args[0], &settings))
+        return 1;
+
+    std::vector<std::string> traces = list_traces(args[1]);
+    if (traces.empty()) {
+        fprintf(stderr, "No traces found in %s\n", args[1]);
+        return 1;
+    }
+
+    // Each thread takes the next trace until all are done. Settings are only read, so they're shared.
+    std::vector<TraceResult> results(traces.size());
+    std::atomic<uint32_t> next_trace(0);
+    auto worker = [&]() {
+        for (uint32_t i; (i = next_trace++) < traces.size(); ) {
+            std::string path = std::string(args[1]) + "/" + traces[i];
+            try {
+                results[i].summary = analyze_trace_file(settings, path.c_str());
+            }
+            catch (const ValidationException &exc) {
+                results[i].error = exc.what();
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < std::min<size_t>(num_jobs, traces.size()); i++)
+        threads.emplace_back(worker);
+    for (auto &thread : threads)
+        thread.join();
+
+    // Print the report and merge the summaries in trace order, so the output doesn't depend on scheduling.
+    TraceSummary total = {};
+    uint32_t num_errors = 0;
+    for (uint32_t i = 0; i < traces.size(); i++) {
+        const TraceResult &res = results[i];
+        if (!res.error.empty()) {
+            printf("== %s: error: %s\n", traces[i].c_str(), res.error.c_str());
+            num_errors++;
+            continue;
+        }
+        res.summary.print(stdout, traces[i].c_str());
+        total.merge(res.summary);
+
+        if (summaries_dir) {
+            std::string path = std::string(summaries_dir) + "/" + traces[i] + ".summary";
+            if (FILE *f = fopen(path.c_str(), "w")) {
+                res.summary.print(f, traces[i].c_str());
+                fclose(f);
+            } else {
+                fprintf(stderr, "Can't write %s\n", path.c_str());
+            }
+        }
+    }
+    total.print(stdout, "All traces");
+    return num_errors ? 1 : 0;
+}
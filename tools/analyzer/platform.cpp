@@ -0,0 +1,75 @@
+// Platform functions for the trace analyzer. There's no hardware: pulses are fed from traces directly, so input
+// and output nodes only exist to let settings pass validation.
+#include "settings.h"
+#include "led_state.h"
+#include "debug_node.h"
+
+#include <chrono>
+#include <string.h>
+
+// ====  Timestamps  ==========================================================
+// Only used for debug output; pipelines run on trace time.
+
+Timestamp Timestamp::cur_time() {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    return (uint32_t)(us * usec);
+}
+
+uint32_t Timestamp::cur_time_millis() {
+    return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void wait_for_event(Timestamp deadline) {
+}
+
+
+// ====  Led, debug and configuration helpers  ================================
+
+void set_led_state(LedState state) {
+}
+
+void update_led_pattern(Timestamp cur_time) {
+}
+
+void print_platform_memory_info(PrintStream &stream) {
+}
+
+void restart_system() {
+}
+
+// No EEPROM: settings start clean and are never saved.
+void eeprom_read(uint32_t eeprom_addr, void *dest, uint32_t len) {
+    memset(dest, 0xFF, len);
+}
+
+void eeprom_write(uint32_t eeprom_addr, const void *src, uint32_t len) {
+}
+
+
+// ====  Inputs and outputs  ==================================================
+
+class TraceInputNode : public InputNode {
+public:
+    TraceInputNode(uint32_t input_idx) : InputNode(input_idx) {}
+};
+
+static InputNode::CreatorRegistrar input_creator([](Arena &arena, uint32_t input_idx, const InputDef &def) -> ArenaPtr<InputNode> {
+    return arena.make<TraceInputNode>(input_idx);
+});
+
+class NullOutputNode : public OutputNode {
+public:
+    NullOutputNode(uint32_t idx, const OutputDef &def) : OutputNode(idx, def) {}
+
+protected:
+    virtual size_t write(const uint8_t *buffer, size_t size) { return size; }
+    virtual size_t read(uint8_t *buffer, size_t size) { return 0; }
+    virtual bool read_available() { return false; }
+    virtual size_t write_available() { return 1024; }
+};
+
+static OutputNode::CreatorRegistrar output_creator([](Arena &arena, uint32_t idx, const OutputDef &def) -> ArenaPtr<OutputNode> {
+    return arena.make<NullOutputNode>(idx, def);
+});
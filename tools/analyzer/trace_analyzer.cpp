@@ -0,0 +1,343 @@
+#include "trace_analyzer.h"
+#include "geometry.h"
+#include <algorithm>
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Pulse times are considered discontinuous if they jump by more than this.
+constexpr TimeDelta max_trace_time_jump(1000, msec);
+// Pipeline needs some time after the last pulse to process the last cycle.
+constexpr TimeDelta trace_flush_time(100, msec);
+
+// Angle frames come every 4 cycles (~33ms) while synced. Longer intervals between positions count as no signals.
+constexpr double max_frame_interval = 0.1;
+// Gaps between valid positions longer than this are dropouts.
+constexpr double min_dropout_duration = 0.1;
+
+static const char *fix_level_names[num_fix_levels] = {"none", "syncing", "synced", "partial", "stale", "full"};
+
+static int fix_level_idx(FixLevel fix_level) {
+    for (int i = num_fix_levels - 1; i > 0; i--)
+        if (fix_level >= fix_levels[i])
+            return i;
+    return 0;
+}
+
+
+// ======  TraceSummary  ======================================================
+
+void TraceSummary::merge(const TraceSummary &other) {
+    num_traces += other.num_traces;
+    num_pulses += other.num_pulses;
+    invalid_lines += other.invalid_lines;
+    time_jumps += other.time_jumps;
+    duration += other.duration;
+
+    num_sensors = std::max(num_sensors, other.num_sensors);
+    for (uint32_t i = 0; i < other.num_sensors; i++) {
+        sensors[i].sum_sq_d2 += other.sensors[i].sum_sq_d2;
+        sensors[i].num_d2 += other.sensors[i].num_d2;
+    }
+
+    num_objects = std::max(num_objects, other.num_objects);
+    for (uint32_t i = 0; i < other.num_objects; i++) {
+        ObjectStats &obj = objects[i];
+        const ObjectStats &other_obj = other.objects[i];
+        for (int l = 0; l < num_fix_levels; l++)
+            obj.fix_time[l] += other_obj.fix_time[l];
+        obj.sum_sq_step += other_obj.sum_sq_step;
+        obj.num_steps += other_obj.num_steps;
+        obj.num_dropouts += other_obj.num_dropouts;
+        obj.dropout_time += other_obj.dropout_time;
+        obj.max_dropout_time = std::max(obj.max_dropout_time, other_obj.max_dropout_time);
+    }
+
+    for (int b = 0; b < num_base_stations; b++) {
+        base_stations[b].frames_started += other.base_stations[b].frames_started;
+        base_stations[b].frames_decoded += other.base_stations[b].frames_decoded;
+    }
+}
+
+// For white noise, variance of the second difference is 6 times the variance of the values.
+float TraceSummary::angle_jitter(uint32_t sensor_idx) const {
+    const SensorStats &s = sensors[sensor_idx];
+    return s.num_d2 ? sqrtf(s.sum_sq_d2 / (6 * s.num_d2)) : 0.f;
+}
+
+// Variance of the difference of two independent positions is 2 times the variance of each.
+float TraceSummary::position_noise(uint32_t object_idx) const {
+    const ObjectStats &obj = objects[object_idx];
+    return obj.num_steps ? sqrtf(obj.sum_sq_step / (2 * obj.num_steps)) : 0.f;
+}
+
+void TraceSummary::print(FILE *f, const char *title) const {
+    fprintf(f, "== %s: %u trace%s, %.1f s, %u pulses", title, num_traces, num_traces == 1 ? "" : "s", duration,
+            num_pulses);
+    if (invalid_lines || time_jumps)
+        fprintf(f, ", %u invalid lines, %u time jumps", invalid_lines, time_jumps);
+    fprintf(f, "\n");
+
+    for (uint32_t i = 0; i < num_objects; i++) {
+        const ObjectStats &obj = objects[i];
+        double total_time = 0;
+        for (int l = 0; l < num_fix_levels; l++)
+            total_time += obj.fix_time[l];
+        fprintf(f, "  object%u: fix time", i);
+        for (int l = num_fix_levels - 1; l >= 0; l--)
+            fprintf(f, " %s %.1f%%", fix_level_names[l], total_time > 0 ? obj.fix_time[l] / total_time * 100 : 0.);
+        if (obj.num_steps)
+            fprintf(f, "; noise %.2f mm", position_noise(i) * 1000);
+        fprintf(f, "; %u dropouts", obj.num_dropouts);
+        if (obj.num_dropouts)
+            fprintf(f, " (%.2f s total, %.2f s max)", obj.dropout_time, obj.max_dropout_time);
+        fprintf(f, "\n");
+    }
+
+    for (uint32_t i = 0; i < num_sensors; i++) {
+        if (sensors[i].num_d2)
+            fprintf(f, "  sensor%u: angle jitter %.1f urad (%u samples)\n", i, angle_jitter(i) * 1e6,
+                    sensors[i].num_d2);
+        else
+            fprintf(f, "  sensor%u: no angles\n", i);
+    }
+
+    for (int b = 0; b < num_base_stations; b++) {
+        const BaseStationStats &bs = base_stations[b];
+        fprintf(f, "  base%d: OOTX frames %u/%u decoded", b, bs.frames_decoded, bs.frames_started);
+        if (bs.frames_started)
+            fprintf(f, " (%.0f%%)", (double)bs.frames_decoded / bs.frames_started * 100);
+        fprintf(f, "\n");
+    }
+}
+
+
+// ======  TraceStatsNode  ====================================================
+
+// Collects statistics of angles and positions into a TraceSummary. Message times are converted to seconds
+// relative to the current trace time, which doesn't wrap around.
+class TraceStatsNode
+    : public WorkerNode
+    , public Consumer<SensorAnglesFrame>
+    , public Consumer<ObjectPosition> {
+public:
+    TraceStatsNode(TraceSummary *summary, const Timestamp *cur_time, const double *cur_seconds)
+        : summary_(summary), cur_time_(cur_time), cur_seconds_(cur_seconds), angles_{}, objects_{} {}
+
+    virtual Timestamp next_work_time(Timestamp cur_time) { return cur_time + max_sleep_time; }
+
+    virtual void consume(const SensorAnglesFrame &f) {
+        if (f.fix_level < FixLevel::kCycleSynced)
+            return;
+        for (uint32_t i = 0; i < f.sensors.size() && i < max_num_inputs; i++)
+            for (int p = 0; p < num_cycle_phases; p++) {
+                uint32_t updated_cycle = f.sensors[i].updated_cycles[p];
+                AngleHistory &history = angles_[i][p];
+                if (f.cycle_idx - updated_cycle >= num_cycle_phases || updated_cycle == history.updated_cycle)
+                    continue;  // Not updated in this frame.
+                if (updated_cycle != history.updated_cycle + num_cycle_phases)
+                    history.len = 0;  // Missed an update.
+                float angle = f.sensors[i].angles[p];
+                if (history.len == 2) {
+                    float d2 = angle - 2 * history.prev[0] + history.prev[1];
+                    summary_->sensors[i].sum_sq_d2 += d2 * d2;
+                    summary_->sensors[i].num_d2++;
+                }
+                history.prev[1] = history.prev[0];
+                history.prev[0] = angle;
+                history.len = std::min(history.len + 1, 2u);
+                history.updated_cycle = updated_cycle;
+            }
+    }
+
+    virtual void consume(const ObjectPosition &pos) {
+        if (pos.object_idx >= summary_->num_objects)
+            return;
+        ObjectState &state = objects_[pos.object_idx];
+        TraceSummary::ObjectStats &stats = summary_->objects[pos.object_idx];
+        double time = to_seconds(pos.time);
+        add_fix_time(state, stats, time);
+        state.fix_level_idx = fix_level_idx(pos.fix_level);
+
+        if (pos.fix_level >= FixLevel::kStaleFix) {
+            if (state.have_valid)
+                add_gap(stats, time - state.last_valid_time);
+            state.have_valid = true;
+            state.last_valid_time = time;
+        }
+
+        if (pos.fix_level == FixLevel::kFullFix) {
+            if (state.have_full && time - state.last_full_time < max_frame_interval) {
+                float dx = pos.pos[0] - state.last_pos[0], dy = pos.pos[1] - state.last_pos[1],
+                      dz = pos.pos[2] - state.last_pos[2];
+                stats.sum_sq_step += dx*dx + dy*dy + dz*dz;
+                stats.num_steps++;
+            }
+            state.have_full = true;
+            state.last_full_time = time;
+            memcpy(state.last_pos, pos.pos, sizeof(state.last_pos));
+        } else {
+            state.have_full = false;
+        }
+    }
+
+    // Account for the time till the end of the trace.
+    void finish(double end_time) {
+        for (uint32_t i = 0; i < summary_->num_objects; i++) {
+            ObjectState &state = objects_[i];
+            add_fix_time(state, summary_->objects[i], end_time);
+            if (state.have_valid)
+                add_gap(summary_->objects[i], end_time - state.last_valid_time);
+        }
+    }
+
+private:
+    struct AngleHistory {
+        float prev[2];  // prev[0] is the last angle, prev[1] is the one before it.
+        uint32_t len;   // Number of consecutive angles seen, up to 2.
+        uint32_t updated_cycle;
+    };
+
+    struct ObjectState {
+        bool have_last;  // Time and fix level of the last position.
+        double last_time;
+        int fix_level_idx;
+        bool have_valid;  // Time of the last valid position.
+        double last_valid_time;
+        bool have_full;  // Last position, if it was a full fix.
+        double last_full_time;
+        float last_pos[3];
+    };
+
+    double to_seconds(Timestamp time) {
+        return *cur_seconds_ + (time - *cur_time_).get_value((TimeUnit)1) / (1e6 * usec);
+    }
+
+    // Time since the previous position is spent at its fix level, unless positions stopped coming.
+    void add_fix_time(ObjectState &state, TraceSummary::ObjectStats &stats, double time) {
+        double prev_time = state.have_last ? state.last_time : 0;
+        double interval = std::max(time - prev_time, 0.);
+        double known = state.have_last ? std::min(interval, max_frame_interval) : 0;
+        if (state.have_last)
+            stats.fix_time[state.fix_level_idx] += known;
+        stats.fix_time[0] += interval - known;
+        state.have_last = true;
+        state.last_time = std::max(time, prev_time);
+    }
+
+    void add_gap(TraceSummary::ObjectStats &stats, double gap) {
+        if (gap > min_dropout_duration) {
+            stats.num_dropouts++;
+            stats.dropout_time += gap;
+            stats.max_dropout_time = std::max(stats.max_dropout_time, gap);
+        }
+    }
+
+    TraceSummary *summary_;
+    const Timestamp *cur_time_;
+    const double *cur_seconds_;
+    AngleHistory angles_[max_num_inputs][num_cycle_phases];
+    ObjectState objects_[max_num_inputs];
+};
+
+
+// ======  TraceAnalyzer  =====================================================
+
+TraceAnalyzer::TraceAnalyzer(const PersistentSettings &settings)
+    : synced_(false)
+    , last_src_us_(0)
+    , last_src_frac_(0)
+    , last_pulse_time_()
+    , cur_time_()
+    , cur_seconds_(0)
+    , summary_() {
+    summary_.num_traces = 1;
+    summary_.num_sensors = settings.inputs().size();
+    summary_.num_objects = settings.geo_builders().size();
+
+    // Same processing nodes as in create_vive_sensor_pipeline(); pulses are fed directly instead of input nodes,
+    // and statistics are collected instead of formatting and output.
+    pulse_processor_ = pipeline_.emplace_back<PulseProcessor>(settings.inputs().size());
+    for (uint32_t i = 0; i < settings.inputs().size(); i++)
+        input_pins_.push_back(settings.inputs()[i].pin);
+
+    stats_ = pipeline_.emplace_back<TraceStatsNode>(&summary_, &cur_time_, &cur_seconds_);
+    pulse_processor_->Producer<SensorAnglesFrame>::pipe(stats_);
+
+    for (uint32_t i = 0; i < settings.geo_builders().size(); i++) {
+        auto node = pipeline_.emplace_back<PointGeometryBuilder>(
+            i, settings.geo_builders()[i], settings.base_stations());
+        pulse_processor_->Producer<SensorAnglesFrame>::pipe(node);
+        node->pipe(stats_);
+    }
+
+    for (uint32_t i = 0; i < settings.base_stations().size(); i++) {
+        auto node = pipeline_.emplace_back<DataFrameDecoder>(i);
+        pulse_processor_->Producer<DataFrameBit>::pipe(node);
+        decoders_.push_back(node);
+    }
+}
+
+void TraceAnalyzer::feed_line(const char *line) {
+    TracePulse pulse;
+    switch (parse_trace_line(line, &pulse)) {
+        case TraceLineType::kComment: return;
+        case TraceLineType::kInvalid: summary_.invalid_lines++; return;
+        case TraceLineType::kPulse: break;
+    }
+
+    // Convert trace time to ours. Pulses can be slightly out of order, but the pipeline time only goes forward.
+    Timestamp time = cur_time_;
+    if (synced_) {
+        int32_t delta_us = (int32_t)(pulse.start_us - last_src_us_);
+        if (-max_trace_time_jump.get_value(usec) < delta_us && delta_us < max_trace_time_jump.get_value(usec)) {
+            time = last_pulse_time_ + TimeDelta(delta_us, usec)
+                 + TimeDelta((int)lroundf((pulse.start_frac - last_src_frac_) * usec), (TimeUnit)1);
+        } else {
+            summary_.time_jumps++;
+            time = cur_time_ + max_trace_time_jump;
+        }
+    }
+    synced_ = true;
+    last_src_us_ = pulse.start_us;
+    last_src_frac_ = pulse.start_frac;
+    last_pulse_time_ = time;
+
+    // Let the pipeline process everything up to this pulse.
+    if (time > cur_time_) {
+        cur_seconds_ += (time - cur_time_).get_value((TimeUnit)1) / (1e6 * usec);
+        cur_time_ = time;
+        pipeline_.do_work(cur_time_);
+    }
+
+    summary_.num_pulses++;
+    TimeDelta len((int)lroundf(pulse.len_us * usec), (TimeUnit)1);
+    for (uint32_t i = 0; i < input_pins_.size(); i++)
+        if (input_pins_[i] == pulse.pin)
+            pulse_processor_->consume({.input_idx = i, .start_time = time, .pulse_len = len});
+}
+
+TraceSummary TraceAnalyzer::finish() {
+    pipeline_.do_work(cur_time_ + trace_flush_time);
+    stats_->finish(cur_seconds_);
+    summary_.duration = cur_seconds_;
+    for (uint32_t i = 0; i < decoders_.size(); i++) {
+        summary_.base_stations[i].frames_started = decoders_[i]->frames_started();
+        summary_.base_stations[i].frames_decoded = decoders_[i]->frames_decoded();
+    }
+    return summary_;
+}
+
+TraceSummary analyze_trace_file(const PersistentSettings &settings, const char *path) {
+    TraceAnalyzer analyzer(settings);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        throw_printf("Can't open %s: %s", path, strerror(errno));
+
+    char line[256];
+    while (fgets(line, sizeof(line), f))
+        analyzer.feed_line(line);
+    fclose(f);
+    return analyzer.finish();
+}
@@ -0,0 +1,87 @@
+// Offline analysis of recorded pulse traces: runs the processing part of the pipeline (pulses -> angles -> positions,
+// base station data frames) on a trace as fast as possible and collects quality statistics.
+// Each TraceAnalyzer owns its own pipeline, so several traces can be analyzed concurrently.
+#pragma once
+#include "settings.h"
+#include "pulse_processor.h"
+#include "data_frame_decoder.h"
+#include "pulse_trace.h"
+#include <stdio.h>
+#include <vector>
+
+// Fix levels reported separately, in increasing order.
+constexpr int num_fix_levels = 6;
+constexpr FixLevel fix_levels[num_fix_levels] = {FixLevel::kNoSignals, FixLevel::kCycleSyncing,
+    FixLevel::kCycleSynced, FixLevel::kPartialVis, FixLevel::kStaleFix, FixLevel::kFullFix};
+
+// Statistics of one or several traces. All members are sums (or maximums), so summaries can be merged.
+struct TraceSummary {
+    uint32_t num_traces;
+    uint32_t num_pulses;
+    uint32_t invalid_lines;
+    uint32_t time_jumps;  // Pulse times jumping more than max_trace_time_jump; each one is counted as 1s of no data.
+    double duration;      // Seconds.
+
+    struct SensorStats {
+        double sum_sq_d2;  // Sum of squared second differences of angles of consecutive frames, rad^2.
+        uint32_t num_d2;
+    };
+    uint32_t num_sensors;
+    SensorStats sensors[max_num_inputs];
+
+    struct ObjectStats {
+        double fix_time[num_fix_levels];  // Seconds spent at each fix level.
+        double sum_sq_step;  // Sum of squared distances between consecutive valid positions, m^2.
+        uint32_t num_steps;
+        uint32_t num_dropouts;  // Gaps in valid positions longer than min_dropout_duration.
+        double dropout_time, max_dropout_time;  // Seconds.
+    };
+    uint32_t num_objects;
+    ObjectStats objects[max_num_inputs];
+
+    struct BaseStationStats {
+        uint32_t frames_started;  // OOTX frames whose preamble was seen.
+        uint32_t frames_decoded;  // OOTX frames received completely.
+    };
+    BaseStationStats base_stations[num_base_stations];
+
+    void merge(const TraceSummary &other);
+
+    // Derived values. Angle jitter is in radians, position noise is RMS of 3d position noise in meters;
+    // both are estimated from differences between consecutive values, so slow motion affects them only a little.
+    float angle_jitter(uint32_t sensor_idx) const;
+    float position_noise(uint32_t object_idx) const;
+
+    void print(FILE *f, const char *title) const;
+};
+
+class TraceStatsNode;
+
+// Runs the pipeline on one trace, fed line by line.
+class TraceAnalyzer {
+public:
+    explicit TraceAnalyzer(const PersistentSettings &settings);
+
+    void feed_line(const char *line);
+    TraceSummary finish();
+
+private:
+    Pipeline pipeline_;
+    PulseProcessor *pulse_processor_;
+    TraceStatsNode *stats_;
+    std::vector<DataFrameDecoder *> decoders_;
+    std::vector<uint32_t> input_pins_;  // Sensor pin of each input.
+
+    // Mapping of trace time to pipeline time.
+    bool synced_;
+    uint32_t last_src_us_;
+    float last_src_frac_;
+    Timestamp last_pulse_time_;
+    Timestamp cur_time_;  // Latest pulse time; pipeline works up to it.
+    double cur_seconds_;  // cur_time_ in seconds since the start of the trace. Doesn't wrap.
+
+    TraceSummary summary_;
+};
+
+// Analyze trace file at given path. Throws ValidationException if it can't be read.
+TraceSummary analyze_trace_file(const PersistentSettings &settings, const char *path);
@@ -0,0 +1,687 @@
+#include "calibration_solver.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+
+namespace calibration {
+
+// ======  Small linear algebra helpers  ======================================
+
+static inline Vec3 add(const Vec3 &a, const Vec3 &b) { return {a[0]+b[0], a[1]+b[1], a[2]+b[2]}; }
+static inline Vec3 sub(const Vec3 &a, const Vec3 &b) { return {a[0]-b[0], a[1]-b[1], a[2]-b[2]}; }
+static inline Vec3 scale(const Vec3 &a, double k) { return {a[0]*k, a[1]*k, a[2]*k}; }
+static inline double dot(const Vec3 &a, const Vec3 &b) { return a[0]*b[0] + a[1]*b[1] + a[2]*b[2]; }
+static inline double norm(const Vec3 &a) { return sqrt(dot(a, a)); }
+static inline Vec3 cross(const Vec3 &a, const Vec3 &b) {
+    return {a[1]*b[2] - a[2]*b[1], a[2]*b[0] - a[0]*b[2], a[0]*b[1] - a[1]*b[0]};
+}
+
+static inline Vec3 mul(const Mat3 &m, const Vec3 &v) {  // m * v
+    return {m[0]*v[0] + m[1]*v[1] + m[2]*v[2],
+            m[3]*v[0] + m[4]*v[1] + m[5]*v[2],
+            m[6]*v[0] + m[7]*v[1] + m[8]*v[2]};
+}
+
+static inline Vec3 mul_t(const Mat3 &m, const Vec3 &v) {  // m^T * v
+    return {m[0]*v[0] + m[3]*v[1] + m[6]*v[2],
+            m[1]*v[0] + m[4]*v[1] + m[7]*v[2],
+            m[2]*v[0] + m[5]*v[1] + m[8]*v[2]};
+}
+
+static Mat3 mul(const Mat3 &a, const Mat3 &b) {
+    Mat3 res;
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            res[i*3+j] = a[i*3+0]*b[0*3+j] + a[i*3+1]*b[1*3+j] + a[i*3+2]*b[2*3+j];
+    return res;
+}
+
+static const Mat3 identity = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+
+// Rotation matrix from a rotation vector (Rodrigues formula).
+static Mat3 exp_so3(const double *w) {
+    double theta = sqrt(w[0]*w[0] + w[1]*w[1] + w[2]*w[2]);
+    double a, b;
+    if (theta < 1e-8) {
+        a = 1.0; b = 0.5;
+    } else {
+        a = sin(theta) / theta;
+        b = (1.0 - cos(theta)) / (theta * theta);
+    }
+    Mat3 k = {0, -w[2], w[1], w[2], 0, -w[0], -w[1], w[0], 0};
+    Mat3 k2 = mul(k, k);
+    Mat3 res;
+    for (int i = 0; i < 9; i++)
+        res[i] = identity[i] + a * k[i] + b * k2[i];
+    return res;
+}
+
+static Mat3 quat_to_mat(const double q[4]) {
+    double w = q[0], x = q[1], y = q[2], z = q[3];
+    return {1 - 2*(y*y + z*z), 2*(x*y - w*z),     2*(x*z + w*y),
+            2*(x*y + w*z),     1 - 2*(x*x + z*z), 2*(y*z - w*x),
+            2*(x*z - w*y),     2*(y*z + w*x),     1 - 2*(x*x + y*y)};
+}
+
+// In-place Cholesky solve of a symmetric positive definite n x n system with 'num_rhs' right hand sides.
+// 'a' is destroyed; 'b' is n x num_rhs, row-major, and is replaced with the solution. Returns false if not PD.
+static bool cholesky_solve(double *a, int n, double *b, int num_rhs) {
+    for (int j = 0; j < n; j++) {
+        double d = a[j*n+j];
+        for (int k = 0; k < j; k++)
+            d -= a[j*n+k] * a[j*n+k];
+        if (!(d > 0))
+            return false;
+        d = sqrt(d);
+        a[j*n+j] = d;
+        for (int i = j+1; i < n; i++) {
+            double s = a[i*n+j];
+            for (int k = 0; k < j; k++)
+                s -= a[i*n+k] * a[j*n+k];
+            a[i*n+j] = s / d;
+        }
+    }
+    for (int c = 0; c < num_rhs; c++) {
+        for (int i = 0; i < n; i++) {  // L y = b
+            double s = b[i*num_rhs+c];
+            for (int k = 0; k < i; k++)
+                s -= a[i*n+k] * b[k*num_rhs+c];
+            b[i*num_rhs+c] = s / a[i*n+i];
+        }
+        for (int i = n-1; i >= 0; i--) {  // L^T x = y
+            double s = b[i*num_rhs+c];
+            for (int k = i+1; k < n; k++)
+                s -= a[k*n+i] * b[k*num_rhs+c];
+            b[i*num_rhs+c] = s / a[i*n+i];
+        }
+    }
+    return true;
+}
+
+// Eigenvector of the largest eigenvalue of a symmetric 4x4 matrix, using cyclic Jacobi rotations.
+static void largest_eigenvector4(double m[16], double res[4]) {
+    double v[16] = {1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1};
+    for (int sweep = 0; sweep < 50; sweep++) {
+        double off = 0;
+        for (int p = 0; p < 4; p++)
+            for (int q = p+1; q < 4; q++)
+                off += m[p*4+q] * m[p*4+q];
+        if (off < 1e-24)
+            break;
+        for (int p = 0; p < 4; p++)
+            for (int q = p+1; q < 4; q++) {
+                if (fabs(m[p*4+q]) < 1e-300)
+                    continue;
+                double theta = (m[q*4+q] - m[p*4+p]) / (2 * m[p*4+q]);
+                double t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta*theta + 1));
+                double c = 1 / sqrt(t*t + 1), s = t * c;
+                for (int k = 0; k < 4; k++) {  // m = J^T m J
+                    double mkp = m[k*4+p], mkq = m[k*4+q];
+                    m[k*4+p] = c*mkp - s*mkq;
+                    m[k*4+q] = s*mkp + c*mkq;
+                }
+                for (int k = 0; k < 4; k++) {
+                    double mpk = m[p*4+k], mqk = m[q*4+k];
+                    m[p*4+k] = c*mpk - s*mqk;
+                    m[q*4+k] = s*mpk + c*mqk;
+                }
+                for (int k = 0; k < 4; k++) {
+                    double vkp = v[k*4+p], vkq = v[k*4+q];
+                    v[k*4+p] = c*vkp - s*vkq;
+                    v[k*4+q] = s*vkp + c*vkq;
+                }
+            }
+    }
+    int best = 0;
+    for (int i = 1; i < 4; i++)
+        if (m[i*4+i] > m[best*4+best])
+            best = i;
+    for (int i = 0; i < 4; i++)
+        res[i] = v[i*4+best];
+}
+
+// Horn's closed-form absolute orientation: finds pose such that dst[i] ~= pose.rot * src[i] + pose.pos.
+static Pose absolute_orientation(const std::vector<Vec3> &src, const std::vector<Vec3> &dst) {
+    Vec3 src_mean = {}, dst_mean = {};
+    for (uint32_t i = 0; i < src.size(); i++) {
+        src_mean = add(src_mean, src[i]);
+        dst_mean = add(dst_mean, dst[i]);
+    }
+    src_mean = scale(src_mean, 1.0 / src.size());
+    dst_mean = scale(dst_mean, 1.0 / dst.size());
+
+    double s[9] = {};  // s[i*3+j] = sum(src_i * dst_j)
+    for (uint32_t k = 0; k < src.size(); k++) {
+        Vec3 a = sub(src[k], src_mean), b = sub(dst[k], dst_mean);
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                s[i*3+j] += a[i] * b[j];
+    }
+    double sxx = s[0], sxy = s[1], sxz = s[2], syx = s[3], syy = s[4], syz = s[5], szx = s[6], szy = s[7], szz = s[8];
+    double n[16] = {
+        sxx + syy + szz, syz - szy,        szx - sxz,        sxy - syx,
+        syz - szy,       sxx - syy - szz,  sxy + syx,        szx + sxz,
+        szx - sxz,       sxy + syx,        -sxx + syy - szz, syz + szy,
+        sxy - syx,       szx + sxz,        syz + szy,        -sxx - syy + szz,
+    };
+    double q[4];
+    largest_eigenvector4(n, q);
+
+    Pose res;
+    res.rot = quat_to_mat(q);
+    res.pos = sub(dst_mean, mul(res.rot, src_mean));
+    return res;
+}
+
+// Closest point between two rays. Returns false if rays are parallel.
+static bool triangulate(const Vec3 &o1, const Vec3 &d1, const Vec3 &o2, const Vec3 &d2, Vec3 *res) {
+    // See intersect_lines() in geometry.cpp.
+    Vec3 w0 = sub(o1, o2);
+    double a = dot(d1, d1), b = dot(d1, d2), c = dot(d2, d2), d = dot(d1, w0), e = dot(d2, w0);
+    double denom = a * c - b * b;
+    if (fabs(denom) < 1e-12)
+        return false;
+    Vec3 pt1 = add(o1, scale(d1, (b * e - c * d) / denom));
+    Vec3 pt2 = add(o2, scale(d2, (a * e - b * d) / denom));
+    *res = scale(add(pt1, pt2), 0.5);
+    return true;
+}
+
+
+// ======  CalibrationSolver  =================================================
+
+// Per-frame pieces of normal equations kept for back-substitution.
+struct CalibrationSolver::FrameState {
+    double v_inv_wt[6*12];  // V^-1 * W^T
+    double v_inv_g[6];      // V^-1 * g_frame
+};
+
+// Thread-local accumulator of the reduced (Schur complement) system for base stations.
+struct CalibrationSolver::Accumulator {
+    double schur[12*12];
+    double rhs[12];
+    double cost;
+    bool failed;
+    std::vector<FrameState> *frame_states;
+};
+
+CalibrationSolver::CalibrationSolver(const std::vector<Vec3> &rig_sensors, const std::vector<CalibrationFrame> &frames,
+                                     uint32_t num_threads)
+    : rig_sensors_(rig_sensors)
+    , num_threads_(std::max(num_threads, 1u))
+    , ref_frame_(0)
+    , bases_initialized_(false)
+    , ref_frame_at_origin_(false)
+    , bases_{}
+    , huber_threshold_(2e-3) {
+
+    // Keep only samples for known sensors, and only frames that can constrain rig pose.
+    for (auto &frame : frames) {
+        CalibrationFrame f = {frame.time_ms, {}};
+        for (auto &sample : frame.samples)
+            if (sample.sensor_idx < rig_sensors_.size() && sample.base_idx < num_base_stations)
+                f.samples.push_back(sample);
+        if (f.samples.size() * 2 >= 6)  // 6 degrees of freedom.
+            frames_.push_back(f);
+    }
+
+    // Reference frame is the first frame with the largest number of sensors visible from both stations.
+    uint32_t best_count = 0;
+    for (uint32_t i = 0; i < frames_.size(); i++) {
+        uint32_t counts[num_base_stations] = {};
+        for (auto &sample : frames_[i].samples)
+            counts[sample.base_idx]++;
+        uint32_t both = std::min(counts[0], counts[1]);
+        if (both > best_count) {
+            best_count = both;
+            ref_frame_ = i;
+        }
+    }
+}
+
+Vec3 CalibrationSolver::ray_from_angles(const double angles[2]) {
+    // Same as calc_ray_vec() in geometry.cpp: intersection of the two laser planes.
+    Vec3 a = {cos(angles[0]), 0, -sin(angles[0])};  // Normal vector to X plane
+    Vec3 b = {0, cos(angles[1]), sin(angles[1])};   // Normal vector to Y plane
+    Vec3 ray = cross(b, a);
+    return scale(ray, 1.0 / norm(ray));
+}
+
+void CalibrationSolver::predict_angles(const Pose &base, const Vec3 &world_pt, double angles[2]) {
+    // Inverse of ray_from_angles(): base station 'looks' to inverse Z axis.
+    Vec3 l = mul_t(base.rot, sub(world_pt, base.pos));
+    angles[0] = atan2(-l[0], -l[2]);
+    angles[1] = atan2(l[1], -l[2]);
+}
+
+void CalibrationSolver::set_initial_base_stations(const BaseStationGeometryDef (&defs)[num_base_stations]) {
+    for (int b = 0; b < num_base_stations; b++) {
+        for (int i = 0; i < 9; i++)
+            bases_[b].rot[i] = defs[b].mat[i];
+        for (int i = 0; i < 3; i++)
+            bases_[b].pos[i] = defs[b].origin[i];
+    }
+    bases_initialized_ = true;
+    ref_frame_at_origin_ = false;
+}
+
+bool CalibrationSolver::initialize_base_stations(std::string *error) {
+    if (frames_.empty()) {
+        *error = "No usable frames found.";
+        return false;
+    }
+    const CalibrationFrame &ref = frames_[ref_frame_];
+    for (uint32_t b = 0; b < num_base_stations; b++) {
+        // Rig pose in the reference frame is identity, so world points are rig sensor positions.
+        std::vector<Vec3> points, rays;
+        for (auto &sample : ref.samples)
+            if (sample.base_idx == b) {
+                points.push_back(rig_sensors_[sample.sensor_idx]);
+                rays.push_back(ray_from_angles(sample.angles));
+            }
+        if (points.size() < 4) {
+            *error = "Need at least 4 rig sensors visible from base station " + std::to_string(b) +
+                     " in one frame to initialize. Provide initial geometry instead.";
+            return false;
+        }
+
+        // Initial depth estimate: ratio of spatial spread of the rig to its angular spread.
+        Vec3 point_mean = {}, ray_mean = {};
+        for (uint32_t i = 0; i < points.size(); i++) {
+            point_mean = add(point_mean, points[i]);
+            ray_mean = add(ray_mean, rays[i]);
+        }
+        point_mean = scale(point_mean, 1.0 / points.size());
+        ray_mean = scale(ray_mean, 1.0 / rays.size());
+        double point_spread = 0, ray_spread = 0;
+        for (uint32_t i = 0; i < points.size(); i++) {
+            point_spread += dot(sub(points[i], point_mean), sub(points[i], point_mean));
+            ray_spread += dot(sub(rays[i], ray_mean), sub(rays[i], ray_mean));
+        }
+        double depth = ray_spread > 0 ? sqrt(point_spread / ray_spread) : 3.0;
+        depth = std::min(std::max(depth, 0.5), 20.0);
+
+        // Orthogonal iteration: alternate between absolute orientation and depth update.
+        std::vector<double> depths(points.size(), depth);
+        std::vector<Vec3> local_points(points.size());
+        Pose pose = {identity, {0, 0, 0}};
+        for (int iter = 0; iter < 200; iter++) {
+            for (uint32_t i = 0; i < points.size(); i++)
+                local_points[i] = scale(rays[i], depths[i]);
+            pose = absolute_orientation(local_points, points);
+            double max_change = 0;
+            for (uint32_t i = 0; i < points.size(); i++) {
+                double new_depth = std::max(dot(rays[i], mul_t(pose.rot, sub(points[i], pose.pos))), 0.01);
+                max_change = std::max(max_change, fabs(new_depth - depths[i]));
+                depths[i] = new_depth;
+            }
+            if (max_change < 1e-9)
+                break;
+        }
+        bases_[b] = pose;
+    }
+    bases_initialized_ = true;
+    ref_frame_at_origin_ = true;
+    return true;
+}
+
+bool CalibrationSolver::triangulate_rig_pose(uint32_t frame_idx, Pose *pose) const {
+    // Triangulate each sensor from both stations and fit the rig to these points.
+    std::vector<Vec3> rig_points, world_points;
+    for (auto &s0 : frames_[frame_idx].samples) {
+        if (s0.base_idx != 0) continue;
+        for (auto &s1 : frames_[frame_idx].samples) {
+            if (s1.base_idx != 1 || s1.sensor_idx != s0.sensor_idx) continue;
+            Vec3 pt;
+            if (triangulate(bases_[0].pos, mul(bases_[0].rot, ray_from_angles(s0.angles)),
+                            bases_[1].pos, mul(bases_[1].rot, ray_from_angles(s1.angles)), &pt)) {
+                rig_points.push_back(rig_sensors_[s0.sensor_idx]);
+                world_points.push_back(pt);
+            }
+        }
+    }
+    if (rig_points.size() < 2)
+        return false;
+    *pose = absolute_orientation(rig_points, world_points);
+    return true;
+}
+
+bool CalibrationSolver::initialize_frame_poses(std::string *error) {
+    std::vector<CalibrationFrame> frames;
+    std::vector<Pose> poses;
+    uint32_t new_ref_frame = 0;
+    for (uint32_t f = 0; f < frames_.size(); f++) {
+        // Reference frame defines world coordinates if base stations were initialized from it.
+        Pose pose = {identity, {0, 0, 0}};
+        bool have_pose = (f == ref_frame_ && ref_frame_at_origin_) || triangulate_rig_pose(f, &pose);
+        if (!have_pose && f != ref_frame_)
+            continue;  // Can't get rig pose for this frame.
+
+        if (f == ref_frame_)
+            new_ref_frame = frames.size();
+        frames.push_back(frames_[f]);
+        poses.push_back(pose);
+    }
+    if (frames.empty()) {
+        *error = "No frames with sensors visible from both base stations.";
+        return false;
+    }
+    frames_.swap(frames);
+    rig_poses_.swap(poses);
+    ref_frame_ = new_ref_frame;
+    return true;
+}
+
+uint32_t CalibrationSolver::refresh_frame_poses() {
+    // Small rigs seen from afar have mirrored rig pose solutions, so a frame initialized from rough base station
+    // estimates can get stuck in the wrong one. Re-triangulating from refined base stations fixes that.
+    std::vector<uint32_t> num_updated(num_threads_);
+    parallel_for_frames([&](uint32_t thread_idx, uint32_t first, uint32_t last) {
+        for (uint32_t f = first; f < last; f++) {
+            Pose pose;
+            if (f != ref_frame_ && triangulate_rig_pose(f, &pose) && frame_cost(f, pose) < frame_cost(f, rig_poses_[f])) {
+                rig_poses_[f] = pose;
+                num_updated[thread_idx]++;
+            }
+        }
+    });
+    uint32_t res = 0;
+    for (auto n : num_updated)
+        res += n;
+    return res;
+}
+
+template<typename Fn>
+void CalibrationSolver::parallel_for_frames(Fn fn) const {
+    uint32_t num_threads = std::min<uint32_t>(num_threads_, std::max<uint32_t>(frames_.size() / 64, 1));
+    uint32_t per_thread = (frames_.size() + num_threads - 1) / num_threads;
+    std::vector<std::thread> threads;
+    for (uint32_t t = 1; t < num_threads; t++)
+        threads.emplace_back(fn, t, std::min<uint32_t>(t * per_thread, frames_.size()),
+                             std::min<uint32_t>((t+1) * per_thread, frames_.size()));
+    fn(0, 0, std::min<uint32_t>(per_thread, frames_.size()));
+    for (auto &thread : threads)
+        thread.join();
+}
+
+static inline double huber_weight(double r, double threshold) {
+    double abs_r = fabs(r);
+    return abs_r <= threshold ? 1.0 : threshold / abs_r;
+}
+
+static inline double huber_cost(double r, double threshold) {
+    double abs_r = fabs(r);
+    return abs_r <= threshold ? r * r : 2 * threshold * abs_r - threshold * threshold;
+}
+
+double CalibrationSolver::frame_cost(uint32_t frame_idx, const Pose &rig) const {
+    double cost = 0;
+    for (auto &sample : frames_[frame_idx].samples) {
+        Vec3 pt = add(mul(rig.rot, rig_sensors_[sample.sensor_idx]), rig.pos);
+        double predicted[2];
+        predict_angles(bases_[sample.base_idx], pt, predicted);
+        for (int k = 0; k < 2; k++)
+            cost += huber_cost(sample.angles[k] - predicted[k], huber_threshold_);
+    }
+    return cost;
+}
+
+void CalibrationSolver::accumulate(uint32_t first_frame, uint32_t last_frame, double lambda, Accumulator *acc) const {
+    for (uint32_t f = first_frame; f < last_frame; f++) {
+        const Pose &rig = rig_poses_[f];
+        bool frame_fixed = f == ref_frame_;
+
+        double v[36] = {}, w[12*6] = {}, g[6] = {};
+        for (auto &sample : frames_[f].samples) {
+            const Pose &base = bases_[sample.base_idx];
+            Vec3 q = mul(rig.rot, rig_sensors_[sample.sensor_idx]);
+            Vec3 l = mul_t(base.rot, sub(add(q, rig.pos), base.pos));
+
+            // Gradients of both angles w.r.t. the point in base station local coordinates.
+            double dxz = l[0]*l[0] + l[2]*l[2], dyz = l[1]*l[1] + l[2]*l[2];
+            Vec3 grads[2] = {{l[2] / dxz, 0, -l[0] / dxz}, {0, -l[2] / dyz, l[1] / dyz}};
+            double predicted[2] = {atan2(-l[0], -l[2]), atan2(l[1], -l[2])};
+
+            for (int k = 0; k < 2; k++) {
+                double r = sample.angles[k] - predicted[k];
+                double wt = huber_weight(r, huber_threshold_);
+                acc->cost += huber_cost(r, huber_threshold_);
+
+                // Jacobian rows. Base: rotation (local perturbation) + origin. Rig: rotation (global) + translation.
+                Vec3 h = mul(base.rot, grads[k]);
+                Vec3 jb_rot = cross(grads[k], l), jf_rot = cross(q, h);
+                double jb[6] = {jb_rot[0], jb_rot[1], jb_rot[2], -h[0], -h[1], -h[2]};
+                double jf[6] = {jf_rot[0], jf_rot[1], jf_rot[2], h[0], h[1], h[2]};
+
+                uint32_t ofs = sample.base_idx * 6;
+                for (int i = 0; i < 6; i++) {
+                    acc->rhs[ofs+i] += wt * jb[i] * r;
+                    for (int j = 0; j < 6; j++)
+                        acc->schur[(ofs+i)*12 + ofs+j] += wt * jb[i] * jb[j];
+                }
+                if (!frame_fixed)
+                    for (int i = 0; i < 6; i++) {
+                        g[i] += wt * jf[i] * r;
+                        for (int j = 0; j < 6; j++) {
+                            v[i*6+j] += wt * jf[i] * jf[j];
+                            w[(ofs+i)*6+j] += wt * jb[i] * jf[j];
+                        }
+                    }
+            }
+        }
+
+        FrameState &state = (*acc->frame_states)[f];
+        if (frame_fixed) {
+            memset(&state, 0, sizeof(state));
+            continue;
+        }
+
+        // Eliminate rig pose: schur -= W V^-1 W^T, rhs -= W V^-1 g.
+        for (int i = 0; i < 6; i++)
+            v[i*6+i] += lambda * std::max(v[i*6+i], 1e-6);
+        for (int i = 0; i < 6; i++) {
+            for (int j = 0; j < 12; j++)
+                state.v_inv_wt[i*12+j] = w[j*6+i];
+            state.v_inv_g[i] = g[i];
+        }
+        double v_copy[36];
+        memcpy(v_copy, v, sizeof(v));
+        if (!cholesky_solve(v, 6, state.v_inv_wt, 12) || !cholesky_solve(v_copy, 6, state.v_inv_g, 1)) {
+            acc->failed = true;
+            continue;
+        }
+        for (int i = 0; i < 12; i++) {
+            for (int k = 0; k < 6; k++)
+                acc->rhs[i] -= w[i*6+k] * state.v_inv_g[k];
+            for (int j = 0; j < 12; j++) {
+                double s = 0;
+                for (int k = 0; k < 6; k++)
+                    s += w[i*6+k] * state.v_inv_wt[k*12+j];
+                acc->schur[i*12+j] -= s;
+            }
+        }
+    }
+}
+
+double CalibrationSolver::evaluate_cost(const Pose (&bases)[num_base_stations], const std::vector<Pose> &rig_poses,
+                                        double *base_sq_err, uint32_t *base_obs) const {
+    std::vector<std::array<double, 1 + 2*num_base_stations>> partial(num_threads_);
+    parallel_for_frames([&](uint32_t thread_idx, uint32_t first, uint32_t last) {
+        auto &res = partial[thread_idx];
+        res.fill(0);
+        for (uint32_t f = first; f < last; f++)
+            for (auto &sample : frames_[f].samples) {
+                const Pose &rig = rig_poses[f];
+                Vec3 pt = add(mul(rig.rot, rig_sensors_[sample.sensor_idx]), rig.pos);
+                double predicted[2];
+                predict_angles(bases[sample.base_idx], pt, predicted);
+                for (int k = 0; k < 2; k++) {
+                    double r = sample.angles[k] - predicted[k];
+                    res[0] += huber_cost(r, huber_threshold_);
+                    res[1 + sample.base_idx*2] += r * r;
+                    res[2 + sample.base_idx*2] += 1;
+                }
+            }
+    });
+    double cost = 0;
+    for (uint32_t b = 0; b < num_base_stations; b++) {
+        base_sq_err[b] = 0;
+        base_obs[b] = 0;
+    }
+    for (auto &res : partial) {
+        cost += res[0];
+        for (uint32_t b = 0; b < num_base_stations; b++) {
+            base_sq_err[b] += res[1 + b*2];
+            base_obs[b] += (uint32_t)res[2 + b*2];
+        }
+    }
+    return cost;
+}
+
+SolverSummary CalibrationSolver::solve(uint32_t max_iterations, std::string *error) {
+    SolverSummary summary = {};
+    if (!bases_initialized_) {
+        *error = "Base stations are not initialized.";
+        return summary;
+    }
+    if (!initialize_frame_poses(error))
+        return summary;
+
+    double base_sq_err[num_base_stations];
+    uint32_t base_obs[num_base_stations];
+    double cost = evaluate_cost(bases_, rig_poses_, base_sq_err, base_obs);
+    summary.num_frames = frames_.size();
+    summary.num_observations = base_obs[0] + base_obs[1];
+    summary.initial_rms = sqrt((base_sq_err[0] + base_sq_err[1]) / std::max(summary.num_observations, 1u));
+
+    double lambda = 1e-3;
+    std::vector<FrameState> frame_states(frames_.size());
+    std::vector<Accumulator> accs(num_threads_);
+    for (summary.iterations = 0; summary.iterations < max_iterations; summary.iterations++) {
+        // Build reduced system for base stations.
+        for (auto &acc : accs) {
+            memset(acc.schur, 0, sizeof(acc.schur));
+            memset(acc.rhs, 0, sizeof(acc.rhs));
+            acc.cost = 0;
+            acc.failed = false;
+            acc.frame_states = &frame_states;
+        }
+        parallel_for_frames([&](uint32_t thread_idx, uint32_t first, uint32_t last) {
+            accumulate(first, last, lambda, &accs[thread_idx]);
+        });
+        double schur[12*12] = {}, delta_bases[12] = {};
+        bool failed = false;
+        for (auto &acc : accs) {
+            for (int i = 0; i < 12*12; i++)
+                schur[i] += acc.schur[i];
+            for (int i = 0; i < 12; i++)
+                delta_bases[i] += acc.rhs[i];
+            failed |= acc.failed;
+        }
+        // NOTE: Damping of base station blocks is applied after the reduction, which is equivalent.
+        for (int i = 0; i < 12; i++)
+            schur[i*12+i] += lambda * std::max(schur[i*12+i], 1e-6);
+
+        if (failed || !cholesky_solve(schur, 12, delta_bases, 1)) {
+            lambda *= 10;
+            continue;
+        }
+
+        // Back-substitute rig poses and apply the step.
+        Pose new_bases[num_base_stations];
+        for (uint32_t b = 0; b < num_base_stations; b++) {
+            new_bases[b].rot = mul(bases_[b].rot, exp_so3(&delta_bases[b*6]));
+            new_bases[b].pos = add(bases_[b].pos, {delta_bases[b*6+3], delta_bases[b*6+4], delta_bases[b*6+5]});
+        }
+        std::vector<Pose> new_rig_poses(rig_poses_);
+        double max_step = 0;
+        for (int i = 0; i < 12; i++)
+            max_step = std::max(max_step, fabs(delta_bases[i]));
+        for (uint32_t f = 0; f < frames_.size(); f++) {
+            if (f == ref_frame_) continue;
+            const FrameState &state = frame_states[f];
+            double delta[6];
+            for (int i = 0; i < 6; i++) {
+                delta[i] = state.v_inv_g[i];
+                for (int j = 0; j < 12; j++)
+                    delta[i] -= state.v_inv_wt[i*12+j] * delta_bases[j];
+                max_step = std::max(max_step, fabs(delta[i]));
+            }
+            new_rig_poses[f].rot = mul(exp_so3(delta), rig_poses_[f].rot);
+            new_rig_poses[f].pos = add(rig_poses_[f].pos, {delta[3], delta[4], delta[5]});
+        }
+
+        double new_cost = evaluate_cost(new_bases, new_rig_poses, base_sq_err, base_obs);
+        bool done;
+        if (new_cost < cost) {
+            done = (cost - new_cost) < 1e-10 * cost || max_step < 1e-10;
+            for (uint32_t b = 0; b < num_base_stations; b++)
+                bases_[b] = new_bases[b];
+            rig_poses_.swap(new_rig_poses);
+            cost = new_cost;
+            lambda = std::max(lambda / 3, 1e-12);
+        } else {
+            lambda *= 4;
+            done = lambda > 1e12;  // Can't improve anymore.
+        }
+
+        // Periodically, and before declaring convergence, check if some rig poses are better when re-triangulated.
+        if ((done || (summary.iterations + 1) % 10 == 0) && refresh_frame_poses() > 0) {
+            cost = evaluate_cost(bases_, rig_poses_, base_sq_err, base_obs);
+            lambda = 1e-3;
+            continue;
+        }
+        if (done) {
+            summary.converged = true;
+            break;
+        }
+    }
+
+    evaluate_cost(bases_, rig_poses_, base_sq_err, base_obs);
+    summary.final_rms = sqrt((base_sq_err[0] + base_sq_err[1]) / std::max(summary.num_observations, 1u));
+    for (uint32_t b = 0; b < num_base_stations; b++)
+        summary.base_rms[b] = sqrt(base_sq_err[b] / std::max(base_obs[b], 1u));
+    return summary;
+}
+
+BaseStationGeometryDef CalibrationSolver::base_station_def(uint32_t base_idx) const {
+    BaseStationGeometryDef def;
+    for (int i = 0; i < 9; i++)
+        def.mat[i] = (float)bases_[base_idx].rot[i];
+    for (int i = 0; i < 3; i++)
+        def.origin[i] = (float)bases_[base_idx].pos[i];
+    return def;
+}
+
+
+// ======  Input parsing  =====================================================
+
+bool parse_angles_line(const char *line, uint32_t *sensor_idx, uint32_t *time_ms, int32_t *fix_level,
+                       double angles[num_cycle_phases], bool valid[num_cycle_phases]) {
+    if (strncmp(line, "ANG", 3) != 0)
+        return false;
+    char *end;
+    *sensor_idx = strtoul(line + 3, &end, 10);
+    if (end == line + 3 || *end != '\t') return false;
+    *time_ms = strtoul(end + 1, &end, 10);
+    if (*end != '\t') return false;
+    *fix_level = strtol(end + 1, &end, 10);
+
+    // Angle fields are tab-separated and can be empty.
+    for (int i = 0; i < num_cycle_phases; i++) {
+        valid[i] = false;
+        if (*end != '\t')
+            continue;
+        char *field = end + 1;
+        end = field;
+        if (*field == '\t' || *field == '\r' || *field == '\n' || *field == 0)
+            continue;  // strtod() would skip the whitespace and read next field.
+        angles[i] = strtod(field, &end);
+        valid[i] = end != field;
+    }
+    return true;
+}
+
+}  // namespace calibration
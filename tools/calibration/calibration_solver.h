@@ -0,0 +1,106 @@
+// Base station geometry calibration using bundle adjustment.
+//
+// Input is a set of SensorAnglesFrame-s recorded while a rigid rig with known sensor positions is either kept static
+// or moved around the tracking volume. Unknowns are the poses of both base stations and the pose of the rig in each
+// frame. World coordinate system is defined by the rig position in the reference frame (the first frame where most
+// sensors are visible), so place the rig at the desired origin, Y axis up, at the start of the recording. When initial
+// base station geometry is given, its coordinate system is kept instead.
+//
+// The problem is solved with Levenberg-Marquardt. Its normal equations are block-sparse: each observation only
+// touches one base station pose and one rig pose, so the rig poses are eliminated with the Schur complement and only
+// a 12x12 system for base stations is solved densely. Accumulation of the normal equations is spread across threads.
+#pragma once
+#include "geometry.h"
+#include <stdint.h>
+#include <array>
+#include <string>
+#include <vector>
+
+namespace calibration {
+
+typedef std::array<double, 3> Vec3;
+typedef std::array<double, 9> Mat3;  // Row-major, same layout as BaseStationGeometryDef::mat.
+
+// Pose of a base station or of the rig: maps local coordinates to world as world = rot * local + pos.
+struct Pose {
+    Mat3 rot;
+    Vec3 pos;
+};
+
+// Pair of angles for one sensor as seen from one base station, i.e. SensorAngles::angles[2*base_idx .. 2*base_idx+1].
+struct AngleSample {
+    uint32_t sensor_idx;
+    uint32_t base_idx;
+    double angles[2];  // Radians, same convention as in calc_ray_vec().
+};
+
+// All samples captured at the same time (one SensorAnglesFrame).
+struct CalibrationFrame {
+    uint32_t time_ms;
+    std::vector<AngleSample> samples;
+};
+
+struct SolverSummary {
+    bool converged;
+    uint32_t iterations;
+    uint32_t num_frames;          // Frames used in the solution.
+    uint32_t num_observations;    // Scalar angle observations used.
+    double initial_rms;           // Radians.
+    double final_rms;             // Radians.
+    double base_rms[num_base_stations];  // Per-base station residual after the solution, radians.
+};
+
+class CalibrationSolver {
+public:
+    // rig_sensors[i] is the position of sensor i in rig coordinates, meters.
+    CalibrationSolver(const std::vector<Vec3> &rig_sensors, const std::vector<CalibrationFrame> &frames,
+                      uint32_t num_threads);
+
+    // Provide initial guess for base station geometry (e.g. from SteamVR or a previous calibration).
+    void set_initial_base_stations(const BaseStationGeometryDef (&defs)[num_base_stations]);
+
+    // Compute initial guess from the reference frame only. Needs at least 4 rig sensors visible from each station.
+    // Returns false and fills 'error' if that's not possible.
+    bool initialize_base_stations(std::string *error);
+
+    // Run bundle adjustment. Base stations need to be initialized with one of the methods above.
+    SolverSummary solve(uint32_t max_iterations, std::string *error);
+
+    // Result in the format used by settings.
+    BaseStationGeometryDef base_station_def(uint32_t base_idx) const;
+
+    // Helpers, exposed mainly for tests.
+    static void predict_angles(const Pose &base, const Vec3 &world_pt, double angles[2]);
+    static Vec3 ray_from_angles(const double angles[2]);  // Unit ray in base station local coordinates.
+
+private:
+    struct FrameState;
+    struct Accumulator;
+
+    bool initialize_frame_poses(std::string *error);
+    bool triangulate_rig_pose(uint32_t frame_idx, Pose *pose) const;
+    uint32_t refresh_frame_poses();
+    double frame_cost(uint32_t frame_idx, const Pose &rig) const;
+    void accumulate(uint32_t first_frame, uint32_t last_frame, double lambda, Accumulator *acc) const;
+    double evaluate_cost(const Pose (&bases)[num_base_stations], const std::vector<Pose> &rig_poses,
+                         double *base_sq_err, uint32_t *base_obs) const;
+    template<typename Fn> void parallel_for_frames(Fn fn) const;
+
+    std::vector<Vec3> rig_sensors_;
+    std::vector<CalibrationFrame> frames_;
+    uint32_t num_threads_;
+    uint32_t ref_frame_;
+    bool bases_initialized_;
+    bool ref_frame_at_origin_;
+
+    Pose bases_[num_base_stations];
+    std::vector<Pose> rig_poses_;
+    double huber_threshold_;
+};
+
+// Parse one line of 'angles' stream output: "ANG<sensor>\t<time ms>\t<fix level>\t<a0>\t<a1>\t<a2>\t<a3>".
+// Missing angles (empty fields) are allowed. Returns false if the line is not an angles line.
+bool parse_angles_line(const char *line, uint32_t *sensor_idx, uint32_t *time_ms, int32_t *fix_level,
+                       double angles[num_cycle_phases], bool valid[num_cycle_phases]);
+
+}  // namespace calibration
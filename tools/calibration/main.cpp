@@ -0,0 +1,236 @@
+// Host tool to calculate base station geometry from recorded sensor angles.
+//
+// Usage: lighthouse-calibrate --rig <config> [--init <config>] [--threads N] [--iterations N] <angles.txt>...
+//
+// <config> files use the same syntax as the device configuration ('view' command output), so the saved config can be
+// used directly. Rig geometry is taken from 'sensor<i> x y z' groups (e.g. on 'object0' line), initial base station
+// geometry - from 'base<i> origin ... matrix ...' lines.
+// <angles.txt> files are recordings of the 'angles' stream. Several files can be given; all frames are solved together.
+// Result is printed as 'base<i>' lines ready to be pasted into the device console.
+#include "calibration_solver.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+
+using namespace calibration;
+
+static void print_usage() {
+    fprintf(stderr, "Usage: lighthouse-calibrate --rig <config> [--init <config>] [--threads N] [--iterations N] "
+                    "<angles.txt>...\n");
+}
+
+static std::vector<std::string> split_words(const char *line) {
+    std::vector<std::string> words;
+    const char *delims = " \t\r\n";
+    while (*line) {
+        line += strspn(line, delims);
+        size_t len = strcspn(line, delims);
+        if (len > 0)
+            words.emplace_back(line, len);
+        line += len;
+    }
+    return words;
+}
+
+// Parse "<prefix><idx>" word.
+static bool parse_indexed_word(const std::string &word, const char *prefix, uint32_t *idx) {
+    size_t prefix_len = strlen(prefix);
+    if (word.size() <= prefix_len || word.compare(0, prefix_len, prefix) != 0)
+        return false;
+    char *end;
+    *idx = strtoul(word.c_str() + prefix_len, &end, 10);
+    return *end == 0;
+}
+
+static bool parse_floats(const std::vector<std::string> &words, uint32_t pos, uint32_t count, float *res) {
+    if (pos + count > words.size())
+        return false;
+    for (uint32_t i = 0; i < count; i++) {
+        char *end;
+        res[i] = strtof(words[pos + i].c_str(), &end);
+        if (*end != 0)
+            return false;
+    }
+    return true;
+}
+
+static bool read_config(const char *filename, std::vector<Vec3> *rig_sensors, bool *rig_sensor_defined,
+                        BaseStationGeometryDef *bases, bool *bases_defined) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "Can't open %s\n", filename);
+        return false;
+    }
+    char line[1024];
+    uint32_t line_num = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line_num++;
+        std::vector<std::string> words = split_words(line);
+        if (words.empty() || words[0][0] == '#')
+            continue;
+
+        uint32_t idx;
+        if (parse_indexed_word(words[0], "base", &idx)) {
+            if (!bases || idx >= num_base_stations) continue;
+            uint32_t pos = 1;
+            if (pos < words.size() && words[pos] == "origin") pos++;
+            bool ok = parse_floats(words, pos, 3, bases[idx].origin);
+            pos += 3;
+            if (pos < words.size() && words[pos] == "matrix") pos++;
+            if (!ok || !parse_floats(words, pos, 9, bases[idx].mat)) {
+                fprintf(stderr, "%s:%u: invalid base station definition\n", filename, line_num);
+                fclose(f);
+                return false;
+            }
+            bases_defined[idx] = true;
+            continue;
+        }
+
+        // Look for 'sensor<i> x y z' groups anywhere in the line.
+        if (!rig_sensors) continue;
+        for (uint32_t pos = 0; pos < words.size(); pos++) {
+            if (!parse_indexed_word(words[pos], "sensor", &idx))
+                continue;
+            float coords[3];
+            if (idx >= max_num_inputs || !parse_floats(words, pos + 1, 3, coords)) {
+                fprintf(stderr, "%s:%u: invalid sensor definition\n", filename, line_num);
+                fclose(f);
+                return false;
+            }
+            if (rig_sensors->size() <= idx)
+                rig_sensors->resize(idx + 1, Vec3{});
+            (*rig_sensors)[idx] = {coords[0], coords[1], coords[2]};
+            rig_sensor_defined[idx] = true;
+            pos += 3;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static bool read_angles(const char *filename, std::vector<CalibrationFrame> *frames) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "Can't open %s\n", filename);
+        return false;
+    }
+    char line[256];
+    bool frame_open = false;
+    uint32_t last_sensor_idx = 0, last_time_ms = 0;
+    while (fgets(line, sizeof(line), f)) {
+        uint32_t sensor_idx, time_ms;
+        int32_t fix_level;
+        double angles[num_cycle_phases];
+        bool valid[num_cycle_phases];
+        if (!parse_angles_line(line, &sensor_idx, &time_ms, &fix_level, angles, valid))
+            continue;  // Skip other streams' output and debug messages.
+
+        // Each frame is printed as a sequence of lines with increasing sensor index and the same time.
+        if (!frame_open || sensor_idx <= last_sensor_idx || time_ms != last_time_ms) {
+            frames->push_back(CalibrationFrame{time_ms, {}});
+            frame_open = true;
+        }
+        last_sensor_idx = sensor_idx;
+        last_time_ms = time_ms;
+
+        if (fix_level != (int32_t)FixLevel::kCycleSynced)
+            continue;
+        for (uint32_t b = 0; b < num_base_stations; b++)
+            if (valid[b*2] && valid[b*2 + 1])
+                frames->back().samples.push_back(AngleSample{sensor_idx, b, {angles[b*2], angles[b*2 + 1]}});
+    }
+    fclose(f);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    const char *rig_filename = nullptr, *init_filename = nullptr;
+    uint32_t num_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    uint32_t max_iterations = 100;
+    std::vector<const char *> angle_filenames;
+    for (int i = 1; i < argc; i++) {
+        bool has_value = i + 1 < argc;
+        if (!strcmp(argv[i], "--rig") && has_value)
+            rig_filename = argv[++i];
+        else if (!strcmp(argv[i], "--init") && has_value)
+            init_filename = argv[++i];
+        else if (!strcmp(argv[i], "--threads") && has_value)
+            num_threads = strtoul(argv[++i], nullptr, 10);
+        else if (!strcmp(argv[i], "--iterations") && has_value)
+            max_iterations = strtoul(argv[++i], nullptr, 10);
+        else if (argv[i][0] == '-') {
+            print_usage();
+            return 1;
+        } else
+            angle_filenames.push_back(argv[i]);
+    }
+    if (!rig_filename || angle_filenames.empty()) {
+        print_usage();
+        return 1;
+    }
+
+    std::vector<Vec3> rig_sensors;
+    bool rig_sensor_defined[max_num_inputs] = {};
+    BaseStationGeometryDef bases[num_base_stations] = {};
+    bool bases_defined[num_base_stations] = {};
+    if (!read_config(rig_filename, &rig_sensors, rig_sensor_defined, bases, bases_defined))
+        return 1;
+    if (init_filename && !read_config(init_filename, nullptr, nullptr, bases, bases_defined))
+        return 1;
+    if (rig_sensors.empty()) {
+        fprintf(stderr, "No sensor positions found in %s\n", rig_filename);
+        return 1;
+    }
+
+    std::vector<CalibrationFrame> frames;
+    for (auto filename : angle_filenames)
+        if (!read_angles(filename, &frames))
+            return 1;
+
+    // Drop samples of sensors with unknown position.
+    for (auto &frame : frames) {
+        auto &samples = frame.samples;
+        samples.erase(std::remove_if(samples.begin(), samples.end(), [&](const AngleSample &s) {
+            return s.sensor_idx >= rig_sensors.size() || !rig_sensor_defined[s.sensor_idx];
+        }), samples.end());
+    }
+
+    CalibrationSolver solver(rig_sensors, frames, num_threads);
+    std::string error;
+    if (init_filename) {
+        if (!bases_defined[0] || !bases_defined[1]) {
+            fprintf(stderr, "Both base stations need to be defined in %s\n", init_filename);
+            return 1;
+        }
+        solver.set_initial_base_stations(bases);
+    } else if (!solver.initialize_base_stations(&error)) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    SolverSummary summary = solver.solve(max_iterations, &error);
+    if (!error.empty()) {
+        fprintf(stderr, "%s\n", error.c_str());
+        return 1;
+    }
+
+    const double mrad = 1000.0;
+    printf("# Calibrated using %u frames, %u angles. RMS error: %.3f mrad -> %.3f mrad (base0 %.3f, base1 %.3f)%s\n",
+           summary.num_frames, summary.num_observations, summary.initial_rms * mrad, summary.final_rms * mrad,
+           summary.base_rms[0] * mrad, summary.base_rms[1] * mrad, summary.converged ? "" : ", not converged");
+
+    // Same format as BaseStationGeometryDef::print_def().
+    for (uint32_t b = 0; b < num_base_stations; b++) {
+        BaseStationGeometryDef def = solver.base_station_def(b);
+        printf("base%u origin", b);
+        for (int j = 0; j < 3; j++)
+            printf(" %f", def.origin[j]);
+        printf(" matrix");
+        for (int j = 0; j < 9; j++)
+            printf(" %f", def.mat[j]);
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,96 @@
+// Decode 'binary' position stream from a file or stdin and print it in the same form as 'position' streams.
+// Usage: decode-positions [--telemetry <tsv file>] [<file>]     e.g.  decode-positions /dev/ttyACM0
+// With --telemetry, packets of 'telemetry' streams on the same port are written as tab-separated values with a
+// header line, one row per packet. Counters are converted to rates per second. Plot them with plot_telemetry.gnuplot.
+#include "position_decoder.h"
+#include <stdio.h>
+#include <string.h>
+
+static void print_telemetry_header(FILE *f) {
+    fprintf(f, "time\tseq\tcycle_fix\tphase_fix\tphase_error_us\tarena_bytes");
+    for (uint32_t i = 0; i < telemetry_max_sensors; i++)
+        fprintf(f, "\tpulses%u\tdropped%u", i, i);
+    for (uint32_t i = 0; i < telemetry_max_objects; i++)
+        fprintf(f, "\tobject_fix%u", i);
+    for (uint32_t i = 0; i < telemetry_max_base_stations; i++)
+        fprintf(f, "\tootx_started%u\tootx_decoded%u", i, i);
+    for (uint32_t i = 0; i < telemetry_max_outputs; i++)
+        fprintf(f, "\tqueue%u\toutput_dropped%u", i, i);
+    fprintf(f, "\n");
+}
+
+// Rates are calculated from the previous packet, so the first one only establishes the baseline.
+static void print_telemetry(FILE *f, const BinaryTelemetryPacket &t, const BinaryTelemetryPacket &prev) {
+    float dt = (uint32_t)(t.time_usec - prev.time_usec) * 1e-6f;
+    if (dt <= 0.f)
+        return;
+    auto rate = [dt](uint32_t cur, uint32_t last) { return (uint32_t)(cur - last) / dt; };
+    auto rate16 = [dt](uint16_t cur, uint16_t last) { return (uint16_t)(cur - last) / dt; };
+
+    fprintf(f, "%.3f\t%u\t%u\t%u\t%.1f\t%u", t.time_usec * 1e-6, t.seq, t.cycle_fix_level, t.phase_fix_level,
+            t.phase_error_x10us * 0.1f, t.arena_bytes);
+    for (uint32_t i = 0; i < telemetry_max_sensors; i++)
+        fprintf(f, "\t%.1f\t%.1f", rate(t.sensor_pulses[i], prev.sensor_pulses[i]),
+                rate16(t.sensor_pulses_dropped[i], prev.sensor_pulses_dropped[i]));
+    for (uint32_t i = 0; i < telemetry_max_objects; i++)
+        fprintf(f, "\t%u", t.object_fix_levels[i]);
+    for (uint32_t i = 0; i < telemetry_max_base_stations; i++)
+        fprintf(f, "\t%.2f\t%.2f", rate16(t.data_frames_started[i], prev.data_frames_started[i]),
+                rate16(t.data_frames_decoded[i], prev.data_frames_decoded[i]));
+    for (uint32_t i = 0; i < telemetry_max_outputs; i++)
+        fprintf(f, "\t%u\t%.1f", t.output_queue_bytes[i], rate(t.output_bytes_dropped[i], prev.output_bytes_dropped[i]));
+    fprintf(f, "\n");
+    fflush(f);
+}
+
+int main(int argc, char *argv[]) {
+    FILE *telemetry_file = nullptr;
+    int arg = 1;
+    if (arg + 1 < argc && !strcmp(argv[arg], "--telemetry")) {
+        telemetry_file = fopen(argv[arg + 1], "w");
+        if (!telemetry_file) {
+            fprintf(stderr, "Can't create %s\n", argv[arg + 1]);
+            return 1;
+        }
+        arg += 2;
+    }
+
+    FILE *f = arg < argc ? fopen(argv[arg], "rb") : stdin;
+    if (!f) {
+        fprintf(stderr, "Can't open %s\n", argv[arg]);
+        return 1;
+    }
+
+    PositionStreamDecoder decoder([](const DecodedPosition &p) {
+        printf("OBJ%u\t%u\t%u", p.object_idx, p.time_usec / 1000, p.fix_level);
+        if (p.fix_level >= 800) {
+            printf("\t%.4f\t%.4f\t%.4f\t%.4f", p.pos[0], p.pos[1], p.pos[2], p.pos_stddev);
+            if (p.q[0] < 0.9999f)
+                printf("\t%.4f\t%.4f\t%.4f\t%.4f", p.q[0], p.q[1], p.q[2], p.q[3]);
+        }
+        printf("\n");
+    });
+
+    BinaryTelemetryPacket prev_telemetry;
+    bool have_telemetry = false;
+    if (telemetry_file) {
+        print_telemetry_header(telemetry_file);
+        decoder.set_telemetry_callback([&](const BinaryTelemetryPacket &t) {
+            if (have_telemetry)
+                print_telemetry(telemetry_file, t, prev_telemetry);
+            prev_telemetry = t;
+            have_telemetry = true;
+        });
+    }
+
+    uint8_t buf[256];
+    size_t len;
+    while ((len = fread(buf, 1, sizeof(buf), f)) > 0)
+        decoder.feed(buf, len);
+
+    fprintf(stderr, "Decoded %u packets, %u errors, %u lost, %u telemetry packets.\n",
+            decoder.num_packets(), decoder.num_errors(), decoder.num_lost_packets(), decoder.num_telemetry_packets());
+    if (telemetry_file)
+        fclose(telemetry_file);
+    return 0;
+}
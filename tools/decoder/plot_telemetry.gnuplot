@@ -0,0 +1,32 @@
+# Plot telemetry written by 'decode-positions --telemetry <file>'.
+# Usage: gnuplot -e "file='telemetry.tsv'" plot_telemetry.gnuplot
+# Live view while decoding: add -e "live=1" to replot every second.
+if (!exists("file")) file = 'telemetry.tsv'
+set datafile separator "\t"
+set key autotitle columnhead outside right
+set xlabel "Time, s"
+set grid
+set multiplot layout 4, 1 title file
+
+set ylabel "Pulses/s"
+plot for [i=0:3] file using "time":sprintf("pulses%d", i) with lines, \
+     for [i=0:3] file using "time":sprintf("dropped%d", i) with points
+
+set ylabel "Fix level"
+plot file using "time":"cycle_fix" with steps, file using "time":"phase_fix" with steps, \
+     for [i=0:1] file using "time":sprintf("object_fix%d", i) with steps
+
+set ylabel "OOTX frames/s"
+set y2label "Phase error, us"
+set y2tics
+plot for [i=0:1] file using "time":sprintf("ootx_decoded%d", i) with steps, \
+     file using "time":"phase_error_us" axes x1y2 with lines
+
+unset y2label
+unset y2tics
+set ylabel "Output bytes"
+plot for [i=0:3] file using "time":sprintf("queue%d", i) with lines, \
+     for [i=0:3] file using "time":sprintf("output_dropped%d", i) with impulses
+
+unset multiplot
+if (exists("live")) pause 1; reread
@@ -0,0 +1,77 @@
+#include "position_decoder.h"
+#include <string.h>
+
+static_assert(binary_telemetry_packet_size < 254, "COBS encoded frame length is fixed for packets shorter than 254");
+
+PositionStreamDecoder::PositionStreamDecoder(Callback callback)
+    : callback_(callback)
+    , frame_len_(0)
+    , have_seq_(false)
+    , last_seq_(0)
+    , num_packets_(0)
+    , num_errors_(0)
+    , num_lost_packets_(0)
+    , num_telemetry_packets_(0) {
+}
+
+void PositionStreamDecoder::feed(const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i] == 0) {
+            process_frame();
+            frame_len_ = 0;
+        } else {
+            if (frame_len_ == sizeof(frame_))
+                memmove(frame_, frame_ + 1, --frame_len_);
+            frame_[frame_len_++] = data[i];
+        }
+    }
+}
+
+void PositionStreamDecoder::process_frame() {
+    if (frame_len_ == 0)
+        return;  // Consecutive delimiters are allowed.
+
+    if (decode_frame(frame_, frame_len_))
+        return;
+
+    // Garbage before the frame: try frames of known lengths at the end of the buffer.
+    num_errors_++;
+    const uint32_t frame_lens[] = {binary_position_packet_size + 1, binary_telemetry_packet_size + 1};
+    for (uint32_t len : frame_lens)
+        if (frame_len_ > len && decode_frame(frame_ + frame_len_ - len, len))
+            return;
+}
+
+bool PositionStreamDecoder::decode_frame(const uint8_t *frame, uint32_t len) {
+    BinaryPositionPacket packet;
+    BinaryTelemetryPacket telemetry;
+    if (decode_position_frame(frame, len, &packet)) {
+        process_position(packet);
+    } else if (decode_telemetry_frame(frame, len, &telemetry)) {
+        num_telemetry_packets_++;
+        if (telemetry_callback_)
+            telemetry_callback_(telemetry);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void PositionStreamDecoder::process_position(const BinaryPositionPacket &packet) {
+    if (have_seq_)
+        num_lost_packets_ += (uint16_t)(packet.seq - last_seq_ - 1);
+    have_seq_ = true;
+    last_seq_ = packet.seq;
+    num_packets_++;
+
+    DecodedPosition pos;
+    pos.object_idx = packet.object_idx;
+    pos.fix_level = packet.fix_level;
+    pos.seq = packet.seq;
+    pos.time_usec = packet.time_usec;
+    for (int i = 0; i < 3; i++)
+        pos.pos[i] = packet.pos_mm[i] / 1000.0;
+    unpack_quaternion(packet.q_packed, pos.q);
+    pos.pos_stddev = packet.pos_stddev_um == 0xFFFF ? -1.f : packet.pos_stddev_um * 1e-6f;
+    callback_(pos);
+}
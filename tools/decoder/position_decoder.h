@@ -0,0 +1,55 @@
+// Host-side decoder for 'binary' position streams and 'telemetry' streams (see binary_protocol.h).
+#pragma once
+#include "binary_protocol.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+
+// Decoded position in convenient units.
+struct DecodedPosition {
+    uint32_t object_idx;
+    uint32_t fix_level;   // FixLevel value; position is valid if >= 800.
+    uint16_t seq;
+    uint32_t time_usec;
+    double pos[3];        // Meters.
+    float q[4];           // Rotation quaternion (w, x, y, z).
+    float pos_stddev;     // Meters; negative if unknown.
+};
+
+// Splits the incoming byte stream into frames and decodes them. Garbage between frames (e.g. text output of
+// other streams on the same port) is skipped and counted as framing errors. As frames of each packet type have fixed
+// length, a frame right after garbage is still decoded.
+// Telemetry packets are passed as is to the telemetry callback, if set; they are not counted as position packets.
+class PositionStreamDecoder {
+public:
+    typedef std::function<void(const DecodedPosition &)> Callback;
+    typedef std::function<void(const BinaryTelemetryPacket &)> TelemetryCallback;
+    explicit PositionStreamDecoder(Callback callback);
+
+    void set_telemetry_callback(TelemetryCallback callback) { telemetry_callback_ = callback; }
+
+    void feed(const uint8_t *data, size_t len);
+
+    uint32_t num_packets() const { return num_packets_; }
+    uint32_t num_errors() const { return num_errors_; }        // Malformed frames or CRC mismatches.
+    uint32_t num_lost_packets() const { return num_lost_packets_; }  // Detected by sequence number gaps.
+    uint32_t num_telemetry_packets() const { return num_telemetry_packets_; }
+
+private:
+    void process_frame();
+    bool decode_frame(const uint8_t *frame, uint32_t len);
+    void process_position(const BinaryPositionPacket &packet);
+
+    Callback callback_;
+    TelemetryCallback telemetry_callback_;
+    uint8_t frame_[binary_telemetry_frame_max_size > binary_position_frame_max_size ?
+                   binary_telemetry_frame_max_size : binary_position_frame_max_size];
+    uint32_t frame_len_;  // Only the last bytes are kept if the frame doesn't fit.
+    bool have_seq_;
+    uint16_t last_seq_;
+
+    uint32_t num_packets_;
+    uint32_t num_errors_;
+    uint32_t num_lost_packets_;
+    uint32_t num_telemetry_packets_;
+};